@@ -75,13 +75,37 @@ echo "$LDD_PATH"
 export PATH="$PATH:$(pwd)/bin"
 echo "$PATH"
 
+echo "=== compiling hash.o __________________________============================================================="
+x86_64-w64-mingw32-gcc -c -fPIC libfiledb/hash.c -o bin/o/hash.o
+echo "=== compiling lz.o ____________________________============================================================="
+x86_64-w64-mingw32-gcc -c -fPIC libfiledb/lz.c -o bin/o/lz.o
+echo "=== compiling btree.o _________________________============================================================="
+x86_64-w64-mingw32-gcc -c -fPIC libfiledb/btree.c -o bin/o/btree.o
+echo "=== compiling bloom.o _________________________============================================================="
+x86_64-w64-mingw32-gcc -c -fPIC libfiledb/bloom.c -o bin/o/bloom.o
+echo "=== compiling uring.o _________________________============================================================="
+x86_64-w64-mingw32-gcc -c -fPIC libfiledb/uring.c -o bin/o/uring.o
 echo "=== compiling filedb.o ________________________============================================================="
 x86_64-w64-mingw32-gcc -c -fPIC libfiledb/filedb.c -o bin/o/filedb.o
+echo "=== compiling shard.o _________________________============================================================="
+x86_64-w64-mingw32-gcc -c -fPIC libfiledb/shard.c -o bin/o/shard.o
 echo "=== compiling libfiledb.dll ___________________============================================================="
-x86_64-w64-mingw32-gcc -shared -o bin/libfiledb.dll bin/o/filedb.o
+x86_64-w64-mingw32-gcc -shared -o bin/libfiledb.dll bin/o/hash.o bin/o/lz.o bin/o/btree.o bin/o/bloom.o bin/o/uring.o bin/o/filedb.o bin/o/shard.o -lpthread
+echo "=== compiling hash.test.exe ___________________============================================================="
+x86_64-w64-mingw32-gcc -o bin/hash.test.exe libfiledb/hash.test.c $FLAGS -Lbin -lfiledb
+echo "=== compiling lz.test.exe _____________________============================================================="
+x86_64-w64-mingw32-gcc -o bin/lz.test.exe libfiledb/lz.test.c $FLAGS -Lbin -lfiledb
+echo "=== compiling btree.test.exe __________________============================================================="
+x86_64-w64-mingw32-gcc -o bin/btree.test.exe libfiledb/btree.test.c $FLAGS -Lbin -lfiledb
+echo "=== compiling bloom.test.exe __________________============================================================="
+x86_64-w64-mingw32-gcc -o bin/bloom.test.exe libfiledb/bloom.test.c $FLAGS -Lbin -lfiledb
+echo "=== compiling uring.test.exe __________________============================================================="
+x86_64-w64-mingw32-gcc -o bin/uring.test.exe libfiledb/uring.test.c $FLAGS -Lbin -lfiledb
 echo "=== compiling filedb.test.exe _________________============================================================="
-x86_64-w64-mingw32-gcc -o bin/filedb.test.exe libfiledb/filedb.test.c $FLAGS -Lbin -lfiledb
+x86_64-w64-mingw32-gcc -o bin/filedb.test.exe libfiledb/filedb.test.c $FLAGS -Lbin -lfiledb -lpthread
+echo "=== compiling shard.test.exe __________________============================================================="
+x86_64-w64-mingw32-gcc -o bin/shard.test.exe libfiledb/shard.test.c $FLAGS -Lbin -lfiledb -lpthread
 echo "=== compiling filedb.test.dll _________________============================================================="
-x86_64-w64-mingw32-gcc -shared -o bin/filedb.test.dll libfiledb/filedb.test.c -Wl,--output-def,bin/filedb.test.def $FLAGS -Lbin -lfiledb
+x86_64-w64-mingw32-gcc -shared -o bin/filedb.test.dll libfiledb/filedb.test.c -Wl,--output-def,bin/filedb.test.def $FLAGS -Lbin -lfiledb -lpthread
 # Create a compressed archive with 7z
 # "C:\Program Files\7-Zip\7z.exe" a "build/voxd31-${TAG}-x86_64-windows.7z" ./build/win64/*
@@ -10,11 +10,23 @@ zig cc libscene/rectangle.c libscene/voxel.c libscene/scene.c src/question_02.c
 zig cc -c -fPIC libscene/rectangle.c -o bin/o/rectangle.o
 zig cc -c -fPIC libscene/voxel.c -o bin/o/voxel.o
 zig cc -c -fPIC libscene/scene.c -o bin/o/scene.o
+zig cc -c -fPIC libfiledb/hash.c -o bin/o/hash.o
+zig cc -c -fPIC libfiledb/lz.c -o bin/o/lz.o
+zig cc -c -fPIC libfiledb/btree.c -o bin/o/btree.o
+zig cc -c -fPIC libfiledb/bloom.c -o bin/o/bloom.o
+zig cc -c -fPIC libfiledb/uring.c -o bin/o/uring.o
 zig cc -c -fPIC libfiledb/filedb.c -o bin/o/filedb.o
+zig cc -c -fPIC libfiledb/shard.c -o bin/o/shard.o
 zig cc -shared -o bin/libscene.so bin/o/rectangle.o bin/o/voxel.o bin/o/scene.o
-zig cc -shared -o bin/libfiledb.so bin/o/filedb.o -lcrypto
+zig cc -shared -o bin/libfiledb.so bin/o/hash.o bin/o/lz.o bin/o/btree.o bin/o/bloom.o bin/o/uring.o bin/o/filedb.o bin/o/shard.o -lpthread
 
 zig cc -o bin/rectangle.test libscene/rectangle.test.c -Lbin -lscene
 zig cc -o bin/voxel.test libscene/voxel.test.c -Lbin -lscene
 zig cc -o bin/scene.test libscene/scene.test.c -Lbin -lscene
-zig cc -o bin/filedb.test libfiledb/filedb.test.c -Lbin -lfiledb
+zig cc -o bin/hash.test libfiledb/hash.test.c -Lbin -lfiledb
+zig cc -o bin/lz.test libfiledb/lz.test.c -Lbin -lfiledb
+zig cc -o bin/btree.test libfiledb/btree.test.c -Lbin -lfiledb
+zig cc -o bin/bloom.test libfiledb/bloom.test.c -Lbin -lfiledb
+zig cc -o bin/uring.test libfiledb/uring.test.c -Lbin -lfiledb
+zig cc -o bin/filedb.test libfiledb/filedb.test.c -Lbin -lfiledb -lpthread
+zig cc -o bin/shard.test libfiledb/shard.test.c -Lbin -lfiledb -lpthread
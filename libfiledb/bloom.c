@@ -0,0 +1,113 @@
+#include "bloom.h"
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __MINGW32__
+#include <sys/types.h>
+// defined next to the database, at an explicit offset without moving the file position
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+#endif
+
+#define BLOOM_MAGIC "FILEDBBF"
+#define BLOOM_VERSION 1
+#define BLOOM_WORDS_PER_BLOCK (BLOOM_BLOCK_LENGTH / sizeof(uint64_t))
+// bits set per key, each picked by 9 bits of the key inside the 512 bits of its block
+#define BLOOM_PROBES 8
+
+typedef struct bloom_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_length;
+    uint64_t blocks;
+    uint64_t length;
+    uint64_t tag;
+} bloom_header_t;
+
+static uint64_t read64(const char *bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static bloom_t* bloom_allocate(size_t blocks) {
+    // room to align the words on a cache line after the filter
+    char *memory = (char*)calloc(1, sizeof(bloom_t) + BLOOM_BLOCK_LENGTH + blocks * BLOOM_BLOCK_LENGTH);
+    if (!memory) return NULL;
+    bloom_t *self = (bloom_t*)memory;
+    uintptr_t words = ((uintptr_t)(memory + sizeof(bloom_t)) + BLOOM_BLOCK_LENGTH - 1) & ~(uintptr_t)(BLOOM_BLOCK_LENGTH - 1);
+    self->words = (uint64_t*)words;
+    self->blocks = blocks;
+    return self;
+}
+
+bloom_t* bloom__static__new(size_t expected) {
+    size_t bits = (expected ? expected : 1) * BLOOM_BITS_PER_KEY;
+    return bloom_allocate((bits + BLOOM_BLOCK_LENGTH * 8 - 1) / (BLOOM_BLOCK_LENGTH * 8));
+}
+
+bloom_t* bloom__static__read(int fd) {
+    bloom_header_t header;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) return NULL;
+    if (memcmp(header.magic, BLOOM_MAGIC, sizeof(header.magic)) != 0 || header.version != BLOOM_VERSION) return NULL;
+    if (header.block_length != BLOOM_BLOCK_LENGTH || header.blocks == 0) return NULL;
+    if ((uint64_t)st.st_size != sizeof(header) + header.blocks * BLOOM_BLOCK_LENGTH) return NULL;
+
+    bloom_t *self = bloom_allocate(header.blocks);
+    if (!self) return NULL;
+    size_t length = self->blocks * BLOOM_BLOCK_LENGTH;
+    if (pread(fd, self->words, length, sizeof(header)) != (ssize_t)length) {
+        free(self);
+        return NULL;
+    }
+    self->length = header.length;
+    self->tag = header.tag;
+    return self;
+}
+
+int bloom__instance__write(const bloom_t *self, int fd) {
+    if (!self) return -1;
+    bloom_header_t header = {BLOOM_MAGIC, BLOOM_VERSION, BLOOM_BLOCK_LENGTH, self->blocks, self->length, self->tag};
+    size_t length = self->blocks * BLOOM_BLOCK_LENGTH;
+    if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) return -1;
+    return pwrite(fd, self->words, length, sizeof(header)) == (ssize_t)length ? 0 : -1;
+}
+
+// The block of a key and the mask of the bits it sets in each word of the block
+static const uint64_t* bloom_masks(const bloom_t *self, const char *key, uint64_t *masks) {
+    const uint64_t *block = self->words + (read64(key) % self->blocks) * BLOOM_WORDS_PER_BLOCK;
+    uint64_t low = read64(key + 8);
+    uint64_t high = read64(key + 16);
+    memset(masks, 0, BLOOM_WORDS_PER_BLOCK * sizeof(uint64_t));
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        unsigned bit = (unsigned)((i < 7 ? low >> (9 * i) : high) & 511);
+        masks[bit >> 6] |= 1ULL << (bit & 63);
+    }
+    return block;
+}
+
+void bloom__instance__add(bloom_t *self, const char *key) {
+    uint64_t masks[BLOOM_WORDS_PER_BLOCK];
+    uint64_t *block = (uint64_t*)bloom_masks(self, key, masks);
+    // a single writer, the readers see each word either before or after it changed
+    for (size_t i = 0; i < BLOOM_WORDS_PER_BLOCK; i++) {
+        if (masks[i]) __atomic_store_n(&block[i], __atomic_load_n(&block[i], __ATOMIC_RELAXED) | masks[i], __ATOMIC_RELAXED);
+    }
+    self->length++;
+}
+
+int bloom__instance__may_contain(const bloom_t *self, const char *key) {
+    uint64_t masks[BLOOM_WORDS_PER_BLOCK];
+    const uint64_t *block = bloom_masks(self, key, masks);
+    for (size_t i = 0; i < BLOOM_WORDS_PER_BLOCK; i++) {
+        if ((__atomic_load_n(&block[i], __ATOMIC_RELAXED) & masks[i]) != masks[i]) return 0;
+    }
+    return 1;
+}
+
+int bloom__instance__full(const bloom_t *self) {
+    return self->length * BLOOM_BITS_PER_KEY >= self->blocks * BLOOM_BLOCK_LENGTH * 8;
+}
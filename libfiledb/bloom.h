@@ -0,0 +1,60 @@
+#ifndef __bloom_h__
+#define __bloom_h__
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * blocked Bloom filter over 32 bytes keys that are already uniformly distributed, like content hashes.
+ * a key only sets and tests bits of one 64 bytes block picked by its first bytes,
+ *   so a test costs a single cache line whatever the size of the filter.
+ * one writer may add keys while any number of threads test them
+ */
+
+#define BLOOM_KEY_LENGTH 32
+#define BLOOM_BLOCK_LENGTH 64
+/**
+ * the bits a filter spends per key it was sized for, about 1% false positives at that load
+ */
+#define BLOOM_BITS_PER_KEY 10
+
+typedef struct bloom_s {
+    size_t blocks;
+    /**
+     * the keys added so far, a key added twice counts twice
+     */
+    size_t length;
+    /**
+     * a value the owner of the filter saves with it
+     */
+    uint64_t tag;
+    /**
+     * blocks * 8 words aligned on a cache line, in the same allocation as the filter
+     */
+    uint64_t* words;
+} bloom_s;
+
+typedef bloom_s bloom_t;
+
+/**
+ * an empty filter sized for expected keys, freed with free
+ */
+bloom_t* bloom__static__new(size_t expected);
+/**
+ * reads a filter written by bloom__instance__write, NULL when the file doesn't hold one
+ */
+bloom_t* bloom__static__read(int fd);
+/**
+ * writes the filter and its tag at the start of the file
+ */
+int bloom__instance__write(const bloom_t* self, int fd);
+void bloom__instance__add(bloom_t* self, const char* key);
+/**
+ * 0 when the key was never added, 1 when it may have been
+ */
+int bloom__instance__may_contain(const bloom_t* self, const char* key);
+/**
+ * set once the filter holds as many keys as it was sized for and its false positive rate starts climbing
+ */
+int bloom__instance__full(const bloom_t* self);
+
+#endif
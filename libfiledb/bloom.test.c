@@ -0,0 +1,80 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bloom.h"
+#include "hash.h"
+
+#define TEST_BLOOM_PATH "bloom.test.bloom"
+#define TEST_BLOOM_KEYS 100000
+
+// Keys shaped like record ids, the content hash of a counter
+void make_key(char *key, unsigned value) {
+    hash__static__compute(&value, sizeof(value), (unsigned char*)key);
+}
+
+void test_membership() {
+    bloom_t *bloom = bloom__static__new(TEST_BLOOM_KEYS);
+    assert(bloom != NULL);
+    assert(((uintptr_t)bloom->words & (BLOOM_BLOCK_LENGTH - 1)) == 0);
+
+    char key[BLOOM_KEY_LENGTH];
+    for (unsigned i = 0; i < TEST_BLOOM_KEYS; i++) {
+        make_key(key, i);
+        assert(!bloom__instance__full(bloom));
+        bloom__instance__add(bloom, key);
+    }
+    // the size is rounded up to whole blocks
+    assert(bloom->blocks * BLOOM_BLOCK_LENGTH * 8 < (TEST_BLOOM_KEYS + 64) * BLOOM_BITS_PER_KEY);
+
+    // never a false negative, and few false positives at the load it was sized for
+    for (unsigned i = 0; i < TEST_BLOOM_KEYS; i++) {
+        make_key(key, i);
+        assert(bloom__instance__may_contain(bloom, key));
+    }
+    size_t false_positives = 0;
+    for (unsigned i = TEST_BLOOM_KEYS; i < 2 * TEST_BLOOM_KEYS; i++) {
+        make_key(key, i);
+        false_positives += bloom__instance__may_contain(bloom, key);
+    }
+    printf("false positive rate %.3f%% over %zu blocks\n", 100.0 * false_positives / TEST_BLOOM_KEYS, bloom->blocks);
+    assert(false_positives < TEST_BLOOM_KEYS / 40);
+    free(bloom);
+}
+
+void test_persistence() {
+    bloom_t *bloom = bloom__static__new(1000);
+    char key[BLOOM_KEY_LENGTH];
+    for (unsigned i = 0; i < 1000; i++) {
+        make_key(key, i);
+        bloom__instance__add(bloom, key);
+    }
+    bloom->tag = 42;
+
+    unlink(TEST_BLOOM_PATH);
+    int fd = open(TEST_BLOOM_PATH, O_RDWR | O_CREAT, 0666);
+    assert(fd != -1);
+    assert(bloom__instance__write(bloom, fd) == 0);
+    bloom_t *read = bloom__static__read(fd);
+    assert(read != NULL);
+    assert(read->blocks == bloom->blocks && read->length == 1000 && read->tag == 42);
+    assert(memcmp(read->words, bloom->words, bloom->blocks * BLOOM_BLOCK_LENGTH) == 0);
+    free(read);
+
+    // a truncated file is not a filter
+    assert(ftruncate(fd, 100) == 0);
+    assert(bloom__static__read(fd) == NULL);
+    close(fd);
+    unlink(TEST_BLOOM_PATH);
+    free(bloom);
+}
+
+int main() {
+    printf("=== test_membership =======================================:\n");
+    test_membership();
+    printf("=== test_persistence =======================================:\n");
+    test_persistence();
+    return 0;
+}
@@ -0,0 +1,456 @@
+#include "btree.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef __MINGW32__
+#include <sys/types.h>
+// defined next to the database, at an explicit offset without moving the file position
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+#endif
+
+#define BTREE_MAGIC "FILEDBBT"
+#define BTREE_VERSION 1
+#define BTREE_MIN_CACHE_PAGES 8
+// deep enough for any tree that fits in a 64 bit file
+#define BTREE_MAX_DEPTH 32
+
+/**
+ * the first page of the file
+ */
+typedef struct btree_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t root;
+    uint64_t page_count;
+    uint64_t length;
+    uint64_t tag;
+    uint32_t clean;
+    uint32_t reserved;
+} btree_header_t;
+
+/**
+ * the start of every node page, the entries follow it
+ */
+typedef struct btree_node_s {
+    uint32_t leaf;
+    uint32_t count;
+    /**
+     * the right sibling of a leaf, 0 for the last one. the leftmost child of an internal node
+     */
+    uint64_t link;
+} btree_node_t;
+
+#define BTREE_FANOUT ((BTREE_PAGE_SIZE - sizeof(btree_node_t)) / sizeof(btree_entry_t))
+
+static int write_page(int fd, const void *bytes, uint64_t page) {
+    return pwrite(fd, bytes, BTREE_PAGE_SIZE, page * BTREE_PAGE_SIZE) == BTREE_PAGE_SIZE ? 0 : -1;
+}
+
+static int sync_tree_file(int fd) {
+#if defined(__MINGW32__)
+    return _commit(fd);
+#elif defined(__linux__)
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+static int btree_write_header(btree_t *self) {
+    unsigned char page[BTREE_PAGE_SIZE];
+    btree_header_t header = {BTREE_MAGIC, BTREE_VERSION, BTREE_PAGE_SIZE, self->root, self->page_count, self->length, self->tag, (uint32_t)self->clean, 0};
+    memset(page, 0, sizeof(page));
+    memcpy(page, &header, sizeof(header));
+    return write_page(self->file_reference, page, 0);
+}
+
+// Marks the tree not clean on disk before the first page changes after a flush
+static int btree_touch(btree_t *self) {
+    if (!self->clean) return 0;
+    self->clean = 0;
+    if (btree_write_header(self) != 0) return -1;
+    return self->durable ? sync_tree_file(self->file_reference) : 0;
+}
+
+static inline btree_node_t* frame_node(const btree_frame_t *frame) {
+    return (btree_node_t*)frame->bytes;
+}
+
+static inline btree_entry_t* node_entries(btree_node_t *node) {
+    return (btree_entry_t*)(node + 1);
+}
+
+/**
+ * Pins a page in a frame, reading it unless fresh, and evicts an unpinned page with the clock algorithm if needed.
+ * NULL when every frame is pinned or on error
+ */
+static btree_frame_t* btree_fetch(btree_t *self, uint64_t page, int fresh) {
+    for (size_t i = 0; i < self->frames_length; i++) {
+        if (self->frames[i].page == page) {
+            self->frames[i].pins++;
+            self->frames[i].referenced = 1;
+            return &self->frames[i];
+        }
+    }
+
+    btree_frame_t *victim = NULL;
+    for (size_t step = 0; step < 2 * self->frames_length && !victim; step++) {
+        btree_frame_t *frame = &self->frames[self->hand];
+        self->hand = (self->hand + 1) % self->frames_length;
+        if (frame->pins > 0) continue;
+        if (frame->referenced) frame->referenced = 0;
+        else victim = frame;
+    }
+    if (!victim) return NULL;
+    if (victim->page != 0 && victim->dirty && write_page(self->file_reference, victim->bytes, victim->page) != 0) return NULL;
+
+    victim->page = 0;
+    victim->dirty = 0;
+    if (fresh) {
+        memset(victim->bytes, 0, BTREE_PAGE_SIZE);
+    } else if (pread(self->file_reference, victim->bytes, BTREE_PAGE_SIZE, page * BTREE_PAGE_SIZE) != BTREE_PAGE_SIZE) {
+        return NULL;
+    }
+    victim->page = page;
+    victim->pins = 1;
+    victim->referenced = 1;
+    return victim;
+}
+
+static void btree_release(btree_frame_t *frame, int dirty) {
+    if (dirty) frame->dirty = 1;
+    frame->pins--;
+}
+
+// A pinned zeroed page at the end of the file
+static btree_frame_t* btree_allocate(btree_t *self, int leaf) {
+    btree_frame_t *frame = btree_fetch(self, self->page_count, 1);
+    if (!frame) return NULL;
+    self->page_count++;
+    frame->dirty = 1;
+    frame_node(frame)->leaf = leaf;
+    return frame;
+}
+
+// Index of the first entry whose key is not below key
+static size_t lower_bound(const btree_entry_t *entries, size_t count, const char *key) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (memcmp(entries[middle].key, key, BTREE_KEY_LENGTH) < 0) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Index of the first entry whose key is above key
+static size_t upper_bound(const btree_entry_t *entries, size_t count, const char *key) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (memcmp(entries[middle].key, key, BTREE_KEY_LENGTH) <= 0) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// The child of an internal node whose range holds key, the leftmost child when key is NULL
+static uint64_t node_child(btree_node_t *node, const char *key) {
+    if (!key) return node->link;
+    size_t i = upper_bound(node_entries(node), node->count, key);
+    return i == 0 ? node->link : node_entries(node)[i - 1].value;
+}
+
+/**
+ * Walks from the root to the leaf whose range holds key and pins it.
+ * path receives the internal nodes passed through, root first
+ */
+static btree_frame_t* btree_descend(btree_t *self, const char *key, uint64_t *path, size_t *depth) {
+    uint64_t page = self->root;
+    size_t level = 0;
+    for (;;) {
+        btree_frame_t *frame = btree_fetch(self, page, 0);
+        if (!frame) return NULL;
+        btree_node_t *node = frame_node(frame);
+        if (node->leaf) {
+            if (depth) *depth = level;
+            return frame;
+        }
+        if (level == BTREE_MAX_DEPTH) {
+            btree_release(frame, 0);
+            return NULL;
+        }
+        if (path) path[level] = page;
+        level++;
+        page = node_child(node, key);
+        btree_release(frame, 0);
+    }
+}
+
+btree_t* btree__static__open(const char *path, size_t cache_pages, int durable) {
+    if (!path) return NULL;
+    btree_t *self = (btree_t*)calloc(1, sizeof(btree_t));
+    if (!self) return NULL;
+    self->durable = durable;
+    self->frames_length = cache_pages < BTREE_MIN_CACHE_PAGES ? BTREE_MIN_CACHE_PAGES : cache_pages;
+    self->frames = (btree_frame_t*)calloc(self->frames_length, sizeof(btree_frame_t));
+    self->file_reference = open(path, O_RDWR | O_CREAT, 0666);
+    if (!self->frames || self->file_reference == -1) {
+        btree__static__close(self);
+        return NULL;
+    }
+    for (size_t i = 0; i < self->frames_length; i++) {
+        self->frames[i].bytes = (unsigned char*)malloc(BTREE_PAGE_SIZE);
+        if (!self->frames[i].bytes) {
+            btree__static__close(self);
+            return NULL;
+        }
+    }
+
+    struct stat st;
+    btree_header_t header;
+    if (fstat(self->file_reference, &st) != 0) {
+        btree__static__close(self);
+        return NULL;
+    }
+    int valid = st.st_size >= BTREE_PAGE_SIZE && pread(self->file_reference, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+        && memcmp(header.magic, BTREE_MAGIC, sizeof(header.magic)) == 0 && header.version == BTREE_VERSION
+        && header.page_size == BTREE_PAGE_SIZE && header.page_count * BTREE_PAGE_SIZE <= (uint64_t)st.st_size;
+    if (valid) {
+        self->root = header.root;
+        self->page_count = header.page_count;
+        self->length = header.length;
+        self->tag = header.tag;
+        self->clean = header.clean != 0;
+        return self;
+    }
+
+    // a new file is an empty clean tree, an unreadable one an empty tree its owner has to rebuild
+    self->clean = st.st_size == 0;
+    self->page_count = 1;
+    if (ftruncate(self->file_reference, BTREE_PAGE_SIZE) != 0 || btree_write_header(self) != 0) {
+        btree__static__close(self);
+        return NULL;
+    }
+    return self;
+}
+
+int btree__static__close(btree_t *self) {
+    if (!self) return -1;
+    int result = 0;
+    if (self->file_reference != -1 && self->frames) {
+        result = btree__instance__flush(self);
+        close(self->file_reference);
+    }
+    if (self->frames) {
+        for (size_t i = 0; i < self->frames_length; i++) free(self->frames[i].bytes);
+        free(self->frames);
+    }
+    free(self);
+    return result;
+}
+
+int btree__instance__get(btree_t *self, const char *key, uint64_t *value) {
+    if (!self || !key) return -1;
+    if (self->root == 0) return 0;
+
+    btree_frame_t *frame = btree_descend(self, key, NULL, NULL);
+    if (!frame) return -1;
+    btree_node_t *node = frame_node(frame);
+    size_t i = lower_bound(node_entries(node), node->count, key);
+    int found = i < node->count && memcmp(node_entries(node)[i].key, key, BTREE_KEY_LENGTH) == 0;
+    if (found && value) *value = node_entries(node)[i].value;
+    btree_release(frame, 0);
+    return found;
+}
+
+/**
+ * Inserts entry at index into a full node, moving the upper half into a new node.
+ * separator receives the first key of the new node and its page, the key moving up to the parent.
+ * a full internal node moves its middle entry up instead of copying it
+ */
+static int btree_split(btree_t *self, btree_frame_t *frame, size_t index, const btree_entry_t *entry, btree_entry_t *separator) {
+    btree_node_t *node = frame_node(frame);
+    btree_entry_t merged[BTREE_FANOUT + 1];
+    memcpy(merged, node_entries(node), index * sizeof(btree_entry_t));
+    merged[index] = *entry;
+    memcpy(merged + index + 1, node_entries(node) + index, (node->count - index) * sizeof(btree_entry_t));
+    size_t total = node->count + 1;
+    size_t left = total / 2;
+
+    btree_frame_t *right_frame = btree_allocate(self, node->leaf);
+    if (!right_frame) return -1;
+    btree_node_t *right = frame_node(right_frame);
+
+    memcpy(node_entries(node), merged, left * sizeof(btree_entry_t));
+    node->count = left;
+    if (node->leaf) {
+        memcpy(node_entries(right), merged + left, (total - left) * sizeof(btree_entry_t));
+        right->count = total - left;
+        right->link = node->link;
+        node->link = right_frame->page;
+        *separator = merged[left];
+    } else {
+        memcpy(node_entries(right), merged + left + 1, (total - left - 1) * sizeof(btree_entry_t));
+        right->count = total - left - 1;
+        right->link = merged[left].value;
+        *separator = merged[left];
+    }
+    separator->value = right_frame->page;
+    btree_release(right_frame, 1);
+    frame->dirty = 1;
+    return 0;
+}
+
+int btree__instance__put(btree_t *self, const char *key, uint64_t value) {
+    if (!self || !key) return -1;
+    if (btree_touch(self) != 0) return -1;
+
+    if (self->root == 0) {
+        btree_frame_t *frame = btree_allocate(self, 1);
+        if (!frame) return -1;
+        self->root = frame->page;
+        btree_release(frame, 1);
+    }
+
+    uint64_t path[BTREE_MAX_DEPTH];
+    size_t depth;
+    btree_frame_t *frame = btree_descend(self, key, path, &depth);
+    if (!frame) return -1;
+    btree_node_t *node = frame_node(frame);
+    size_t index = lower_bound(node_entries(node), node->count, key);
+    if (index < node->count && memcmp(node_entries(node)[index].key, key, BTREE_KEY_LENGTH) == 0) {
+        node_entries(node)[index].value = value;
+        btree_release(frame, 1);
+        return 0;
+    }
+    self->length++;
+
+    btree_entry_t entry;
+    memcpy(entry.key, key, BTREE_KEY_LENGTH);
+    entry.value = value;
+    // climb while the nodes overflow, each split inserts its separator into the parent
+    for (;;) {
+        node = frame_node(frame);
+        if (node->count < BTREE_FANOUT) {
+            memmove(node_entries(node) + index + 1, node_entries(node) + index, (node->count - index) * sizeof(btree_entry_t));
+            node_entries(node)[index] = entry;
+            node->count++;
+            btree_release(frame, 1);
+            return 0;
+        }
+
+        btree_entry_t separator;
+        uint64_t left_page = frame->page;
+        int result = btree_split(self, frame, index, &entry, &separator);
+        btree_release(frame, 1);
+        if (result != 0) return -1;
+        entry = separator;
+
+        if (depth == 0) {
+            // the root split, the tree grows one level
+            btree_frame_t *root = btree_allocate(self, 0);
+            if (!root) return -1;
+            frame_node(root)->link = left_page;
+            frame_node(root)->count = 1;
+            node_entries(frame_node(root))[0] = entry;
+            self->root = root->page;
+            btree_release(root, 1);
+            return 0;
+        }
+        depth--;
+        frame = btree_fetch(self, path[depth], 0);
+        if (!frame) return -1;
+        index = upper_bound(node_entries(frame_node(frame)), frame_node(frame)->count, entry.key);
+    }
+}
+
+int btree__instance__remove(btree_t *self, const char *key) {
+    if (!self || !key) return -1;
+    if (self->root == 0) return 0;
+
+    btree_frame_t *frame = btree_descend(self, key, NULL, NULL);
+    if (!frame) return -1;
+    btree_node_t *node = frame_node(frame);
+    size_t index = lower_bound(node_entries(node), node->count, key);
+    if (index == node->count || memcmp(node_entries(node)[index].key, key, BTREE_KEY_LENGTH) != 0) {
+        btree_release(frame, 0);
+        return 0;
+    }
+    if (btree_touch(self) != 0) {
+        btree_release(frame, 0);
+        return -1;
+    }
+    memmove(node_entries(node) + index, node_entries(node) + index + 1, (node->count - index - 1) * sizeof(btree_entry_t));
+    node->count--;
+    self->length--;
+    btree_release(frame, 1);
+    return 0;
+}
+
+int btree__instance__scan(btree_t *self, const char *after, btree_entry_t *entries, size_t capacity, size_t *out_length) {
+    if (!self || !out_length || (!entries && capacity > 0)) return -1;
+    *out_length = 0;
+    if (self->root == 0) return 0;
+
+    btree_frame_t *frame = btree_descend(self, after, NULL, NULL);
+    if (!frame) return -1;
+    size_t index = after ? upper_bound(node_entries(frame_node(frame)), frame_node(frame)->count, after) : 0;
+    size_t length = 0;
+    while (length < capacity) {
+        btree_node_t *node = frame_node(frame);
+        size_t take = node->count - index;
+        if (take > capacity - length) take = capacity - length;
+        memcpy(entries + length, node_entries(node) + index, take * sizeof(btree_entry_t));
+        length += take;
+
+        // the emptied leaves stay linked, the walk just passes them
+        uint64_t next = node->link;
+        btree_release(frame, 0);
+        frame = NULL;
+        if (length == capacity || next == 0) break;
+        frame = btree_fetch(self, next, 0);
+        if (!frame) return -1;
+        index = 0;
+    }
+    if (frame) btree_release(frame, 0);
+    *out_length = length;
+    return 0;
+}
+
+int btree__instance__flush(btree_t *self) {
+    if (!self) return -1;
+    if (self->clean) return 0;
+    for (size_t i = 0; i < self->frames_length; i++) {
+        btree_frame_t *frame = &self->frames[i];
+        if (frame->page == 0 || !frame->dirty) continue;
+        if (write_page(self->file_reference, frame->bytes, frame->page) != 0) return -1;
+        frame->dirty = 0;
+    }
+    // the pages are on disk before the header that describes them says so
+    if (self->durable && sync_tree_file(self->file_reference) != 0) return -1;
+    self->clean = 1;
+    if (btree_write_header(self) != 0) return -1;
+    return self->durable ? sync_tree_file(self->file_reference) : 0;
+}
+
+int btree__instance__clear(btree_t *self) {
+    if (!self) return -1;
+    if (btree_touch(self) != 0) return -1;
+    for (size_t i = 0; i < self->frames_length; i++) {
+        self->frames[i].page = 0;
+        self->frames[i].dirty = 0;
+        self->frames[i].pins = 0;
+    }
+    self->root = 0;
+    self->page_count = 1;
+    self->length = 0;
+    self->tag = 0;
+    return ftruncate(self->file_reference, BTREE_PAGE_SIZE);
+}
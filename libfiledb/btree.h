@@ -0,0 +1,117 @@
+#ifndef __btree_h__
+#define __btree_h__
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * page based B+tree in its own file mapping 32 bytes keys to 64 bit values.
+ * page 0 is the header, every other page is a node. the leaves are linked left to right
+ *   so that the keys can be walked in order. only a fixed number of pages is kept in memory,
+ *   the others are read on demand and written back when evicted.
+ * removing a key never merges nodes, a tree that shrank a lot is compacted by clearing and refilling it
+ */
+
+#define BTREE_PAGE_SIZE 4096
+#define BTREE_KEY_LENGTH 32
+
+/**
+ * a key and its value in a leaf, a separator key and the child right of it in an internal node
+ */
+typedef struct btree_entry_s {
+    char key[BTREE_KEY_LENGTH];
+    uint64_t value;
+} btree_entry_s;
+
+typedef btree_entry_s btree_entry_t;
+
+/**
+ * a page held in memory
+ */
+typedef struct btree_frame_s {
+    /**
+     * the page number, 0 when the frame is free
+     */
+    uint64_t page;
+    int dirty;
+    /**
+     * set while a node operation uses the page, a pinned page is never evicted
+     */
+    int pins;
+    /**
+     * the second chance bit of the clock eviction
+     */
+    int referenced;
+    unsigned char* bytes;
+} btree_frame_s;
+
+typedef btree_frame_s btree_frame_t;
+
+typedef struct btree_s {
+    int file_reference;
+    /**
+     * the root node, 0 while the tree is empty
+     */
+    uint64_t root;
+    uint64_t page_count;
+    /**
+     * the number of keys
+     */
+    uint64_t length;
+    /**
+     * a value the owner of the tree stores in the header, saved with the pages by flush
+     */
+    uint64_t tag;
+    /**
+     * set while the header on disk describes the pages on disk.
+     * the first change after a flush clears it on disk before any page is written,
+     *   a tree opened with clean unset may be torn and has to be rebuilt by its owner
+     */
+    int clean;
+    /**
+     * when set flush and the ordering points fsync the file
+     */
+    int durable;
+    btree_frame_t* frames;
+    size_t frames_length;
+    size_t hand;
+} btree_s;
+
+typedef btree_s btree_t;
+
+/**
+ * opens the tree file, creating an empty tree if the file is empty.
+ * a file with an unknown header is reset to an empty tree that is not clean.
+ * cache_pages is the number of pages kept in memory, at least 8
+ */
+btree_t* btree__static__open(const char* path, size_t cache_pages, int durable);
+/**
+ * flushes the tree and frees it
+ */
+int btree__static__close(btree_t* self);
+/**
+ * 1 and the value of the key when it is found, 0 when it is not, -1 on error
+ */
+int btree__instance__get(btree_t* self, const char* key, uint64_t* value);
+/**
+ * inserts the key or replaces its value
+ */
+int btree__instance__put(btree_t* self, const char* key, uint64_t value);
+/**
+ * removes the key, removing a missing key is not an error
+ */
+int btree__instance__remove(btree_t* self, const char* key);
+/**
+ * copies up to capacity entries in key order starting after the key after, from the first key when after is NULL.
+ * out_length receives the number of entries copied, less than capacity only at the end of the tree
+ */
+int btree__instance__scan(btree_t* self, const char* after, btree_entry_t* entries, size_t capacity, size_t* out_length);
+/**
+ * writes the dirty pages then the header and marks the tree clean
+ */
+int btree__instance__flush(btree_t* self);
+/**
+ * removes every key and truncates the file
+ */
+int btree__instance__clear(btree_t* self);
+
+#endif
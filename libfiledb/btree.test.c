@@ -0,0 +1,143 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "btree.h"
+
+#define TEST_BTREE_PATH "btree.test.btree"
+#define TEST_BTREE_KEYS 20000
+
+void make_key(char *key, unsigned value) {
+    // the counter is scrambled so that the keys arrive in random order
+    unsigned scrambled = value * 2654435761u;
+    memset(key, 0, BTREE_KEY_LENGTH);
+    snprintf(key, BTREE_KEY_LENGTH, "%08x-%u", scrambled, value);
+}
+
+int compare_keys(const void *a, const void *b) {
+    return memcmp(a, b, BTREE_KEY_LENGTH);
+}
+
+void test_put_get_remove() {
+    unlink(TEST_BTREE_PATH);
+    btree_t *tree = btree__static__open(TEST_BTREE_PATH, 8, 0);
+    assert(tree != NULL);
+    assert(tree->clean);
+
+    char key[BTREE_KEY_LENGTH];
+    uint64_t value;
+    make_key(key, 1);
+    assert(btree__instance__get(tree, key, &value) == 0);
+
+    for (unsigned i = 0; i < TEST_BTREE_KEYS; i++) {
+        make_key(key, i);
+        assert(btree__instance__put(tree, key, i) == 0);
+    }
+    assert(tree->length == TEST_BTREE_KEYS);
+    // replacing a value doesn't add a key
+    make_key(key, 5);
+    assert(btree__instance__put(tree, key, 500000) == 0);
+    assert(tree->length == TEST_BTREE_KEYS);
+
+    for (unsigned i = 0; i < TEST_BTREE_KEYS; i++) {
+        make_key(key, i);
+        assert(btree__instance__get(tree, key, &value) == 1);
+        assert(value == (i == 5 ? 500000 : i));
+    }
+    for (unsigned i = 0; i < TEST_BTREE_KEYS; i += 3) {
+        make_key(key, i);
+        assert(btree__instance__remove(tree, key) == 0);
+    }
+    assert(btree__instance__remove(tree, key) == 0);
+    for (unsigned i = 0; i < TEST_BTREE_KEYS; i++) {
+        make_key(key, i);
+        assert(btree__instance__get(tree, key, &value) == (i % 3 == 0 ? 0 : 1));
+    }
+    printf("%llu keys in %llu pages with a cache of %zu pages\n", (unsigned long long)tree->length,
+           (unsigned long long)tree->page_count, tree->frames_length);
+    assert(btree__static__close(tree) == 0);
+}
+
+void test_scan() {
+    btree_t *tree = btree__static__open(TEST_BTREE_PATH, 8, 0);
+    assert(tree != NULL);
+
+    size_t expected_length = 0;
+    char *expected = malloc((size_t)TEST_BTREE_KEYS * BTREE_KEY_LENGTH);
+    for (unsigned i = 0; i < TEST_BTREE_KEYS; i++) {
+        if (i % 3 == 0) continue;
+        make_key(expected + expected_length * BTREE_KEY_LENGTH, i);
+        expected_length++;
+    }
+    qsort(expected, expected_length, BTREE_KEY_LENGTH, compare_keys);
+
+    // small chunks continuing after the last key seen cross every leaf boundary
+    btree_entry_t entries[37];
+    size_t seen = 0, length;
+    const char *after = NULL;
+    char last[BTREE_KEY_LENGTH];
+    do {
+        assert(btree__instance__scan(tree, after, entries, 37, &length) == 0);
+        for (size_t i = 0; i < length; i++) {
+            assert(seen < expected_length);
+            assert(memcmp(entries[i].key, expected + seen * BTREE_KEY_LENGTH, BTREE_KEY_LENGTH) == 0);
+            seen++;
+        }
+        if (length > 0) {
+            memcpy(last, entries[length - 1].key, BTREE_KEY_LENGTH);
+            after = last;
+        }
+    } while (length == 37);
+    assert(seen == expected_length);
+    free(expected);
+    assert(btree__static__close(tree) == 0);
+}
+
+void test_persistence_and_clear() {
+    btree_t *tree = btree__static__open(TEST_BTREE_PATH, 16, 1);
+    assert(tree != NULL);
+    assert(tree->clean);
+    assert(tree->length == TEST_BTREE_KEYS - (TEST_BTREE_KEYS + 2) / 3);
+
+    char key[BTREE_KEY_LENGTH];
+    uint64_t value;
+    make_key(key, 7);
+    assert(btree__instance__get(tree, key, &value) == 1 && value == 7);
+    tree->tag = 1234;
+    assert(btree__instance__put(tree, key, 8) == 0);
+    assert(!tree->clean);
+    assert(btree__instance__flush(tree) == 0);
+    assert(tree->clean);
+
+    assert(btree__instance__clear(tree) == 0);
+    assert(tree->length == 0 && tree->root == 0);
+    assert(btree__instance__get(tree, key, &value) == 0);
+    make_key(key, 1);
+    assert(btree__instance__put(tree, key, 1) == 0);
+    assert(btree__static__close(tree) == 0);
+
+    tree = btree__static__open(TEST_BTREE_PATH, 8, 0);
+    assert(tree->clean && tree->length == 1);
+    assert(btree__instance__get(tree, key, &value) == 1 && value == 1);
+    assert(btree__static__close(tree) == 0);
+
+    // a file that isn't a tree is reset and reported as not clean
+    FILE *garbage = fopen(TEST_BTREE_PATH, "wb");
+    fputs("not a tree", garbage);
+    fclose(garbage);
+    tree = btree__static__open(TEST_BTREE_PATH, 8, 0);
+    assert(tree != NULL && !tree->clean && tree->length == 0);
+    assert(btree__static__close(tree) == 0);
+    unlink(TEST_BTREE_PATH);
+}
+
+int main() {
+    printf("=== test_put_get_remove =======================================:\n");
+    test_put_get_remove();
+    printf("=== test_scan =======================================:\n");
+    test_scan();
+    printf("=== test_persistence_and_clear =======================================:\n");
+    test_persistence_and_clear();
+    return 0;
+}
@@ -1,42 +1,145 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "filedb.h"
+#include "hash.h"
+#include "lz.h"
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#define FILEDB_HAS_MMAP
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#else
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+// number of entries appended to a mapped index before it is remapped
+#define INDEX_MAP_TAIL_LIMIT 4096
+// log entries a parallel scan worker claims at once
+#define PARALLEL_SCAN_BATCH 256
+// a batch is read with a single pread when its records span at most this many times their own bytes
+#define PARALLEL_SCAN_SPAN_RATIO 2
+// first allocation of record_list, it then doubles on growth
+#define RECORD_LIST_INITIAL_CAPACITY 64
+// bounce buffer of the compaction when the kernel can't copy between the files itself
+#define COPY_BUFFER_SIZE (1 << 20)
+// segments compacted in parallel by a single optimize when compaction_segments is 0
+#define SEGMENT_COMPACTION_DEFAULT 4
+// first bytes of an index file, the index files of the first releases have no header
+#define INDEX_MAGIC "FILEDBIX"
+// entries stored as record_t, the format a mapped index reads in place
+#define INDEX_VERSION_FIXED 2
+// entries in the variable length encoding of index_entry_encode
+#define INDEX_VERSION_COMPACT 3
+// flags byte of a compact entry: the tombstone bit, the codec in the high 4 bits
+#define INDEX_ENTRY_TOMBSTONE 1
+#define INDEX_ENTRY_CODEC_SHIFT 4
+// flags, id, checksum and the 3 varints of 10 bytes at most
+#define INDEX_ENTRY_MAX_LENGTH (1 + 32 + 4 + 3 * 10)
+#define INDEX_ENTRY_MIN_LENGTH (1 + 32 + 4)
+
+/**
+ * The header at the start of the index file, padded to the size of an entry
+ *   so that the entries of a mapped index stay aligned
+ */
+typedef struct index_header_s {
+    char magic[8];
+    unsigned int version;
+    unsigned int entry_size;
+    /**
+     * the log entries and data bytes that were durable and intact when they were last synced, 0 when unknown
+     */
+    uint64_t verified_length;
+    uint64_t verified_data_length;
+} index_header_t;
+
+#define CHECKPOINT_MAGIC "FILEDBCP"
+#define CHECKPOINT_VERSION 1
+
+/**
+ * The header of the checkpoint file, followed by length entries
+ */
+typedef struct checkpoint_header_s {
+    char magic[8];
+    unsigned int version;
+    unsigned int entry_size;
+    /**
+     * the log entries the checkpoint reflects, the later ones are replayed
+     */
+    size_t covered;
+    size_t length;
+} checkpoint_header_t;
+
+/**
+ * A live record of the checkpoint: its id and the position of its latest version
+ */
+typedef struct checkpoint_entry_s {
+    char id[32];
+    size_t position;
+} checkpoint_entry_t;
+
+/**
+ * An entry of the headerless index files of the first releases
+ */
+typedef struct legacy_record_s {
+    char id[32];
+    size_t start;
+    size_t end;
+} legacy_record_t;
 
 // Compute hash
-// Helper function to compute a simple hash for record content
-static void compute_hash(char *data, int data_length, char *hash) {
-    unsigned long long sum = 0;
-    for (int i = 0; i < data_length; i++) {
-        sum += (unsigned char)data[i] * (i + 1);
-    }
-    snprintf(hash, 32, "%032llx", sum);
+// the record id is the raw 32 bytes BLAKE3 digest of the content
+static void compute_hash(const char *data, size_t data_length, char *hash) {
+    hash__static__compute(data, data_length, (unsigned char *)hash);
 }
 
 #ifdef __MINGW32__
 #include <windows.h>
+#include <io.h>
 
+// the reads and writes at an offset go through an OVERLAPPED structure
+//   so that concurrent readers never race on the shared file position
 ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
-    off_t original_offset = lseek(fd, 0, SEEK_CUR); // Save current position
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        return -1; // Error seeking
+    OVERLAPPED overlapped = {0};
+    overlapped.Offset = (DWORD)((unsigned long long)offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+    DWORD got = 0;
+    if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, count > 0x7FFFFFFF ? 0x7FFFFFFF : (DWORD)count, &got, &overlapped)) {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
     }
-    ssize_t result = read(fd, buf, count);         // Read data
-    lseek(fd, original_offset, SEEK_SET);          // Restore original position
-    return result;
+    return got;
 }
 
 ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
-    off_t original_offset = lseek(fd, 0, SEEK_CUR); // Save current position
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        return -1; // Error seeking
-    }
-    ssize_t result = write(fd, buf, count);        // Write data
-    lseek(fd, original_offset, SEEK_SET);          // Restore original position
-    return result;
+    OVERLAPPED overlapped = {0};
+    overlapped.Offset = (DWORD)((unsigned long long)offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+    DWORD written = 0;
+    if (!WriteFile((HANDLE)_get_osfhandle(fd), buf, count > 0x7FFFFFFF ? 0x7FFFFFFF : (DWORD)count, &written, &overlapped)) return -1;
+    return written;
 }
 
 int rename_file(const char *oldname, const char *newname) {
@@ -81,6 +184,157 @@ int rename_file(const char *oldname, const char *newname) {
 
 #endif
 
+// Writes the whole buffer at offset, retrying short writes
+static int write_fully(int fd, const void *buffer, size_t length, size_t offset) {
+    const char *cursor = (const char*)buffer;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, cursor, length, offset);
+        if (written <= 0) return -1;
+        cursor += written;
+        offset += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Reads the whole buffer at offset, retrying short reads
+static int read_fully(int fd, void *buffer, size_t length, size_t offset) {
+    char *cursor = (char*)buffer;
+    while (length > 0) {
+        ssize_t got = pread(fd, cursor, length, offset);
+        if (got <= 0) return -1;
+        cursor += got;
+        offset += got;
+        length -= got;
+    }
+    return 0;
+}
+
+// Writes the buffers back to back at offset with as few syscalls as possible
+static int write_gathered(int fd, struct iovec *iov, size_t count, size_t offset) {
+#ifdef __MINGW32__
+    for (size_t i = 0; i < count; i++) {
+        if (write_fully(fd, iov[i].iov_base, iov[i].iov_len, offset) != 0) return -1;
+        offset += iov[i].iov_len;
+    }
+    return 0;
+#else
+    while (count > 0) {
+        int chunk = count < IOV_MAX ? (int)count : IOV_MAX;
+        ssize_t written = pwritev(fd, iov, chunk, offset);
+        if (written <= 0) return -1;
+        offset += written;
+
+        // skip the fully written buffers and resume inside a partially written one
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+#endif
+}
+
+// Reads the file at offset into the buffers back to back with as few syscalls as possible
+static int read_scattered(int fd, struct iovec *iov, size_t count, size_t offset) {
+#ifdef __MINGW32__
+    for (size_t i = 0; i < count; i++) {
+        if (read_fully(fd, iov[i].iov_base, iov[i].iov_len, offset) != 0) return -1;
+        offset += iov[i].iov_len;
+    }
+    return 0;
+#else
+    while (count > 0) {
+        int chunk = count < IOV_MAX ? (int)count : IOV_MAX;
+        ssize_t got = preadv(fd, iov, chunk, offset);
+        if (got <= 0) return -1;
+        offset += got;
+
+        // skip the filled buffers and resume inside a partially filled one
+        while (count > 0 && (size_t)got >= iov->iov_len) {
+            got -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + got;
+            iov->iov_len -= got;
+        }
+    }
+    return 0;
+#endif
+}
+
+// Flushes the file contents to stable storage
+static int sync_file(int fd) {
+#if defined(__MINGW32__)
+    return _commit(fd);
+#elif defined(__linux__)
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+// Preallocates whole extents past the end of the file so appends up to end don't allocate blocks
+static void file_reserve(int fd, size_t *allocated, size_t end, size_t extent) {
+#ifdef __linux__
+    if (extent == 0 || end <= *allocated) return;
+    size_t length = ((end - *allocated + extent - 1) / extent) * extent;
+    // KEEP_SIZE leaves st_size at the logical end so readers never see the preallocated tail
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, *allocated, length) == 0) *allocated += length;
+#endif
+}
+
+// Writes the buffered bytes to the file
+static int write_buffer_flush(int fd, write_buffer_t *buffer) {
+    if (buffer->length == 0) return 0;
+    if (write_fully(fd, buffer->bytes, buffer->length, buffer->offset) != 0) return -1;
+    buffer->offset += buffer->length;
+    buffer->length = 0;
+    return 0;
+}
+
+/**
+ * Appends the iov[1..count) buffers, total bytes long, at offset through the write buffer.
+ * iov[0] is reserved for the pending bytes so that when the new bytes don't fit
+ *   everything is spilled with one gathered write
+ */
+static int write_buffer_append(int fd, write_buffer_t *buffer, struct iovec *iov, size_t count, size_t offset, size_t total) {
+    if (buffer->capacity == 0) return write_gathered(fd, iov + 1, count - 1, offset);
+
+    if (buffer->length == 0) buffer->offset = offset;
+    if (buffer->length + total <= buffer->capacity) {
+        for (size_t i = 1; i < count; i++) {
+            memcpy(buffer->bytes + buffer->length, iov[i].iov_base, iov[i].iov_len);
+            buffer->length += iov[i].iov_len;
+        }
+        return 0;
+    }
+
+    iov[0].iov_base = buffer->bytes;
+    iov[0].iov_len = buffer->length;
+    if (write_gathered(fd, iov, count, buffer->offset) != 0) return -1;
+    buffer->offset += buffer->length + total;
+    buffer->length = 0;
+    return 0;
+}
+
+// Fills in a record for content stored at start
+static void record__instance__init(record_t *self, size_t start, const char *data, size_t data_length) {
+    compute_hash(data, data_length, self->id);
+    self->start = start;
+    self->end = start + data_length;
+    self->length = data_length;
+    self->codec = RECORD_CODEC_NONE;
+    self->reserved = 0;
+}
+
 // Record creation function
 record_t* record__static__new_from_buffer(int start, char* data, int data_length) {
     if (!data || data_length <= 0) return NULL;
@@ -88,9 +342,7 @@ record_t* record__static__new_from_buffer(int start, char* data, int data_length
     record_t *record = (record_t*)malloc(sizeof(record_t));
     if (!record) return NULL;
 
-    compute_hash(data, data_length, record->id); // Using SHA-256 here
-    record->start = start;
-    record->end = start + data_length;
+    record__instance__init(record, start, data, data_length);
     return record;
 }
 
@@ -99,269 +351,4279 @@ int record__instance__is_deleted(const record_t *record) {
     return record->start == 0 && record->end == 0;
 }
 
-// Open a database
-database_t* database__static_open(const char* path) {
-    if (!path) return NULL;
+size_t record__instance__segment(const record_t *record) {
+    if (!record) return 0;
+    return record->start >> DATABASE_SEGMENT_OFFSET_BITS;
+}
 
-    database_t *db = (database_t*)malloc(sizeof(database_t));
-    if (!db) return NULL;
+// Starts a change the readers of the guarded fields must not see half done
+static inline void sequence_write_begin(size_t *sequence) {
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    db->path = strdup(path);
-    db->record_list = NULL;
-    db->record_list_length = 0;
+static inline void sequence_write_end(size_t *sequence) {
+    __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
 
-    char data_file_path[256];
-    char index_file_path[256];
-    snprintf(data_file_path, 256, "%s.data", path);
-    snprintf(index_file_path, 256, "%s.index", path);
+// Waits for the change in progress, if any, and returns the sequence to validate the reads against
+static inline size_t sequence_read_begin(const size_t *sequence) {
+    size_t value;
+    while ((value = __atomic_load_n(sequence, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+    return value;
+}
 
-    db->data_file_reference = open(data_file_path, O_RDWR | O_CREAT, 0666);
-    db->index_file_reference = open(index_file_path, O_RDWR | O_CREAT, 0666);
+// Whether the reads since sequence_read_begin may have seen a change half done and must be retried
+static inline int sequence_read_retry(const size_t *sequence, size_t value) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(sequence, __ATOMIC_RELAXED) != value;
+}
 
-    if (db->data_file_reference == -1 || db->index_file_reference == -1) {
-        free(db);
-        return NULL;
-    }
+// Number of entries in the log, the entries below it are fully written
+static inline size_t log_length(const database_t *self) {
+    return __atomic_load_n(&self->record_list_length, __ATOMIC_ACQUIRE);
+}
 
-    struct stat st;
-    if (fstat(db->index_file_reference, &st) == 0 && st.st_size > 0) {
-        db->record_list_length = st.st_size / sizeof(record_t);
-        db->record_list = (record_t*)malloc(st.st_size);
-        pread(db->index_file_reference, db->record_list, st.st_size, 0);
-    }
+// Log entry at position, either inside the index mapping or the in-memory record_list
+static inline record_t* record_at(const database_t *self, size_t position) {
+    record_t *record;
+    size_t sequence;
+    do {
+        sequence = sequence_read_begin(&self->log_sequence);
+        size_t offset = __atomic_load_n(&self->record_list_offset, __ATOMIC_RELAXED);
+        if (position < offset) record = (record_t*)&__atomic_load_n(&self->index_map, __ATOMIC_ACQUIRE)[position];
+        else record = &__atomic_load_n(&self->record_list, __ATOMIC_ACQUIRE)[position - offset];
+    } while (sequence_read_retry(&self->log_sequence, sequence));
+    return record;
+}
 
-    return db;
+static void retired_release(const retired_t *retired) {
+#ifdef FILEDB_HAS_MMAP
+    if (retired->length > 0) {
+        munmap(retired->pointer, retired->length);
+        return;
+    }
+#endif
+    free(retired->pointer);
 }
 
-// Close a database
-error_t database__static__close(database_t* self) {
-    if (!self) return -1;
+/**
+ * Frees the retired storage no reader can see anymore, the reclaim lock is held by the caller.
+ * storage retired in epoch E is freed once the epoch moved to E + 1 and the readers registered in E left,
+ *   two passes let a writer without concurrent readers free what it just retired
+ */
+static void database__instance__reclaim_locked(database_t *self) {
+    for (int pass = 0; pass < 2 && self->retired_length > 0; pass++) {
+        size_t epoch = self->reader_epoch;
+        if (__atomic_load_n(&self->readers[(epoch + 1) & 1], __ATOMIC_SEQ_CST) != 0) return;
 
-    if (self->data_file_reference >= 0) close(self->data_file_reference);
-    if (self->index_file_reference >= 0) close(self->index_file_reference);
+        size_t kept = 0;
+        for (size_t i = 0; i < self->retired_length; i++) {
+            if (self->retired[i].epoch < epoch) retired_release(&self->retired[i]);
+            else self->retired[kept++] = self->retired[i];
+        }
+        self->retired_length = kept;
+        if (kept > 0) __atomic_store_n(&self->reader_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    }
+}
 
-    if (self->record_list) free(self->record_list);
-    if (self->path) free((void*)self->path);
+static void database__instance__reclaim(database_t *self) {
+    pthread_mutex_lock(&self->reclaim_lock);
+    database__instance__reclaim_locked(self);
+    pthread_mutex_unlock(&self->reclaim_lock);
+}
 
-    free(self);
-    return 0;
+// Hands replaced storage over to the reclamation, length > 0 marks a mapping. the reclaim lock is held by the caller
+static void database__instance__retire_locked(database_t *self, void *pointer, size_t length) {
+    if (!pointer) return;
+    if (self->retired_length == self->retired_capacity) {
+        size_t capacity = self->retired_capacity ? self->retired_capacity * 2 : 16;
+        retired_t *retired = (retired_t*)realloc(self->retired, capacity * sizeof(retired_t));
+        // leaked rather than freed under a reader
+        if (!retired) return;
+        self->retired = retired;
+        self->retired_capacity = capacity;
+    }
+    self->retired[self->retired_length].pointer = pointer;
+    self->retired[self->retired_length].length = length;
+    self->retired[self->retired_length].epoch = self->reader_epoch;
+    self->retired_length++;
+    database__instance__reclaim_locked(self);
 }
 
-// Insert a record
-record_t* database__instance__insert_record(database_t* self, char* data, int data_length) {
-    if (!self || !data || data_length <= 0) return NULL;
+static void database__instance__retire(database_t *self, void *pointer, size_t length) {
+    pthread_mutex_lock(&self->reclaim_lock);
+    database__instance__retire_locked(self, pointer, length);
+    pthread_mutex_unlock(&self->reclaim_lock);
+}
 
-    // Determine the position to write the new record's content
-    lseek(self->data_file_reference, 0, SEEK_END);
-    int start = lseek(self->data_file_reference, 0, SEEK_CUR);
-    write(self->data_file_reference, data, data_length);
+// Frees every retired storage, only called while no reader can be in a section
+static void database__instance__reclaim_all(database_t *self) {
+    for (size_t i = 0; i < self->retired_length; i++) retired_release(&self->retired[i]);
+    self->retired_length = 0;
+}
 
-    // Create a new record
-    record_t *record = record__static__new_from_buffer(start, data, data_length);
-    if (!record) return NULL;
+// databases a thread can be in a read section of at once
+#define READ_SECTIONS_PER_THREAD 8
 
-    // Add the record to the record list
-    self->record_list = (record_t*)realloc(self->record_list, (self->record_list_length + 1) * sizeof(record_t));
-    self->record_list[self->record_list_length++] = *record;
+/**
+ * the outermost read section the thread has open in a database and how deep it is nested.
+ * only the outermost one takes the generation lock, a second read lock from the same thread would
+ *   wait behind a queued optimize on a writer preferring rwlock while holding the first one
+ */
+typedef struct read_section_s {
+    const database_t *database;
+    size_t depth;
+    size_t epoch;
+} read_section_t;
 
-    // Write the new record to the index file
-    pwrite(self->index_file_reference, record, sizeof(record_t), (self->record_list_length - 1) * sizeof(record_t));
+static __thread read_section_t read_sections[READ_SECTIONS_PER_THREAD];
 
-    return record;
+static read_section_t* read_section_of(const database_t *self) {
+    for (int i = 0; i < READ_SECTIONS_PER_THREAD; i++) {
+        if (read_sections[i].database == self) return &read_sections[i];
+    }
+    return NULL;
 }
 
-// Delete a record
-record_t* database__instance__delete_record(database_t* self, record_t* record) {
-    if (!self || !record) return NULL;
+// Open a read section
+size_t database__instance__read_begin(database_t *self) {
+    read_section_t *open = read_section_of(self);
+    if (open) {
+        open->depth++;
+        return open->epoch;
+    }
+    pthread_rwlock_rdlock(&self->generation_lock);
+    for (;;) {
+        size_t epoch = __atomic_load_n(&self->reader_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&self->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        // the epoch moved on meanwhile, the reclamation may not have counted this reader
+        if (__atomic_load_n(&self->reader_epoch, __ATOMIC_SEQ_CST) == epoch) {
+            read_section_t *free_section = read_section_of(NULL);
+            // past READ_SECTIONS_PER_THREAD databases the sections of the thread are no longer tracked
+            if (free_section) {
+                free_section->database = self;
+                free_section->depth = 1;
+                free_section->epoch = epoch;
+            }
+            return epoch;
+        }
+        __atomic_sub_fetch(&self->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
 
-    // Create a new record with the same ID but with start and end set to 0
-    record_t deleted_record = *record;
-    deleted_record.start = 0;
-    deleted_record.end = 0;
+// Close a read section
+void database__instance__read_end(database_t *self, size_t section) {
+    read_section_t *open = read_section_of(self);
+    if (open && --open->depth > 0) return;
+    if (open) open->database = NULL;
+    __atomic_sub_fetch(&self->readers[section & 1], 1, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&self->generation_lock);
+}
 
-    // Add the deleted record to the record list
-    self->record_list = (record_t*)realloc(self->record_list, (self->record_list_length + 1) * sizeof(record_t));
-    self->record_list[self->record_list_length++] = deleted_record;
+// Segment of a data address, the data log of an unsegmented database is segment 0
+static inline size_t address_segment(const database_t *self, size_t address) {
+    if (self->options.segment_size == 0) return 0;
+    return address >> DATABASE_SEGMENT_OFFSET_BITS;
+}
 
-    // Write the deleted record to the index file
-    pwrite(self->index_file_reference, &deleted_record, sizeof(record_t), (self->record_list_length - 1) * sizeof(record_t));
+// Offset of a data address inside its segment file
+static inline size_t address_offset(const database_t *self, size_t address) {
+    if (self->options.segment_size == 0) return address;
+    return address & (((size_t)1 << DATABASE_SEGMENT_OFFSET_BITS) - 1);
+}
 
-    return &self->record_list[self->record_list_length - 1];
+// Data address of an offset inside the given segment
+static inline size_t segment_address(size_t segment, size_t offset) {
+    return (segment << DATABASE_SEGMENT_OFFSET_BITS) | offset;
 }
 
+// Path of a segment file <path>.data.NNNNNN
+static void segment_path(const database_t *self, size_t segment, char *path) {
+    snprintf(path, 256, "%s.data.%06zu", self->path, segment);
+}
 
-// List all records
-error_t database__instance__list_all(database_t* self, record_found_fn on_record_found) {
-    if (!self || !on_record_found) return -1;
+// Grows the segments table so that segment is a valid index, the readers keep using the old table until they are done
+static int segments_reserve(database_t *self, size_t segment) {
+    if (segment < self->segments_length) return 0;
 
-    for (size_t i = 0; i < self->record_list_length; i++) {
-        on_record_found(&self->record_list[i], i);
+    segment_t *segments = (segment_t*)malloc((segment + 1) * sizeof(segment_t));
+    if (!segments) return -1;
+    if (self->segments_length > 0) memcpy(segments, self->segments, self->segments_length * sizeof(segment_t));
+    for (size_t i = self->segments_length; i <= segment; i++) {
+        segments[i].file_reference = -1;
+        segments[i].length = 0;
+        segments[i].live_bytes = 0;
     }
+    segment_t *old_segments = self->segments;
+    __atomic_store_n(&self->segments, segments, __ATOMIC_RELEASE);
+    __atomic_store_n(&self->segments_length, segment + 1, __ATOMIC_RELEASE);
+    database__instance__retire(self, old_segments, 0);
     return 0;
 }
 
-// List all records with content
-error_t database__instance__list_all_with_content(database_t* self, record_found_with_content_fn on_record_with_content_found) {
-    if (!self || !on_record_with_content_found) return -1;
+// Descriptor of a segment file, opened on first use with the given extra open flags
+static int segment_open(database_t *self, size_t segment, int flags) {
+    if (segments_reserve(self, segment) != 0) return -1;
+    segment_t *entry = &self->segments[segment];
+    if (entry->file_reference >= 0) return entry->file_reference;
 
-    for (size_t i = 0; i < self->record_list_length; i++) {
-        record_t *record = &self->record_list[i];
-        size_t content_size = record->end - record->start;
+    char path[256];
+    segment_path(self, segment, path);
+    entry->file_reference = open(path, O_RDWR | flags, 0666);
+    if (entry->file_reference == -1) return -1;
 
-        if (content_size == 0) continue;
+    struct stat st;
+    entry->length = fstat(entry->file_reference, &st) == 0 ? (size_t)st.st_size : 0;
+    return entry->file_reference;
+}
 
-        char *content = (char *)malloc(content_size + 1);
-        if (!content) return -1;
+// Moves the live bytes of a record in or out of its segment accounting
+static void segments_account(database_t *self, const record_t *record, int live) {
+    size_t segment = address_segment(self, record->start);
+    if (segments_reserve(self, segment) != 0) return;
+    size_t content_size = record->end - record->start;
+    if (live) self->segments[segment].live_bytes += content_size;
+    else self->segments[segment].live_bytes -= content_size;
+}
 
-        if (lseek(self->data_file_reference, record->start, SEEK_SET) == (off_t)-1) {
-            free(content);
-            return -1;
-        }
+#define ID_INDEX_INITIAL_CAPACITY 64
+#define ID_INDEX_EMPTY 0
+// lock-free copies of the id index tried before get_latest_records copies it under the write lock
+#define ID_INDEX_SNAPSHOT_ATTEMPTS 3
 
-        if (read(self->data_file_reference, content, content_size) != (ssize_t)content_size) {
-            free(content);
-            return -1;
-        }
+// FNV-1a over the full 32 bytes of the id
+static size_t id_index_hash(const char *id) {
+    unsigned long long h = 1469598103934665603ULL;
+    for (int i = 0; i < 32; i++) {
+        h ^= (unsigned char)id[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
 
-        content[content_size] = '\0';
+// Allocates an empty table, its capacity is stored in front of the slots so that a reader never pairs it with another table
+static size_t* id_index_allocate(size_t capacity) {
+    size_t *index = (size_t*)calloc(capacity + 1, sizeof(size_t));
+    if (!index) return NULL;
+    index[0] = capacity;
+    return index + 1;
+}
 
-        error_t result = on_record_with_content_found(record, (int)i, content);
-        free(content);
+// Returns the slot holding the id, or the empty slot where it would go. only used by the writer
+static size_t id_index_find_slot(const database_t *self, const char *id) {
+    size_t mask = self->id_index_capacity - 1;
+    size_t slot = id_index_hash(id) & mask;
+    while (self->id_index[slot] != ID_INDEX_EMPTY) {
+        const record_t *record = record_at(self, self->id_index[slot] - 1);
+        if (memcmp(record->id, id, 32) == 0) break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Rehash every live entry into a table of the given power of two capacity.
+ * the new table is filled before it is published, the readers still probing the old one see it unchanged
+ */
+static int id_index_resize(database_t *self, size_t capacity) {
+    size_t *index = id_index_allocate(capacity);
+    if (!index) return -1;
 
-        if (result != 0) return result;
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < self->id_index_capacity; i++) {
+        size_t position = self->id_index[i];
+        if (position == ID_INDEX_EMPTY) continue;
+        size_t slot = id_index_hash(record_at(self, position - 1)->id) & mask;
+        while (index[slot] != ID_INDEX_EMPTY) slot = (slot + 1) & mask;
+        index[slot] = position;
     }
 
+    size_t *old_index = self->id_index;
+    __atomic_store_n(&self->id_index, index, __ATOMIC_RELEASE);
+    self->id_index_capacity = capacity;
+    if (old_index) database__instance__retire(self, old_index - 1, 0);
     return 0;
 }
 
-// Helper function to check if a record is already in the list
-static int is_id_in_list(const char **processed_ids, size_t count, const char *id) {
-    for (size_t i = 0; i < count; i++) {
-        if (strncmp(processed_ids[i], id, 32) == 0) {
-            return 1; // ID found
-        }
+// Points the id of the log entry at position to that position
+static int id_index_put(database_t *self, size_t position) {
+    if ((self->id_index_length + 1) * 2 > self->id_index_capacity) {
+        size_t capacity = self->id_index_capacity ? self->id_index_capacity * 2 : ID_INDEX_INITIAL_CAPACITY;
+        if (id_index_resize(self, capacity) != 0) return -1;
     }
+    size_t slot = id_index_find_slot(self, record_at(self, position)->id);
+    if (self->id_index[slot] == ID_INDEX_EMPTY) self->id_index_length++;
+    // a single store, a reader sees either the previous version or this one
+    __atomic_store_n(&self->id_index[slot], position + 1, __ATOMIC_RELEASE);
     return 0;
 }
 
+// Removes the id using backward shift deletion so no tombstones are left behind
+static void id_index_remove(database_t *self, const char *id) {
+    if (self->id_index_capacity == 0) return;
+
+    size_t mask = self->id_index_capacity - 1;
+    size_t slot = id_index_find_slot(self, id);
+    if (self->id_index[slot] == ID_INDEX_EMPTY) return;
+
+    // a reader probing while the entries shift could miss one, it retries when the sequence moved
+    sequence_write_begin(&self->id_index_sequence);
+    size_t next = (slot + 1) & mask;
+    while (self->id_index[next] != ID_INDEX_EMPTY) {
+        size_t home = id_index_hash(record_at(self, self->id_index[next] - 1)->id) & mask;
+        // move the entry back if its home slot is not in the cyclic range (slot, next]
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            __atomic_store_n(&self->id_index[slot], self->id_index[next], __ATOMIC_RELEASE);
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    __atomic_store_n(&self->id_index[slot], ID_INDEX_EMPTY, __ATOMIC_RELEASE);
+    sequence_write_end(&self->id_index_sequence);
+    self->id_index_length--;
+}
+
+// Grows the id index so that n more ids fit without a resize
+static int id_index_reserve(database_t *self, size_t n) {
+    size_t capacity = self->id_index_capacity ? self->id_index_capacity : ID_INDEX_INITIAL_CAPACITY;
+    while ((self->id_index_length + n) * 2 > capacity) capacity *= 2;
+    if (capacity == self->id_index_capacity) return 0;
+    return id_index_resize(self, capacity);
+}
+
+// Shrinks the id index after removals so that iterating the table stays proportional to the live records
+static void id_index_shrink(database_t *self) {
+    size_t capacity = self->id_index_capacity;
+    while (capacity > ID_INDEX_INITIAL_CAPACITY && self->id_index_length * 8 < capacity) capacity /= 2;
+    // a failed shrink keeps the larger table
+    if (capacity != self->id_index_capacity) id_index_resize(self, capacity);
+}
+
+// Applies the log entry at position to the id index
+static int id_index_apply(database_t *self, size_t position) {
+    record_t *record = record_at(self, position);
+
+    // the version being replaced or deleted turns into garbage of its segment
+    if (self->options.segment_size && self->id_index_capacity > 0) {
+        size_t slot = id_index_find_slot(self, record->id);
+        if (self->id_index[slot] != ID_INDEX_EMPTY) segments_account(self, record_at(self, self->id_index[slot] - 1), 0);
+    }
+    if (self->options.segment_size && !record__instance__is_deleted(record)) segments_account(self, record, 1);
+
+    if (record__instance__is_deleted(record)) {
+        id_index_remove(self, record->id);
+        return 0;
+    }
+    return id_index_put(self, position);
+}
+
+static void checkpoint_path(const database_t *self, char *path) {
+    snprintf(path, 256, "%s.checkpoint", self->path);
+}
+
 /**
- * Iterates over the latest, non-deleted records.
- * Calls the provided callback function for each valid record.
+ * Fills the empty id index from the checkpoint, covered receives the log length it reflects or 0 without a usable one.
+ * every entry is checked against the log before any is used, so a torn checkpoint or one of another log is ignored
  */
-error_t database__instance__get_latest_records(database_t *self, record_iter_fn on_record_found) {
-    if (!self || !on_record_found) return -1;
+static int id_index_load_checkpoint(database_t *self, size_t *covered) {
+    *covered = 0;
+    char path[256];
+    checkpoint_path(self, path);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
 
-    // Allocate memory for tracking processed IDs
-    const char **processed_ids = (const char **)calloc(self->record_list_length, sizeof(char *));
-    if (!processed_ids) return -1;
+    checkpoint_header_t header;
+    struct stat st;
+    checkpoint_entry_t *entries = NULL;
+    int valid = fstat(fd, &st) == 0 && read_fully(fd, &header, sizeof(header), 0) == 0
+        && memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 && header.version == CHECKPOINT_VERSION
+        && header.entry_size == sizeof(checkpoint_entry_t) && header.covered <= self->record_list_length && header.length <= header.covered
+        && (size_t)st.st_size == sizeof(header) + header.length * sizeof(checkpoint_entry_t);
+    if (valid) {
+        entries = (checkpoint_entry_t*)malloc((header.length ? header.length : 1) * sizeof(checkpoint_entry_t));
+        valid = entries && read_fully(fd, entries, header.length * sizeof(checkpoint_entry_t), sizeof(header)) == 0;
+    }
+    close(fd);
+    for (size_t i = 0; valid && i < header.length; i++) {
+        valid = entries[i].position < header.covered;
+        if (!valid) break;
+        const record_t *record = record_at(self, entries[i].position);
+        valid = !record__instance__is_deleted(record) && memcmp(record->id, entries[i].id, 32) == 0;
+    }
+    if (!valid) {
+        free(entries);
+        return 0;
+    }
 
-    size_t processed_count = 0;
+    // sized once for the live records and the tail to replay
+    size_t capacity = ID_INDEX_INITIAL_CAPACITY;
+    while (capacity < 2 * (header.length + self->record_list_length - header.covered)) capacity *= 2;
+    int result = id_index_resize(self, capacity);
+    for (size_t i = 0; result == 0 && i < header.length; i++) {
+        result = id_index_put(self, entries[i].position);
+        if (self->options.segment_size) segments_account(self, record_at(self, entries[i].position), 1);
+    }
+    free(entries);
+    if (result == 0) *covered = header.covered;
+    return result;
+}
 
-    // Iterate in reverse order to prioritize the latest records
-    for (ssize_t i = self->record_list_length - 1; i >= 0; i--) {
-        record_t *record = &self->record_list[i];
+// Builds the id index by replaying the log after the checkpoint, later versions override earlier ones
+static int id_index_build(database_t *self) {
+    size_t from = 0;
+    if (self->options.checkpoint_interval && !self->options.btree_index && id_index_load_checkpoint(self, &from) != 0) return -1;
+    self->checkpoint_length = from;
+    for (size_t i = from; i < self->record_list_length; i++) {
+        if (id_index_apply(self, i) != 0) return -1;
+    }
+    id_index_shrink(self);
+    __atomic_store_n(&self->id_index_built, 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
-        // Skip if the record ID is already processed
-        if (is_id_in_list(processed_ids, processed_count, record->id)) continue;
+// The id index of a mapped database is only built on first use so that open stays O(1), the write lock is held by the caller
+static int id_index_ensure_locked(database_t *self) {
+    if (self->id_index_built) return 0;
+    return id_index_build(self);
+}
 
-        // If the record is deleted, add its ID to processed and skip
-        if (record__instance__is_deleted(record)) {
-            processed_ids[processed_count++] = record->id;
-            continue;
+// Builds the id index on first use from a reader
+static int id_index_ensure(database_t *self) {
+    if (__atomic_load_n(&self->id_index_built, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&self->write_lock);
+    int result = id_index_ensure_locked(self);
+    pthread_mutex_unlock(&self->write_lock);
+    return result;
+}
+
+// Position + 1 of the latest version of the id, ID_INDEX_EMPTY if it is not live. safe against a concurrent writer
+static size_t id_index_lookup(const database_t *self, const char *id) {
+    for (;;) {
+        size_t sequence = sequence_read_begin(&self->id_index_sequence);
+        const size_t *index = __atomic_load_n(&self->id_index, __ATOMIC_ACQUIRE);
+        size_t found = ID_INDEX_EMPTY;
+        if (index) {
+            size_t capacity = index[-1];
+            size_t mask = capacity - 1;
+            size_t slot = id_index_hash(id) & mask;
+            // bounded so that a probe racing with the writer always ends
+            for (size_t probes = 0; probes < capacity; probes++) {
+                size_t position = __atomic_load_n(&index[slot], __ATOMIC_ACQUIRE);
+                if (position == ID_INDEX_EMPTY) break;
+                if (memcmp(record_at(self, position - 1)->id, id, 32) == 0) {
+                    found = position;
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
         }
+        if (!sequence_read_retry(&self->id_index_sequence, sequence)) return found;
+    }
+}
 
-        // Yield the record via the callback
-        error_t result = on_record_found(record, (int)processed_count);
-        if (result != 0) {
-            free(processed_ids);
-            return result; // Stop on callback error
+/**
+ * Copies the occupied slots of the id index.
+ * a writer moving entries around meanwhile makes the copy start over, after a few attempts it is taken under the write lock
+ */
+static int id_index_snapshot(database_t *self, size_t **out_positions, size_t *out_length) {
+    for (int attempt = 0; attempt <= ID_INDEX_SNAPSHOT_ATTEMPTS; attempt++) {
+        int locked = attempt == ID_INDEX_SNAPSHOT_ATTEMPTS;
+        if (locked) pthread_mutex_lock(&self->write_lock);
+
+        size_t sequence = sequence_read_begin(&self->id_index_sequence);
+        const size_t *index = __atomic_load_n(&self->id_index, __ATOMIC_ACQUIRE);
+        size_t capacity = index ? index[-1] : 0;
+        size_t *positions = (size_t*)malloc((capacity ? capacity : 1) * sizeof(size_t));
+        size_t length = 0;
+        for (size_t slot = 0; positions && slot < capacity; slot++) {
+            size_t position = __atomic_load_n(&index[slot], __ATOMIC_ACQUIRE);
+            if (position != ID_INDEX_EMPTY) positions[length++] = position;
         }
+        int retry = sequence_read_retry(&self->id_index_sequence, sequence);
 
-        // Mark the record ID as processed
-        processed_ids[processed_count++] = record->id;
+        if (locked) pthread_mutex_unlock(&self->write_lock);
+        if (!positions) return -1;
+        if (!retry) {
+            *out_positions = positions;
+            *out_length = length;
+            return 0;
+        }
+        free(positions);
     }
-
-    // Cleanup
-    free(processed_ids);
-    return 0;
+    return -1;
 }
 
-// Optimize the database
-error_t database__instance__optimize(database_t *self) {
-    if (!self) return -1;
+#define BTREE_DEFAULT_CACHE_PAGES 64
+// entries copied out of the tree each time its lock is taken while iterating it
+#define BTREE_SCAN_CHUNK 128
 
-    // Prepare paths for temporary files
-    char temp_data_path[256];
-    char temp_index_path[256];
-    snprintf(temp_data_path, 256, "%s.data.temp", self->path);
-    snprintf(temp_index_path, 256, "%s.index.temp", self->path);
+// Applies the log entry at position to the persistent id index, the tree lock is held by the caller
+static int btree_index_apply(database_t *self, size_t position, int account) {
+    record_t *record = record_at(self, position);
+    int deleted = record__instance__is_deleted(record);
 
-    // Open temporary files
-    int temp_data_fd = open(temp_data_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    int temp_index_fd = open(temp_index_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (temp_data_fd == -1 || temp_index_fd == -1) {
-        if (temp_data_fd != -1) close(temp_data_fd);
-        if (temp_index_fd != -1) close(temp_index_fd);
-        return -1;
+    // the version being replaced or deleted turns into garbage of its segment
+    if (account && self->options.segment_size) {
+        uint64_t previous;
+        int found = btree__instance__get(self->btree, record->id, &previous);
+        if (found < 0) return -1;
+        if (found) segments_account(self, record_at(self, previous), 0);
+        if (!deleted) segments_account(self, record, 1);
     }
+    if (deleted) return btree__instance__remove(self->btree, record->id);
+    return btree__instance__put(self->btree, record->id, position);
+}
 
-    // Callback to write valid records to temporary files
-    error_t write_record_to_temp(record_t *record, int ord) {
-        size_t content_size = record->end - record->start;
+// Applies the log entries in [from, to) and records in the tree how much of the log it reflects
+static int btree_index_replay(database_t *self, size_t from, size_t to, int account) {
+    int result = 0;
+    pthread_mutex_lock(&self->btree_lock);
+    for (size_t i = from; result == 0 && i < to; i++) result = btree_index_apply(self, i, account);
+    if (result == 0) self->btree->tag = to;
+    pthread_mutex_unlock(&self->btree_lock);
+    return result;
+}
 
-        // Read the record's content from the original data file
-        char *buffer = (char *)malloc(content_size);
-        if (!buffer) return -1;
-        lseek(self->data_file_reference, record->start, SEEK_SET);
-        read(self->data_file_reference, buffer, content_size);
+typedef int (*btree_index_visit_fn)(database_t *self, size_t position, void *ctx);
 
-        // Write the content to the temporary data file
-        off_t new_start = lseek(temp_data_fd, 0, SEEK_END);
-        write(temp_data_fd, buffer, content_size);
-        free(buffer);
+/**
+ * Visits the position of every live record in id order.
+ * the tree lock is only held while a chunk of entries is copied out, never while visiting them
+ */
+static int btree_index_each(database_t *self, btree_index_visit_fn visit, void *ctx) {
+    btree_entry_t entries[BTREE_SCAN_CHUNK];
+    char after[BTREE_KEY_LENGTH];
+    size_t length;
+    int first = 1;
+    do {
+        pthread_mutex_lock(&self->btree_lock);
+        int result = btree__instance__scan(self->btree, first ? NULL : after, entries, BTREE_SCAN_CHUNK, &length);
+        pthread_mutex_unlock(&self->btree_lock);
+        if (result != 0) return -1;
+        for (size_t i = 0; i < length; i++) {
+            result = visit(self, entries[i].value, ctx);
+            if (result != 0) return result;
+        }
+        if (length > 0) memcpy(after, entries[length - 1].key, BTREE_KEY_LENGTH);
+        first = 0;
+    } while (length == BTREE_SCAN_CHUNK);
+    return 0;
+}
 
-        // Update the record's start and end for the new data file
-        record->start = new_start;
-        record->end = new_start + content_size;
+static int btree_index_account(database_t *self, size_t position, void *ctx) {
+    (void)ctx;
+    segments_account(self, record_at(self, position), 1);
+    return 0;
+}
 
-        // Write the updated record to the temporary index file
-        pwrite(temp_index_fd, record, sizeof(record_t), ord * sizeof(record_t));
+#define SAMPLE_INITIAL_CAPACITY 64
 
-        return 0;
+// The table slot holding the sampling slot of the id, or the empty slot where it would go
+static size_t sample_find(const database_t *self, const char *id) {
+    size_t mask = self->sample_table_capacity - 1;
+    size_t slot = id_index_hash(id) & mask;
+    while (self->sample_table[slot] != 0) {
+        const record_t *record = record_at(self, self->sample_positions[self->sample_table[slot] - 1]);
+        if (memcmp(record->id, id, 32) == 0) break;
+        slot = (slot + 1) & mask;
     }
+    return slot;
+}
 
-    // Use the iterator to process the latest, non-deleted records
-    error_t result = database__instance__get_latest_records(self, write_record_to_temp);
-    if (result != 0) {
-        close(temp_data_fd);
-        close(temp_index_fd);
-        return result;
+// Rebuilds the table at the given power of two capacity from the dense array
+static int sample_resize(database_t *self, size_t capacity) {
+    size_t *table = (size_t*)calloc(capacity, sizeof(size_t));
+    if (!table) return -1;
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < self->sample_length; i++) {
+        size_t slot = id_index_hash(record_at(self, self->sample_positions[i])->id) & mask;
+        while (table[slot] != 0) slot = (slot + 1) & mask;
+        table[slot] = i + 1;
     }
+    free(self->sample_table);
+    self->sample_table = table;
+    self->sample_table_capacity = capacity;
+    return 0;
+}
 
-    // Cleanup
-    close(self->data_file_reference);
-    close(self->index_file_reference);
-    close(temp_data_fd);
-    close(temp_index_fd);
+// Makes position the sampled version of its id, appended to the dense array when the id is new
+static int sample_put(database_t *self, size_t position) {
+    if ((self->sample_length + 1) * 2 > self->sample_table_capacity) {
+        if (sample_resize(self, self->sample_table_capacity ? self->sample_table_capacity * 2 : SAMPLE_INITIAL_CAPACITY) != 0) return -1;
+    }
+    if (self->sample_length == self->sample_capacity) {
+        size_t capacity = self->sample_capacity ? self->sample_capacity * 2 : SAMPLE_INITIAL_CAPACITY;
+        size_t *positions = (size_t*)realloc(self->sample_positions, capacity * sizeof(size_t));
+        if (!positions) return -1;
+        self->sample_positions = positions;
+        self->sample_capacity = capacity;
+    }
+    size_t slot = sample_find(self, record_at(self, position)->id);
+    if (self->sample_table[slot] != 0) {
+        self->sample_positions[self->sample_table[slot] - 1] = position;
+        return 0;
+    }
+    self->sample_positions[self->sample_length++] = position;
+    self->sample_table[slot] = self->sample_length;
+    return 0;
+}
 
-    // Replace old files with optimized files
-    char old_data_path[256];
-    char old_index_path[256];
-    snprintf(old_data_path, 256, "%s.data", self->path);
-    snprintf(old_index_path, 256, "%s.index", self->path);
+// Drops the id, the last slot of the dense array moves into its hole
+static void sample_remove(database_t *self, const char *id) {
+    if (self->sample_table_capacity == 0) return;
+    size_t mask = self->sample_table_capacity - 1;
+    size_t slot = sample_find(self, id);
+    if (self->sample_table[slot] == 0) return;
+    size_t hole = self->sample_table[slot] - 1;
 
-    if (rename(temp_data_path, old_data_path) == -1) {
-        perror("Failed to rename temp_data_path to old_data_path");
-        return -1;
+    // backward shift deletion like the id index
+    size_t next = (slot + 1) & mask;
+    while (self->sample_table[next] != 0) {
+        size_t home = id_index_hash(record_at(self, self->sample_positions[self->sample_table[next] - 1])->id) & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            self->sample_table[slot] = self->sample_table[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
     }
-    if (rename(temp_index_path, old_index_path) == -1) {
+    self->sample_table[slot] = 0;
+
+    size_t last = self->sample_length - 1;
+    if (hole != last) {
+        size_t moved = self->sample_positions[last];
+        self->sample_table[sample_find(self, record_at(self, moved)->id)] = hole + 1;
+        self->sample_positions[hole] = moved;
+    }
+    self->sample_length--;
+}
+
+// Drops the sampling arrays, they are built again on the next sample
+static void sample_reset(database_t *self) {
+    free(self->sample_positions);
+    free(self->sample_table);
+    self->sample_positions = NULL;
+    self->sample_table = NULL;
+    self->sample_length = 0;
+    self->sample_capacity = 0;
+    self->sample_table_capacity = 0;
+    __atomic_store_n(&self->sample_built, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Applies the log entries in [from, to) to the sampling arrays once they were built, the write lock is held by the caller.
+ * arrays that can't grow are dropped rather than failing the append
+ */
+static void sample_apply(database_t *self, size_t from, size_t to) {
+    if (!self->sample_built) return;
+    pthread_mutex_lock(&self->sample_lock);
+    for (size_t i = from; i < to; i++) {
+        const record_t *record = record_at(self, i);
+        if (record__instance__is_deleted(record)) {
+            sample_remove(self, record->id);
+        } else if (sample_put(self, i) != 0) {
+            sample_reset(self);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&self->sample_lock);
+}
+
+static int sample_collect(database_t *self, size_t position, void *ctx) {
+    (void)ctx;
+    return sample_put(self, position);
+}
+
+// Lays the live records out in the sampling arrays
+static int sample_ensure(database_t *self) {
+    if (__atomic_load_n(&self->sample_built, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&self->write_lock);
+    int result = 0;
+    if (!self->sample_built) {
+        if (!self->btree) result = id_index_ensure_locked(self);
+        pthread_mutex_lock(&self->sample_lock);
+        if (result == 0 && self->btree) {
+            result = btree_index_each(self, sample_collect, NULL);
+        } else if (result == 0) {
+            for (size_t slot = 0; result == 0 && slot < self->id_index_capacity; slot++) {
+                if (self->id_index[slot] != ID_INDEX_EMPTY) result = sample_put(self, self->id_index[slot] - 1);
+            }
+        }
+        if (result == 0) {
+            // any odd seed, the samples only need to look uniform
+            if (self->sample_state == 0) self->sample_state = ((uint64_t)time(NULL) << 32) ^ (uint64_t)(uintptr_t)self ^ 0x9E3779B97F4A7C15ULL;
+            __atomic_store_n(&self->sample_built, 1, __ATOMIC_RELEASE);
+        } else {
+            sample_reset(self);
+        }
+        pthread_mutex_unlock(&self->sample_lock);
+    }
+    pthread_mutex_unlock(&self->write_lock);
+    return result;
+}
+
+// A uniform index below length, the sample lock is held by the caller
+static size_t sample_next(database_t *self, size_t length) {
+    uint64_t x = self->sample_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    self->sample_state = x;
+    return (size_t)((x * 0x2545F4914F6CDD1DULL) % length);
+}
+
+/**
+ * Opens the persistent id index and brings it up to date with the log.
+ * a tree that wasn't saved cleanly, or that is ahead of a log that lost its tail, is rebuilt from the whole log
+ */
+static int btree_index_load(database_t *self) {
+    if (!self->btree) {
+        char btree_path[256];
+        snprintf(btree_path, 256, "%s.btree", self->path);
+        size_t cache_pages = self->options.btree_cache_pages ? self->options.btree_cache_pages : BTREE_DEFAULT_CACHE_PAGES;
+        self->btree = btree__static__open(btree_path, cache_pages, self->options.durability != DATABASE_DURABILITY_NONE);
+        if (!self->btree) return -1;
+    }
+
+    size_t from = self->btree->tag;
+    if (!self->btree->clean || from > self->record_list_length) {
+        if (btree__instance__clear(self->btree) != 0) return -1;
+        from = 0;
+    }
+    if (btree_index_replay(self, from, self->record_list_length, 0) != 0) return -1;
+    // the live bytes of the segments are counted once over the tree instead of over the whole log
+    if (self->options.segment_size) return btree_index_each(self, btree_index_account, NULL);
+    return 0;
+}
+
+// Empties the persistent id index before the log is rewritten, a crash before it is refilled makes the next open rebuild it
+static int btree_index_invalidate(database_t *self) {
+    if (!self->btree) return 0;
+    pthread_mutex_lock(&self->btree_lock);
+    int result = btree__instance__clear(self->btree);
+    pthread_mutex_unlock(&self->btree_lock);
+    return result;
+}
+
+// ids the filter is sized for at least, so that a small database doesn't rebuild it on every few inserts
+#define BLOOM_MIN_KEYS 1024
+
+static void id_bloom_path(const database_t *self, char *path) {
+    snprintf(path, 256, "%s.bloom", self->path);
+}
+
+// Builds a filter over the ids of the first length log entries and of n entries about to be appended, with room to grow
+static bloom_t* id_bloom_build(database_t *self, size_t length, const record_t *entries, size_t n) {
+    size_t expected = 2 * (length + n);
+    bloom_t *bloom = bloom__static__new(expected < BLOOM_MIN_KEYS ? BLOOM_MIN_KEYS : expected);
+    if (!bloom) return NULL;
+    for (size_t i = 0; i < length; i++) {
+        const record_t *record = record_at(self, i);
+        if (!record__instance__is_deleted(record)) bloom__instance__add(bloom, record->id);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!record__instance__is_deleted(&entries[i])) bloom__instance__add(bloom, entries[i].id);
+    }
+    return bloom;
+}
+
+// Replaces the filter, a reader testing the previous one keeps using it until its section ends
+static void id_bloom_publish(database_t *self, bloom_t *bloom) {
+    bloom_t *old_bloom = self->bloom;
+    __atomic_store_n(&self->bloom, bloom, __ATOMIC_RELEASE);
+    if (old_bloom) database__instance__retire(self, old_bloom, 0);
+}
+
+// Adds the ids of n entries before they are appended, a full filter is rebuilt twice as large. the write lock is held by the caller
+static int id_bloom_add(database_t *self, const record_t *entries, size_t n) {
+    if (!self->bloom) return 0;
+    if (bloom__instance__full(self->bloom)) {
+        bloom_t *bloom = id_bloom_build(self, self->record_list_length, entries, n);
+        if (!bloom) return -1;
+        id_bloom_publish(self, bloom);
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!record__instance__is_deleted(&entries[i])) bloom__instance__add(self->bloom, entries[i].id);
+    }
+    return 0;
+}
+
+/**
+ * Loads the saved filter and adds the ids appended since it was saved.
+ * a filter that is missing, too small or ahead of the log is rebuilt, and so is the filter of a rewritten log
+ */
+static int id_bloom_load(database_t *self) {
+    size_t length = self->record_list_length;
+    bloom_t *bloom = NULL;
+    if (!self->bloom) {
+        char path[256];
+        id_bloom_path(self, path);
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            bloom = bloom__static__read(fd);
+            close(fd);
+        }
+        if (bloom && (bloom->tag > length || (bloom->length + length - bloom->tag) * BLOOM_BITS_PER_KEY > bloom->blocks * BLOOM_BLOCK_LENGTH * 8)) {
+            free(bloom);
+            bloom = NULL;
+        }
+    }
+
+    if (bloom) {
+        for (size_t i = bloom->tag; i < length; i++) {
+            const record_t *record = record_at(self, i);
+            if (!record__instance__is_deleted(record)) bloom__instance__add(bloom, record->id);
+        }
+    } else {
+        bloom = id_bloom_build(self, length, NULL, 0);
+        if (!bloom) return -1;
+    }
+    id_bloom_publish(self, bloom);
+    return 0;
+}
+
+// Saves the filter with the log length it covers, replacing the saved one in a single rename. the write lock is held by the caller
+static int id_bloom_save(database_t *self) {
+    if (!self->bloom) return 0;
+    char path[256], temp_path[256];
+    id_bloom_path(self, path);
+    // a truncated name could be another file, the filter is then not saved
+    if (snprintf(temp_path, sizeof(temp_path), "%s.bloom.temp", self->path) >= (int)sizeof(temp_path)) return -1;
+
+    self->bloom->tag = self->record_list_length;
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) return -1;
+    // the saved filter must never miss an id, it is durable before it replaces the previous one
+    int result = bloom__instance__write(self->bloom, fd);
+    if (result == 0) result = sync_file(fd);
+    close(fd);
+    if (result == 0) result = rename_file(temp_path, path);
+    return result;
+}
+
+// Drops the saved filter before the log is rewritten, a crash before it is saved again makes the next open rebuild it
+static int id_bloom_invalidate(database_t *self) {
+    if (!self->bloom) return 0;
+    char path[256];
+    id_bloom_path(self, path);
+    return unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+// 0 when the id was never inserted, testing the filter is the whole cost of such a lookup
+static int id_bloom_may_contain(const database_t *self, const char *id) {
+    const bloom_t *bloom = __atomic_load_n(&self->bloom, __ATOMIC_ACQUIRE);
+    return !bloom || bloom__instance__may_contain(bloom, id);
+}
+
+// File offset of the log entry at position in the fixed format, the header takes the room of one entry
+static inline size_t index_entry_offset(size_t position) {
+    return (position + 1) * sizeof(record_t);
+}
+
+// The index format the options need: a mapped index reads the fixed entries in place, the others are compact
+static unsigned int index_version_wanted(const database_t *self) {
+#ifdef FILEDB_HAS_MMAP
+    if (self->options.map_index) return INDEX_VERSION_FIXED;
+#endif
+    return INDEX_VERSION_COMPACT;
+}
+
+static size_t varint_write(unsigned char *out, size_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (unsigned char)value;
+    return length;
+}
+
+// -1 when the bytes end inside the varint or it doesn't fit in a size_t
+static int varint_read(const unsigned char **cursor, const unsigned char *end, size_t *value) {
+    *value = 0;
+    for (unsigned shift = 0; shift < 8 * sizeof(size_t); shift += 7) {
+        if (*cursor >= end) return -1;
+        unsigned char byte = *(*cursor)++;
+        *value |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return 0;
+    }
+    return -1;
+}
+
+/**
+ * Encodes a log entry in the compact format and returns its length, at most INDEX_ENTRY_MAX_LENGTH:
+ *   flags, the 32 id bytes, the start and stored length varints unless it is a tombstone,
+ *   the content length varint only when it is compressed, then the CRC-32C of all that
+ */
+static size_t index_entry_encode(const record_t *record, unsigned char *out) {
+    unsigned char *cursor = out;
+    int deleted = record__instance__is_deleted(record);
+    *cursor++ = (unsigned char)((deleted ? INDEX_ENTRY_TOMBSTONE : 0) | (record->codec << INDEX_ENTRY_CODEC_SHIFT));
+    memcpy(cursor, record->id, 32);
+    cursor += 32;
+    if (!deleted) {
+        cursor += varint_write(cursor, record->start);
+        cursor += varint_write(cursor, record->end - record->start);
+        if (record->codec != RECORD_CODEC_NONE) cursor += varint_write(cursor, record->length);
+    }
+    uint32_t checksum = hash__static__crc32c(0, out, cursor - out);
+    for (int i = 0; i < 4; i++) *cursor++ = (unsigned char)(checksum >> (8 * i));
+    return cursor - out;
+}
+
+/**
+ * Decodes the compact entry at the start of bytes, consumed receives its length.
+ * -1 when the bytes end inside the entry or its checksum doesn't match
+ */
+static int index_entry_decode(const unsigned char *bytes, size_t available, record_t *record, size_t *consumed) {
+    const unsigned char *cursor = bytes;
+    const unsigned char *end = bytes + available;
+    if (available < INDEX_ENTRY_MIN_LENGTH) return -1;
+
+    memset(record, 0, sizeof(record_t));
+    unsigned char flags = *cursor++;
+    memcpy(record->id, cursor, 32);
+    cursor += 32;
+    record->codec = flags >> INDEX_ENTRY_CODEC_SHIFT;
+    if (!(flags & INDEX_ENTRY_TOMBSTONE)) {
+        size_t stored_length;
+        if (varint_read(&cursor, end, &record->start) != 0 || varint_read(&cursor, end, &stored_length) != 0) return -1;
+        record->end = record->start + stored_length;
+        record->length = stored_length;
+        if (record->codec != RECORD_CODEC_NONE && varint_read(&cursor, end, &record->length) != 0) return -1;
+        // a live record never has the in-memory shape of a tombstone
+        if (record->end == 0) return -1;
+    }
+    if (end - cursor < 4) return -1;
+    uint32_t checksum = (uint32_t)cursor[0] | ((uint32_t)cursor[1] << 8) | ((uint32_t)cursor[2] << 16) | ((uint32_t)cursor[3] << 24);
+    if (checksum != hash__static__crc32c(0, bytes, cursor - bytes)) return -1;
+    *consumed = cursor + 4 - bytes;
+    return 0;
+}
+
+/**
+ * The bytes of n entries in an index format: the entries themselves in the fixed format,
+ *   a new allocation holding their encoding in the compact one. NULL when out of memory
+ */
+static const void* index_entries_encode(unsigned int version, const record_t *entries, size_t n, size_t *out_length) {
+    static const unsigned char empty[1];
+    if (n == 0) {
+        *out_length = 0;
+        return empty;
+    }
+    if (version == INDEX_VERSION_FIXED) {
+        *out_length = n * sizeof(record_t);
+        return entries;
+    }
+    unsigned char *bytes = (unsigned char*)malloc(n * INDEX_ENTRY_MAX_LENGTH);
+    if (!bytes) return NULL;
+    size_t length = 0;
+    for (size_t i = 0; i < n; i++) length += index_entry_encode(&entries[i], bytes + length);
+    *out_length = length;
+    return bytes;
+}
+
+static void index_entries_free(const void *encoded, const record_t *entries, size_t n) {
+    if (n > 0 && encoded != (const void*)entries) free((void*)encoded);
+}
+
+// Writes a whole index file in the given format: the header then the entries
+static int index_file_write(int fd, unsigned int version, const record_t *entries, size_t n) {
+    char header[sizeof(record_t)];
+    // the compact entries have no fixed size, nothing is verified yet in a new file
+    index_header_t fields = {INDEX_MAGIC, version, version == INDEX_VERSION_FIXED ? sizeof(record_t) : 0, 0, 0};
+    memset(header, 0, sizeof(header));
+    memcpy(header, &fields, sizeof(fields));
+    size_t length;
+    const void *encoded = index_entries_encode(version, entries, n, &length);
+    if (!encoded) return -1;
+    struct iovec iov[2] = {{header, sizeof(header)}, {(void*)encoded, length}};
+    int result = write_gathered(fd, iov, 2, 0);
+    index_entries_free(encoded, entries, n);
+    return result;
+}
+
+// Saves the verified mark in the header of an index file
+static int index_mark_write(int fd, size_t verified_length, size_t verified_data_length) {
+    uint64_t mark[2] = {verified_length, verified_data_length};
+    return write_fully(fd, mark, sizeof(mark), offsetof(index_header_t, verified_length));
+}
+
+/**
+ * Marks the whole log as verified once its entries and data were made durable.
+ * the next open only checks what is appended after this point
+ */
+static int database__instance__mark_verified_locked(database_t *self) {
+    size_t data_length = self->options.segment_size ? 0 : self->data_file_length;
+    if (index_mark_write(self->index_file_reference, self->record_list_length, data_length) != 0) return -1;
+    self->verified_length = self->record_list_length;
+    self->verified_data_length = data_length;
+    return 0;
+}
+
+// Releases the in-memory view of the index file
+static void database__instance__unload_index(database_t *self) {
+#ifdef FILEDB_HAS_MMAP
+    // the mapping starts with the header
+    if (self->index_map) munmap((void*)(self->index_map - 1), index_entry_offset(self->index_map_length));
+#endif
+    if (self->record_list) free(self->record_list);
+    if (self->id_index) free(self->id_index - 1);
+    // the index is only unloaded while no reader is in a section
+    pthread_mutex_lock(&self->reclaim_lock);
+    database__instance__reclaim_all(self);
+    pthread_mutex_unlock(&self->reclaim_lock);
+    self->index_map = NULL;
+    self->index_map_length = 0;
+    self->record_list = NULL;
+    self->record_list_capacity = 0;
+    self->record_list_length = 0;
+    self->record_list_offset = 0;
+    self->id_index = NULL;
+    self->id_index_capacity = 0;
+    self->id_index_length = 0;
+    self->id_index_built = 0;
+    // the positions change with the log
+    sample_reset(self);
+}
+
+#ifdef FILEDB_HAS_MMAP
+// Maps the first length entries of the index file, the previous mapping and the tail are dropped
+static int index_map_remap(database_t *self, size_t length) {
+    const record_t *map = NULL;
+    if (length > 0) {
+        map = (const record_t*)mmap(NULL, index_entry_offset(length), PROT_READ, MAP_SHARED, self->index_file_reference, 0);
+        if (map == MAP_FAILED) return -1;
+        map++;
+    }
+    const record_t *old_map = self->index_map;
+    size_t old_map_length = self->index_map_length;
+    record_t *old_list = self->record_list;
+
+    // the ids only move between the mapping and the tail, a reader resolving a position retries across the switch
+    sequence_write_begin(&self->log_sequence);
+    __atomic_store_n(&self->index_map, map, __ATOMIC_RELEASE);
+    __atomic_store_n(&self->record_list_offset, length, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->record_list, NULL, __ATOMIC_RELEASE);
+    sequence_write_end(&self->log_sequence);
+    self->index_map_length = length;
+    self->record_list_capacity = 0;
+
+    if (old_map) database__instance__retire(self, (void*)(old_map - 1), index_entry_offset(old_map_length));
+    database__instance__retire(self, old_list, 0);
+    return 0;
+}
+#endif
+
+// Opens every <path>.data.NNNNNN file so that the garbage of each segment is known and new ids never collide
+static int database__instance__discover_segments(database_t *self) {
+    char directory[256];
+    const char *separator = strrchr(self->path, '/');
+    const char *name = separator ? separator + 1 : self->path;
+    if (separator) snprintf(directory, sizeof(directory), "%.*s", (int)(separator - self->path), self->path);
+    else snprintf(directory, sizeof(directory), ".");
+    if (directory[0] == '\0') snprintf(directory, sizeof(directory), "/");
+
+    char prefix[256];
+    snprintf(prefix, sizeof(prefix), "%s.data.", name);
+    size_t prefix_length = strlen(prefix);
+
+    DIR *dir = opendir(directory);
+    if (!dir) return -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_length) != 0) continue;
+        const char *digits = entry->d_name + prefix_length;
+        char *end;
+        size_t segment = strtoul(digits, &end, 10);
+        if (end == digits || *end != '\0' || segment == 0) continue;
+        if (segment_open(self, segment, 0) == -1) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+/**
+ * Opens the active segment of a segmented database once its index is loaded.
+ * the active segment is the highest one referenced by the log, the live byte counts are rebuilt with the id index
+ */
+static int database__instance__load_segments(database_t *self) {
+    if (database__instance__discover_segments(self) != 0) return -1;
+    for (size_t i = 0; i < self->segments_length; i++) self->segments[i].live_bytes = 0;
+
+    if (self->active_segment == 0) {
+        self->active_segment = 1;
+        for (size_t i = 0; i < self->record_list_length; i++) {
+            record_t *record = record_at(self, i);
+            if (record__instance__is_deleted(record)) continue;
+            size_t segment = address_segment(self, record->start);
+            if (segment > self->active_segment) self->active_segment = segment;
+        }
+    }
+    if (!self->options.btree_index && id_index_build(self) != 0) return -1;
+
+    self->data_file_reference = segment_open(self, self->active_segment, O_CREAT);
+    if (self->data_file_reference == -1) return -1;
+    self->data_file_length = self->segments[self->active_segment].length;
+    self->data_file_allocated = self->data_file_length;
+    return 0;
+}
+
+/**
+ * Replaces the index file with one holding the given entries in the format the options need.
+ * the new file is durable before it replaces the old one
+ */
+static int database__instance__rewrite_index(database_t *self, const record_t *records, size_t length) {
+    char index_path[256], temp_index_path[256];
+    snprintf(index_path, 256, "%s.index", self->path);
+    snprintf(temp_index_path, 256, "%s.index.temp", self->path);
+    unsigned int version = index_version_wanted(self);
+    int fd = open(temp_index_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    int result = fd == -1 ? -1 : index_file_write(fd, version, records, length);
+    // the same entries, as verified as they were
+    if (result == 0) result = index_mark_write(fd, self->verified_length, self->verified_data_length);
+    if (result == 0) result = sync_file(fd);
+#ifdef __MINGW32__
+    // windows can't replace a file that is still open
+    if (result == 0) close(self->index_file_reference);
+#endif
+    if (result == 0) result = rename_file(temp_index_path, index_path);
+    if (result != 0) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+#ifndef __MINGW32__
+    close(self->index_file_reference);
+#endif
+    self->index_file_reference = fd;
+    self->index_version = version;
+    return 0;
+}
+
+/**
+ * Decodes the compact entries of the index file.
+ * a last entry cut short by a crash while it was appended is dropped from the file, any other damage is an error
+ */
+static int database__instance__read_compact_index(database_t *self, size_t file_size, record_t **out_records, size_t *out_length) {
+    size_t offset = sizeof(record_t);
+    size_t capacity = file_size > offset ? (file_size - offset) / INDEX_ENTRY_MIN_LENGTH : 0;
+    record_t *records = (record_t*)malloc((capacity ? capacity : 1) * sizeof(record_t));
+    unsigned char *chunk = (unsigned char*)malloc(COPY_BUFFER_SIZE);
+    size_t length = 0;
+    int result = records && chunk ? 0 : -1;
+
+    // decoded a chunk at a time, an entry crossing the end of a chunk starts the next one
+    while (result == 0 && offset < file_size) {
+        size_t chunk_length = file_size - offset < COPY_BUFFER_SIZE ? file_size - offset : COPY_BUFFER_SIZE;
+        if (read_fully(self->index_file_reference, chunk, chunk_length, offset) != 0) {
+            result = -1;
+            break;
+        }
+        size_t used = 0;
+        while (used < chunk_length) {
+            size_t consumed;
+            if (index_entry_decode(chunk + used, chunk_length - used, &records[length], &consumed) != 0) break;
+            length++;
+            used += consumed;
+        }
+        if (used == 0 || (used < chunk_length && offset + chunk_length == file_size)) {
+            // nothing decodes at offset, only a torn append may be left at the very end
+            if (file_size - (offset + used) >= INDEX_ENTRY_MAX_LENGTH) {
+                fprintf(stderr, "corrupted index entry at offset %zu\n", offset + used);
+                result = -1;
+            } else if (ftruncate(self->index_file_reference, offset + used) != 0) {
+                result = -1;
+            } else {
+                self->recovery.dropped_index_bytes += file_size - (offset + used);
+            }
+            offset += used;
+            break;
+        }
+        offset += used;
+    }
+    free(chunk);
+    if (result != 0) {
+        free(records);
+        return -1;
+    }
+    self->index_file_length = offset;
+    *out_records = records;
+    *out_length = length;
+    return 0;
+}
+
+// Decodes the whole index file whatever its format, to rewrite it in another one
+static int database__instance__read_index(database_t *self, size_t file_size, record_t **out_records, size_t *out_length) {
+    if (self->index_version == INDEX_VERSION_COMPACT) return database__instance__read_compact_index(self, file_size, out_records, out_length);
+    size_t length = file_size / sizeof(record_t) - 1;
+    record_t *records = (record_t*)malloc((length ? length : 1) * sizeof(record_t));
+    if (!records || read_fully(self->index_file_reference, records, length * sizeof(record_t), index_entry_offset(0)) != 0) {
+        free(records);
+        return -1;
+    }
+    *out_records = records;
+    *out_length = length;
+    return 0;
+}
+
+// Rewrites the headerless index file of the first releases in the current format
+static int database__instance__upgrade_index(database_t *self, size_t file_size) {
+    size_t length = file_size / sizeof(legacy_record_t);
+    legacy_record_t *legacy = (legacy_record_t*)malloc((length ? length : 1) * sizeof(legacy_record_t));
+    record_t *records = (record_t*)calloc(length ? length : 1, sizeof(record_t));
+    if (!legacy || !records || pread(self->index_file_reference, legacy, length * sizeof(legacy_record_t), 0) != (ssize_t)(length * sizeof(legacy_record_t))) {
+        free(legacy);
+        free(records);
+        return -1;
+    }
+    for (size_t i = 0; i < length; i++) {
+        memcpy(records[i].id, legacy[i].id, sizeof(records[i].id));
+        records[i].start = legacy[i].start;
+        records[i].end = legacy[i].end;
+        records[i].length = legacy[i].end - legacy[i].start;
+        if (records[i].end > self->verified_data_length) self->verified_data_length = records[i].end;
+    }
+    free(legacy);
+    // the ids of the first releases are not hashes of the content, the log is taken as it is
+    self->verified_length = length;
+
+    int result = database__instance__rewrite_index(self, records, length);
+    free(records);
+    return result;
+}
+
+/**
+ * Writes the header of a new index file and refuses unknown versions.
+ * an index file without a header, or in the other format than the options need, is rewritten
+ */
+static int database__instance__check_index_header(database_t *self, size_t file_size) {
+    self->verified_length = 0;
+    self->verified_data_length = 0;
+    if (file_size == 0) {
+        self->index_version = index_version_wanted(self);
+        return index_file_write(self->index_file_reference, self->index_version, NULL, 0);
+    }
+
+    index_header_t header;
+    if (file_size < sizeof(header) || pread(self->index_file_reference, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        return database__instance__upgrade_index(self, file_size);
+    }
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0) return database__instance__upgrade_index(self, file_size);
+    int fixed = header.version == INDEX_VERSION_FIXED && header.entry_size == sizeof(record_t);
+    int compact = header.version == INDEX_VERSION_COMPACT && header.entry_size == 0;
+    if (!fixed && !compact) {
+        fprintf(stderr, "unsupported index file version %u\n", header.version);
+        return -1;
+    }
+    self->index_version = header.version;
+    self->verified_length = header.verified_length;
+    self->verified_data_length = header.verified_data_length;
+    if (self->index_version == index_version_wanted(self)) return 0;
+
+    record_t *records;
+    size_t length;
+    if (database__instance__read_index(self, file_size, &records, &length) != 0) return -1;
+    int result = database__instance__rewrite_index(self, records, length);
+    free(records);
+    return result;
+}
+
+// Starts a new empty segment and makes it the append target, the write lock is held by the caller
+static int database__instance__roll_segment_locked(database_t *self) {
+    if (write_buffer_flush(self->data_file_reference, &self->data_buffer) != 0) return -1;
+    // sync_locked only syncs the active segment, a sealed one is made durable once when it is rolled out
+    if (self->options.durability != DATABASE_DURABILITY_NONE && sync_file(self->data_file_reference) != 0) return -1;
+
+    size_t segment = self->segments_length;
+    int fd = segment_open(self, segment, O_CREAT | O_TRUNC);
+    if (fd == -1) return -1;
+
+    self->active_segment = segment;
+    self->data_file_reference = fd;
+    self->data_file_length = 0;
+    self->data_file_allocated = 0;
+    return 0;
+}
+
+// Data file descriptor and file offset of a data address, the writer opened the segment before publishing any record in it
+static int database__instance__data_file_at(database_t *self, size_t address, size_t *offset) {
+    *offset = address_offset(self, address);
+    if (self->options.segment_size == 0) return self->data_file_reference;
+    size_t segment = address_segment(self, address);
+    if (segment >= __atomic_load_n(&self->segments_length, __ATOMIC_ACQUIRE)) return -1;
+    return __atomic_load_n(&self->segments, __ATOMIC_ACQUIRE)[segment].file_reference;
+}
+
+// Reads the stored bytes of a record into buffer
+static int database__instance__read_stored(database_t *self, const record_t *record, char *buffer) {
+    size_t offset;
+    int fd = database__instance__data_file_at(self, record->start, &offset);
+    if (fd == -1) return -1;
+    return read_fully(fd, buffer, record->end - record->start, offset);
+}
+
+// Decodes the stored bytes of a record into its record->length bytes of content
+static int record_decode(const record_t *record, const char *stored, char *content) {
+    size_t stored_length = record->end - record->start;
+    switch (record->codec) {
+        case RECORD_CODEC_NONE:
+            if (stored_length != record->length) return -1;
+            memcpy(content, stored, stored_length);
+            return 0;
+        case RECORD_CODEC_LZ:
+            return lz__static__decompress(stored, stored_length, content, record->length);
+        default:
+            return -1;
+    }
+}
+
+/**
+ * the buffers reused by a scan to read and decode the records, so that a scan allocates
+ *   as many times as the largest record grows them and not once per record
+ */
+typedef struct scan_buffer_s {
+    char *stored;
+    size_t stored_capacity;
+    char *content;
+    size_t content_capacity;
+} scan_buffer_t;
+
+static int scan_buffer_reserve(char **buffer, size_t *capacity, size_t size) {
+    if (size <= *capacity) return 0;
+    char *grown = (char*)realloc(*buffer, size);
+    if (!grown) return -1;
+    *buffer = grown;
+    *capacity = size;
+    return 0;
+}
+
+static void scan_buffer_free(scan_buffer_t *scan) {
+    free(scan->stored);
+    free(scan->content);
+}
+
+// Reads and decodes a record into scan->content followed by a 0 byte
+static int database__instance__scan_content(database_t *self, const record_t *record, scan_buffer_t *scan) {
+    if (scan_buffer_reserve(&scan->content, &scan->content_capacity, record->length + 1) != 0) return -1;
+    if (record->codec == RECORD_CODEC_NONE) {
+        if (database__instance__read_stored(self, record, scan->content) != 0) return -1;
+    } else {
+        if (scan_buffer_reserve(&scan->stored, &scan->stored_capacity, record->end - record->start) != 0) return -1;
+        if (database__instance__read_stored(self, record, scan->stored) != 0) return -1;
+        if (record_decode(record, scan->stored, scan->content) != 0) return -1;
+    }
+    scan->content[record->length] = '\0';
+    return 0;
+}
+
+// Makes every data file durable, the active one and the sealed segments
+static int database__instance__sync_data_files(database_t *self) {
+    if (self->options.segment_size == 0) return sync_file(self->data_file_reference);
+    for (size_t i = 0; i < self->segments_length; i++) {
+        if (self->segments[i].file_reference >= 0 && sync_file(self->segments[i].file_reference) != 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Checks that a record points at data that exists and hashes to its id.
+ * 1 when it does, 0 when it doesn't, -1 when it couldn't be checked
+ */
+static int database__instance__record_intact(database_t *self, const record_t *record, scan_buffer_t *scan) {
+    if (record->end < record->start) return 0;
+    size_t stored_length = record->end - record->start;
+    size_t offset;
+    int fd = database__instance__data_file_at(self, record->start, &offset);
+    if (fd == -1) return 0;
+    size_t file_length = self->options.segment_size ? self->segments[address_segment(self, record->start)].length : self->data_file_length;
+    if (offset + stored_length > file_length) return 0;
+    // the content length of a torn entry may be anything, an LZ block never expands more than 255 times
+    if (record->codec == RECORD_CODEC_NONE ? record->length != stored_length : record->length / 255 > stored_length + 1) return 0;
+
+    if (scan_buffer_reserve(&scan->content, &scan->content_capacity, record->length + 1) != 0) return -1;
+    if (scan_buffer_reserve(&scan->stored, &scan->stored_capacity, stored_length) != 0) return -1;
+    if (database__instance__scan_content(self, record, scan) != 0) return 0;
+    char id[32];
+    compute_hash(scan->content, record->length, id);
+    return memcmp(id, record->id, 32) == 0;
+}
+
+/**
+ * Verifies the log entries appended after the verified mark, a crash may have left them pointing at data
+ *   that never reached the disk. the first bad entry and all that follow are dropped from the index file,
+ *   then the data file is cut after the last byte the remaining entries need
+ */
+static int database__instance__recover_tail(database_t *self) {
+    size_t length = self->record_list_length;
+    // a mark ahead of the log belongs to another log, everything is checked
+    size_t from = self->verified_length <= length ? self->verified_length : 0;
+    size_t data_end = from ? self->verified_data_length : 0;
+    if (self->options.segment_size && database__instance__discover_segments(self) != 0) return -1;
+
+    scan_buffer_t scan = {0};
+    size_t kept = from;
+    int intact = 1;
+    for (; kept < length; kept++) {
+        const record_t *record = record_at(self, kept);
+        if (record__instance__is_deleted(record)) continue;
+        intact = database__instance__record_intact(self, record, &scan);
+        if (intact != 1) break;
+        if (record->end > data_end) data_end = record->end;
+    }
+    scan_buffer_free(&scan);
+    if (intact == -1) return -1;
+    self->recovery.verified = kept - from;
+
+    if (kept < length) {
+        size_t index_end = index_entry_offset(kept);
+        if (self->index_version == INDEX_VERSION_COMPACT) {
+            unsigned char entry[INDEX_ENTRY_MAX_LENGTH];
+            index_end = self->index_file_length;
+            for (size_t i = kept; i < length; i++) index_end -= index_entry_encode(record_at(self, i), entry);
+        }
+#ifdef FILEDB_HAS_MMAP
+        // the dropped entries are unmapped before the file shrinks under them
+        if (self->index_map && index_map_remap(self, kept) != 0) return -1;
+#endif
+        self->record_list_length = kept;
+        self->index_file_length = index_end;
+        self->recovery.dropped = length - kept;
+    }
+    // a fixed entry cut short is ignored by the load, it is dropped here with the bad entries
+    struct stat st;
+    if (fstat(self->index_file_reference, &st) != 0) return -1;
+    if ((size_t)st.st_size > self->index_file_length) {
+        if (ftruncate(self->index_file_reference, self->index_file_length) != 0) return -1;
+        self->recovery.dropped_index_bytes += st.st_size - self->index_file_length;
+        self->index_file_allocated = self->index_file_length;
+    }
+    // the data appended for entries that were never written or dropped
+    if (self->options.segment_size == 0 && self->data_file_length > data_end) {
+        if (ftruncate(self->data_file_reference, data_end) != 0) return -1;
+        self->recovery.dropped_data_bytes = self->data_file_length - data_end;
+        self->data_file_length = data_end;
+        self->data_file_allocated = data_end;
+    }
+
+    if (self->recovery.dropped || self->recovery.dropped_index_bytes || self->recovery.dropped_data_bytes) {
+        fprintf(stderr, "recovered %s: dropped %zu log entries, %zu index bytes and %zu data bytes left by a crash\n", self->path,
+                self->recovery.dropped, self->recovery.dropped_index_bytes, self->recovery.dropped_data_bytes);
+    }
+    return 0;
+}
+
+/**
+ * Loads the index file either by mapping it or by reading it into record_list.
+ * on open the log past the verified mark is checked and its torn end dropped before anything is built from it
+ */
+static int database__instance__load_index(database_t *self, int recover) {
+    database__instance__unload_index(self);
+    if (recover) memset(&self->recovery, 0, sizeof(self->recovery));
+
+    struct stat st;
+    if (self->options.segment_size == 0) {
+        if (fstat(self->data_file_reference, &st) != 0) return -1;
+        self->data_file_length = st.st_size;
+        self->data_file_allocated = st.st_size;
+    }
+
+    if (fstat(self->index_file_reference, &st) != 0) return -1;
+    if (database__instance__check_index_header(self, st.st_size) != 0) return -1;
+    if (fstat(self->index_file_reference, &st) != 0) return -1;
+    size_t length = st.st_size / sizeof(record_t) - 1;
+    self->index_file_allocated = st.st_size;
+    self->index_file_length = index_entry_offset(length);
+
+    if (self->index_version == INDEX_VERSION_COMPACT) {
+        if (database__instance__read_compact_index(self, st.st_size, &self->record_list, &length) != 0) return -1;
+        self->record_list_capacity = length;
+        self->record_list_length = length;
+    } else
+#ifdef FILEDB_HAS_MMAP
+    if (self->options.map_index) {
+        if (index_map_remap(self, length) != 0) return -1;
+        self->record_list_length = length;
+    } else
+#endif
+    if (length > 0) {
+        self->record_list = (record_t*)malloc(length * sizeof(record_t));
+        if (!self->record_list) return -1;
+        if (pread(self->index_file_reference, self->record_list, length * sizeof(record_t), index_entry_offset(0)) != (ssize_t)(length * sizeof(record_t))) return -1;
+        self->record_list_capacity = length;
+        self->record_list_length = length;
+    }
+
+    if (recover && database__instance__recover_tail(self) != 0) return -1;
+
+    if (self->options.segment_size && database__instance__load_segments(self) != 0) return -1;
+    if (self->options.bloom_filter && id_bloom_load(self) != 0) return -1;
+    if (self->options.btree_index && btree_index_load(self) != 0) return -1;
+    if (!self->options.btree_index && !self->options.segment_size && !self->options.map_index && id_index_build(self) != 0) return -1;
+
+    // what was checked is made durable before the mark moves past it, without fsync it is checked again next time
+    if (recover && self->recovery.verified > 0 && self->options.durability != DATABASE_DURABILITY_NONE) {
+        if (database__instance__sync_data_files(self) != 0 || sync_file(self->index_file_reference) != 0) return -1;
+        return database__instance__mark_verified_locked(self);
+    }
+    return 0;
+}
+
+// Pushes the buffered data then the buffered index entries to the kernel
+static int database__instance__flush_locked(database_t *self) {
+    if (write_buffer_flush(self->data_file_reference, &self->data_buffer) != 0) return -1;
+    return write_buffer_flush(self->index_file_reference, &self->index_buffer);
+}
+
+// Flushes and makes both files durable, data first so that a durable index entry never points at missing data
+static int database__instance__sync_locked(database_t *self) {
+    if (write_buffer_flush(self->data_file_reference, &self->data_buffer) != 0) return -1;
+    if (sync_file(self->data_file_reference) != 0) return -1;
+    if (write_buffer_flush(self->index_file_reference, &self->index_buffer) != 0) return -1;
+    if (sync_file(self->index_file_reference) != 0) return -1;
+    self->records_since_sync = 0;
+    return database__instance__mark_verified_locked(self);
+}
+
+// Applies the durability mode once n records were committed
+static int database__instance__commit_locked(database_t *self, size_t n) {
+    self->records_since_sync += n;
+    switch (self->options.durability) {
+        case DATABASE_DURABILITY_COMMIT:
+            return database__instance__sync_locked(self);
+        case DATABASE_DURABILITY_EVERY_N_RECORDS: {
+            size_t every = self->options.sync_every_records ? self->options.sync_every_records : 1;
+            if (self->records_since_sync >= every) return database__instance__sync_locked(self);
+            return 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Background flusher of DATABASE_DURABILITY_INTERVAL, syncs every sync_interval_ms until stopped
+static void* database__instance__flusher(void *arg) {
+    database_t *self = (database_t*)arg;
+    unsigned interval = self->options.sync_interval_ms ? self->options.sync_interval_ms : 1000;
+
+    pthread_mutex_lock(&self->write_lock);
+    while (self->flusher_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval / 1000;
+        deadline.tv_nsec += (long)(interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        int waited = 0;
+        while (self->flusher_running && waited != ETIMEDOUT) {
+            waited = pthread_cond_timedwait(&self->flusher_wakeup, &self->write_lock, &deadline);
+        }
+        if (self->records_since_sync > 0) database__instance__sync_locked(self);
+    }
+    pthread_mutex_unlock(&self->write_lock);
+    return NULL;
+}
+
+// Flush the write buffers
+error_t database__instance__flush(database_t *self) {
+    if (!self) return -1;
+    pthread_mutex_lock(&self->write_lock);
+    error_t result = database__instance__flush_locked(self);
+    pthread_mutex_unlock(&self->write_lock);
+    return result;
+}
+
+// Flush the write buffers and make the files durable
+error_t database__instance__sync(database_t *self) {
+    if (!self) return -1;
+    pthread_mutex_lock(&self->write_lock);
+    error_t result = database__instance__sync_locked(self);
+    // the tree and the filter are saved once the log entries they reflect are durable
+    if (result == 0 && self->btree) {
+        pthread_mutex_lock(&self->btree_lock);
+        result = btree__instance__flush(self->btree);
+        pthread_mutex_unlock(&self->btree_lock);
+    }
+    if (result == 0) result = id_bloom_save(self);
+    pthread_mutex_unlock(&self->write_lock);
+    return result;
+}
+
+/**
+ * Writes the live map with the log length it covers, replacing the previous checkpoint in a single rename.
+ * the write lock is held by the caller
+ */
+static error_t database__instance__checkpoint_locked(database_t *self) {
+    // the persistent tree never replays the whole log
+    if (self->options.btree_index) return 0;
+    if (id_index_ensure_locked(self) != 0) return -1;
+    // the checkpoint never covers entries the log file may not hold
+    int flushed = self->options.durability != DATABASE_DURABILITY_NONE ? database__instance__sync_locked(self) : database__instance__flush_locked(self);
+    if (flushed != 0) return -1;
+
+    checkpoint_header_t header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, sizeof(checkpoint_entry_t), self->record_list_length, 0};
+    checkpoint_entry_t *entries = (checkpoint_entry_t*)malloc((self->id_index_length ? self->id_index_length : 1) * sizeof(checkpoint_entry_t));
+    if (!entries) return -1;
+    for (size_t slot = 0; slot < self->id_index_capacity; slot++) {
+        if (self->id_index[slot] == ID_INDEX_EMPTY) continue;
+        size_t position = self->id_index[slot] - 1;
+        memcpy(entries[header.length].id, record_at(self, position)->id, 32);
+        entries[header.length].position = position;
+        header.length++;
+    }
+
+    char path[256], temp_path[256];
+    checkpoint_path(self, path);
+    // a truncated name could be another file, the checkpoint is then not written
+    int named = snprintf(temp_path, sizeof(temp_path), "%s.checkpoint.temp", self->path) < (int)sizeof(temp_path);
+    int fd = named ? open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0666) : -1;
+    struct iovec iov[2] = {{&header, sizeof(header)}, {entries, header.length * sizeof(checkpoint_entry_t)}};
+    error_t result = fd == -1 ? -1 : write_gathered(fd, iov, 2, 0);
+    free(entries);
+    if (result == 0) result = sync_file(fd);
+    if (fd != -1) close(fd);
+    if (result == 0) result = rename_file(temp_path, path);
+    if (result == 0) self->checkpoint_length = header.covered;
+    return result;
+}
+
+// Checkpoint the live map
+error_t database__instance__checkpoint(database_t *self) {
+    if (!self) return -1;
+    pthread_mutex_lock(&self->write_lock);
+    error_t result = database__instance__checkpoint_locked(self);
+    pthread_mutex_unlock(&self->write_lock);
+    return result;
+}
+
+// Drops the checkpoint before the log is rewritten, whatever the options, since its positions are about to change
+static int checkpoint_invalidate(database_t *self) {
+    char path[256];
+    checkpoint_path(self, path);
+    self->checkpoint_length = 0;
+    return unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+// Grows record_list geometrically so that it can hold n more entries
+static int record_list_reserve(database_t *self, size_t n) {
+    size_t tail_length = self->record_list_length - self->record_list_offset;
+    if (tail_length + n <= self->record_list_capacity) return 0;
+
+    size_t capacity = self->record_list_capacity ? self->record_list_capacity : RECORD_LIST_INITIAL_CAPACITY;
+    while (capacity < tail_length + n) capacity *= 2;
+
+    // copied rather than reallocated, the readers keep using the old list until they are done
+    record_t *list = (record_t*)malloc(capacity * sizeof(record_t));
+    if (!list) return -1;
+    if (tail_length > 0) memcpy(list, self->record_list, tail_length * sizeof(record_t));
+    record_t *old_list = self->record_list;
+    sequence_write_begin(&self->log_sequence);
+    __atomic_store_n(&self->record_list, list, __ATOMIC_RELEASE);
+    sequence_write_end(&self->log_sequence);
+    self->record_list_capacity = capacity;
+    database__instance__retire(self, old_list, 0);
+    return 0;
+}
+
+// Appends n entries to the log, in memory and with a single write to the index file
+static int database__instance__append_entries(database_t *self, const record_t *entries, size_t n) {
+    if (record_list_reserve(self, n) != 0) return -1;
+    // the id index is grown before anything is written, applying the entries to it then cannot fail
+    if (self->id_index_built && id_index_reserve(self, n) != 0) return -1;
+
+    size_t position = self->record_list_length;
+    size_t offset = self->index_file_length;
+    size_t total;
+    const void *encoded = index_entries_encode(self->index_version, entries, n, &total);
+    if (!encoded) return -1;
+    struct iovec iov[2] = {{NULL, 0}, {(void*)encoded, total}};
+    file_reserve(self->index_file_reference, &self->index_file_allocated, offset + total, self->options.preallocate_extent);
+    int written = write_buffer_append(self->index_file_reference, &self->index_buffer, iov, 2, offset, total);
+    index_entries_free(encoded, entries, n);
+    if (written != 0) return -1;
+    self->index_file_length = offset + total;
+
+    // the filter knows the ids before any reader can find them in the log
+    if (id_bloom_add(self, entries, n) != 0) return -1;
+    memcpy(&self->record_list[position - self->record_list_offset], entries, n * sizeof(record_t));
+
+    // the indexes know the entries before a reader can find them in the log and look their ids up
+    if (self->id_index_built) {
+        for (size_t i = position; i < position + n; i++) {
+            if (id_index_apply(self, i) != 0) return -1;
+        }
+        id_index_shrink(self);
+    }
+    if (self->btree && btree_index_replay(self, position, position + n, 1) != 0) return -1;
+    sample_apply(self, position, position + n);
+    // published once written, a reader never sees an entry being filled in
+    __atomic_store_n(&self->record_list_length, position + n, __ATOMIC_RELEASE);
+
+    if (self->options.checkpoint_interval && self->record_list_length - self->checkpoint_length >= self->options.checkpoint_interval) {
+        // a failed checkpoint loses nothing, the next open replays more of the log
+        database__instance__checkpoint_locked(self);
+    }
+
+#ifdef FILEDB_HAS_MMAP
+    // fold a grown tail back into the mapping, the ids only move between storage so the index stays valid
+    if (self->options.map_index && self->record_list_length - self->record_list_offset >= INDEX_MAP_TAIL_LIMIT) {
+        if (database__instance__flush_locked(self) == 0) index_map_remap(self, self->record_list_length);
+    }
+#endif
+
+    return 0;
+}
+
+// Drops the data file mapping, only called while no reader is in a section
+static void data_map_release(database_t *self) {
+#ifdef FILEDB_HAS_MMAP
+    if (self->data_map) munmap((void*)self->data_map, self->data_map_length);
+#endif
+    self->data_map = NULL;
+    self->data_map_length = 0;
+}
+
+#ifdef FILEDB_HAS_MMAP
+/**
+ * Returns the data file mapping, remapped up to the current file size if it does not cover end yet.
+ * the readers scanning concurrently each remap under the reclaim lock, the replaced mapping is retired
+ */
+static const char* data_map_ensure(database_t *self, size_t end) {
+    // the length is published after the mapping, a mapping at least that long is seen
+    if (end <= __atomic_load_n(&self->data_map_length, __ATOMIC_ACQUIRE)) return __atomic_load_n(&self->data_map, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&self->reclaim_lock);
+    const char *map = self->data_map;
+    struct stat st;
+    if (end > self->data_map_length) {
+        map = NULL;
+        if (fstat(self->data_file_reference, &st) == 0 && (size_t)st.st_size >= end) {
+            map = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, self->data_file_reference, 0);
+            if (map == MAP_FAILED) map = NULL;
+        }
+        if (map) {
+            if (self->options.advise_sequential) madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+            const char *old_map = self->data_map;
+            size_t old_length = self->data_map_length;
+            __atomic_store_n(&self->data_map, map, __ATOMIC_RELEASE);
+            __atomic_store_n(&self->data_map_length, (size_t)st.st_size, __ATOMIC_RELEASE);
+            database__instance__retire_locked(self, (void*)old_map, old_length);
+        }
+    }
+    pthread_mutex_unlock(&self->reclaim_lock);
+    return map;
+}
+#endif
+
+// Open a database
+database_t* database__static_open(const char* path) {
+    return database__static_open_with_options(path, NULL);
+}
+
+// Open a database with options
+database_t* database__static_open_with_options(const char* path, const database_options_t* options) {
+    if (!path) return NULL;
+
+    database_t *db = (database_t*)calloc(1, sizeof(database_t));
+    if (!db) return NULL;
+
+    if (options) db->options = *options;
+    if (db->options.btree_index) db->options.map_index = 1;
+    db->path = strdup(path);
+    db->data_file_reference = -1;
+    db->index_file_reference = -1;
+    pthread_mutex_init(&db->write_lock, NULL);
+    pthread_cond_init(&db->flusher_wakeup, NULL);
+    pthread_mutex_init(&db->reclaim_lock, NULL);
+    pthread_rwlock_init(&db->generation_lock, NULL);
+    pthread_mutex_init(&db->btree_lock, NULL);
+    pthread_mutex_init(&db->sample_lock, NULL);
+
+    if (db->options.write_buffer_size > 0) {
+        db->data_buffer.bytes = (char*)malloc(db->options.write_buffer_size);
+        db->index_buffer.bytes = (char*)malloc(db->options.write_buffer_size);
+        if (!db->data_buffer.bytes || !db->index_buffer.bytes) {
+            database__static__close(db);
+            return NULL;
+        }
+        db->data_buffer.capacity = db->options.write_buffer_size;
+        db->index_buffer.capacity = db->options.write_buffer_size;
+    }
+
+    char data_file_path[256];
+    char index_file_path[256];
+    snprintf(data_file_path, 256, "%s.data", path);
+    snprintf(index_file_path, 256, "%s.index", path);
+
+    // a segmented database opens its active segment once the index is loaded
+    if (db->options.segment_size == 0) db->data_file_reference = open(data_file_path, O_RDWR | O_CREAT, 0666);
+    db->index_file_reference = open(index_file_path, O_RDWR | O_CREAT, 0666);
+
+    if ((db->options.segment_size == 0 && db->data_file_reference == -1) || db->index_file_reference == -1 || database__instance__load_index(db, 1) != 0) {
+        // nothing is written back to an index that failed to load
+        if (db->index_file_reference >= 0) close(db->index_file_reference);
+        db->index_file_reference = -1;
+        database__static__close(db);
+        return NULL;
+    }
+
+    if (db->options.durability == DATABASE_DURABILITY_INTERVAL) {
+        db->flusher_running = 1;
+        if (pthread_create(&db->flusher_thread, NULL, database__instance__flusher, db) != 0) {
+            db->flusher_running = 0;
+            database__static__close(db);
+            return NULL;
+        }
+    }
+
+    return db;
+}
+
+// Close a database
+error_t database__static__close(database_t* self) {
+    if (!self) return -1;
+
+    // let a running compaction switch generations before closing
+    database__instance__optimize_wait(self);
+
+    // stop the background flusher before the final flush
+    if (self->flusher_running) {
+        pthread_mutex_lock(&self->write_lock);
+        self->flusher_running = 0;
+        pthread_cond_signal(&self->flusher_wakeup);
+        pthread_mutex_unlock(&self->write_lock);
+        pthread_join(self->flusher_thread, NULL);
+    }
+
+    error_t result = 0;
+    // a live map that was never built has nothing newer to checkpoint
+    if (self->options.checkpoint_interval && self->id_index_built && self->record_list_length > self->checkpoint_length) {
+        result = database__instance__checkpoint_locked(self);
+    }
+    if (self->data_file_reference >= 0 && self->index_file_reference >= 0) {
+        error_t flushed;
+        if (self->options.durability != DATABASE_DURABILITY_NONE) {
+            flushed = database__instance__sync_locked(self);
+        } else {
+            // the kernel may write the mark before the data it covers, without fsync the next open checks the tail
+            flushed = database__instance__flush_locked(self);
+        }
+        if (flushed != 0) result = flushed;
+    }
+    free(self->data_buffer.bytes);
+    free(self->index_buffer.bytes);
+    if (self->btree && btree__static__close(self->btree) != 0) result = -1;
+    if (self->index_file_reference >= 0 && id_bloom_save(self) != 0) result = -1;
+
+    database__instance__unload_index(self);
+
+    data_map_release(self);
+
+    // the data file of a segmented database is its active segment, closed with the others
+    if (self->options.segment_size == 0 && self->data_file_reference >= 0) close(self->data_file_reference);
+    if (self->index_file_reference >= 0) close(self->index_file_reference);
+    for (size_t i = 0; i < self->segments_length; i++) {
+        if (self->segments[i].file_reference >= 0) close(self->segments[i].file_reference);
+    }
+    free(self->segments);
+    database__instance__reclaim_all(self);
+    free(self->retired);
+    free(self->bloom);
+
+    if (self->path) free((void*)self->path);
+
+    pthread_cond_destroy(&self->flusher_wakeup);
+    pthread_mutex_destroy(&self->write_lock);
+    pthread_mutex_destroy(&self->reclaim_lock);
+    pthread_rwlock_destroy(&self->generation_lock);
+    pthread_mutex_destroy(&self->btree_lock);
+    pthread_mutex_destroy(&self->sample_lock);
+    free(self);
+    return result;
+}
+
+// Log entry by position
+record_t* database__instance__record_at(database_t* self, size_t position) {
+    if (!self || position >= log_length(self)) return NULL;
+    return record_at(self, position);
+}
+
+// Payload of a batch, sorted by id to find the payloads repeated inside the batch
+typedef struct batch_payload_s {
+    const char *id;
+    size_t length;
+    size_t index;
+} batch_payload_t;
+
+static int batch_payload_compare(const void *a, const void *b) {
+    const batch_payload_t *left = (const batch_payload_t*)a;
+    const batch_payload_t *right = (const batch_payload_t*)b;
+    int order = memcmp(left->id, right->id, 32);
+    if (order != 0) return order;
+    if (left->length != right->length) return left->length < right->length ? -1 : 1;
+    return left->index < right->index ? -1 : (left->index > right->index ? 1 : 0);
+}
+
+// For each payload the index of its first copy in the batch, itself when it is the first one
+static size_t* batch_first_copies(const record_t *records, const size_t *lengths, size_t n) {
+    size_t *first_copies = (size_t*)malloc(n * sizeof(size_t));
+    batch_payload_t *payloads = (batch_payload_t*)malloc(n * sizeof(batch_payload_t));
+    if (!first_copies || !payloads) {
+        free(first_copies);
+        free(payloads);
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        payloads[i].id = records[i].id;
+        payloads[i].length = lengths[i];
+        payloads[i].index = i;
+    }
+    qsort(payloads, n, sizeof(batch_payload_t), batch_payload_compare);
+    for (size_t i = 0; i < n; i++) {
+        int same = i > 0 && memcmp(payloads[i].id, payloads[i - 1].id, 32) == 0 && payloads[i].length == payloads[i - 1].length;
+        first_copies[payloads[i].index] = same ? first_copies[payloads[i - 1].index] : payloads[i].index;
+    }
+    free(payloads);
+    return first_copies;
+}
+
+// The stored copy of a payload: an earlier payload of the batch or a live record with the same content
+static const record_t* database__instance__find_copy_locked(database_t *self, const record_t *records, const size_t *first_copies, size_t i, size_t length) {
+    if (first_copies && first_copies[i] != i) return &records[first_copies[i]];
+    if (!id_bloom_may_contain(self, records[i].id)) return NULL;
+    if (self->btree) {
+        uint64_t position;
+        pthread_mutex_lock(&self->btree_lock);
+        int found = btree__instance__get(self->btree, records[i].id, &position);
+        pthread_mutex_unlock(&self->btree_lock);
+        if (found != 1) return NULL;
+        const record_t *existing = record_at(self, position);
+        return existing->length == length ? existing : NULL;
+    }
+    if (id_index_ensure_locked(self) != 0 || self->id_index_capacity == 0) return NULL;
+
+    size_t slot = id_index_find_slot(self, records[i].id);
+    if (self->id_index[slot] == ID_INDEX_EMPTY) return NULL;
+    const record_t *existing = record_at(self, self->id_index[slot] - 1);
+    return existing->length == length ? existing : NULL;
+}
+
+/**
+ * Compresses the payloads of a batch into one arena and points stored at the bytes to write.
+ * a payload that doesn't shrink is stored as it is, straight from the caller's buffer
+ */
+static char* batch_compress(char **buffers, const size_t *lengths, size_t n, record_t *records, char **stored, size_t *stored_lengths) {
+    size_t capacity = 0;
+    for (size_t i = 0; i < n; i++) capacity += lengths[i];
+    char *arena = (char*)malloc(capacity);
+    if (!arena) return NULL;
+
+    size_t used = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t compressed = lz__static__compress(buffers[i], lengths[i], arena + used, lengths[i] - 1);
+        if (compressed > 0) {
+            stored[i] = arena + used;
+            stored_lengths[i] = compressed;
+            records[i].codec = RECORD_CODEC_LZ;
+            used += compressed;
+        } else {
+            stored[i] = buffers[i];
+            stored_lengths[i] = lengths[i];
+        }
+    }
+    return arena;
+}
+
+/**
+ * Inserts a batch of records, out_last when not NULL receives the last log entry
+ *   taken before a background compaction can reload the log
+ */
+static error_t database__instance__insert_batch_returning(database_t* self, char** buffers, const size_t* lengths, size_t n, record_t* out_records, record_t** out_last) {
+    if (!self || !buffers || !lengths) return -1;
+    for (size_t i = 0; i < n; i++) {
+        if (!buffers[i] || lengths[i] == 0) return -1;
+    }
+
+    record_t *records = out_records ? out_records : (record_t*)malloc(n * sizeof(record_t));
+    struct iovec *iov = (struct iovec*)malloc((n + 1) * sizeof(struct iovec));
+    if (!records || !iov) {
+        if (records != out_records) free(records);
+        free(iov);
+        return -1;
+    }
+
+    // the payloads are hashed and compressed before taking the write lock
+    for (size_t i = 0; i < n; i++) {
+        compute_hash(buffers[i], lengths[i], records[i].id);
+        records[i].length = lengths[i];
+        records[i].codec = RECORD_CODEC_NONE;
+        records[i].reserved = 0;
+    }
+    size_t *first_copies = NULL;
+    if (self->options.deduplicate && n > 1) first_copies = batch_first_copies(records, lengths, n);
+
+    char **stored = buffers;
+    const size_t *stored_lengths = lengths;
+    char **compressed_buffers = NULL;
+    size_t *compressed_lengths = NULL;
+    char *arena = NULL;
+    if (self->options.compression == RECORD_CODEC_LZ) {
+        compressed_buffers = (char**)malloc(n * sizeof(char*));
+        compressed_lengths = (size_t*)malloc(n * sizeof(size_t));
+        if (compressed_buffers && compressed_lengths) arena = batch_compress(buffers, lengths, n, records, compressed_buffers, compressed_lengths);
+        if (arena) {
+            stored = compressed_buffers;
+            stored_lengths = compressed_lengths;
+        }
+    }
+
+    pthread_mutex_lock(&self->write_lock);
+
+    error_t result = 0;
+    size_t first = 0;
+    while (result == 0 && first < n) {
+        // a segmented log rolls to a new segment when the next payload would overflow the active one
+        size_t segment_size = self->options.segment_size;
+        if (segment_size && self->data_file_length > 0 && self->data_file_length + stored_lengths[first] > segment_size) {
+            result = database__instance__roll_segment_locked(self);
+            if (result != 0) break;
+        }
+
+        // Lay out the payloads back to back at the end of the data file, iov[0] is reserved for the write buffer
+        size_t start = self->data_file_length;
+        size_t last = first;
+        size_t count = 1;
+        for (; last < n; last++) {
+            if (self->options.deduplicate) {
+                const record_t *copy = database__instance__find_copy_locked(self, records, first_copies, last, lengths[last]);
+                if (copy) {
+                    records[last].start = copy->start;
+                    records[last].end = copy->end;
+                    records[last].codec = copy->codec;
+                    continue;
+                }
+            }
+            if (segment_size && last > first && start + stored_lengths[last] > segment_size) break;
+            records[last].start = segment_address(self->active_segment, start);
+            records[last].end = records[last].start + stored_lengths[last];
+            iov[count].iov_base = stored[last];
+            iov[count].iov_len = stored_lengths[last];
+            count++;
+            start += stored_lengths[last];
+        }
+
+        // One gathered write for the payloads, one write for the index entries
+        if (start > self->data_file_length) {
+            file_reserve(self->data_file_reference, &self->data_file_allocated, start, self->options.preallocate_extent);
+            result = write_buffer_append(self->data_file_reference, &self->data_buffer, iov, count, self->data_file_length, start - self->data_file_length);
+        }
+        if (result == 0) {
+            self->data_file_length = start;
+            if (segment_size) self->segments[self->active_segment].length = start;
+            result = database__instance__append_entries(self, records + first, last - first);
+        }
+        first = last;
+    }
+    if (result == 0) result = database__instance__commit_locked(self, n);
+    if (result == 0 && out_last) *out_last = record_at(self, self->record_list_length - 1);
+
+    pthread_mutex_unlock(&self->write_lock);
+    database__instance__reclaim(self);
+
+    if (records != out_records) free(records);
+    free(first_copies);
+    free(compressed_buffers);
+    free(compressed_lengths);
+    free(arena);
+    free(iov);
+    return result;
+}
+
+// Insert a batch of records
+error_t database__instance__insert_batch(database_t* self, char** buffers, const size_t* lengths, size_t n, record_t* out_records) {
+    return database__instance__insert_batch_returning(self, buffers, lengths, n, out_records, NULL);
+}
+
+// Insert a record
+record_t* database__instance__insert_record(database_t* self, char* data, int data_length) {
+    if (!self || !data || data_length <= 0) return NULL;
+
+    size_t length = data_length;
+    record_t *record = NULL;
+    if (database__instance__insert_batch_returning(self, &data, &length, 1, NULL, &record) != 0) return NULL;
+    return record;
+}
+
+// Delete a record
+record_t* database__instance__delete_record(database_t* self, record_t* record) {
+    if (!self || !record) return NULL;
+
+    // Create a new record with the same ID but with start and end set to 0
+    record_t deleted_record = *record;
+    deleted_record.start = 0;
+    deleted_record.end = 0;
+    deleted_record.length = 0;
+    deleted_record.codec = RECORD_CODEC_NONE;
+
+    // Add the deleted record to the record list and the index file
+    pthread_mutex_lock(&self->write_lock);
+    error_t result = database__instance__append_entries(self, &deleted_record, 1);
+    if (result == 0) result = database__instance__commit_locked(self, 1);
+    record_t *deleted = result == 0 ? record_at(self, self->record_list_length - 1) : NULL;
+    pthread_mutex_unlock(&self->write_lock);
+    database__instance__reclaim(self);
+    return deleted;
+}
+
+
+// List all records
+error_t database__instance__list_all(database_t* self, record_found_fn on_record_found) {
+    if (!self || !on_record_found) return -1;
+
+    size_t section = database__instance__read_begin(self);
+    size_t length = log_length(self);
+    for (size_t i = 0; i < length; i++) {
+        on_record_found(record_at(self, i), i);
+    }
+    database__instance__read_end(self, section);
+    return 0;
+}
+
+// Copy the content of a record
+error_t database__instance__read_content(database_t* self, const record_t* record, char* buffer) {
+    if (!self || !record || !buffer) return -1;
+    if (self->options.write_buffer_size && database__instance__flush(self) != 0) return -1;
+
+    size_t section = database__instance__read_begin(self);
+    error_t result;
+    if (record->codec == RECORD_CODEC_NONE) {
+        result = database__instance__read_stored(self, record, buffer);
+    } else {
+        char *stored = (char*)malloc(record->end - record->start);
+        result = stored ? database__instance__read_stored(self, record, stored) : -1;
+        if (result == 0) result = record_decode(record, stored, buffer);
+        free(stored);
+    }
+    database__instance__read_end(self, section);
+    return result;
+}
+
+// Copy a range of the content of a record
+error_t database__instance__read_range(database_t* self, const record_t* record, size_t offset, size_t length, char* buffer) {
+    if (!self || !record || (!buffer && length > 0)) return -1;
+    if (offset > record->length || length > record->length - offset) return -1;
+    if (length == 0) return 0;
+    if (self->options.write_buffer_size && database__instance__flush(self) != 0) return -1;
+
+    size_t section = database__instance__read_begin(self);
+    error_t result;
+    if (record->codec == RECORD_CODEC_NONE) {
+        size_t file_offset;
+        int fd = database__instance__data_file_at(self, record->start, &file_offset);
+        result = fd == -1 ? -1 : read_fully(fd, buffer, length, file_offset + offset);
+    } else {
+        // a compressed block is only decoded whole
+        char *stored = (char*)malloc(record->end - record->start);
+        char *content = (char*)malloc(record->length);
+        result = stored && content ? database__instance__read_stored(self, record, stored) : -1;
+        if (result == 0) result = record_decode(record, stored, content);
+        if (result == 0) memcpy(buffer, content + offset, length);
+        free(stored);
+        free(content);
+    }
+    database__instance__read_end(self, section);
+    return result;
+}
+
+// List all records with content
+error_t database__instance__list_all_with_content(database_t* self, record_found_with_content_fn on_record_with_content_found) {
+    if (!self || !on_record_with_content_found) return -1;
+    // the entries counted before the flush have their content in the file
+    size_t length = log_length(self);
+    if (database__instance__flush(self) != 0) return -1;
+
+    size_t section = database__instance__read_begin(self);
+    scan_buffer_t scan = {0};
+    error_t result = 0;
+    for (size_t i = 0; i < length && result == 0; i++) {
+        record_t *record = record_at(self, i);
+        if (record->length == 0) continue;
+
+        if (database__instance__scan_content(self, record, &scan) != 0) {
+            result = -1;
+            break;
+        }
+        result = on_record_with_content_found(record, (int)i, scan.content);
+    }
+
+    scan_buffer_free(&scan);
+    database__instance__read_end(self, section);
+    return result;
+}
+
+// List all records with content served from the data file mapping
+error_t database__instance__list_all_mapped_content(database_t* self, record_found_with_span_fn on_record_found) {
+    if (!self || !on_record_found) return -1;
+    size_t length = log_length(self);
+    if (database__instance__flush(self) != 0) return -1;
+
+    size_t section = database__instance__read_begin(self);
+    scan_buffer_t scan = {0};
+    error_t result = 0;
+
+    for (size_t i = 0; i < length && result == 0; i++) {
+        record_t *record = record_at(self, i);
+        if (record->length == 0) continue;
+
+        const char *content;
+#ifdef FILEDB_HAS_MMAP
+        if (self->options.segment_size == 0) {
+            const char *map = data_map_ensure(self, record->end);
+            if (!map) {
+                result = -1;
+                break;
+            }
+            content = map + record->start;
+            // compressed records are decoded into a buffer reused across records
+            if (record->codec != RECORD_CODEC_NONE) {
+                if (scan_buffer_reserve(&scan.content, &scan.content_capacity, record->length) != 0 || record_decode(record, content, scan.content) != 0) {
+                    result = -1;
+                    break;
+                }
+                content = scan.content;
+            }
+        } else
+#endif
+        {
+            // segmented logs and platforms without mmap read into buffers reused across records
+            if (database__instance__scan_content(self, record, &scan) != 0) {
+                result = -1;
+                break;
+            }
+            content = scan.content;
+        }
+
+        result = on_record_found(record, (int)i, content, record->length);
+    }
+
+    scan_buffer_free(&scan);
+    database__instance__read_end(self, section);
+    return result;
+}
+
+/**
+ * the contents of a range of log entries read by a parallel scan worker,
+ *   contents[i] is NULL for a deleted entry
+ */
+typedef struct scan_batch_s {
+    record_t *records[PARALLEL_SCAN_BATCH];
+    const char *contents[PARALLEL_SCAN_BATCH];
+    scan_buffer_t buffer;
+} scan_batch_t;
+
+/**
+ * Reads and decodes the entries [first, first + length) of the log into the batch.
+ * records appended back to back are read with one pread and served from it, the others one by one
+ */
+static int database__instance__read_batch(database_t *self, size_t first, size_t length, scan_batch_t *batch) {
+    size_t stored_total = 0, content_total = 0;
+    size_t span_start = (size_t)-1, span_end = 0, segment = (size_t)-1;
+    int same_segment = 1;
+    for (size_t i = 0; i < length; i++) {
+        record_t *record = record_at(self, first + i);
+        batch->records[i] = record;
+        if (record->length == 0) continue;
+
+        stored_total += record->end - record->start;
+        if (record->codec != RECORD_CODEC_NONE) content_total += record->length;
+        size_t record_segment = address_segment(self, record->start);
+        if (segment == (size_t)-1) segment = record_segment;
+        else if (record_segment != segment) same_segment = 0;
+        if (record->start < span_start) span_start = record->start;
+        if (record->end > span_end) span_end = record->end;
+    }
+    if (stored_total == 0) {
+        for (size_t i = 0; i < length; i++) batch->contents[i] = NULL;
+        return 0;
+    }
+
+    scan_buffer_t *buffer = &batch->buffer;
+    int spanned = same_segment && span_end - span_start <= stored_total * PARALLEL_SCAN_SPAN_RATIO;
+    if (scan_buffer_reserve(&buffer->stored, &buffer->stored_capacity, spanned ? span_end - span_start : stored_total) != 0) return -1;
+    if (scan_buffer_reserve(&buffer->content, &buffer->content_capacity, content_total ? content_total : 1) != 0) return -1;
+    if (spanned) {
+        size_t offset;
+        int fd = database__instance__data_file_at(self, span_start, &offset);
+        if (fd == -1 || read_fully(fd, buffer->stored, span_end - span_start, offset) != 0) return -1;
+    }
+
+    size_t stored_used = 0, content_used = 0;
+    for (size_t i = 0; i < length; i++) {
+        const record_t *record = batch->records[i];
+        batch->contents[i] = NULL;
+        if (record->length == 0) continue;
+
+        const char *stored;
+        if (spanned) {
+            stored = buffer->stored + (record->start - span_start);
+        } else {
+            stored = buffer->stored + stored_used;
+            if (database__instance__read_stored(self, record, buffer->stored + stored_used) != 0) return -1;
+            stored_used += record->end - record->start;
+        }
+        if (record->codec == RECORD_CODEC_NONE) {
+            if (record->end - record->start != record->length) return -1;
+            batch->contents[i] = stored;
+        } else {
+            if (record_decode(record, stored, buffer->content + content_used) != 0) return -1;
+            batch->contents[i] = buffer->content + content_used;
+            content_used += record->length;
+        }
+    }
+    return 0;
+}
+
+/**
+ * the state shared by the workers of a parallel scan
+ */
+typedef struct parallel_scan_s {
+    database_t *db;
+    size_t length;
+    size_t batches;
+    /**
+     * the next batch to claim, taken with an atomic increment
+     */
+    size_t next_batch;
+    /**
+     * in ordered mode the batch whose callbacks are to be made next
+     */
+    int ordered;
+    size_t emitted;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    /**
+     * the first error, it stops every worker
+     */
+    error_t result;
+    record_found_parallel_fn on_record_found;
+    void *user_ctx;
+} parallel_scan_t;
+
+typedef struct parallel_scan_worker_s {
+    parallel_scan_t *scan;
+    size_t worker;
+    pthread_t thread;
+    int started;
+    scan_batch_t batch;
+} parallel_scan_worker_t;
+
+static void parallel_scan_fail(parallel_scan_t *scan, error_t result) {
+    pthread_mutex_lock(&scan->lock);
+    if (scan->result == 0) __atomic_store_n(&scan->result, result, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&scan->turn);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Claims batches until none is left, the calling thread runs it as worker 0
+static void* parallel_scan_worker(void *arg) {
+    parallel_scan_worker_t *worker = (parallel_scan_worker_t*)arg;
+    parallel_scan_t *scan = worker->scan;
+
+    while (__atomic_load_n(&scan->result, __ATOMIC_RELAXED) == 0) {
+        size_t batch = __atomic_fetch_add(&scan->next_batch, 1, __ATOMIC_RELAXED);
+        if (batch >= scan->batches) break;
+        size_t first = batch * PARALLEL_SCAN_BATCH;
+        size_t length = scan->length - first < PARALLEL_SCAN_BATCH ? scan->length - first : PARALLEL_SCAN_BATCH;
+
+        // the batches are claimed in order, waiting for the earlier ones never deadlocks
+        error_t result = database__instance__read_batch(scan->db, first, length, &worker->batch);
+        if (scan->ordered) {
+            pthread_mutex_lock(&scan->lock);
+            while (scan->emitted != batch && scan->result == 0) pthread_cond_wait(&scan->turn, &scan->lock);
+            if (scan->result != 0) result = scan->result;
+            pthread_mutex_unlock(&scan->lock);
+        }
+        for (size_t i = 0; i < length && result == 0; i++) {
+            if (!worker->batch.contents[i]) continue;
+            record_t *record = worker->batch.records[i];
+            result = scan->on_record_found(record, (int)(first + i), worker->batch.contents[i], record->length, worker->worker, scan->user_ctx);
+        }
+        if (result != 0) {
+            parallel_scan_fail(scan, result);
+            break;
+        }
+        if (scan->ordered) {
+            pthread_mutex_lock(&scan->lock);
+            scan->emitted = batch + 1;
+            pthread_cond_broadcast(&scan->turn);
+            pthread_mutex_unlock(&scan->lock);
+        }
+    }
+    return NULL;
+}
+
+static error_t database__instance__parallel_scan_with(database_t *self, size_t nthreads, int ordered, record_found_parallel_fn on_record_found, void *user_ctx) {
+    if (!self || !on_record_found) return -1;
+    size_t length = log_length(self);
+    if (database__instance__flush(self) != 0) return -1;
+
+    if (nthreads == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (size_t)cpus : 1;
+#else
+        nthreads = 1;
+#endif
+    }
+    parallel_scan_t scan = {0};
+    scan.db = self;
+    scan.length = length;
+    scan.batches = (length + PARALLEL_SCAN_BATCH - 1) / PARALLEL_SCAN_BATCH;
+    scan.ordered = ordered;
+    scan.on_record_found = on_record_found;
+    scan.user_ctx = user_ctx;
+    if (nthreads > scan.batches) nthreads = scan.batches ? scan.batches : 1;
+
+    parallel_scan_worker_t *workers = (parallel_scan_worker_t*)calloc(nthreads, sizeof(parallel_scan_worker_t));
+    if (!workers) return -1;
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.turn, NULL);
+
+    // one section covers the workers, the records they are handed stay valid until the end of the scan
+    size_t section = database__instance__read_begin(self);
+    for (size_t w = 0; w < nthreads; w++) {
+        workers[w].scan = &scan;
+        workers[w].worker = w;
+    }
+    // a worker that can't be started leaves its batches to the others
+    for (size_t w = 1; w < nthreads; w++) {
+        workers[w].started = pthread_create(&workers[w].thread, NULL, parallel_scan_worker, &workers[w]) == 0;
+    }
+    parallel_scan_worker(&workers[0]);
+    for (size_t w = 1; w < nthreads; w++) {
+        if (workers[w].started) pthread_join(workers[w].thread, NULL);
+    }
+    database__instance__read_end(self, section);
+
+    for (size_t w = 0; w < nthreads; w++) scan_buffer_free(&workers[w].batch.buffer);
+    free(workers);
+    pthread_cond_destroy(&scan.turn);
+    pthread_mutex_destroy(&scan.lock);
+    return scan.result;
+}
+
+// Scan the records with their content on several threads
+error_t database__instance__parallel_scan(database_t* self, size_t nthreads, record_found_parallel_fn on_record_found, void* user_ctx) {
+    return database__instance__parallel_scan_with(self, nthreads, 0, on_record_found, user_ctx);
+}
+
+// Scan the records with their content on several threads, calling back in log order
+error_t database__instance__parallel_scan_ordered(database_t* self, size_t nthreads, record_found_parallel_fn on_record_found, void* user_ctx) {
+    return database__instance__parallel_scan_with(self, nthreads, 1, on_record_found, user_ctx);
+}
+
+/**
+ * Opens a read section in which ids can be looked up with database__instance__lookup.
+ * the id index is built before the section as building it takes the write lock, a generation reload between the two
+ *   unloads it again and it is built again
+ */
+static int database__instance__lookup_begin(database_t *self, size_t *section) {
+    for (;;) {
+        if (!self->btree && id_index_ensure(self) != 0) return -1;
+        *section = database__instance__read_begin(self);
+        if (self->btree || __atomic_load_n(&self->id_index_built, __ATOMIC_ACQUIRE)) return 0;
+        database__instance__read_end(self, *section);
+    }
+}
+
+// The latest version of the id, inside a section opened by lookup_begin
+static record_t* database__instance__lookup(database_t *self, const char *id) {
+    record_t *record = NULL;
+    if (!id_bloom_may_contain(self, id)) {
+        // an id that was never inserted never reaches the index
+    } else if (self->btree) {
+        uint64_t position;
+        pthread_mutex_lock(&self->btree_lock);
+        int found = btree__instance__get(self->btree, id, &position);
+        pthread_mutex_unlock(&self->btree_lock);
+        if (found == 1) record = record_at(self, position);
+    } else {
+        size_t position = id_index_lookup(self, id);
+        if (position != ID_INDEX_EMPTY) record = record_at(self, position - 1);
+    }
+    return record;
+}
+
+// The latest version of the id in a section of its own, copied into out_record before the section ends when not NULL
+static record_t* database__instance__find(database_t *self, const char *id, record_t *out_record) {
+    // the filter answers for an id that was never inserted without the id index being built
+    size_t section = database__instance__read_begin(self);
+    int known = id_bloom_may_contain(self, id);
+    database__instance__read_end(self, section);
+    if (!known) return NULL;
+
+    if (database__instance__lookup_begin(self, &section) != 0) return NULL;
+    record_t *record = database__instance__lookup(self, id);
+    if (record && out_record) *out_record = *record;
+    database__instance__read_end(self, section);
+    return record;
+}
+
+// Get the latest version of a record by id
+record_t* database__instance__get_by_id(database_t *self, const char *id) {
+    if (!self || !id) return NULL;
+    return database__instance__find(self, id, NULL);
+}
+
+// Copy the latest version of a record by id
+error_t database__instance__get_copy_by_id(database_t *self, const char *id, record_t *out_record) {
+    if (!self || !id || !out_record) return -1;
+    return database__instance__find(self, id, out_record) ? 0 : -1;
+}
+
+/**
+ * the callback of get_latest_records over the persistent id index and the ordinal of the next record
+ */
+typedef struct latest_visit_s {
+    record_iter_fn on_record_found;
+    int ord;
+} latest_visit_t;
+
+static int latest_visit(database_t *self, size_t position, void *ctx) {
+    latest_visit_t *visit = (latest_visit_t*)ctx;
+    return visit->on_record_found(record_at(self, position), visit->ord++);
+}
+
+/**
+ * Iterates over the latest, non-deleted records.
+ * Calls the provided callback function for each valid record.
+ */
+error_t database__instance__get_latest_records(database_t *self, record_iter_fn on_record_found) {
+    if (!self || !on_record_found) return -1;
+    if (self->btree) {
+        latest_visit_t visit = {on_record_found, 0};
+        size_t section = database__instance__read_begin(self);
+        error_t result = btree_index_each(self, latest_visit, &visit);
+        database__instance__read_end(self, section);
+        return result;
+    }
+    if (id_index_ensure(self) != 0) return -1;
+
+    // The id index only holds live records, each pointing at its latest version
+    size_t section = database__instance__read_begin(self);
+    size_t *positions = NULL;
+    size_t length = 0;
+    error_t result = id_index_snapshot(self, &positions, &length);
+    for (size_t i = 0; result == 0 && i < length; i++) {
+        result = on_record_found(record_at(self, positions[i] - 1), (int)i); // Stop on callback error
+    }
+    free(positions);
+    database__instance__read_end(self, section);
+    return result;
+}
+
+/**
+ * Opens a read section over built sampling arrays and takes the sample lock.
+ * a generation switch may drop the arrays between the build and the section, they are built again
+ */
+static int database__instance__sample_begin(database_t *self, size_t *section) {
+    for (;;) {
+        if (sample_ensure(self) != 0) return -1;
+        *section = database__instance__read_begin(self);
+        pthread_mutex_lock(&self->sample_lock);
+        if (self->sample_built) return 0;
+        pthread_mutex_unlock(&self->sample_lock);
+        database__instance__read_end(self, *section);
+    }
+}
+
+static void database__instance__sample_end(database_t *self, size_t section) {
+    pthread_mutex_unlock(&self->sample_lock);
+    database__instance__read_end(self, section);
+}
+
+// Pick a live record uniformly at random
+record_t* database__instance__get_random_live_record(database_t *self) {
+    if (!self) return NULL;
+    size_t section;
+    if (database__instance__sample_begin(self, &section) != 0) return NULL;
+    record_t *record = self->sample_length ? record_at(self, self->sample_positions[sample_next(self, self->sample_length)]) : NULL;
+    database__instance__sample_end(self, section);
+    return record;
+}
+
+// Pick k distinct live records uniformly at random
+error_t database__instance__sample_k(database_t *self, size_t k, record_t *out_records, size_t *out_length) {
+    if (!self || (k > 0 && !out_records) || !out_length) return -1;
+    size_t section;
+    if (database__instance__sample_begin(self, &section) != 0) return -1;
+
+    // a partial Fisher-Yates shuffle of the dense array, the table follows the slots it swaps
+    size_t length = k < self->sample_length ? k : self->sample_length;
+    for (size_t i = 0; i < length; i++) {
+        size_t j = i + sample_next(self, self->sample_length - i);
+        if (j != i) {
+            size_t picked = self->sample_positions[j];
+            size_t swapped = self->sample_positions[i];
+            self->sample_table[sample_find(self, record_at(self, picked)->id)] = i + 1;
+            self->sample_table[sample_find(self, record_at(self, swapped)->id)] = j + 1;
+            self->sample_positions[i] = picked;
+            self->sample_positions[j] = swapped;
+        }
+        out_records[i] = *record_at(self, self->sample_positions[i]);
+    }
+    *out_length = length;
+    database__instance__sample_end(self, section);
+    return 0;
+}
+
+// records whose content a cursor announces to the kernel ahead of the one it returns
+#define CURSOR_PREFETCH_RECORDS 64
+
+static int position__static__compare(const void *a, const void *b) {
+    size_t left = *(const size_t*)a;
+    size_t right = *(const size_t*)b;
+    return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+// Opens a cursor over the items [next, end) of its kind
+static database_cursor_t* database__instance__cursor_new(database_t *self, database_cursor_kind_t kind, size_t from, size_t to) {
+    if (!self) return NULL;
+    // the entries counted before the flush have their content in the file
+    size_t length = log_length(self);
+    if (self->options.write_buffer_size && database__instance__flush(self) != 0) return NULL;
+    if (kind == DATABASE_CURSOR_LATEST && !self->btree && id_index_ensure(self) != 0) return NULL;
+
+    database_cursor_t *cursor = (database_cursor_t*)calloc(1, sizeof(database_cursor_t));
+    if (!cursor) return NULL;
+    cursor->database = self;
+    cursor->kind = kind;
+    size_t section = database__instance__read_begin(self);
+    cursor->generation = self->generation;
+    error_t result = 0;
+    if (kind != DATABASE_CURSOR_LATEST) {
+        cursor->end = to < length ? to : length;
+        cursor->next = from < cursor->end ? from : cursor->end;
+    } else if (self->btree) {
+        // filled a chunk of the tree at a time
+        cursor->positions = (size_t*)malloc(BTREE_SCAN_CHUNK * sizeof(size_t));
+        if (!cursor->positions) result = -1;
+    } else {
+        result = id_index_snapshot(self, &cursor->positions, &cursor->end);
+        for (size_t i = 0; result == 0 && i < cursor->end; i++) cursor->positions[i]--;
+        // in log order, which mostly follows the data file
+        if (result == 0) qsort(cursor->positions, cursor->end, sizeof(size_t), position__static__compare);
+    }
+    database__instance__read_end(self, section);
+    if (result != 0) {
+        database_cursor__instance__close(cursor);
+        return NULL;
+    }
+    cursor->prefetched = cursor->next;
+    return cursor;
+}
+
+// Open a cursor
+database_cursor_t* database__instance__cursor_open(database_t *self, database_cursor_kind_t kind) {
+    if (kind == DATABASE_CURSOR_RANGE) return NULL;
+    return database__instance__cursor_new(self, kind, 0, SIZE_MAX);
+}
+
+// Open a cursor over a range of the log
+database_cursor_t* database__instance__cursor_open_range(database_t *self, size_t from, size_t to) {
+    return database__instance__cursor_new(self, DATABASE_CURSOR_RANGE, from, to);
+}
+
+// Log position of an item of the cursor
+static inline size_t database_cursor__instance__position(const database_cursor_t *self, size_t item) {
+    return self->kind == DATABASE_CURSOR_LATEST ? self->positions[item] : item;
+}
+
+// Copies the next chunk of the tree once the previous one was returned, the read section is held by the caller
+static int database_cursor__instance__refill(database_cursor_t *self) {
+    database_t *db = self->database;
+    btree_entry_t entries[BTREE_SCAN_CHUNK];
+    size_t length;
+    pthread_mutex_lock(&db->btree_lock);
+    int result = btree__instance__scan(db->btree, self->end > 0 ? self->after : NULL, entries, BTREE_SCAN_CHUNK, &length);
+    pthread_mutex_unlock(&db->btree_lock);
+    if (result != 0) return -1;
+    for (size_t i = 0; i < length; i++) self->positions[i] = entries[i].value;
+    if (length > 0) memcpy(self->after, entries[length - 1].key, BTREE_KEY_LENGTH);
+    self->tree_done = length < BTREE_SCAN_CHUNK;
+    self->next = 0;
+    self->end = length;
+    self->prefetched = 0;
+    return 0;
+}
+
+/**
+ * Asks the kernel to read the content of the coming records, once half of the previous window was consumed.
+ * the records that follow each other in a data file are announced as one extent
+ */
+static void database_cursor__instance__prefetch(database_cursor_t *self) {
+#ifdef __linux__
+    if (self->prefetched > self->next + CURSOR_PREFETCH_RECORDS / 2) return;
+    database_t *db = self->database;
+    size_t from = self->prefetched > self->next ? self->prefetched : self->next;
+    size_t to = self->next + CURSOR_PREFETCH_RECORDS < self->end ? self->next + CURSOR_PREFETCH_RECORDS : self->end;
+    int extent_fd = -1;
+    size_t extent_start = 0, extent_end = 0;
+    for (size_t i = from; i <= to; i++) {
+        int fd = -1;
+        size_t offset = 0, stored_length = 0;
+        if (i < to) {
+            const record_t *record = record_at(db, database_cursor__instance__position(self, i));
+            if (record__instance__is_deleted(record)) continue;
+            fd = database__instance__data_file_at(db, record->start, &offset);
+            stored_length = record->end - record->start;
+            if (fd == extent_fd && offset == extent_end) {
+                extent_end += stored_length;
+                continue;
+            }
+        }
+        if (extent_fd != -1) posix_fadvise(extent_fd, extent_start, extent_end - extent_start, POSIX_FADV_WILLNEED);
+        extent_fd = fd;
+        extent_start = offset;
+        extent_end = offset + stored_length;
+    }
+    self->prefetched = to;
+#endif
+}
+
+// Next record of a cursor
+int database_cursor__instance__next(database_cursor_t *self, record_t *record, char **buffer, size_t *capacity) {
+    if (!self || !record || !buffer || !capacity) return -1;
+    database_t *db = self->database;
+
+    size_t section = database__instance__read_begin(db);
+    int result = 1;
+    if (db->generation != self->generation) result = -1;
+    if (result == 1 && self->kind == DATABASE_CURSOR_LATEST && db->btree && self->next == self->end && !self->tree_done) {
+        if (database_cursor__instance__refill(self) != 0) result = -1;
+    }
+    if (result == 1 && self->next == self->end) result = 0;
+    if (result == 1) {
+        database_cursor__instance__prefetch(self);
+        const record_t *entry = record_at(db, database_cursor__instance__position(self, self->next));
+        *record = *entry;
+        if (scan_buffer_reserve(buffer, capacity, record->length + 1) != 0) {
+            result = -1;
+        } else if (record__instance__is_deleted(record)) {
+            // nothing stored
+        } else if (record->codec == RECORD_CODEC_NONE) {
+            if (database__instance__read_stored(db, record, *buffer) != 0) result = -1;
+        } else {
+            if (scan_buffer_reserve(&self->stored, &self->stored_capacity, record->end - record->start) != 0) result = -1;
+            if (result == 1 && database__instance__read_stored(db, record, self->stored) != 0) result = -1;
+            if (result == 1 && record_decode(record, self->stored, *buffer) != 0) result = -1;
+        }
+        if (result == 1) {
+            (*buffer)[record->length] = '\0';
+            self->next++;
+        }
+    }
+    database__instance__read_end(db, section);
+    return result;
+}
+
+// Close a cursor
+void database_cursor__instance__close(database_cursor_t *self) {
+    if (!self) return;
+    free(self->positions);
+    free(self->stored);
+    free(self);
+}
+
+// stored bytes a batch read fetches before delivering them, unless a single record is larger
+#define BATCH_READ_WINDOW_BYTES (4 << 20)
+// holes between neighbouring records up to this size are read through rather than splitting the read
+#define BATCH_READ_GAP (64 << 10)
+#define BATCH_READ_WINDOW_RECORDS 1024
+
+/**
+ * a record of a batch read and where its stored bytes land in the window buffer.
+ * position is its log position in a latest records scan, the index of its id in a multi get
+ */
+typedef struct batch_item_s {
+    record_t *record;
+    size_t position;
+    size_t slot;
+} batch_item_t;
+
+typedef struct batch_items_s {
+    batch_item_t *items;
+    size_t length;
+    size_t capacity;
+} batch_items_t;
+
+/**
+ * receives the decoded content of each item of a batch read in the order of the items
+ */
+typedef int (*batch_read_fn)(batch_item_t *item, size_t ord, const char *content, void *ctx);
+
+static int batch_item__static__compare_start(const void *a, const void *b) {
+    const batch_item_t *left = *(const batch_item_t* const*)a;
+    const batch_item_t *right = *(const batch_item_t* const*)b;
+    if (left->record->start != right->record->start) return left->record->start < right->record->start ? -1 : 1;
+    return left->position < right->position ? -1 : (left->position > right->position ? 1 : 0);
+}
+
+static int batch_item__static__compare_data(const void *a, const void *b) {
+    const batch_item_t *left = (const batch_item_t*)a;
+    const batch_item_t *right = (const batch_item_t*)b;
+    if (left->record->start != right->record->start) return left->record->start < right->record->start ? -1 : 1;
+    return left->position < right->position ? -1 : (left->position > right->position ? 1 : 0);
+}
+
+static int batch_item__static__compare_log(const void *a, const void *b) {
+    size_t left = ((const batch_item_t*)a)->position;
+    size_t right = ((const batch_item_t*)b)->position;
+    return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+static int batch_item__static__compare_id(const void *a, const void *b) {
+    return memcmp(((const batch_item_t*)a)->record->id, ((const batch_item_t*)b)->record->id, 32);
+}
+
+static int batch_items_add(batch_items_t *items, record_t *record, size_t position) {
+    if (items->length == items->capacity) {
+        size_t capacity = items->capacity ? 2 * items->capacity : 1024;
+        batch_item_t *grown = (batch_item_t*)realloc(items->items, capacity * sizeof(batch_item_t));
+        if (!grown) return -1;
+        items->items = grown;
+        items->capacity = capacity;
+    }
+    batch_item_t *item = &items->items[items->length++];
+    item->record = record;
+    item->position = position;
+    return 0;
+}
+
+// Adds a live position to the items, the tree may grow while it is walked so the array does too
+static int batch_items_add_position(database_t *self, size_t position, void *ctx) {
+    return batch_items_add((batch_items_t*)ctx, record_at(self, position), position);
+}
+
+// The live set of the log, the read section is held by the caller
+static int database__instance__latest_items(database_t *self, batch_items_t *items) {
+    if (self->btree) return btree_index_each(self, batch_items_add_position, items);
+    size_t *positions = NULL;
+    size_t length = 0;
+    if (id_index_snapshot(self, &positions, &length) != 0) return -1;
+    int result = 0;
+    for (size_t i = 0; result == 0 && i < length; i++) result = batch_items_add_position(self, positions[i] - 1, items);
+    free(positions);
+    return result;
+}
+
+/**
+ * Reads the stored bytes of the window items, sorted by start, back to back into the window buffer.
+ * neighbouring records of a file are read with one preadv, the holes between them landing in gap
+ */
+static int database__instance__read_window(database_t *self, batch_item_t **sorted, size_t length, char *window, char *gap, struct iovec *iov) {
+    size_t used = 0;
+    size_t i = 0;
+    while (i < length) {
+        size_t run_offset;
+        int fd = database__instance__data_file_at(self, sorted[i]->record->start, &run_offset);
+        if (fd == -1) return -1;
+        size_t run_end = run_offset;
+        size_t count = 0;
+        for (; i < length; i++) {
+            const record_t *record = sorted[i]->record;
+            size_t offset;
+            if (database__instance__data_file_at(self, record->start, &offset) != fd) break;
+            if (offset < run_end || offset - run_end > BATCH_READ_GAP || count + 2 > IOV_MAX) break;
+            if (offset > run_end) {
+                iov[count].iov_base = gap;
+                iov[count].iov_len = offset - run_end;
+                count++;
+            }
+            size_t stored_length = record->end - record->start;
+            sorted[i]->slot = used;
+            iov[count].iov_base = window + used;
+            iov[count].iov_len = stored_length;
+            count++;
+            used += stored_length;
+            run_end = offset + stored_length;
+        }
+        if (read_scattered(fd, iov, count, run_offset) != 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads and decodes the content of the items, a window of them at a time, and hands it to deliver in the order of the items.
+ * the read section is held by the caller, the content is only valid during the call to deliver
+ */
+static int database__instance__batch_read(database_t *self, batch_item_t *items, size_t length, batch_read_fn deliver, void *ctx) {
+    batch_item_t **sorted = (batch_item_t**)malloc(BATCH_READ_WINDOW_RECORDS * sizeof(batch_item_t*));
+    struct iovec *iov = (struct iovec*)malloc(2 * BATCH_READ_WINDOW_RECORDS * sizeof(struct iovec));
+    char *gap = (char*)malloc(BATCH_READ_GAP);
+    scan_buffer_t buffer = {0};
+    int result = sorted && iov && gap ? 0 : -1;
+
+    size_t first = 0;
+    while (result == 0 && first < length) {
+        // a window of the delivery order, read in data order
+        size_t last = first, stored_total = 0;
+        while (last < length && last - first < BATCH_READ_WINDOW_RECORDS) {
+            size_t stored_length = items[last].record->end - items[last].record->start;
+            if (last > first && stored_total + stored_length > BATCH_READ_WINDOW_BYTES) break;
+            sorted[last - first] = &items[last];
+            stored_total += stored_length;
+            last++;
+        }
+        qsort(sorted, last - first, sizeof(batch_item_t*), batch_item__static__compare_start);
+        if (scan_buffer_reserve(&buffer.stored, &buffer.stored_capacity, stored_total ? stored_total : 1) != 0) result = -1;
+        if (result == 0) result = database__instance__read_window(self, sorted, last - first, buffer.stored, gap, iov);
+
+        for (size_t i = first; result == 0 && i < last; i++) {
+            const record_t *record = items[i].record;
+            const char *content = buffer.stored + items[i].slot;
+            if (record->codec != RECORD_CODEC_NONE) {
+                if (scan_buffer_reserve(&buffer.content, &buffer.content_capacity, record->length) != 0) result = -1;
+                if (result == 0) result = record_decode(record, content, buffer.content);
+                content = buffer.content;
+            }
+            if (result == 0) result = deliver(&items[i], i, content, ctx);
+        }
+        first = last;
+    }
+
+    scan_buffer_free(&buffer);
+    free(gap);
+    free(iov);
+    free(sorted);
+    return result;
+}
+
+static int latest_scan_deliver(batch_item_t *item, size_t ord, const char *content, void *ctx) {
+    record_found_with_span_fn on_record_found = *(record_found_with_span_fn*)ctx;
+    return on_record_found(item->record, (int)ord, content, item->record->length);
+}
+
+// Iterate over the latest records with their content in data order
+error_t database__instance__get_latest_records_with_content(database_t *self, database_scan_order_t order, record_found_with_span_fn on_record_found) {
+    if (!self || !on_record_found) return -1;
+    if (self->options.write_buffer_size && database__instance__flush(self) != 0) return -1;
+    if (!self->btree && id_index_ensure(self) != 0) return -1;
+
+    size_t section = database__instance__read_begin(self);
+    batch_items_t items = {NULL, 0, 0};
+    error_t result = database__instance__latest_items(self, &items);
+    if (result == 0) {
+        int (*compare)(const void*, const void*) = batch_item__static__compare_data;
+        if (order == DATABASE_SCAN_LOG_ORDER) compare = batch_item__static__compare_log;
+        if (order == DATABASE_SCAN_ID_ORDER) compare = batch_item__static__compare_id;
+        qsort(items.items, items.length, sizeof(batch_item_t), compare);
+        result = database__instance__batch_read(self, items.items, items.length, latest_scan_deliver, &on_record_found);
+    }
+    free(items.items);
+    database__instance__read_end(self, section);
+    return result;
+}
+
+/**
+ * the caller's outputs of a multi get
+ */
+typedef struct multi_get_s {
+    char **out_buffers;
+    size_t *out_lengths;
+} multi_get_t;
+
+static int multi_get_deliver(batch_item_t *item, size_t ord, const char *content, void *ctx) {
+    (void)ord;
+    multi_get_t *get = (multi_get_t*)ctx;
+    size_t length = item->record->length;
+    char *copy = (char*)malloc(length + 1);
+    if (!copy) return -1;
+    memcpy(copy, content, length);
+    copy[length] = '\0';
+    get->out_buffers[item->position] = copy;
+    get->out_lengths[item->position] = length;
+    return 0;
+}
+
+// Fetch the content of many records by id, the extents sorted by address and merged into few reads
+error_t database__instance__multi_get(database_t *self, const char *const *ids, size_t n, char **out_buffers, size_t *out_lengths) {
+    if (!self || (n > 0 && (!ids || !out_buffers || !out_lengths))) return -1;
+    for (size_t i = 0; i < n; i++) {
+        out_buffers[i] = NULL;
+        out_lengths[i] = 0;
+    }
+    if (n == 0) return 0;
+    if (self->options.write_buffer_size && database__instance__flush(self) != 0) return -1;
+
+    // the records found stay valid for the whole section
+    size_t section;
+    if (database__instance__lookup_begin(self, &section) != 0) return -1;
+    batch_items_t items = {NULL, 0, 0};
+    error_t result = 0;
+    for (size_t i = 0; result == 0 && i < n; i++) {
+        record_t *record = database__instance__lookup(self, ids[i]);
+        if (record) result = batch_items_add(&items, record, i);
+    }
+    if (result == 0) {
+        qsort(items.items, items.length, sizeof(batch_item_t), batch_item__static__compare_data);
+        multi_get_t get = {out_buffers, out_lengths};
+        result = database__instance__batch_read(self, items.items, items.length, multi_get_deliver, &get);
+    }
+    free(items.items);
+    database__instance__read_end(self, section);
+
+    if (result != 0) {
+        for (size_t i = 0; i < n; i++) {
+            free(out_buffers[i]);
+            out_buffers[i] = NULL;
+            out_lengths[i] = 0;
+        }
+    }
+    return result;
+}
+
+// Orders records by their position in the data file
+static int record__static__compare_start(const void *a, const void *b) {
+    const record_t *left = (const record_t*)a;
+    const record_t *right = (const record_t*)b;
+    if (left->start != right->start) return left->start < right->start ? -1 : 1;
+    return 0;
+}
+
+/**
+ * the live records copied out of the persistent id index
+ */
+typedef struct live_collect_s {
+    record_t *records;
+    size_t capacity;
+    size_t length;
+} live_collect_t;
+
+static int live_collect(database_t *self, size_t position, void *ctx) {
+    live_collect_t *collect = (live_collect_t*)ctx;
+    if (collect->length == collect->capacity) return -1;
+    collect->records[collect->length++] = *record_at(self, position);
+    return 0;
+}
+
+// Copies a copy of the latest version of every live record into a new array
+static error_t database__instance__collect_live_records(database_t *self, record_t **out_records, size_t *out_length) {
+    if (self->btree) {
+        live_collect_t collect = {(record_t*)malloc((self->btree->length ? self->btree->length : 1) * sizeof(record_t)), self->btree->length, 0};
+        if (!collect.records) return -1;
+        if (btree_index_each(self, live_collect, &collect) != 0) {
+            free(collect.records);
+            return -1;
+        }
+        *out_records = collect.records;
+        *out_length = collect.length;
+        return 0;
+    }
+    if (id_index_ensure_locked(self) != 0) return -1;
+
+    record_t *records = (record_t*)malloc((self->id_index_length ? self->id_index_length : 1) * sizeof(record_t));
+    if (!records) return -1;
+
+    size_t length = 0;
+    for (size_t slot = 0; slot < self->id_index_capacity; slot++) {
+        if (self->id_index[slot] == ID_INDEX_EMPTY) continue;
+        records[length++] = *record_at(self, self->id_index[slot] - 1);
+    }
+    *out_records = records;
+    *out_length = length;
+    return 0;
+}
+
+// Copies length bytes between the files without passing them through user space when the kernel allows it
+static int copy_extent(int from_fd, size_t from_offset, int to_fd, size_t to_offset, size_t length) {
+#ifdef __linux__
+    loff_t in = from_offset;
+    loff_t out = to_offset;
+    while (length > 0) {
+        ssize_t copied = copy_file_range(from_fd, &in, to_fd, &out, length, 0);
+        if (copied <= 0) break;
+        length -= copied;
+    }
+    if (length == 0) return 0;
+
+    // cross filesystem or unsupported, sendfile still keeps the copy in the kernel
+    off_t offset = in;
+    if (lseek(to_fd, out, SEEK_SET) == (off_t)-1) return -1;
+    while (length > 0) {
+        ssize_t copied = sendfile(to_fd, from_fd, &offset, length);
+        if (copied <= 0) break;
+        length -= copied;
+    }
+    if (length == 0) return 0;
+    from_offset = offset;
+    to_offset = lseek(to_fd, 0, SEEK_CUR);
+#endif
+
+    // portable fallback through a bounce buffer
+    char *buffer = (char*)malloc(COPY_BUFFER_SIZE);
+    if (!buffer) return -1;
+    while (length > 0) {
+        size_t chunk = length < COPY_BUFFER_SIZE ? length : COPY_BUFFER_SIZE;
+        ssize_t got = pread(from_fd, buffer, chunk, from_offset);
+        if (got <= 0 || write_fully(to_fd, buffer, got, to_offset) != 0) {
+            free(buffer);
+            return -1;
+        }
+        from_offset += got;
+        to_offset += got;
+        length -= got;
+    }
+    free(buffer);
+    return 0;
+}
+
+/**
+ * Appends the contents of the records, sorted by start, to the end of to_fd and rewrites their offsets.
+ * Adjacent or overlapping records are merged into a single extent so every extent is copied with one call
+ */
+static error_t compact_records(int from_fd, int to_fd, record_t *records, size_t length) {
+    struct stat st;
+    if (fstat(to_fd, &st) != 0) return -1;
+    size_t out = st.st_size;
+
+    size_t i = 0;
+    while (i < length) {
+        size_t extent_start = records[i].start;
+        size_t extent_end = records[i].end;
+        size_t j = i + 1;
+        while (j < length && records[j].start <= extent_end) {
+            if (records[j].end > extent_end) extent_end = records[j].end;
+            j++;
+        }
+
+        if (copy_extent(from_fd, extent_start, to_fd, out, extent_end - extent_start) != 0) return -1;
+        for (size_t k = i; k < j; k++) {
+            size_t content_size = records[k].end - records[k].start;
+            records[k].start = out + (records[k].start - extent_start);
+            records[k].end = records[k].start + content_size;
+        }
+
+        out += extent_end - extent_start;
+        i = j;
+    }
+    return 0;
+}
+
+// Paths of the live and the next generation files
+static void database__instance__generation_paths(const database_t *self, char *data_path, char *index_path, char *temp_data_path, char *temp_index_path) {
+    snprintf(data_path, 256, "%s.data", self->path);
+    snprintf(index_path, 256, "%s.index", self->path);
+    snprintf(temp_data_path, 256, "%s.data.temp", self->path);
+    snprintf(temp_index_path, 256, "%s.index.temp", self->path);
+}
+
+/**
+ * Renames the next generation files over the live ones and switches the database to their descriptors,
+ *   then reloads the index so the in-memory log matches the new offsets.
+ * the generation lock is held exclusively and the write lock is held by the caller
+ */
+static error_t database__instance__switch_generation_locked(database_t *self, int temp_data_fd, int temp_index_fd) {
+    char data_path[256], index_path[256], temp_data_path[256], temp_index_path[256];
+    database__instance__generation_paths(self, data_path, index_path, temp_data_path, temp_index_path);
+
+    if (self->options.durability != DATABASE_DURABILITY_NONE) {
+        if (sync_file(temp_data_fd) != 0 || sync_file(temp_index_fd) != 0) return -1;
+    }
+
+    // the positions change with the new log
+    if (btree_index_invalidate(self) != 0 || id_bloom_invalidate(self) != 0 || checkpoint_invalidate(self) != 0) return -1;
+    data_map_release(self);
+#ifdef __MINGW32__
+    // windows can't replace a file that is still open
+    close(self->data_file_reference);
+    close(self->index_file_reference);
+#endif
+
+    if (rename_file(temp_data_path, data_path) == -1) {
+        perror("Failed to rename temp_data_path to old_data_path");
+        return -1;
+    }
+    if (rename_file(temp_index_path, index_path) == -1) {
+        perror("Failed to rename temp_index_path to old_index_path");
+        return -1;
+    }
+
+#ifndef __MINGW32__
+    close(self->data_file_reference);
+    close(self->index_file_reference);
+#endif
+    self->data_file_reference = temp_data_fd;
+    self->index_file_reference = temp_index_fd;
+
+    self->generation++;
+    // the new generation was written from the verified log, it is only durable when it was synced
+    if (database__instance__load_index(self, 0) != 0) return -1;
+    if (self->options.durability == DATABASE_DURABILITY_NONE) return 0;
+    return database__instance__mark_verified_locked(self);
+}
+
+// Opens empty next generation files
+static int database__instance__open_generation(const database_t *self, int *temp_data_fd, int *temp_index_fd) {
+    char data_path[256], index_path[256], temp_data_path[256], temp_index_path[256];
+    database__instance__generation_paths(self, data_path, index_path, temp_data_path, temp_index_path);
+
+    *temp_data_fd = open(temp_data_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    *temp_index_fd = open(temp_index_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (*temp_data_fd == -1 || *temp_index_fd == -1) {
+        if (*temp_data_fd != -1) close(*temp_data_fd);
+        if (*temp_index_fd != -1) close(*temp_index_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Optimize the database, the generation lock is held exclusively and the write lock is held by the caller
+static error_t database__instance__optimize_locked(database_t *self) {
+    if (self->compaction_running) return -1;
+    if (database__instance__flush_locked(self) != 0) return -1;
+
+    int temp_data_fd, temp_index_fd;
+    if (database__instance__open_generation(self, &temp_data_fd, &temp_index_fd) != 0) return -1;
+
+    // Collect the live records and copy them in data file order, coalesced into extents
+    record_t *live = NULL;
+    size_t live_length = 0;
+    error_t result = database__instance__collect_live_records(self, &live, &live_length);
+    if (result == 0) {
+        qsort(live, live_length, sizeof(record_t), record__static__compare_start);
+        result = compact_records(self->data_file_reference, temp_data_fd, live, live_length);
+    }
+    if (result == 0) result = index_file_write(temp_index_fd, self->index_version, live, live_length);
+    free(live);
+    if (result == 0) result = database__instance__switch_generation_locked(self, temp_data_fd, temp_index_fd);
+    if (result != 0) {
+        close(temp_data_fd);
+        close(temp_index_fd);
+    }
+    return result;
+}
+
+/**
+ * the live records of one segment being compacted into a new segment
+ */
+typedef struct segment_compaction_s {
+    size_t segment;
+    size_t target;
+    int from_fd;
+    int to_fd;
+    /**
+     * the records sorted by start, rewritten to offsets inside the target by the copy
+     */
+    record_t *records;
+    /**
+     * the addresses the records had before the copy, in the same order
+     */
+    size_t *old_starts;
+    size_t length;
+    pthread_t thread;
+    int started;
+    error_t result;
+} segment_compaction_s;
+
+typedef segment_compaction_s segment_compaction_t;
+
+/**
+ * a sealed segment and how many of its bytes are garbage
+ */
+typedef struct segment_garbage_s {
+    size_t segment;
+    size_t dead_bytes;
+} segment_garbage_s;
+
+typedef segment_garbage_s segment_garbage_t;
+
+// Orders segments by decreasing garbage
+static int segment_garbage_compare(const void *a, const void *b) {
+    const segment_garbage_t *left = (const segment_garbage_t*)a;
+    const segment_garbage_t *right = (const segment_garbage_t*)b;
+    if (left->dead_bytes != right->dead_bytes) return left->dead_bytes > right->dead_bytes ? -1 : 1;
+    return 0;
+}
+
+// Copies the live records of one segment, runs on its own thread
+static void* segment_compaction_worker(void *arg) {
+    segment_compaction_t *job = (segment_compaction_t*)arg;
+    job->result = compact_records(job->from_fd, job->to_fd, job->records, job->length);
+    return NULL;
+}
+
+// New address of a record moved by a segment compaction, 0 if it was not part of it
+static size_t segment_compaction_lookup(const segment_compaction_t *job, size_t start) {
+    size_t low = 0, high = job->length;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (job->old_starts[middle] < start) low = middle + 1;
+        else high = middle;
+    }
+    if (low < job->length && job->old_starts[low] == start) return segment_address(job->target, job->records[low].start);
+    return 0;
+}
+
+static void segment_compactions_free(segment_compaction_t *jobs, size_t count, int unlink_targets, database_t *self) {
+    for (size_t j = 0; j < count; j++) {
+        if (jobs[j].to_fd != -1) {
+            char path[256];
+            segment_path(self, jobs[j].target, path);
+            close(jobs[j].to_fd);
+            if (unlink_targets) unlink(path);
+            else segment_open(self, jobs[j].target, 0);
+        }
+        free(jobs[j].records);
+        free(jobs[j].old_starts);
+    }
+    free(jobs);
+}
+
+/**
+ * Compacts the segments with the most garbage, each on its own thread.
+ * the copy runs without the write lock since only the active segment is ever appended to;
+ *   the index is then rewritten with the moved addresses and the old segments are removed
+ */
+static error_t database__instance__compact_segments(database_t *self) {
+    pthread_mutex_lock(&self->write_lock);
+
+    record_t *live = NULL;
+    size_t live_length = 0;
+    error_t result = database__instance__flush_locked(self);
+    if (result == 0) result = database__instance__collect_live_records(self, &live, &live_length);
+    if (result != 0) {
+        pthread_mutex_unlock(&self->write_lock);
+        return result;
+    }
+
+    // pick the sealed segments with the most dead bytes
+    segment_garbage_t *candidates = (segment_garbage_t*)malloc(self->segments_length * sizeof(segment_garbage_t));
+    size_t candidates_length = 0;
+    for (size_t i = 1; candidates && i < self->segments_length; i++) {
+        if (i == self->active_segment || segment_open(self, i, 0) == -1) continue;
+        if (self->segments[i].length <= self->segments[i].live_bytes) continue;
+        candidates[candidates_length].segment = i;
+        candidates[candidates_length].dead_bytes = self->segments[i].length - self->segments[i].live_bytes;
+        candidates_length++;
+    }
+    if (candidates) qsort(candidates, candidates_length, sizeof(segment_garbage_t), segment_garbage_compare);
+    size_t limit = self->options.compaction_segments ? self->options.compaction_segments : SEGMENT_COMPACTION_DEFAULT;
+    size_t count = candidates_length < limit ? candidates_length : limit;
+
+    segment_compaction_t *jobs = (segment_compaction_t*)calloc(count ? count : 1, sizeof(segment_compaction_t));
+    if (!candidates || !jobs) result = -1;
+    size_t first_target = self->segments_length;
+    for (size_t j = 0; result == 0 && j < count; j++) {
+        segment_compaction_t *job = &jobs[j];
+        job->segment = candidates[j].segment;
+        job->target = first_target + j;
+        job->from_fd = self->segments[job->segment].file_reference;
+        job->to_fd = -1;
+
+        for (size_t i = 0; i < live_length; i++) {
+            if (address_segment(self, live[i].start) == job->segment) job->length++;
+        }
+        job->records = (record_t*)malloc((job->length ? job->length : 1) * sizeof(record_t));
+        job->old_starts = (size_t*)malloc((job->length ? job->length : 1) * sizeof(size_t));
+        if (!job->records || !job->old_starts) {
+            result = -1;
+            break;
+        }
+        size_t k = 0;
+        for (size_t i = 0; i < live_length; i++) {
+            if (address_segment(self, live[i].start) != job->segment) continue;
+            job->records[k] = live[i];
+            job->records[k].start = address_offset(self, live[i].start);
+            job->records[k].end = job->records[k].start + (live[i].end - live[i].start);
+            k++;
+        }
+        qsort(job->records, job->length, sizeof(record_t), record__static__compare_start);
+        for (k = 0; k < job->length; k++) job->old_starts[k] = segment_address(job->segment, job->records[k].start);
+
+        // a segment with nothing left alive is simply dropped
+        if (job->length > 0) {
+            char path[256];
+            segment_path(self, job->target, path);
+            job->to_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+            if (job->to_fd == -1) result = -1;
+        }
+    }
+    // reserve the target ids so that a roll can't reuse them meanwhile
+    if (result == 0 && count > 0) result = segments_reserve(self, first_target + count - 1);
+    free(candidates);
+    free(live);
+    pthread_mutex_unlock(&self->write_lock);
+
+    if (result != 0 || count == 0) {
+        segment_compactions_free(jobs, count, 1, self);
+        return result;
+    }
+
+    // copy the segments in parallel
+    for (size_t j = 0; j < count; j++) {
+        if (jobs[j].length == 0) continue;
+        if (pthread_create(&jobs[j].thread, NULL, segment_compaction_worker, &jobs[j]) != 0) jobs[j].result = -1;
+        else jobs[j].started = 1;
+    }
+    for (size_t j = 0; j < count; j++) {
+        if (jobs[j].started) pthread_join(jobs[j].thread, NULL);
+        if (jobs[j].result != 0) result = -1;
+    }
+
+    if (result == 0 && self->options.durability != DATABASE_DURABILITY_NONE) {
+        for (size_t j = 0; j < count; j++) {
+            if (jobs[j].to_fd != -1 && sync_file(jobs[j].to_fd) != 0) result = -1;
+        }
+    }
+
+    // the segments are swapped and the index reloaded, the readers are waited for first
+    pthread_rwlock_wrlock(&self->generation_lock);
+    pthread_mutex_lock(&self->write_lock);
+    if (result == 0) result = database__instance__flush_locked(self);
+
+    // rewrite the index with the current live set, moving what the copy relocated
+    live = NULL;
+    live_length = 0;
+    if (result == 0) result = database__instance__collect_live_records(self, &live, &live_length);
+    for (size_t i = 0; result == 0 && i < live_length; i++) {
+        size_t segment = address_segment(self, live[i].start);
+        for (size_t j = 0; j < count; j++) {
+            if (jobs[j].segment != segment) continue;
+            size_t moved = segment_compaction_lookup(&jobs[j], live[i].start);
+            if (moved == 0) {
+                result = -1;
+                break;
+            }
+            live[i].end = moved + (live[i].end - live[i].start);
+            live[i].start = moved;
+        }
+    }
+
+    char data_path[256], index_path[256], temp_data_path[256], temp_index_path[256];
+    database__instance__generation_paths(self, data_path, index_path, temp_data_path, temp_index_path);
+    int temp_index_fd = -1;
+    if (result == 0) {
+        temp_index_fd = open(temp_index_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (temp_index_fd == -1) result = -1;
+    }
+    if (result == 0) result = index_file_write(temp_index_fd, self->index_version, live, live_length);
+    if (result == 0 && self->options.durability != DATABASE_DURABILITY_NONE) result = sync_file(temp_index_fd);
+    free(live);
+    if (result == 0) result = btree_index_invalidate(self);
+    if (result == 0) result = id_bloom_invalidate(self);
+    if (result == 0) result = checkpoint_invalidate(self);
+#ifdef __MINGW32__
+    if (result == 0) close(self->index_file_reference);
+#endif
+    if (result == 0 && rename_file(temp_index_path, index_path) == -1) {
         perror("Failed to rename temp_index_path to old_index_path");
+        result = -1;
+    }
+    if (result != 0) {
+        if (temp_index_fd != -1) close(temp_index_fd);
+        segment_compactions_free(jobs, count, 1, self);
+        pthread_mutex_unlock(&self->write_lock);
+        pthread_rwlock_unlock(&self->generation_lock);
+        return result;
+    }
+
+#ifndef __MINGW32__
+    close(self->index_file_reference);
+#endif
+    self->index_file_reference = temp_index_fd;
+
+    // the compacted segments are no longer referenced
+    for (size_t j = 0; j < count; j++) {
+        segment_t *segment = &self->segments[jobs[j].segment];
+        char path[256];
+        segment_path(self, jobs[j].segment, path);
+        close(segment->file_reference);
+        unlink(path);
+        segment->file_reference = -1;
+        segment->length = 0;
+    }
+    segment_compactions_free(jobs, count, 0, self);
+
+    self->generation++;
+    result = database__instance__load_index(self, 0);
+    if (result == 0 && self->options.durability != DATABASE_DURABILITY_NONE) result = database__instance__mark_verified_locked(self);
+    pthread_mutex_unlock(&self->write_lock);
+    pthread_rwlock_unlock(&self->generation_lock);
+    return result;
+}
+
+// Optimize the database
+error_t database__instance__optimize(database_t *self) {
+    if (!self) return -1;
+
+    if (self->options.segment_size) {
+        // two compactions would pick the same sealed segments
+        pthread_mutex_lock(&self->write_lock);
+        int busy = self->compaction_running;
+        self->compaction_running = 1;
+        pthread_mutex_unlock(&self->write_lock);
+        if (busy) return -1;
+        error_t result = database__instance__compact_segments(self);
+        pthread_mutex_lock(&self->write_lock);
+        self->compaction_running = 0;
+        pthread_mutex_unlock(&self->write_lock);
+        return result;
+    }
+
+    pthread_rwlock_wrlock(&self->generation_lock);
+    pthread_mutex_lock(&self->write_lock);
+    error_t result = database__instance__optimize_locked(self);
+    pthread_mutex_unlock(&self->write_lock);
+    pthread_rwlock_unlock(&self->generation_lock);
+    return result;
+}
+
+/**
+ * Replays the log entries appended since the snapshot into the next generation.
+ * the payloads appended after the snapshot data end are copied as one extent and shifted,
+ *   entries pointing before it (shared extents) are copied one by one.
+ * the write lock is held by the caller
+ */
+static error_t database__instance__replay_tail_locked(database_t *self, size_t snapshot_length, size_t snapshot_data_length, int temp_data_fd, int temp_index_fd) {
+    size_t tail_length = self->record_list_length - snapshot_length;
+    if (tail_length == 0) return 0;
+
+    struct stat st;
+    if (fstat(temp_data_fd, &st) != 0) return -1;
+    size_t out = st.st_size;
+    size_t appended = self->data_file_length - snapshot_data_length;
+    if (appended > 0 && copy_extent(self->data_file_reference, snapshot_data_length, temp_data_fd, out, appended) != 0) return -1;
+    size_t shared_out = out + appended;
+
+    record_t *tail = (record_t*)malloc(tail_length * sizeof(record_t));
+    if (!tail) return -1;
+    for (size_t i = 0; i < tail_length; i++) {
+        record_t entry = *record_at(self, snapshot_length + i);
+        if (!record__instance__is_deleted(&entry)) {
+            size_t content_size = entry.end - entry.start;
+            if (entry.start >= snapshot_data_length) {
+                entry.start = out + (entry.start - snapshot_data_length);
+            } else {
+                if (copy_extent(self->data_file_reference, entry.start, temp_data_fd, shared_out, content_size) != 0) {
+                    free(tail);
+                    return -1;
+                }
+                entry.start = shared_out;
+                shared_out += content_size;
+            }
+            entry.end = entry.start + content_size;
+        }
+        tail[i] = entry;
+    }
+
+    size_t encoded_length;
+    const void *encoded = fstat(temp_index_fd, &st) == 0 ? index_entries_encode(self->index_version, tail, tail_length, &encoded_length) : NULL;
+    error_t result = encoded ? write_fully(temp_index_fd, encoded, encoded_length, st.st_size) : -1;
+    if (encoded) index_entries_free(encoded, tail, tail_length);
+    free(tail);
+    return result;
+}
+
+// Body of the background compaction thread
+static void* database__instance__compaction_worker(void *arg) {
+    database_t *self = (database_t*)arg;
+    int temp_data_fd = -1, temp_index_fd = -1;
+
+    // segments other than the active one are immutable, their compaction never blocks the inserts
+    if (self->options.segment_size) {
+        error_t result = database__instance__compact_segments(self);
+        pthread_mutex_lock(&self->write_lock);
+        self->compaction_result = result;
+        pthread_mutex_unlock(&self->write_lock);
+        return NULL;
+    }
+
+    // Snapshot the live set up to the current log position
+    pthread_mutex_lock(&self->write_lock);
+    record_t *live = NULL;
+    size_t live_length = 0;
+    size_t snapshot_length = self->record_list_length;
+    size_t snapshot_data_length = self->data_file_length;
+    error_t result = database__instance__flush_locked(self);
+    if (result == 0) result = database__instance__collect_live_records(self, &live, &live_length);
+    pthread_mutex_unlock(&self->write_lock);
+
+    // Copy the snapshot into the next generation while inserts keep appending to the current one
+    if (result == 0) result = database__instance__open_generation(self, &temp_data_fd, &temp_index_fd);
+    if (result == 0) {
+        qsort(live, live_length, sizeof(record_t), record__static__compare_start);
+        result = compact_records(self->data_file_reference, temp_data_fd, live, live_length);
+    }
+    if (result == 0) result = index_file_write(temp_index_fd, self->index_version, live, live_length);
+    free(live);
+
+    // Replay what was appended meanwhile and switch generations once the readers are out
+    pthread_rwlock_wrlock(&self->generation_lock);
+    pthread_mutex_lock(&self->write_lock);
+    if (result == 0) result = database__instance__flush_locked(self);
+    if (result == 0) result = database__instance__replay_tail_locked(self, snapshot_length, snapshot_data_length, temp_data_fd, temp_index_fd);
+    if (result == 0) result = database__instance__switch_generation_locked(self, temp_data_fd, temp_index_fd);
+    if (result != 0) {
+        if (temp_data_fd != -1) close(temp_data_fd);
+        if (temp_index_fd != -1) close(temp_index_fd);
+    }
+    self->compaction_result = result;
+    pthread_mutex_unlock(&self->write_lock);
+    pthread_rwlock_unlock(&self->generation_lock);
+    return NULL;
+}
+
+// Start an online compaction
+error_t database__instance__optimize_async(database_t *self) {
+    if (!self) return -1;
+
+    pthread_mutex_lock(&self->write_lock);
+    if (self->compaction_running) {
+        pthread_mutex_unlock(&self->write_lock);
+        return -1;
+    }
+    self->compaction_running = 1;
+    self->compaction_joinable = 1;
+    self->compaction_result = 0;
+    pthread_mutex_unlock(&self->write_lock);
+
+    if (pthread_create(&self->compaction_thread, NULL, database__instance__compaction_worker, self) != 0) {
+        pthread_mutex_lock(&self->write_lock);
+        self->compaction_running = 0;
+        self->compaction_joinable = 0;
+        pthread_mutex_unlock(&self->write_lock);
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the online compaction to finish
+error_t database__instance__optimize_wait(database_t *self) {
+    if (!self) return -1;
+    pthread_mutex_lock(&self->write_lock);
+    int joinable = self->compaction_joinable;
+    self->compaction_joinable = 0;
+    pthread_mutex_unlock(&self->write_lock);
+    if (!joinable) return 0;
+
+    pthread_join(self->compaction_thread, NULL);
+    pthread_mutex_lock(&self->write_lock);
+    self->compaction_running = 0;
+    error_t result = self->compaction_result;
+    pthread_mutex_unlock(&self->write_lock);
+    return result;
+}
+
+// Start a streamed record
+record_stream_t* database__instance__stream_begin(database_t *self) {
+    if (!self) return NULL;
+    record_stream_t *stream = (record_stream_t*)malloc(sizeof(record_stream_t));
+    if (!stream) return NULL;
+
+    // next to the database so that the commit copies inside one filesystem
+    char path[256];
+    snprintf(path, 256, "%s.stream.%zu", self->path, __atomic_fetch_add(&self->stream_counter, 1, __ATOMIC_RELAXED));
+#ifdef __MINGW32__
+    // windows deletes it once closed
+    stream->file_reference = open(path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY | O_TEMPORARY, 0666);
+#else
+    stream->file_reference = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (stream->file_reference != -1) unlink(path);
+#endif
+    if (stream->file_reference == -1) {
+        free(stream);
+        return NULL;
+    }
+    stream->database = self;
+    stream->length = 0;
+    hasher__instance__init(&stream->hasher);
+    return stream;
+}
+
+// Append a chunk to a streamed record
+error_t record_stream__instance__append(record_stream_t *self, const void *data, size_t data_length) {
+    if (!self || self->file_reference == -1 || (!data && data_length > 0)) return -1;
+    if (write_fully(self->file_reference, data, data_length, self->length) != 0) {
+        // a stream missing a chunk can only be aborted
+        close(self->file_reference);
+        self->file_reference = -1;
         return -1;
     }
+    hasher__instance__update(&self->hasher, data, data_length);
+    self->length += data_length;
+    return 0;
+}
+
+// Commit a streamed record
+record_t* record_stream__instance__commit(record_stream_t *self) {
+    if (!self) return NULL;
+    database_t *db = self->database;
+    if (self->file_reference == -1 || self->length == 0) {
+        record_stream__instance__abort(self);
+        return NULL;
+    }
+
+    record_t record;
+    hasher__instance__finalize(&self->hasher, (unsigned char*)record.id);
+    record.length = self->length;
+    record.codec = RECORD_CODEC_NONE;
+    record.reserved = 0;
+
+    pthread_mutex_lock(&db->write_lock);
+    const record_t *copy = db->options.deduplicate ? database__instance__find_copy_locked(db, &record, NULL, 0, record.length) : NULL;
+    error_t result = 0;
+    if (copy) {
+        record.start = copy->start;
+        record.end = copy->end;
+        record.codec = copy->codec;
+    } else {
+        size_t segment_size = db->options.segment_size;
+        if (segment_size && db->data_file_length > 0 && db->data_file_length + record.length > segment_size) {
+            result = database__instance__roll_segment_locked(db);
+        }
+        // a record fills at most a whole segment address range
+        if (result == 0 && segment_size && db->data_file_length + record.length > ((size_t)1 << DATABASE_SEGMENT_OFFSET_BITS)) result = -1;
+        // copied past the staged appends, straight to the file
+        if (result == 0) result = write_buffer_flush(db->data_file_reference, &db->data_buffer);
+        if (result == 0) {
+            size_t start = db->data_file_length;
+            file_reserve(db->data_file_reference, &db->data_file_allocated, start + record.length, db->options.preallocate_extent);
+            result = copy_extent(self->file_reference, 0, db->data_file_reference, start, record.length);
+            record.start = segment_address(db->active_segment, start);
+            record.end = record.start + record.length;
+        }
+        if (result == 0) {
+            db->data_file_length += record.length;
+            if (segment_size) db->segments[db->active_segment].length = db->data_file_length;
+        }
+    }
+    if (result == 0) result = database__instance__append_entries(db, &record, 1);
+    if (result == 0) result = database__instance__commit_locked(db, 1);
+    record_t *committed = result == 0 ? record_at(db, db->record_list_length - 1) : NULL;
+    pthread_mutex_unlock(&db->write_lock);
+    database__instance__reclaim(db);
+
+    record_stream__instance__abort(self);
+    return committed;
+}
+
+// Drop a streamed record
+void record_stream__instance__abort(record_stream_t *self) {
+    if (!self) return;
+    if (self->file_reference != -1) close(self->file_reference);
+    free(self);
+}
+
+// registered file slots of an asynchronous queue, segment k goes through slot k % DATABASE_ASYNC_FILES
+#define DATABASE_ASYNC_FILES 64
+// staging bytes of each request, larger transfers go through the heap or the caller's buffers
+#define DATABASE_ASYNC_SLOT_LENGTH (16 << 10)
+#define DATABASE_ASYNC_SEGMENT_NONE ((size_t)-1)
+
+struct database_async_request_s {
+    database_async_kind_t kind;
+    void *user_data;
+    error_t result;
+    record_t record;
+    /**
+     * the log entry a scan read is for, valid during the scan's read section
+     */
+    const record_t *entry;
+    /**
+     * the caller's content of an insert, inserted again if optimize replaced the file it was written to
+     */
+    const char *data;
+    size_t data_length;
+    /**
+     * the bytes in flight: the request's staging slot, a heap buffer when owned, the caller's content or the get's content
+     */
+    char *stored;
+    size_t stored_length;
+    int owned;
+    /**
+     * the bytes moved so far, a short transfer is resubmitted for the rest
+     */
+    size_t done;
+    /**
+     * the registered slot the bytes are moved through, bound to the file of file_segment in file_generation
+     */
+    unsigned file_slot;
+    size_t file_segment;
+    size_t file_generation;
+    size_t offset;
+    size_t generation;
+    char *content;
+};
+
+static char* async_slot(database_async_t *self, unsigned index) {
+    return self->arena + (size_t)index * DATABASE_ASYNC_SLOT_LENGTH;
+}
+
+// Requests taken and not finished yet, prepared or handed to the kernel
+static unsigned async_in_flight(const database_async_t *self) {
+    return self->depth - self->free_length - self->ready_length;
+}
+
+// Takes an unused request, NULL when all of them are in flight or waiting to be reaped
+static database_async_request_t* async_request_take(database_async_t *self, database_async_kind_t kind, void *user_data, unsigned *index) {
+    if (self->free_length == 0) return NULL;
+    *index = self->free_requests[--self->free_length];
+    database_async_request_t *request = &self->requests[*index];
+    memset(request, 0, sizeof(*request));
+    request->kind = kind;
+    request->user_data = user_data;
+    return request;
+}
+
+static void async_request_finish(database_async_t *self, unsigned index, error_t result) {
+    self->requests[index].result = result;
+    self->ready[self->ready_length++] = index;
+}
+
+static void async_request_release(database_async_t *self, unsigned index) {
+    database_async_request_t *request = &self->requests[index];
+    if (request->owned) free(request->stored);
+    request->owned = 0;
+    request->stored = NULL;
+    self->free_requests[self->free_length++] = index;
+}
+
+/**
+ * Binds the data file holding the request's bytes to a registered slot, updated when it holds another file.
+ * the write lock or a read section is held by the caller so that the generation can't change meanwhile
+ */
+static int database_async__instance__file_slot(database_async_t *self, database_async_request_t *request) {
+    database_t *db = self->database;
+    size_t address = request->record.start;
+    int fd = database__instance__data_file_at(db, address, &request->offset);
+    if (fd == -1) return -1;
+    // optimize replaced the files, every slot is updated before its next use
+    if (self->generation != db->generation) {
+        for (unsigned i = 0; i < DATABASE_ASYNC_FILES; i++) self->slot_segments[i] = DATABASE_ASYNC_SEGMENT_NONE;
+        self->generation = db->generation;
+    }
+    size_t segment = db->options.segment_size ? address_segment(db, address) : 0;
+    unsigned found = (unsigned)(segment % DATABASE_ASYNC_FILES);
+    if (self->slot_segments[found] != segment) {
+        if (uring__instance__update_file(self->ring, found, fd) != 0) return -1;
+        self->slot_segments[found] = segment;
+    }
+    request->file_slot = found;
+    request->file_segment = segment;
+    request->file_generation = db->generation;
+    return 0;
+}
+
+/**
+ * Binds the file of a short transfer again before the rest is submitted, its slot may have been given to another file.
+ * 1 when optimize replaced the file meanwhile
+ */
+static int database_async__instance__rebind(database_async_t *self, database_async_request_t *request) {
+    if (self->generation == request->file_generation && self->slot_segments[request->file_slot] == request->file_segment) return 0;
+    database_t *db = self->database;
+    // the write lock keeps the generation as the caller may be in a read section already
+    pthread_mutex_lock(&db->write_lock);
+    int result = db->generation != request->file_generation ? 1 : database_async__instance__file_slot(self, request);
+    pthread_mutex_unlock(&db->write_lock);
+    return result;
+}
+
+// Prepares the transfer of the bytes of the request not moved yet
+static int database_async__instance__prepare(database_async_t *self, unsigned index) {
+    database_async_request_t *request = &self->requests[index];
+    char *bytes = request->stored + request->done;
+    size_t length = request->stored_length - request->done;
+    uint64_t offset = request->offset + request->done;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int prepared = request->kind == DATABASE_ASYNC_INSERT
+            ? uring__instance__write(self->ring, request->file_slot, bytes, length, offset, index)
+            : uring__instance__read(self->ring, request->file_slot, bytes, length, offset, index);
+        if (prepared == 0) return 0;
+        // the submission ring is full of prepared requests, the kernel takes them first
+        if (uring__instance__submit(self->ring, 0) != 0) return -1;
+    }
+    return -1;
+}
+
+// Stages the bytes of a read in the request's slot when they fit, on the heap otherwise
+static int async_request_stage_read(database_async_t *self, unsigned index) {
+    database_async_request_t *request = &self->requests[index];
+    request->stored_length = request->record.end - request->record.start;
+    if (request->stored_length <= DATABASE_ASYNC_SLOT_LENGTH) {
+        request->stored = async_slot(self, index);
+        return 0;
+    }
+    request->stored = (char*)malloc(request->stored_length);
+    request->owned = 1;
+    return request->stored ? 0 : -1;
+}
+
+/**
+ * Adds the log entry of an insert whose bytes were written.
+ * when optimize replaced the file they went to meanwhile the content is inserted again the synchronous way
+ */
+static error_t database_async__instance__publish(database_async_t *self, database_async_request_t *request) {
+    database_t *db = self->database;
+    pthread_mutex_lock(&db->write_lock);
+    int replaced = db->generation != request->generation;
+    error_t result = 0;
+    if (!replaced) {
+        result = database__instance__append_entries(db, &request->record, 1);
+        if (result == 0) result = database__instance__commit_locked(db, 1);
+    }
+    pthread_mutex_unlock(&db->write_lock);
+    database__instance__reclaim(db);
+    if (replaced) {
+        char *data = (char*)request->data;
+        size_t data_length = request->data_length;
+        result = database__instance__insert_batch(db, &data, &data_length, 1, &request->record);
+    }
+    return result;
+}
+
+// Moves the completions out of the ring and finishes the requests whose transfers are complete
+static void database_async__instance__reap(database_async_t *self) {
+    uring_completion_t completions[64];
+    unsigned count;
+    while ((count = uring__instance__reap(self->ring, completions, 64)) > 0) {
+        for (unsigned i = 0; i < count; i++) {
+            unsigned index = (unsigned)completions[i].user_data;
+            database_async_request_t *request = &self->requests[index];
+            // nothing moved means past the end of the file
+            if (completions[i].result <= 0) {
+                async_request_finish(self, index, -1);
+                continue;
+            }
+            request->done += completions[i].result;
+            if (request->done < request->stored_length) {
+                int replaced = database_async__instance__rebind(self, request);
+                if (replaced == 0 && database_async__instance__prepare(self, index) == 0) continue;
+                // the rest of an insert whose file was replaced is not written, publish inserts it again
+                if (replaced != 1 || request->kind != DATABASE_ASYNC_INSERT) {
+                    async_request_finish(self, index, -1);
+                    continue;
+                }
+            }
+
+            error_t result = 0;
+            if (request->kind == DATABASE_ASYNC_INSERT) {
+                result = database_async__instance__publish(self, request);
+            } else if (request->kind == DATABASE_ASYNC_GET) {
+                if (request->stored != request->content) result = record_decode(&request->record, request->stored, request->content);
+                request->content[request->record.length] = '\0';
+            }
+            // a scan read is decoded when it is delivered
+            async_request_finish(self, index, result);
+        }
+    }
+}
+
+// Open an asynchronous queue
+database_async_t* database__instance__async_open(database_t *db, unsigned depth) {
+    if (!db || depth == 0) return NULL;
+    database_async_t *self = (database_async_t*)calloc(1, sizeof(database_async_t));
+    if (!self) return NULL;
+    self->database = db;
+    self->depth = depth;
+    self->requests = (database_async_request_t*)calloc(depth, sizeof(database_async_request_t));
+    self->free_requests = (unsigned*)malloc(depth * sizeof(unsigned));
+    self->ready = (unsigned*)malloc(depth * sizeof(unsigned));
+    self->slot_segments = (size_t*)malloc(DATABASE_ASYNC_FILES * sizeof(size_t));
+    if (!self->requests || !self->free_requests || !self->ready || !self->slot_segments) {
+        database_async__instance__close(self);
+        return NULL;
+    }
+    // taken from the end, request 0 first
+    for (unsigned i = 0; i < depth; i++) self->free_requests[i] = depth - 1 - i;
+    self->free_length = depth;
+    for (unsigned i = 0; i < DATABASE_ASYNC_FILES; i++) self->slot_segments[i] = DATABASE_ASYNC_SEGMENT_NONE;
+    self->generation = db->generation;
+
+    // without a usable ring every request runs when it is submitted
+    self->ring = uring__static__new(depth);
+    if (self->ring) {
+        self->arena = (char*)malloc((size_t)depth * DATABASE_ASYNC_SLOT_LENGTH);
+        if (!self->arena || uring__instance__register_files(self->ring, DATABASE_ASYNC_FILES) != 0
+            || uring__instance__register_buffer(self->ring, self->arena, (size_t)depth * DATABASE_ASYNC_SLOT_LENGTH) != 0) {
+            uring__instance__close(self->ring);
+            self->ring = NULL;
+            free(self->arena);
+            self->arena = NULL;
+        }
+    }
+    return self;
+}
+
+// Queue an insert
+error_t database_async__instance__insert(database_async_t *self, const char *data, size_t data_length, void *user_data) {
+    if (!self || !data || data_length == 0) return -1;
+    database_t *db = self->database;
+    unsigned index;
+    database_async_request_t *request = async_request_take(self, DATABASE_ASYNC_INSERT, user_data, &index);
+    if (!request) return -1;
+    record_t *record = &request->record;
+    if (!self->ring) {
+        char *buffer = (char*)data;
+        async_request_finish(self, index, database__instance__insert_batch(db, &buffer, &data_length, 1, record));
+        return 0;
+    }
+
+    // hashed and compressed before taking the write lock, staged in the slot when it fits
+    compute_hash(data, data_length, record->id);
+    record->length = data_length;
+    record->codec = RECORD_CODEC_NONE;
+    request->data = data;
+    request->data_length = data_length;
+    request->stored = (char*)data;
+    request->stored_length = data_length;
+    char *slot = async_slot(self, index);
+    if (db->options.compression == RECORD_CODEC_LZ) {
+        int fits = data_length - 1 <= DATABASE_ASYNC_SLOT_LENGTH;
+        char *target = fits ? slot : (char*)malloc(data_length - 1);
+        size_t compressed = target ? lz__static__compress(data, data_length, target, data_length - 1) : 0;
+        if (compressed > 0) {
+            request->stored = target;
+            request->stored_length = compressed;
+            request->owned = !fits;
+            record->codec = RECORD_CODEC_LZ;
+        } else if (!fits) {
+            free(target);
+        }
+    }
+    if (request->stored == data && data_length <= DATABASE_ASYNC_SLOT_LENGTH) {
+        memcpy(slot, data, data_length);
+        request->stored = slot;
+    }
+
+    // the bytes are reserved at the end of the data log, the entry is only added once they are written
+    pthread_mutex_lock(&db->write_lock);
+    const record_t *copy = db->options.deduplicate ? database__instance__find_copy_locked(db, record, NULL, 0, data_length) : NULL;
+    error_t result = 0;
+    if (copy) {
+        record->start = copy->start;
+        record->end = copy->end;
+        record->codec = copy->codec;
+        result = database__instance__append_entries(db, record, 1);
+        if (result == 0) result = database__instance__commit_locked(db, 1);
+    } else {
+        size_t segment_size = db->options.segment_size;
+        size_t stored_length = request->stored_length;
+        if (segment_size && db->data_file_length > 0 && db->data_file_length + stored_length > segment_size) {
+            result = database__instance__roll_segment_locked(db);
+        }
+        if (result == 0 && segment_size && db->data_file_length + stored_length > ((size_t)1 << DATABASE_SEGMENT_OFFSET_BITS)) result = -1;
+        // written past the staged appends
+        if (result == 0) result = write_buffer_flush(db->data_file_reference, &db->data_buffer);
+        if (result == 0) {
+            size_t start = db->data_file_length;
+            file_reserve(db->data_file_reference, &db->data_file_allocated, start + stored_length, db->options.preallocate_extent);
+            record->start = segment_address(db->active_segment, start);
+            record->end = record->start + stored_length;
+            db->data_file_length += stored_length;
+            if (segment_size) db->segments[db->active_segment].length = db->data_file_length;
+            request->generation = db->generation;
+            result = database_async__instance__file_slot(self, request);
+        }
+    }
+    pthread_mutex_unlock(&db->write_lock);
+    database__instance__reclaim(db);
+
+    if (result == 0 && !copy) result = database_async__instance__prepare(self, index);
+    if (result != 0 || copy) async_request_finish(self, index, result);
+    return 0;
+}
+
+// Queue a read by id
+error_t database_async__instance__get(database_async_t *self, const char *id, void *user_data) {
+    if (!self || !id) return -1;
+    database_t *db = self->database;
+    unsigned index;
+    database_async_request_t *request = async_request_take(self, DATABASE_ASYNC_GET, user_data, &index);
+    if (!request) return -1;
+    if (db->options.write_buffer_size && database__instance__flush(db) != 0) {
+        async_request_finish(self, index, -1);
+        return 0;
+    }
 
-    // Reopen the new files for the database
-    self->data_file_reference = open(old_data_path, O_RDWR, 0666);
-    self->index_file_reference = open(old_index_path, O_RDWR, 0666);
+    size_t section;
+    if (database__instance__lookup_begin(db, &section) != 0) {
+        async_request_finish(self, index, -1);
+        return 0;
+    }
+    const record_t *record = database__instance__lookup(db, id);
+    error_t result = record ? 0 : -1;
+    if (record) {
+        request->record = *record;
+        request->content = (char*)malloc(record->length + 1);
+        if (!request->content) result = -1;
+    }
+    if (result == 0 && !self->ring) {
+        result = database__instance__read_content(db, record, request->content);
+        request->content[record->length] = '\0';
+    } else if (result == 0) {
+        // an uncompressed record too large for the slot is read straight into its content
+        if (record->codec == RECORD_CODEC_NONE && record->length > DATABASE_ASYNC_SLOT_LENGTH) {
+            request->stored = request->content;
+            request->stored_length = record->length;
+        } else {
+            result = async_request_stage_read(self, index);
+        }
+        if (result == 0) result = database_async__instance__file_slot(self, request);
+    }
+    database__instance__read_end(db, section);
 
+    if (result == 0 && self->ring) result = database_async__instance__prepare(self, index);
+    if (result != 0 || !self->ring) async_request_finish(self, index, result);
     return 0;
 }
+
+// Reap the finished requests
+int database_async__instance__poll(database_async_t *self, database_completion_t *completions, unsigned max, unsigned wait) {
+    if (!self || (max > 0 && !completions)) return -1;
+    if (self->ring) {
+        for (;;) {
+            // never waits for more than what is still in flight
+            unsigned waiting = self->ready_length < wait && async_in_flight(self) > 0;
+            if (uring__instance__submit(self->ring, waiting) != 0) return -1;
+            database_async__instance__reap(self);
+            if (!waiting) break;
+        }
+    }
+
+    unsigned moved = 0, kept = 0;
+    for (unsigned i = 0; i < self->ready_length; i++) {
+        unsigned index = self->ready[i];
+        database_async_request_t *request = &self->requests[index];
+        // the reads of a scan that failed midway are dropped
+        if (request->kind == DATABASE_ASYNC_SCAN) {
+            async_request_release(self, index);
+            continue;
+        }
+        if (moved == max) {
+            self->ready[kept++] = index;
+            continue;
+        }
+        database_completion_t *completion = &completions[moved++];
+        completion->kind = request->kind;
+        completion->user_data = request->user_data;
+        completion->result = request->result;
+        completion->record = request->record;
+        completion->content = NULL;
+        if (request->result == 0) {
+            completion->content = request->content;
+        } else {
+            free(request->content);
+        }
+        async_request_release(self, index);
+    }
+    self->ready_length = kept;
+    return (int)moved;
+}
+
+// Iterate over the latest records with their content, reads kept in flight through the ring
+error_t database_async__instance__get_latest_records_with_content(database_async_t *self, record_found_with_span_fn on_record_found) {
+    if (!self || !on_record_found) return -1;
+    database_t *db = self->database;
+    if (!self->ring) return database__instance__get_latest_records_with_content(db, DATABASE_SCAN_DATA_ORDER, on_record_found);
+    if (db->options.write_buffer_size && database__instance__flush(db) != 0) return -1;
+    if (!db->btree && id_index_ensure(db) != 0) return -1;
+
+    size_t section = database__instance__read_begin(db);
+    batch_items_t items = {NULL, 0, 0};
+    error_t result = database__instance__latest_items(db, &items);
+    if (result == 0) qsort(items.items, items.length, sizeof(batch_item_t), batch_item__static__compare_data);
+
+    scan_buffer_t buffer = {0};
+    size_t next = 0;
+    int ord = 0;
+    unsigned scanning = 0;
+    for (;;) {
+        // a read per free request, in data order
+        while (result == 0 && next < items.length && self->free_length > 0) {
+            unsigned index;
+            database_async_request_t *request = async_request_take(self, DATABASE_ASYNC_SCAN, NULL, &index);
+            request->entry = items.items[next++].record;
+            request->record = *request->entry;
+            result = async_request_stage_read(self, index);
+            if (result == 0) result = database_async__instance__file_slot(self, request);
+            if (result == 0) result = database_async__instance__prepare(self, index);
+            if (result != 0) {
+                async_request_release(self, index);
+                break;
+            }
+            scanning++;
+        }
+        if (scanning == 0 && (result != 0 || next == items.length)) break;
+        // every request waits for the caller to reap it
+        if (async_in_flight(self) == 0 || uring__instance__submit(self->ring, 1) != 0) {
+            result = -1;
+            break;
+        }
+        database_async__instance__reap(self);
+
+        // deliver the finished reads, the other requests stay for poll
+        unsigned kept = 0;
+        for (unsigned i = 0; i < self->ready_length; i++) {
+            unsigned index = self->ready[i];
+            database_async_request_t *request = &self->requests[index];
+            if (request->kind != DATABASE_ASYNC_SCAN) {
+                self->ready[kept++] = index;
+                continue;
+            }
+            scanning--;
+            if (result == 0) result = request->result;
+            if (result == 0) {
+                const record_t *record = &request->record;
+                const char *content = request->stored;
+                if (record->codec != RECORD_CODEC_NONE) {
+                    if (scan_buffer_reserve(&buffer.content, &buffer.content_capacity, record->length) != 0) result = -1;
+                    if (result == 0) result = record_decode(record, request->stored, buffer.content);
+                    content = buffer.content;
+                }
+                if (result == 0) result = on_record_found((record_t*)request->entry, ord++, content, record->length);
+            }
+            async_request_release(self, index);
+        }
+        self->ready_length = kept;
+    }
+
+    scan_buffer_free(&buffer);
+    free(items.items);
+    database__instance__read_end(db, section);
+    return result;
+}
+
+// Close an asynchronous queue
+error_t database_async__instance__close(database_async_t *self) {
+    if (!self) return 0;
+    error_t result = 0;
+    if (self->ring) {
+        // the kernel may still write into the slots and the heap buffers
+        while (async_in_flight(self) > 0) {
+            if (uring__instance__submit(self->ring, 1) != 0) {
+                result = -1;
+                break;
+            }
+            database_async__instance__reap(self);
+        }
+        uring__instance__close(self->ring);
+    }
+    for (unsigned i = 0; i < self->ready_length; i++) {
+        free(self->requests[self->ready[i]].content);
+        async_request_release(self, self->ready[i]);
+    }
+    free(self->arena);
+    free(self->slot_segments);
+    free(self->ready);
+    free(self->free_requests);
+    free(self->requests);
+    free(self);
+    return result;
+}
@@ -1,24 +1,62 @@
 #ifndef __filedb_h__
 #define __filedb_h__
 #include <stddef.h>
+#include <pthread.h>
+#include "btree.h"
+#include "bloom.h"
+#include "hash.h"
+#include "uring.h"
+
+/**
+ * a segmented database stores data addresses in record.start and record.end:
+ *   the segment id in the high bits and the offset inside the segment file in the low DATABASE_SEGMENT_OFFSET_BITS bits
+ */
+#define DATABASE_SEGMENT_OFFSET_BITS 40
 
 typedef struct record_s {
     /**
      * 256bits/32 bytes uuid generated hashing the contents of the record
+     * the raw BLAKE3 digest bytes, not a string
     */
     char id[32];
     /**
      * record start fseek position inside the database.data file
+     * or its data address when the data log is segmented
      */
     size_t start;
     /**
      * record end fseek position inside the database.data file
      */
     size_t end;
+    /**
+     * length of the record content, end - start unless the stored bytes are compressed
+     */
+    size_t length;
+    /**
+     * the record_codec_t the stored bytes are encoded with
+     */
+    unsigned int codec;
+    /**
+     * always 0
+     */
+    unsigned int reserved;
 } record_s;
 
 typedef record_s record_t;
 
+/**
+ * how the content of a record is stored in the data file
+ */
+typedef enum record_codec_e {
+    RECORD_CODEC_NONE = 0,
+    /**
+     * LZ4 block format, see lz.h
+     */
+    RECORD_CODEC_LZ,
+} record_codec_e;
+
+typedef record_codec_e record_codec_t;
+
 /**
  * allocates a new record calculating the uuid of the record based on some hashing algorhithm of the given content ( preferably not outsourced to an external library )
  */
@@ -27,9 +65,198 @@ record_t* record__static__new_from_buffer(int start,char* data,int data_length);
  * checks if the record is deleted or not
  */
 int record__instance__is_deleted(const record_t *record);
+/**
+ * the segment holding the record content when the data log is segmented
+ */
+size_t record__instance__segment(const record_t *record);
 
 typedef int error_t;
 
+/**
+ * when the written records are made durable with fsync
+ */
+typedef enum database_durability_e {
+    /**
+     * never fsync, the kernel writes the data back whenever it likes
+     */
+    DATABASE_DURABILITY_NONE = 0,
+    /**
+     * fsync once every sync_every_records records
+     */
+    DATABASE_DURABILITY_EVERY_N_RECORDS,
+    /**
+     * fsync every sync_interval_ms milliseconds from a background flusher thread
+     */
+    DATABASE_DURABILITY_INTERVAL,
+    /**
+     * fsync at the end of every insert, batch insert and delete
+     */
+    DATABASE_DURABILITY_COMMIT,
+} database_durability_e;
+
+typedef database_durability_e database_durability_t;
+
+typedef struct database_options_s {
+    /**
+     * when set the index file is memory mapped read-only instead of being read into record_list
+     * open time then no longer depends on the index size and the entries are shared with the page cache.
+     * entries appended after open are kept in a small in-memory tail that is remapped on growth.
+     * ignored on platforms without mmap
+     */
+    int map_index;
+    /**
+     * when set the mapping used by database__instance__list_all_mapped_content
+     *   is advised with MADV_SEQUENTIAL so the kernel reads ahead aggressively
+     */
+    int advise_sequential;
+    /**
+     * the point of the throughput versus durability curve, DATABASE_DURABILITY_NONE by default
+     */
+    database_durability_t durability;
+    /**
+     * records between two fsync in DATABASE_DURABILITY_EVERY_N_RECORDS mode, 0 means 1
+     */
+    size_t sync_every_records;
+    /**
+     * milliseconds between two fsync in DATABASE_DURABILITY_INTERVAL mode, 0 means 1000
+     */
+    unsigned sync_interval_ms;
+    /**
+     * size in bytes of the user-space buffers staging the appends to each of the data and index files.
+     * 0 writes every append straight to the files
+     */
+    size_t write_buffer_size;
+    /**
+     * both files are grown ahead of the appends in extents of this many bytes with fallocate
+     *   so that appending does not allocate blocks every time. 0 disables preallocation
+     */
+    size_t preallocate_extent;
+    /**
+     * when set the data log is split into segment files <path>.data.000001, <path>.data.000002, ...
+     *   a new segment is started once appending would grow the active one past segment_size bytes.
+     * optimize then only rewrites the sealed segments with the most garbage instead of the whole log.
+     * requires a 64 bit size_t
+     */
+    size_t segment_size;
+    /**
+     * the number of segments a segmented optimize compacts in parallel, 0 means 4
+     */
+    size_t compaction_segments;
+    /**
+     * when set inserting a payload that a live record already stores only appends an index entry
+     *   pointing at the existing bytes, nothing is written to the data file.
+     * payloads are matched by their 256bit content hash and their length
+     */
+    int deduplicate;
+    /**
+     * the codec new records are compressed with, RECORD_CODEC_NONE by default.
+     * a record that doesn't shrink is stored as it is.
+     * records are decoded on read whatever this option is
+     */
+    record_codec_t compression;
+    /**
+     * when set the latest version of every id is kept in a persistent B+tree in <path>.btree
+     *   instead of the in-memory id index, so that lookups and get_latest_records run in bounded memory.
+     * the tree is updated by every insert and delete and saved by database__instance__sync and close,
+     *   open only replays the entries appended since it was last saved. implies map_index
+     */
+    int btree_index;
+    /**
+     * the pages of the tree kept in memory, 0 means 64
+     */
+    size_t btree_cache_pages;
+    /**
+     * when set a blocked Bloom filter over the inserted ids is kept in memory and saved in <path>.bloom,
+     *   get_by_id and the deduplication test it before any index probe so that an unknown id
+     *   costs one cache line. optimize rebuilds it over the live ids only
+     */
+    int bloom_filter;
+    /**
+     * when not 0 the live map of the id index is checkpointed into <path>.checkpoint
+     *   every checkpoint_interval appended log entries and on close.
+     * building the id index then loads the checkpoint and only replays the entries appended after it,
+     *   O(live records + recent writes) instead of O(log length). unused with btree_index, which is persistent already
+     */
+    size_t checkpoint_interval;
+} database_options_s;
+
+typedef database_options_s database_options_t;
+
+/**
+ * what opening the database found past the verified mark of the log and dropped
+ */
+typedef struct database_recovery_s {
+    /**
+     * the log entries after the mark whose content was checked against their id
+     */
+    size_t verified;
+    /**
+     * the entries dropped, from the first one that was torn or pointed at missing data to the end of the log
+     */
+    size_t dropped;
+    size_t dropped_index_bytes;
+    /**
+     * the bytes past the end of the data the remaining entries need
+     */
+    size_t dropped_data_bytes;
+} database_recovery_s;
+
+typedef database_recovery_s database_recovery_t;
+
+/**
+ * a file of the segmented data log
+ */
+typedef struct segment_s {
+    /**
+     * the open segment file or -1 until it is first used
+     */
+    int file_reference;
+    /**
+     * the size of the segment file
+     */
+    size_t length;
+    /**
+     * the bytes of the latest versions of the live records stored in the segment,
+     *   the remaining length - live_bytes bytes are garbage
+     */
+    size_t live_bytes;
+} segment_s;
+
+typedef segment_s segment_t;
+
+/**
+ * appends staged in memory before they are written to a file
+ */
+typedef struct write_buffer_s {
+    char* bytes;
+    size_t length;
+    size_t capacity;
+    /**
+     * the file offset the first buffered byte belongs at
+     */
+    size_t offset;
+} write_buffer_s;
+
+typedef write_buffer_s write_buffer_t;
+
+/**
+ * storage replaced by the writer that a concurrent reader may still be using,
+ *   freed once every reader that could have seen it left its read section
+ */
+typedef struct retired_s {
+    void* pointer;
+    /**
+     * the length of a memory mapping to unmap, 0 for memory to free
+     */
+    size_t length;
+    /**
+     * the reader epoch the storage was retired in
+     */
+    size_t epoch;
+} retired_s;
+
+typedef retired_s retired_t;
+
 typedef struct database_s {
     /**
      * the name of the database, is effectively a path
@@ -46,17 +273,272 @@ typedef struct database_s {
     int data_file_reference;
     /**
      * stores a reference to the index file.
-     * the index file is basically a binary dump of a list of record*
+     * the index file starts with a FILEDBIX header holding its version and the verified mark, padded to the size of a record_t,
+     *   then one entry per log entry: a record_t as is in version 2, the format options.map_index reads in place,
+     *   or in version 3 a flags byte, the id, varints for the start, the stored length and the length of a compressed content,
+     *   and the CRC-32C of the entry. the headerless index files of the first releases are rewritten in the current format on open
      */
     int index_file_reference;
+    /**
+     * the end of the data file, new record contents are appended here
+     */
+    size_t data_file_length;
+
+    /**
+     * the segments of a segmented data log indexed by segment id, segment 0 is never used.
+     * data_file_reference and data_file_length then describe the active segment
+     */
+    segment_t* segments;
+    size_t segments_length;
+    size_t active_segment;
+
+    /**
+     * the staged appends to the data and index files and how far each file was preallocated
+     */
+    write_buffer_t data_buffer;
+    write_buffer_t index_buffer;
+    size_t data_file_allocated;
+    size_t index_file_allocated;
+    /**
+     * the format of the index file and the offset the next entry is appended at.
+     * a mapped index is stored as record_t entries, otherwise the entries are compact and checksummed
+     */
+    unsigned int index_version;
+    size_t index_file_length;
+    /**
+     * the log entries and data bytes known to be durable and intact, saved in the index header after each sync.
+     * opening only verifies what follows them
+     */
+    size_t verified_length;
+    size_t verified_data_length;
+    database_recovery_t recovery;
+    /**
+     * numbers the staging files of the record streams
+     */
+    size_t stream_counter;
 
+    /**
+     * records committed since the last fsync
+     */
+    size_t records_since_sync;
+    /**
+     * serializes the writers, the buffered appends and the background flusher
+     */
+    pthread_mutex_t write_lock;
+    pthread_cond_t flusher_wakeup;
+    pthread_t flusher_thread;
+    int flusher_running;
+
+    /**
+     * the online compaction worker, compaction_joinable stays set until optimize_wait joins it.
+     * compaction_running is set while any compaction is underway, a synchronous segmented one included,
+     *   both are read and written under the write lock
+     */
+    pthread_t compaction_thread;
+    int compaction_running;
+    int compaction_joinable;
+    error_t compaction_result;
+
+    /**
+     * the options the database was opened with
+     */
+    database_options_t options;
+
+    /**
+     * read-only mapping of the index file when options.map_index is set, NULL otherwise
+     * it holds the first index_map_length entries of the log
+     */
+    const record_t* index_map;
+    size_t index_map_length;
+
+    /**
+     * the in-memory log entries, record_list[0] is the entry at position record_list_offset.
+     * without a mapped index record_list_offset is 0 and record_list holds the whole log,
+     *   otherwise it only holds the entries appended since the index file was last mapped
+     */
     record_t* record_list;
+    size_t record_list_capacity;
+    size_t record_list_offset;
+    /**
+     * the total number of entries in the log
+     */
     size_t record_list_length;
 
+    /**
+     * open addressing hash table (linear probing) keyed on record.id
+     * each slot stores the position + 1 of the latest version of the record
+     *   inside record_list, 0 marks an empty slot.
+     * deleted ids are removed from the table so it only holds live records
+     *   and iterating it costs O(live records)
+     */
+    size_t* id_index;
+    size_t id_index_capacity;
+    size_t id_index_length;
+    /**
+     * set once the id index reflects the log, a mapped database builds it on first use
+     */
+    int id_index_built;
+
+    /**
+     * the live records for uniform sampling, built on first use and then kept up by every append.
+     * sample_positions holds the log position of each live record densely in sample_length slots,
+     *   sample_table is an open addressing table mapping an id to its slot + 1 so that a delete
+     *   moves the last slot into the hole. sample_lock guards them, the writer takes it after the write lock
+     */
+    size_t* sample_positions;
+    size_t sample_length;
+    size_t sample_capacity;
+    size_t* sample_table;
+    size_t sample_table_capacity;
+    int sample_built;
+    /**
+     * the xorshift state the samples are drawn from
+     */
+    uint64_t sample_state;
+    pthread_mutex_t sample_lock;
+
+    /**
+     * read-only mapping of the data file used by the mapped content scans, NULL until first used.
+     * it is remapped lazily whenever a record ends past data_map_length
+     */
+    const char* data_map;
+    size_t data_map_length;
+
+    /**
+     * readers register in one of two epochs, readers[epoch & 1] counts the open read sections of each.
+     * storage the writer replaces is retired with the current epoch and only freed once
+     *   the epoch moved on and no reader is left in the previous one
+     */
+    size_t reader_epoch;
+    size_t readers[2];
+    retired_t* retired;
+    size_t retired_length;
+    size_t retired_capacity;
+    /**
+     * guards the retired list and the remapping of data_map
+     */
+    pthread_mutex_t reclaim_lock;
+    /**
+     * sequence counters, odd while the writer swaps the log storage or shifts the id index entries
+     *   so that a reader can tell its lookup saw a consistent state
+     */
+    size_t log_sequence;
+    size_t id_index_sequence;
+    /**
+     * held shared by every read section and exclusively by the generation switches of optimize,
+     *   which replace the files and reload the whole index. inserts and deletes never take it
+     */
+    pthread_rwlock_t generation_lock;
+    /**
+     * counts the generation switches, the log positions taken before one don't mean anything after it
+     */
+    size_t generation;
+
+    /**
+     * the persistent id index of options.btree_index, NULL otherwise.
+     * btree_lock guards its page cache, the writer takes it after the write lock
+     */
+    btree_t* btree;
+    pthread_mutex_t btree_lock;
+    /**
+     * the id filter of options.bloom_filter, NULL otherwise.
+     * replaced by a larger copy when it fills up, the previous one is retired
+     */
+    bloom_t* bloom;
+    /**
+     * the log length covered by the last checkpoint written or loaded
+     */
+    size_t checkpoint_length;
+
 } database_s;
 
 typedef database_s database_t;
 
+/**
+ * a record written a chunk at a time.
+ * the chunks are hashed as they come and staged in a file of their own next to the database,
+ *   the record is copied into the data log in one go when it is committed
+ */
+typedef struct record_stream_s {
+    database_t* database;
+    /**
+     * the staging file, already unlinked, or -1 once the stream failed
+     */
+    int file_reference;
+    size_t length;
+    hasher_t hasher;
+} record_stream_s;
+
+typedef record_stream_s record_stream_t;
+
+/**
+ * what an asynchronous request did
+ */
+typedef enum database_async_kind_e {
+    DATABASE_ASYNC_INSERT = 0,
+    DATABASE_ASYNC_GET,
+    /**
+     * a read of a latest records scan, never reaped by the caller
+     */
+    DATABASE_ASYNC_SCAN,
+} database_async_kind_t;
+
+/**
+ * a finished asynchronous request as reaped by database_async__instance__poll
+ */
+typedef struct database_completion_s {
+    database_async_kind_t kind;
+    void* user_data;
+    /**
+     * 0 when the request succeeded, -1 when it failed or a get found no live record
+     */
+    error_t result;
+    /**
+     * a copy of the log entry inserted or read
+     */
+    record_t record;
+    /**
+     * the content of a get followed by a 0 byte, malloc'ed and freed by the caller. NULL otherwise
+     */
+    char* content;
+} database_completion_s;
+
+typedef database_completion_s database_completion_t;
+
+typedef struct database_async_request_s database_async_request_t;
+
+/**
+ * a queue of asynchronous inserts and gets driven by one thread.
+ * on linux the requests go through an io_uring whose registered files are the data files
+ *   and whose registered buffer holds a staging slot per request, so that a single thread keeps
+ *   depth reads and writes in flight instead of blocking on each. where io_uring is missing
+ *   ring is NULL and every request runs synchronously when it is submitted
+ */
+typedef struct database_async_s {
+    database_t* database;
+    uring_t* ring;
+    unsigned depth;
+    database_async_request_t* requests;
+    /**
+     * the indexes of the unused requests and of the finished ones not reaped yet
+     */
+    unsigned* free_requests;
+    unsigned free_length;
+    unsigned* ready;
+    unsigned ready_length;
+    /**
+     * the segment held by each registered file slot, -1 for none, valid for the given database generation
+     */
+    size_t* slot_segments;
+    size_t generation;
+    /**
+     * depth staging slots of DATABASE_ASYNC_SLOT_LENGTH bytes, registered with the ring
+     */
+    char* arena;
+} database_async_s;
+
+typedef database_async_s database_async_t;
+
 /**
  * creates a database connection.
  * if any of the index file or data file do not exist it will create them
@@ -64,7 +546,14 @@ typedef database_s database_t;
  */
 database_t* database__static_open(const char* path);
 /**
- * frees up the memory of the database
+ * creates a database connection using the given options, NULL options means defaults.
+ * a zero initialized database_options_t is the default configuration
+ */
+database_t* database__static_open_with_options(const char* path,const database_options_t* options);
+/**
+ * flushes the staged appends, fsyncs them unless the durability is DATABASE_DURABILITY_NONE,
+ *   and frees up the memory of the database. the verified mark only moves with the fsync,
+ *   so the next open checks the tail of a database closed without one
  */
 error_t database__static__close(database_t* self);
 /**
@@ -72,16 +561,100 @@ error_t database__static__close(database_t* self);
  * the binary data is stored at the end of the data 
  *   file then the record object is initialized, stored
  *   in the index file and finally added to the record_list
+ * the returned pointer lives inside the log and is only valid
+ *   until the next insert or delete
  */
 record_t* database__instance__insert_record(database_t* self,char* data,int data_length);
 /**
- * deletes the record by simply inserting a new
- *   record that copies the given record id but uses the content ''
- * effectively the deleted record will have the start and end fields equal with the current data fseek index
- * and will be stored as such in the index file 
+ * creates n records in one go.
+ * all the payloads are appended to the data file with a single gathered write,
+ *   then the n index entries are written with a single write and added to the record_list.
+ * out_records, when not NULL, receives a copy of the n created records.
+ * fails without writing anything if any buffer is NULL or empty
+ */
+error_t database__instance__insert_batch(database_t* self,char** buffers,const size_t* lengths,size_t n,record_t* out_records);
+/**
+ * starts a record written a chunk at a time, for contents too large to hold in memory or over 2 GB.
+ * the other writers and the readers are not held up while the chunks are appended, NULL on failure
+ */
+record_stream_t* database__instance__stream_begin(database_t* self);
+/**
+ * appends a chunk of content to the stream
+ */
+error_t record_stream__instance__append(record_stream_t* self, const void* data, size_t data_length);
+/**
+ * copies the staged content at the end of the data log and adds its log entry, then frees the stream.
+ * the content is stored as it is whatever options.compression says, and not copied at all when options.deduplicate finds it.
+ * returns the log entry like database__instance__insert_record, NULL when the stream is empty or failed
+ */
+record_t* record_stream__instance__commit(record_stream_t* self);
+/**
+ * drops the staged content and frees the stream
+ */
+void record_stream__instance__abort(record_stream_t* self);
+/**
+ * writes the staged appends of both files to the kernel
+ */
+error_t database__instance__flush(database_t* self);
+/**
+ * writes the staged appends and fsyncs the data file then the index file,
+ *   then saves the B+tree of options.btree_index and the filter of options.bloom_filter
+ */
+error_t database__instance__sync(database_t* self);
+/**
+ * writes the live map of the id index and the log length it covers to <path>.checkpoint,
+ *   after making the log entries it covers durable
+ */
+error_t database__instance__checkpoint(database_t* self);
+/**
+ * deletes the record by appending a tombstone, a log entry with the record id, no content and start and end 0.
+ * nothing is written to the data file, the index file stores the tombstone as an entry with the tombstone flag in version 3.
+ * returns the tombstone, NULL on failure
  */
 record_t* database__instance__delete_record(database_t* self,record_t* record);
 
+/**
+ * concurrent readers:
+ *   any number of threads may read while a single thread inserts and deletes.
+ *   readers never wait for the writer and the writer appends without waiting for the readers:
+ *   the log and the id index are replaced, never resized in place, and the replaced storage
+ *   is only freed once no read section that could still see it is open.
+ * a pointer returned by record_at or get_by_id stays valid until the end of the read section it was taken in,
+ *   outside of a section only until the next insert or delete.
+ * the iterators and read_content open their own section.
+ * optimize waits for the open read sections, it must not be called from inside one
+ *   nor while a thread keeps a section open indefinitely
+ */
+
+/**
+ * opens a read section and returns the value to hand to database__instance__read_end.
+ * sections nest: only the outermost section of a thread takes the generation lock, the nested ones
+ *   and the sections get_by_id, read_content and the iterators open inside it only count the depth
+ */
+size_t database__instance__read_begin(database_t* self);
+/**
+ * closes the read section opened by database__instance__read_begin
+ */
+void database__instance__read_end(database_t* self,size_t section);
+
+/**
+ * returns the log entry at the given position or NULL if out of range.
+ * works for both the mapped and the in-memory index, see the concurrent readers note for how long the pointer is valid
+ */
+record_t* database__instance__record_at(database_t* self,size_t position);
+
+/**
+ * returns the latest version of the record with the given 32 bytes id
+ *   or NULL if the id is unknown or the record was deleted.
+ * the returned pointer lives inside the log, see the concurrent readers note for how long it is valid
+ */
+record_t* database__instance__get_by_id(database_t* self,const char* id);
+/**
+ * copies the latest version of the record with the given 32 bytes id into out_record, -1 when it is not live.
+ * the copy is taken inside the lookup's own read section so it stays valid whatever is appended afterwards
+ */
+error_t database__instance__get_copy_by_id(database_t* self, const char* id, record_t* out_record);
+
 /**
  * functional type used in the record iterator functions
  */
@@ -107,9 +680,118 @@ typedef error_t (*record_iter_fn)(record_t* record, int ord);
 /**
  * Iterates over the latest, non-deleted records.
  * Calls the provided callback function for each valid record.
+ * Runs in O(live records) over a copy of the id index, in no particular order.
+ * The records inserted or deleted by the callback or a concurrent writer are not seen.
+ * With options.btree_index the records come in id order a few pages at a time,
+ *   a record inserted or deleted meanwhile is seen when its id was not passed yet.
  */
 error_t database__instance__get_latest_records(database_t *self, record_found_fn on_record_found);
 
+/**
+ * returns the latest version of a live record picked uniformly at random, NULL when there is none.
+ * the first call lays the live records out in a dense array, from then on a pick, an insert and a delete each cost O(1).
+ * the returned pointer lives inside the log, see the concurrent readers note for how long it is valid
+ */
+record_t* database__instance__get_random_live_record(database_t* self);
+/**
+ * copies k distinct live records picked uniformly at random into out_records in O(k),
+ *   all of them when there are fewer, and their number into out_length
+ */
+error_t database__instance__sample_k(database_t* self, size_t k, record_t* out_records, size_t* out_length);
+
+/**
+ * what a cursor goes over
+ */
+typedef enum database_cursor_kind_e {
+    /**
+     * every log entry in log order, the deletions included with an empty content
+     */
+    DATABASE_CURSOR_ALL = 0,
+    /**
+     * the latest version of every live record, in log order.
+     * in id order a few pages at a time with options.btree_index
+     */
+    DATABASE_CURSOR_LATEST,
+    /**
+     * the log entries at the positions [from, to) in log order
+     */
+    DATABASE_CURSOR_RANGE,
+} database_cursor_kind_e;
+
+typedef database_cursor_kind_e database_cursor_kind_t;
+
+/**
+ * a pull iterator over the log, the records are copied out one at a time by database_cursor__instance__next.
+ * it sees the log as it was when it was opened, the records appended later are not seen
+ */
+typedef struct database_cursor_s {
+    database_t* database;
+    database_cursor_kind_t kind;
+    /**
+     * the database generation the positions belong to
+     */
+    size_t generation;
+    /**
+     * the next item and the end of the items: log positions, or indexes in positions for DATABASE_CURSOR_LATEST
+     */
+    size_t next;
+    size_t end;
+    /**
+     * the positions of the live records, or the current chunk of the tree with options.btree_index
+     */
+    size_t* positions;
+    char after[32];
+    int tree_done;
+    /**
+     * the items before it had their content announced to the kernel
+     */
+    size_t prefetched;
+    /**
+     * reused for the stored bytes of the compressed records
+     */
+    char* stored;
+    size_t stored_capacity;
+} database_cursor_s;
+
+typedef database_cursor_s database_cursor_t;
+
+/**
+ * opens a cursor over all the log entries or over the latest records, NULL on failure
+ */
+database_cursor_t* database__instance__cursor_open(database_t* self, database_cursor_kind_t kind);
+/**
+ * opens a cursor over the log entries at the positions [from, to), clamped to the log
+ */
+database_cursor_t* database__instance__cursor_open_range(database_t* self, size_t from, size_t to);
+/**
+ * copies the next record into record and its content into *buffer followed by a 0 byte.
+ * *buffer belongs to the caller, it is grown with realloc when it is shorter than the content and *capacity updated,
+ *   so that reusing it the whole way allocates only as the largest record grows it.
+ * the content of the records coming next is read ahead in the background.
+ * returns 1 with a record, 0 at the end, -1 on failure or once optimize switched the database to a new log
+ */
+int database_cursor__instance__next(database_cursor_t* self, record_t* record, char** buffer, size_t* capacity);
+void database_cursor__instance__close(database_cursor_t* self);
+
+/**
+ * copies the content of the record, record->length bytes, into buffer decompressing it if needed
+ */
+error_t database__instance__read_content(database_t* self, const record_t* record, char* buffer);
+/**
+ * copies length bytes of the content of the record starting at offset into buffer.
+ * only those bytes are read unless the record is compressed, fails when the range is past the end of the content
+ */
+error_t database__instance__read_range(database_t* self, const record_t* record, size_t offset, size_t length, char* buffer);
+/**
+ * fetches the content of the latest version of each of the n 32 bytes ids.
+ * out_buffers[i] gets a malloc'ed copy followed by a 0 byte that the caller frees, and out_lengths[i] its length,
+ *   NULL and 0 when the id is unknown or deleted. the same id may be asked more than once.
+ * the extents are read in address order, neighbours merged into a single vectored read,
+ *   so a batch costs about one syscall per cluster of records rather than one per record.
+ * fails without any output allocated when a read fails
+ */
+error_t database__instance__multi_get(database_t* self, const char* const* ids, size_t n, char** out_buffers, size_t* out_lengths);
+
 /**
  * functional type used in the record with content iterator functions
  */
@@ -118,13 +800,130 @@ typedef error_t (*record_found_with_content_fn)(record_t*,int ord,char* content)
 /**
  * lists all the records with no sorting and with their 
  *     content buffer read from the database.data file.
- * the content buffer is freed after the call on on_record_with_content_found 
+ * the content buffer is reused for the next record after the call on on_record_with_content_found
  */
 error_t database__instance__list_all_with_content(database_t* self,record_found_with_content_fn on_record_with_content_found);
 
+/**
+ * functional type used in the zero-copy content iterator functions
+ * the content points straight into the data file mapping, or into a reused buffer for compressed records.
+ *   it is not null terminated and is only valid for the duration of the call
+ */
+typedef error_t (*record_found_with_span_fn)(record_t*,int ord,const char* content,size_t content_length);
+
+/**
+ * lists all the records with no sorting and with their content
+ *     served straight from a memory mapping of the database.data file.
+ * no per record allocation or syscall is made, the mapping grows lazily with the file.
+ * falls back to pread into a reused buffer on platforms without mmap
+ */
+error_t database__instance__list_all_mapped_content(database_t* self,record_found_with_span_fn on_record_found);
+
+/**
+ * the order database__instance__get_latest_records_with_content delivers the records in
+ */
+typedef enum database_scan_order_e {
+    /**
+     * by position in the data files, the order they are read in
+     */
+    DATABASE_SCAN_DATA_ORDER = 0,
+    /**
+     * by position in the log, still read in data order a window at a time
+     */
+    DATABASE_SCAN_LOG_ORDER,
+    /**
+     * by id, still read in data order a window at a time
+     */
+    DATABASE_SCAN_ID_ORDER,
+} database_scan_order_e;
+
+typedef database_scan_order_e database_scan_order_t;
+
+/**
+ * iterates over the latest, non-deleted records with their content.
+ * the live set is resolved first, then the contents are read in ascending data file order
+ *   with one preadv per run of neighbouring records, small holes between them read through,
+ *   so that a cold scan streams through the files instead of seeking.
+ * the content is not null terminated and is only valid for the duration of the call
+ */
+error_t database__instance__get_latest_records_with_content(database_t* self, database_scan_order_t order, record_found_with_span_fn on_record_found);
+
+/**
+ * functional type used by the parallel scans.
+ * worker is the index in [0, nthreads) of the thread making the call so that the callback can keep per-thread state
+ *   inside user_ctx. the content is not null terminated and is only valid for the duration of the call
+ */
+typedef error_t (*record_found_parallel_fn)(record_t* record,int ord,const char* content,size_t content_length,size_t worker,void* user_ctx);
+
+/**
+ * lists all the records with their content like database__instance__list_all_mapped_content,
+ *   calling on_record_found concurrently from nthreads threads, the calling thread included.
+ * the log is split into ranges of entries claimed by the workers as they go, each worker reads a range into its own
+ *   buffers with a single pread when its records are contiguous in the data file.
+ * nthreads 0 means one thread per online cpu. the first error returned by a callback stops the scan and is returned
+ */
+error_t database__instance__parallel_scan(database_t* self,size_t nthreads,record_found_parallel_fn on_record_found,void* user_ctx);
+
+/**
+ * database__instance__parallel_scan merging the results in log order:
+ *   the ranges are still read and decompressed in parallel but the callbacks are made one at a time in log order
+ */
+error_t database__instance__parallel_scan_ordered(database_t* self,size_t nthreads,record_found_parallel_fn on_record_found,void* user_ctx);
+
 /**
  * will eliminate all but the last version of a record from the database, updating the index and the data file
+ * the surviving records are copied in data file order, merged into contiguous extents
+ *   and moved with copy_file_range (or sendfile) so their bytes never pass through user space.
+ * a segmented database only rewrites the compaction_segments sealed segments with the most garbage,
+ *   each on its own thread, and rewrites the index to their new addresses
  */
 error_t database__instance__optimize(database_t* self);
 
+/**
+ * starts an online compaction on a worker thread.
+ * the live records as of the current log position are copied into a new generation while
+ *   inserts and deletes keep appending to the current one; the worker then replays the entries
+ *   appended meanwhile and switches data_file_reference/index_file_reference under the write lock.
+ * returns -1 if a compaction is already running
+ */
+error_t database__instance__optimize_async(database_t* self);
+
+/**
+ * waits for the online compaction started by database__instance__optimize_async
+ *   and returns its result, 0 when none is running
+ */
+error_t database__instance__optimize_wait(database_t* self);
+
+/**
+ * opens an asynchronous queue of depth requests over the database.
+ * the queue belongs to the thread using it and is closed before the database
+ */
+database_async_t* database__instance__async_open(database_t* self, unsigned depth);
+/**
+ * queues the insert of a copy of data. data stays valid until the completion is reaped,
+ *   the record is published when its bytes are written and the completion holds its log entry.
+ * returns -1 when all the requests are in flight, poll then frees some
+ */
+error_t database_async__instance__insert(database_async_t* self, const char* data, size_t data_length, void* user_data);
+/**
+ * queues the read of the latest version of the record with the given 32 bytes id.
+ * an id that is not live completes at once with a -1 result
+ */
+error_t database_async__instance__get(database_async_t* self, const char* id, void* user_data);
+/**
+ * hands the queued requests to the kernel, waits until at least wait of them finished
+ *   or nothing is left in flight, and moves up to max of the finished ones into completions.
+ * returns how many were moved, -1 when the ring failed
+ */
+int database_async__instance__poll(database_async_t* self, database_completion_t* completions, unsigned max, unsigned wait);
+/**
+ * iterates over the latest records with their content like database__instance__get_latest_records_with_content
+ *   in data order, keeping depth reads in flight. the records come in the order their reads finish
+ */
+error_t database_async__instance__get_latest_records_with_content(database_async_t* self, record_found_with_span_fn on_record_found);
+/**
+ * waits for the requests in flight, drops the completions nobody reaped and frees the queue
+ */
+error_t database_async__instance__close(database_async_t* self);
+
 #endif
\ No newline at end of file
@@ -2,15 +2,24 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "filedb.h"
 
 #define DEFAULT_TEST_DATABASE_NAME "testdb"
 
+// record ids are raw hash bytes, printed as hex
+static const char* id_to_hex(const record_t *record, char *hex) {
+    for (int i = 0; i < 32; i++) sprintf(hex + 2 * i, "%02x", (unsigned char)record->id[i]);
+    return hex;
+}
+
 void test_record_creation() {
     char data[] = "Test content creation";
     printf(" - creating record from buffer\n");
     record_t *record = record__static__new_from_buffer(0, data, strlen(data));
-    printf(" * record_t(%s %zu %zu)\n",record->id,record->start,record->end);
+    char hex[65];
+    printf(" * record_t(%s %zu %zu)\n",id_to_hex(record, hex),record->start,record->end);
     printf(" - test not null\n");
     assert(record != NULL);
     printf(" - test not null\n");
@@ -47,6 +56,109 @@ void test_insert_record(const char* dbname) {
     assert(database__static__close(db) == 0);
 }
 
+static char* test_insert_batch__data[] = {"Batch record 1", "Batch record number 2", "Batch record 3 of 3"};
+static size_t test_insert_batch__start;
+static int test_insert_batch__found;
+error_t test_insert_batch__compare(record_t *record, int ord, char *content) {
+    if (record->start < test_insert_batch__start) return 0;
+    assert(strcmp(content, test_insert_batch__data[test_insert_batch__found++]) == 0);
+    return 0;
+}
+void test_insert_batch(const char* dbname) {
+    database_t *db = database__static_open(dbname);
+    size_t length = db->record_list_length;
+    size_t data_file_length = db->data_file_length;
+
+    size_t lengths[3];
+    for (int i = 0; i < 3; i++) lengths[i] = strlen(test_insert_batch__data[i]);
+    record_t records[3];
+    assert(database__instance__insert_batch(db, test_insert_batch__data, lengths, 3, records) == 0);
+    assert(db->record_list_length == length + 3);
+
+    // the payloads are laid out back to back at the previous end of the data file
+    size_t start = data_file_length;
+    for (int i = 0; i < 3; i++) {
+        assert(records[i].start == start);
+        assert(records[i].end == start + lengths[i]);
+        assert(memcmp(&db->record_list[length + i], &records[i], sizeof(record_t)) == 0);
+        start = records[i].end;
+    }
+    assert(db->data_file_length == start);
+
+    // an empty buffer rejects the whole batch
+    size_t bad_lengths[3] = {lengths[0], 0, lengths[2]};
+    assert(database__instance__insert_batch(db, test_insert_batch__data, bad_lengths, 3, NULL) != 0);
+    assert(db->record_list_length == length + 3);
+    assert(database__static__close(db) == 0);
+
+    // the batch is persisted in both files
+    db = database__static_open(dbname);
+    assert(db->record_list_length == length + 3);
+    assert(db->data_file_length == start);
+    assert(memcmp(&db->record_list[length + 2], &records[2], sizeof(record_t)) == 0);
+    test_insert_batch__start = data_file_length;
+    test_insert_batch__found = 0;
+    assert(database__instance__list_all_with_content(db, test_insert_batch__compare) == 0);
+    assert(test_insert_batch__found == 3);
+    assert(database__static__close(db) == 0);
+}
+
+void test_durability(const char* dbname) {
+    database_options_t options = {
+        .durability = DATABASE_DURABILITY_EVERY_N_RECORDS,
+        .sync_every_records = 2,
+        .write_buffer_size = 4096,
+        .preallocate_extent = 1 << 20,
+    };
+    database_t *db = database__static_open_with_options(dbname, &options);
+    assert(db != NULL);
+    size_t length = db->record_list_length;
+
+    // the first record stays staged in the buffers, the second one triggers the sync
+    char data1[] = "Record 1 test_durability";
+    char data2[] = "Record 2 test_durability";
+    assert(database__instance__insert_record(db, data1, strlen(data1)) != NULL);
+    assert(db->data_buffer.length == strlen(data1));
+    // the compact index entry is far smaller than the in-memory record
+    assert(db->index_buffer.length > 0 && db->index_buffer.length < sizeof(record_t));
+    assert(db->records_since_sync == 1);
+    assert(database__instance__insert_record(db, data2, strlen(data2)) != NULL);
+    assert(db->data_buffer.length == 0);
+    assert(db->index_buffer.length == 0);
+    assert(db->records_since_sync == 0);
+
+    // a staged delete is visible to the readers once flushed
+    record_t *deleted = database__instance__delete_record(db, &db->record_list[length]);
+    assert(deleted != NULL);
+    assert(db->index_buffer.length > 0 && db->index_buffer.length < sizeof(record_t));
+    assert(database__instance__flush(db) == 0);
+    assert(db->index_buffer.length == 0);
+    assert(database__static__close(db) == 0);
+
+    db = database__static_open(dbname);
+    assert(db->record_list_length == length + 3);
+    assert(record__instance__is_deleted(&db->record_list[length + 2]));
+    assert(database__static__close(db) == 0);
+
+    // the background flusher syncs the staged records on its own
+    options.durability = DATABASE_DURABILITY_INTERVAL;
+    options.sync_interval_ms = 10;
+    db = database__static_open_with_options(dbname, &options);
+    assert(db != NULL);
+    assert(database__instance__insert_record(db, data1, strlen(data1)) != NULL);
+    // the flusher resets the count under the write lock
+    size_t records_since_sync = 1;
+    for (int i = 0; i < 100 && records_since_sync != 0; i++) {
+        usleep(10000);
+        assert(database__instance__flush(db) == 0);
+        pthread_mutex_lock(&db->write_lock);
+        records_since_sync = db->records_since_sync;
+        pthread_mutex_unlock(&db->write_lock);
+    }
+    assert(records_since_sync == 0);
+    assert(database__static__close(db) == 0);
+}
+
 void test_delete_record(const char* dbname) {
     database_t *db = database__static_open(dbname);
     char data[] = "Test delete";
@@ -60,7 +172,8 @@ void test_delete_record(const char* dbname) {
 
 
 int cbk_print_record(record_t *record, int ord) {
-    printf("Record %d: %.32s  %1x  %32x %32x\n", ord, record->id,record__instance__is_deleted(record),record->start,record->end);fflush(stdout);
+    char hex[65];
+    printf("Record %d: %s  %1x  %32x %32x\n", ord, id_to_hex(record, hex),record__instance__is_deleted(record),record->start,record->end);fflush(stdout);
     return 0;
 }
 void test_list_all(const char* dbname) {
@@ -88,6 +201,116 @@ void test_get_latest_records(const char* dbname){
     }
 }
 
+static size_t test_list_all_mapped_content__bytes;
+error_t test_list_all_mapped_content__compare(record_t *record, int ord, const char *content, size_t content_length) {
+    assert(content_length == record->length);
+    test_list_all_mapped_content__bytes += content_length;
+    return 0;
+}
+error_t test_list_all_mapped_content__sum(record_t *record, int ord, char *content) {
+    test_list_all_mapped_content__bytes -= strlen(content);
+    return 0;
+}
+void test_list_all_mapped_content(const char* dbname) {
+    database_options_t options = {.advise_sequential = 1};
+    database_t *db = database__static_open_with_options(dbname, &options);
+    assert(db != NULL);
+
+    test_list_all_mapped_content__bytes = 0;
+    assert(database__instance__list_all_mapped_content(db, test_list_all_mapped_content__compare) == 0);
+    size_t mapped = db->data_map_length;
+
+    // the mapping grows lazily once records are appended past its end
+    char data[] = "Record test_list_all_mapped_content";
+    database__instance__insert_record(db, data, strlen(data));
+    assert(database__instance__list_all_mapped_content(db, test_list_all_mapped_content__compare) == 0);
+    assert(db->data_map_length == mapped + strlen(data));
+
+    // both scans see the same bytes
+    test_list_all_mapped_content__bytes = 0;
+    assert(database__instance__list_all_mapped_content(db, test_list_all_mapped_content__compare) == 0);
+    assert(database__instance__list_all_with_content(db, test_list_all_mapped_content__sum) == 0);
+    assert(test_list_all_mapped_content__bytes == 0);
+    assert(database__static__close(db) == 0);
+}
+
+void test_get_by_id(const char* dbname) {
+    database_t *db = database__static_open(dbname);
+    char data[] = "Record test_get_by_id";
+    record_t *record = database__instance__insert_record(db, data, strlen(data));
+    assert(record != NULL);
+    char id[32];
+    memcpy(id, record->id, 32);
+
+    record_t *found = database__instance__get_by_id(db, id);
+    assert(found != NULL);
+    assert(memcmp(found->id, id, 32) == 0);
+    assert(found->end - found->start == strlen(data));
+
+    database__instance__delete_record(db, found);
+    assert(database__instance__get_by_id(db, id) == NULL);
+    assert(database__static__close(db) == 0);
+
+    // the index is rebuilt from the log on open
+    db = database__static_open(dbname);
+    assert(database__instance__get_by_id(db, id) == NULL);
+    record = database__instance__insert_record(db, data, strlen(data));
+    assert(database__static__close(db) == 0);
+    db = database__static_open(dbname);
+    found = database__instance__get_by_id(db, id);
+    assert(found != NULL);
+    assert(found == &db->record_list[db->record_list_length - 1]);
+    assert(database__static__close(db) == 0);
+}
+
+int cbk_count_record(record_t *record, int ord) {
+    return 0;
+}
+void test_mapped_index(const char* dbname) {
+    database_t *db = database__static_open(dbname);
+    size_t length = db->record_list_length;
+    assert(database__static__close(db) == 0);
+
+    database_options_t options = {.map_index = 1};
+    db = database__static_open_with_options(dbname, &options);
+    assert(db != NULL);
+    assert(db->record_list_length == length);
+    assert(db->record_list_offset == length);
+
+    // enough appends to fold the in-memory tail back into the mapping
+    char data[64];
+    char id[32];
+    for (int i = 0; i < 5000; i++) {
+        int data_length = snprintf(data, sizeof(data), "Record %d test_mapped_index", i);
+        record_t *record = database__instance__insert_record(db, data, data_length);
+        assert(record != NULL);
+        if (i == 0) memcpy(id, record->id, 32);
+    }
+    assert(db->record_list_length == length + 5000);
+    assert(db->record_list_offset > length);
+    assert(database__instance__list_all(db, cbk_count_record) == 0);
+    assert(database__instance__record_at(db, length + 4999) != NULL);
+    assert(database__instance__record_at(db, length + 5000) == NULL);
+
+    record_t *found = database__instance__get_by_id(db, id);
+    assert(found != NULL);
+    assert(found == database__instance__record_at(db, length));
+    assert(database__static__close(db) == 0);
+
+    // the heap loaded index sees the same log
+    db = database__static_open(dbname);
+    assert(db->record_list_length == length + 5000);
+    assert(memcmp(db->record_list[length].id, id, 32) == 0);
+    assert(database__static__close(db) == 0);
+}
+
+error_t test_optimize__verify_content(record_t *record, int ord, char *content) {
+    // the content still hashes to the id once moved
+    record_t *rehashed = record__static__new_from_buffer(0, content, record->length);
+    assert(memcmp(rehashed->id, record->id, 32) == 0);
+    free(rehashed);
+    return 0;
+}
 void test_optimize(const char* dbname) {
     database_t *db = database__static_open(dbname);
     char data1[] = "Record 1 test_optimize";
@@ -100,14 +323,1225 @@ void test_optimize(const char* dbname) {
     assert(database__instance__optimize(db) == 0);
     printf(" - print optimized\n");
     assert(database__instance__list_all(db, cbk_print_record) == 0);
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+    assert(db->record_list_length == db->id_index_length);
+    assert(database__static__close(db) == 0);
+}
+
+
+void test_optimize_async(const char* dbname) {
+    database_t *db = database__static_open(dbname);
+    char data[64];
+    char ids[200][32];
+    for (int i = 0; i < 100; i++) {
+        int data_length = snprintf(data, sizeof(data), "Record %d before test_optimize_async", i);
+        memcpy(ids[i], database__instance__insert_record(db, data, data_length)->id, 32);
+    }
+
+    // inserts and deletes keep going while the worker compacts
+    assert(database__instance__optimize_async(db) == 0);
+    assert(database__instance__optimize_async(db) != 0);
+    for (int i = 100; i < 200; i++) {
+        int data_length = snprintf(data, sizeof(data), "Record %d during test_optimize_async", i);
+        memcpy(ids[i], database__instance__insert_record(db, data, data_length)->id, 32);
+    }
+    for (int i = 0; i < 200; i += 10) {
+        record_t *record = database__instance__get_by_id(db, ids[i]);
+        if (record) database__instance__delete_record(db, record);
+    }
+    assert(database__instance__optimize_wait(db) == 0);
+
+    // the tail was replayed into the new generation
+    for (int i = 0; i < 200; i++) {
+        // distinct contents may share an id, those are deleted together
+        int deleted = 0;
+        for (int j = 0; j < 200; j += 10) deleted |= memcmp(ids[i], ids[j], 32) == 0;
+        record_t *record = database__instance__get_by_id(db, ids[i]);
+        assert(deleted ? record == NULL : record != NULL);
+    }
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+    assert(database__static__close(db) == 0);
+
+    db = database__static_open(dbname);
+    assert(database__instance__get_by_id(db, ids[190]) == NULL);
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+    assert(database__static__close(db) == 0);
+}
+
+static void* test_segmented_log__optimize(void *db) {
+    return database__instance__optimize((database_t*)db) == 0 ? db : NULL;
+}
+
+void test_segmented_log(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.segmented", dbname);
+    database_options_t options = {.segment_size = 256, .compaction_segments = 2};
+    database_t *db = database__static_open_with_options(path, &options);
+    assert(db != NULL);
+    size_t first_segment = db->active_segment;
+
+    // the payloads roll over to new segments once the active one is full
+    char data[64];
+    char ids[40][32];
+    for (int i = 0; i < 40; i++) {
+        int data_length = snprintf(data, sizeof(data), "Segmented record test_segmented_log %c", '0' + i);
+        record_t *record = database__instance__insert_record(db, data, data_length);
+        assert(record != NULL);
+        assert(record__instance__segment(record) == db->active_segment);
+        memcpy(ids[i], record->id, 32);
+    }
+    assert(db->active_segment > first_segment + 4);
+    for (size_t i = 1; i < db->segments_length; i++) assert(db->segments[i].length <= 256);
+
+    // deleting the early records turns their segments into garbage
+    for (int i = 0; i < 20; i++) {
+        record_t *record = database__instance__get_by_id(db, ids[i]);
+        if (record) database__instance__delete_record(db, record);
+    }
+    size_t garbage_segment = record__instance__segment(database__instance__get_by_id(db, ids[39])) - 1;
+    size_t dead_bytes = 0;
+    for (size_t i = 1; i < db->segments_length; i++) dead_bytes += db->segments[i].length - db->segments[i].live_bytes;
+    assert(dead_bytes > 0);
+
+    // each optimize pass compacts at most two segments
+    assert(database__instance__optimize(db) == 0);
+    size_t remaining = 0;
+    for (size_t i = 1; i < db->segments_length; i++) remaining += db->segments[i].length - db->segments[i].live_bytes;
+    assert(remaining < dead_bytes);
+    assert(database__instance__optimize_async(db) == 0);
+    assert(database__instance__optimize_wait(db) == 0);
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+    for (int i = 20; i < 40; i++) assert(database__instance__get_by_id(db, ids[i]) != NULL);
+    assert(database__instance__get_by_id(db, ids[0]) == NULL);
+    assert(garbage_segment > 0);
+    assert(database__static__close(db) == 0);
+
+    db = database__static_open_with_options(path, &options);
+    for (int i = 20; i < 40; i++) assert(database__instance__get_by_id(db, ids[i]) != NULL);
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+
+    // two synchronous passes at once never compact the same segments, the second one is refused while the first runs
+    for (int i = 20; i < 30; i++) assert(database__instance__delete_record(db, database__instance__get_by_id(db, ids[i])) != NULL);
+    pthread_t optimizer;
+    assert(pthread_create(&optimizer, NULL, test_segmented_log__optimize, db) == 0);
+    error_t result = database__instance__optimize(db);
+    void *other_result;
+    pthread_join(optimizer, &other_result);
+    assert(result == 0 || other_result != NULL);
+    for (int i = 30; i < 40; i++) assert(database__instance__get_by_id(db, ids[i]) != NULL);
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+    assert(database__static__close(db) == 0);
+}
+
+void test_deduplicate(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.deduplicated", dbname);
+    database_options_t options = {.deduplicate = 1};
+    database_t *db = database__static_open_with_options(path, &options);
+    assert(db != NULL);
+    size_t data_length = db->data_file_length;
+
+    // the same payload is only stored once, whether inserted alone or repeated in a batch
+    char blob[] = "Deduplicated blob test_deduplicate";
+    char other[] = "Another blob test_deduplicate";
+    record_t *record = database__instance__insert_record(db, blob, strlen(blob));
+    assert(record != NULL);
+    size_t start = record->start;
+    assert(database__instance__insert_record(db, blob, strlen(blob))->start == start);
+
+    char *buffers[] = {other, blob, other, blob};
+    size_t lengths[] = {strlen(other), strlen(blob), strlen(other), strlen(blob)};
+    record_t records[4];
+    assert(database__instance__insert_batch(db, buffers, lengths, 4, records) == 0);
+    assert(records[1].start == start && records[3].start == start);
+    assert(records[0].start == records[2].start);
+    assert(memcmp(records[0].id, records[2].id, 32) == 0);
+    assert(db->data_file_length <= data_length + strlen(blob) + strlen(other));
+
+    // a deleted payload is written again
+    size_t before = db->data_file_length;
+    assert(database__instance__delete_record(db, database__instance__get_by_id(db, records[0].id)) != NULL);
+    record = database__instance__insert_record(db, other, strlen(other));
+    assert(record->start == before);
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+    assert(database__static__close(db) == 0);
+
+    // reopened, the index rebuilt from the log still finds the stored copies
+    db = database__static_open_with_options(path, &options);
+    before = db->data_file_length;
+    assert(database__instance__insert_record(db, blob, strlen(blob))->start == start);
+    assert(db->data_file_length == before);
     assert(database__static__close(db) == 0);
 }
 
+static size_t test_compression__bytes;
+error_t test_compression__compare(record_t *record, int ord, const char *content, size_t content_length) {
+    test_compression__bytes += content_length;
+    return test_optimize__verify_content(record, ord, (char*)content);
+}
+void test_compression(const char* dbname) {
+    char path[256], data_path[256], index_path[256];
+    snprintf(path, sizeof(path), "%s.compressed", dbname);
+    // the byte counts below only hold for a new database
+    snprintf(data_path, sizeof(data_path), "%s.data", path);
+    snprintf(index_path, sizeof(index_path), "%s.index", path);
+    unlink(data_path);
+    unlink(index_path);
+    database_options_t options = {.compression = RECORD_CODEC_LZ};
+    database_t *db = database__static_open_with_options(path, &options);
+    assert(db != NULL);
+
+    // json like payloads shrink, tiny ones are stored as they are
+    char json[2048];
+    size_t json_length = 0;
+    for (int i = 0; json_length < 1900; i++) {
+        json_length += sprintf(json + json_length, "{\"id\":%d,\"name\":\"user %d\",\"active\":true}\n", i, i);
+    }
+    char tiny[] = "tiny test_compression";
+    record_t *record = database__instance__insert_record(db, json, json_length);
+    assert(record->codec == RECORD_CODEC_LZ);
+    assert(record->length == json_length);
+    assert(record->end - record->start < json_length / 2);
+    record = database__instance__insert_record(db, tiny, strlen(tiny));
+    assert(record->codec == RECORD_CODEC_NONE);
+
+    char content[2048];
+    record = database__instance__get_by_id(db, database__instance__record_at(db, 0)->id);
+    assert(database__instance__read_content(db, record, content) == 0);
+    assert(memcmp(content, json, json_length) == 0);
+
+    // every reader decodes, also after the records were moved by optimize and without the option
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+    test_compression__bytes = 0;
+    assert(database__instance__list_all_mapped_content(db, test_compression__compare) == 0);
+    assert(test_compression__bytes == json_length + strlen(tiny));
+    assert(database__instance__optimize(db) == 0);
+    assert(database__static__close(db) == 0);
+
+    db = database__static_open(path);
+    test_compression__bytes = 0;
+    assert(database__instance__list_all_mapped_content(db, test_compression__compare) == 0);
+    assert(test_compression__bytes == json_length + strlen(tiny));
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+    assert(database__static__close(db) == 0);
+}
+
+void test_legacy_index(const char* dbname) {
+    // the headerless 48 bytes entries written by the first releases
+    struct {
+        char id[32];
+        size_t start;
+        size_t end;
+    } legacy[2] = {{"0000000000000000000000000000abc", 0, 18}, {"0000000000000000000000000000abd", 18, 36}};
+    char path[256], data_path[256], index_path[256];
+    snprintf(path, sizeof(path), "%s.legacy", dbname);
+    snprintf(data_path, sizeof(data_path), "%s.data", path);
+    snprintf(index_path, sizeof(index_path), "%s.index", path);
+    FILE *data = fopen(data_path, "wb");
+    fputs("legacy record no 1legacy record no 2", data);
+    fclose(data);
+    FILE *index = fopen(index_path, "wb");
+    fwrite(legacy, sizeof(legacy), 1, index);
+    fclose(index);
+
+    // opening upgrades the index in place and keeps every record
+    database_t *db = database__static_open(path);
+    assert(db != NULL);
+    assert(db->record_list_length == 2);
+    record_t *record = database__instance__get_by_id(db, legacy[1].id);
+    assert(record != NULL && record->length == 18);
+    char content[18];
+    assert(database__instance__read_content(db, record, content) == 0);
+    assert(memcmp(content, "legacy record no 2", 18) == 0);
+    assert(database__static__close(db) == 0);
+
+    char magic[8];
+    index = fopen(index_path, "rb");
+    assert(fread(magic, sizeof(magic), 1, index) == 1);
+    fclose(index);
+    assert(memcmp(magic, "FILEDBIX", 8) == 0);
+    db = database__static_open(path);
+    assert(db->record_list_length == 2);
+    assert(database__static__close(db) == 0);
+}
+
+typedef struct test_concurrent_readers__context_s {
+    database_t *db;
+    int stop;
+    size_t lookups;
+} test_concurrent_readers__context_t;
+
+static __thread size_t test_concurrent_readers__latest;
+error_t test_concurrent_readers__count(record_t *record, int ord) {
+    test_concurrent_readers__latest++;
+    return 0;
+}
+error_t test_concurrent_readers__check_span(record_t *record, int ord, const char *content, size_t content_length) {
+    assert(content_length > 25 && memcmp(content, "concurrent reader record ", 25) == 0);
+    return 0;
+}
+void* test_concurrent_readers__reader(void *arg) {
+    test_concurrent_readers__context_t *context = (test_concurrent_readers__context_t*)arg;
+    database_t *db = context->db;
+    unsigned seed = (unsigned)(size_t)pthread_self();
+    size_t live = 0;
+    char content[64];
+    for (size_t round = 0; !__atomic_load_n(&context->stop, __ATOMIC_ACQUIRE); round++) {
+        // the records stay valid until read_end whatever the writer appends meanwhile,
+        // the sections get_by_id and read_content open inside it are nested ones
+        size_t section = database__instance__read_begin(db);
+        size_t length = __atomic_load_n(&db->record_list_length, __ATOMIC_ACQUIRE);
+        if (length > 0) {
+            record_t *record = database__instance__record_at(db, rand_r(&seed) % length);
+            record_t *latest = database__instance__get_by_id(db, record->id);
+            assert(latest != NULL && memcmp(latest->id, record->id, 32) == 0);
+            assert(latest->length < sizeof(content));
+            assert(database__instance__read_content(db, latest, content) == 0);
+            assert(memcmp(content, "concurrent reader record ", 25) == 0);
+        }
+        database__instance__read_end(db, section);
+
+        // nothing is deleted, the live records only grow
+        test_concurrent_readers__latest = 0;
+        assert(database__instance__get_latest_records(db, test_concurrent_readers__count) == 0);
+        assert(test_concurrent_readers__latest >= live);
+        live = test_concurrent_readers__latest;
+        if (round % 64 == 0) assert(database__instance__list_all_mapped_content(db, test_concurrent_readers__check_span) == 0);
+        __atomic_add_fetch(&context->lookups, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+void test_concurrent_readers(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.concurrent", dbname);
+    database_options_t configurations[3] = {{.map_index = 1, .bloom_filter = 1}, {.write_buffer_size = 4096, .compression = RECORD_CODEC_LZ}, {.btree_index = 1}};
+    for (int c = 0; c < 3; c++) {
+        database_t *db = database__static_open_with_options(path, &configurations[c]);
+        assert(db != NULL);
+        char data[64];
+        int length = sprintf(data, "concurrent reader record %d", -1);
+        assert(database__instance__insert_record(db, data, length) != NULL);
+
+        test_concurrent_readers__context_t context = {db, 0, 0};
+        pthread_t readers[4];
+        for (int r = 0; r < 4; r++) assert(pthread_create(&readers[r], NULL, test_concurrent_readers__reader, &context) == 0);
+        // enough entries to grow the log and the id index several times and to remap a mapped index
+        for (int i = 0; i < 5000; i++) {
+            length = sprintf(data, "concurrent reader record %d", i);
+            assert(database__instance__insert_record(db, data, length) != NULL);
+        }
+        __atomic_store_n(&context.stop, 1, __ATOMIC_RELEASE);
+        for (int r = 0; r < 4; r++) pthread_join(readers[r], NULL);
+        printf("%zu read rounds while inserting\n", context.lookups);
+
+        // a nested section only counts the depth, the generation lock is released with the outer one
+        size_t outer = database__instance__read_begin(db);
+        size_t inner = database__instance__read_begin(db);
+        assert(inner == outer);
+        assert(database__instance__get_by_id(db, database__instance__record_at(db, 0)->id) != NULL);
+        database__instance__read_end(db, inner);
+        assert(pthread_rwlock_trywrlock(&db->generation_lock) != 0);
+        database__instance__read_end(db, outer);
+        assert(pthread_rwlock_trywrlock(&db->generation_lock) == 0);
+        pthread_rwlock_unlock(&db->generation_lock);
+
+        assert(database__instance__optimize(db) == 0);
+        test_concurrent_readers__latest = 0;
+        assert(database__instance__get_latest_records(db, test_concurrent_readers__count) == 0);
+        assert(test_concurrent_readers__latest >= 5001);
+        assert(database__static__close(db) == 0);
+    }
+}
+
+typedef struct test_parallel_scan__context_s {
+    size_t bytes[4];
+    size_t records[4];
+    int inside;
+    int last_ord;
+    int fail_at;
+} test_parallel_scan__context_t;
+
+static size_t test_parallel_scan__expected_bytes;
+error_t test_parallel_scan__count_expected(record_t *record, int ord, const char *content, size_t content_length) {
+    test_parallel_scan__expected_bytes += content_length;
+    return 0;
+}
+error_t test_parallel_scan__check(record_t *record, int ord, const char *content, size_t content_length, size_t worker, void *user_ctx) {
+    test_parallel_scan__context_t *context = (test_parallel_scan__context_t*)user_ctx;
+    assert(worker < 4);
+    assert(content_length == record->length && memcmp(content, "parallel scan record ", 21) == 0);
+    context->bytes[worker] += content_length;
+    context->records[worker]++;
+    return ord == context->fail_at ? -7 : 0;
+}
+error_t test_parallel_scan__check_order(record_t *record, int ord, const char *content, size_t content_length, size_t worker, void *user_ctx) {
+    test_parallel_scan__context_t *context = (test_parallel_scan__context_t*)user_ctx;
+    // the ordered callbacks are never concurrent
+    assert(__atomic_add_fetch(&context->inside, 1, __ATOMIC_SEQ_CST) == 1);
+    assert(ord > context->last_ord);
+    context->last_ord = ord;
+    context->bytes[0] += content_length;
+    __atomic_sub_fetch(&context->inside, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+void test_parallel_scan(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.parallel", dbname);
+    database_options_t options = {.compression = RECORD_CODEC_LZ};
+    database_t *db = database__static_open_with_options(path, &options);
+    assert(db != NULL);
+
+    // compressible and incompressible payloads, with some deleted records in between
+    char data[512];
+    for (int i = 0; i < 3000; i++) {
+        int length = sprintf(data, "parallel scan record %d ", i);
+        for (int j = 0; j < i % 7; j++) length += sprintf(data + length, "{\"field\":%d,\"value\":%d}", j, j);
+        record_t *record = database__instance__insert_record(db, data, length);
+        assert(record != NULL);
+        if (i % 10 == 3) database__instance__delete_record(db, record);
+    }
+    test_parallel_scan__expected_bytes = 0;
+    assert(database__instance__list_all_mapped_content(db, test_parallel_scan__count_expected) == 0);
+
+    test_parallel_scan__context_t context = {.last_ord = -1, .fail_at = -1};
+    assert(database__instance__parallel_scan(db, 4, test_parallel_scan__check, &context) == 0);
+    size_t bytes = 0, records = 0;
+    for (int w = 0; w < 4; w++) {
+        bytes += context.bytes[w];
+        records += context.records[w];
+    }
+    assert(bytes == test_parallel_scan__expected_bytes);
+    assert(records >= 3000);
+
+    test_parallel_scan__context_t ordered = {.last_ord = -1, .fail_at = -1};
+    assert(database__instance__parallel_scan_ordered(db, 4, test_parallel_scan__check_order, &ordered) == 0);
+    assert(ordered.bytes[0] == test_parallel_scan__expected_bytes);
+
+    // the first error stops the scan and is returned
+    test_parallel_scan__context_t failing = {.last_ord = -1, .fail_at = 1000};
+    assert(database__instance__parallel_scan(db, 4, test_parallel_scan__check, &failing) == -7);
+    assert(database__static__close(db) == 0);
+}
 
 // Callback to validate record content
+static size_t test_btree_index__latest;
+error_t test_btree_index__count(record_t *record, int ord) {
+    assert(!record__instance__is_deleted(record));
+    test_btree_index__latest++;
+    return 0;
+}
+void test_btree_index(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.btree_index", dbname);
+    database_options_t options = {.btree_index = 1, .btree_cache_pages = 8};
+    database_t *db = database__static_open_with_options(path, &options);
+    assert(db != NULL);
+    assert(db->btree != NULL);
+
+    // more ids than the cached pages can hold, every fifth one deleted
+    char data[64];
+    static char ids[3000][32];
+    for (int i = 0; i < 3000; i++) {
+        int data_length = snprintf(data, sizeof(data), "Record %d test_btree_index", i);
+        record_t *record = database__instance__insert_record(db, data, data_length);
+        assert(record != NULL);
+        memcpy(ids[i], record->id, 32);
+        if (i % 5 == 0) assert(database__instance__delete_record(db, record) != NULL);
+    }
+    for (int i = 0; i < 3000; i++) {
+        record_t *found = database__instance__get_by_id(db, ids[i]);
+        assert((found == NULL) == (i % 5 == 0));
+        if (found) assert(memcmp(found->id, ids[i], 32) == 0);
+    }
+    test_btree_index__latest = 0;
+    assert(database__instance__get_latest_records(db, test_btree_index__count) == 0);
+    assert(test_btree_index__latest == 2400);
+    // the in-memory id index is never built
+    assert(db->id_index == NULL);
+    assert(database__instance__sync(db) == 0);
+    assert(db->btree->clean);
+    assert(database__static__close(db) == 0);
+
+    // a saved tree is reused as it is, an unreadable one is rebuilt from the log
+    db = database__static_open_with_options(path, &options);
+    assert(db->btree->clean);
+    assert(db->btree->tag == db->record_list_length);
+    assert(database__instance__get_by_id(db, ids[1]) != NULL);
+    assert(database__static__close(db) == 0);
+    char btree_path[256];
+    snprintf(btree_path, sizeof(btree_path), "%s.btree", path);
+    FILE *garbage = fopen(btree_path, "wb");
+    fputs("not a tree", garbage);
+    fclose(garbage);
+    db = database__static_open_with_options(path, &options);
+    assert(db->btree->length == 2400);
+    assert(database__instance__get_by_id(db, ids[2]) != NULL);
+
+    // optimize moves every record, the tree follows the new positions
+    assert(database__instance__optimize(db) == 0);
+    assert(db->record_list_length == 2400);
+    for (int i = 1; i < 3000; i += 7) {
+        record_t *found = database__instance__get_by_id(db, ids[i]);
+        assert((found == NULL) == (i % 5 == 0));
+    }
+    assert(database__instance__list_all_with_content(db, test_optimize__verify_content) == 0);
+    assert(database__static__close(db) == 0);
+
+    // the segment garbage is accounted through the tree
+    snprintf(path, sizeof(path), "%s.btree_segmented", dbname);
+    database_options_t segmented = {.btree_index = 1, .segment_size = 512};
+    db = database__static_open_with_options(path, &segmented);
+    assert(db != NULL);
+    for (int i = 0; i < 200; i++) {
+        int data_length = snprintf(data, sizeof(data), "Record %d test_btree_index", i);
+        record_t *record = database__instance__insert_record(db, data, data_length);
+        assert(record != NULL);
+        if (i < 100) database__instance__delete_record(db, record);
+    }
+    assert(database__instance__optimize(db) == 0);
+    test_btree_index__latest = 0;
+    assert(database__instance__get_latest_records(db, test_btree_index__count) == 0);
+    assert(test_btree_index__latest == 100);
+    assert(database__static__close(db) == 0);
+}
+
+void test_bloom_filter(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.bloom_filter", dbname);
+    database_options_t options = {.bloom_filter = 1};
+    database_t *db = database__static_open_with_options(path, &options);
+    assert(db != NULL);
+    assert(db->bloom != NULL);
+    size_t initial_blocks = db->bloom->blocks;
+
+    // enough ids to outgrow the initial filter, every fourth one deleted
+    char data[64];
+    static char ids[3000][32];
+    for (int i = 0; i < 3000; i++) {
+        int data_length = snprintf(data, sizeof(data), "Record %d test_bloom_filter", i);
+        record_t *record = database__instance__insert_record(db, data, data_length);
+        assert(record != NULL);
+        memcpy(ids[i], record->id, 32);
+        if (i % 4 == 0) assert(database__instance__delete_record(db, record) != NULL);
+    }
+    assert(db->bloom->blocks > initial_blocks);
+    for (int i = 0; i < 3000; i++) {
+        assert(bloom__instance__may_contain(db->bloom, ids[i]));
+        assert((database__instance__get_by_id(db, ids[i]) == NULL) == (i % 4 == 0));
+    }
+    assert(database__static__close(db) == 0);
+
+    // a mapped index builds its id index on first use, unknown ids are answered by the saved filter alone
+    database_options_t mapped = {.bloom_filter = 1, .map_index = 1};
+    db = database__static_open_with_options(path, &mapped);
+    assert(db->bloom->tag == db->record_list_length);
+    size_t misses = 0;
+    char unknown[32];
+    for (int i = 0; i < 1000; i++) {
+        int data_length = snprintf(data, sizeof(data), "Never inserted %d test_bloom_filter", i);
+        record_t *record = record__static__new_from_buffer(0, data, data_length);
+        memcpy(unknown, record->id, 32);
+        free(record);
+        if (bloom__instance__may_contain(db->bloom, unknown)) continue;
+        assert(database__instance__get_by_id(db, unknown) == NULL);
+        misses++;
+    }
+    printf("%zu of 1000 unknown ids rejected by the filter\n", misses);
+    assert(misses > 950);
+    assert(!db->id_index_built);
+    assert(database__instance__get_by_id(db, ids[1]) != NULL);
+
+    // optimize rebuilds the filter over the live ids only
+    assert(database__instance__optimize(db) == 0);
+    assert(db->bloom->length == 2250);
+    for (int i = 1; i < 3000; i += 4) assert(database__instance__get_by_id(db, ids[i]) != NULL);
+    assert(database__static__close(db) == 0);
+}
+
+void test_checkpoint(const char* dbname) {
+    char path[256], checkpoint_path[256];
+    snprintf(path, sizeof(path), "%s.checkpoint_test", dbname);
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.checkpoint", path);
+    database_options_t options = {.checkpoint_interval = 1000};
+    database_t *db = database__static_open_with_options(path, &options);
+    assert(db != NULL);
+
+    // a checkpoint every 1000 entries, every third record deleted
+    char data[64];
+    static char ids[2500][32];
+    for (int i = 0; i < 2500; i++) {
+        int data_length = snprintf(data, sizeof(data), "Record %d test_checkpoint", i);
+        record_t *record = database__instance__insert_record(db, data, data_length);
+        assert(record != NULL);
+        memcpy(ids[i], record->id, 32);
+        if (i % 3 == 0) assert(database__instance__delete_record(db, record) != NULL);
+    }
+    size_t covered = db->checkpoint_length;
+    assert(covered >= 3000 && covered < db->record_list_length);
+    assert(database__instance__checkpoint(db) == 0);
+    assert(db->checkpoint_length == db->record_list_length);
+    // appended after the last checkpoint and replayed on open
+    record_t *late = database__instance__insert_record(db, "late record test_checkpoint", 27);
+    char late_id[32];
+    memcpy(late_id, late->id, 32);
+    database__instance__delete_record(db, database__instance__get_by_id(db, ids[1]));
+    size_t length = db->record_list_length;
+    assert(database__static__close(db) == 0);
+
+    db = database__static_open_with_options(path, &options);
+    assert(db->checkpoint_length == length);
+    assert(db->id_index_length == 2500 - 834 - 1 + 1);
+    for (int i = 0; i < 2500; i++) assert((database__instance__get_by_id(db, ids[i]) == NULL) == (i % 3 == 0 || i == 1));
+    assert(database__instance__get_by_id(db, late_id) != NULL);
+    assert(database__static__close(db) == 0);
+
+    // a checkpoint that doesn't match the log is ignored and the whole log replayed
+    FILE *garbage = fopen(checkpoint_path, "r+b");
+    fseek(garbage, 200, SEEK_SET);
+    fputs("corrupted", garbage);
+    fclose(garbage);
+    db = database__static_open_with_options(path, &options);
+    assert(db->checkpoint_length == 0);
+    assert(db->id_index_length == 2500 - 834);
+    assert(database__instance__get_by_id(db, late_id) != NULL);
+
+    // optimize moves the records, the checkpoint of the previous log is dropped
+    assert(database__instance__optimize(db) == 0);
+    FILE *dropped = fopen(checkpoint_path, "rb");
+    assert(dropped == NULL);
+    assert(database__static__close(db) == 0);
+    db = database__static_open_with_options(path, &options);
+    assert(db->checkpoint_length == db->record_list_length);
+    assert(database__instance__get_by_id(db, late_id) != NULL);
+    assert(database__instance__get_by_id(db, ids[2]) != NULL);
+    assert(database__static__close(db) == 0);
+}
+
+static unsigned int test_index_format__version(const char *index_path, long *size) {
+    struct {
+        char magic[8];
+        unsigned int version;
+    } header;
+    FILE *index = fopen(index_path, "rb");
+    assert(fread(&header, sizeof(header), 1, index) == 1);
+    fseek(index, 0, SEEK_END);
+    *size = ftell(index);
+    fclose(index);
+    return header.version;
+}
+
+void test_index_format(const char* dbname) {
+    char path[256], index_path[256], data_path[256];
+    snprintf(path, sizeof(path), "%s.format_test", dbname);
+    snprintf(index_path, sizeof(index_path), "%s.index", path);
+    // the last run left a damaged index behind
+    snprintf(data_path, sizeof(data_path), "%s.data", path);
+    unlink(data_path);
+    unlink(index_path);
+    database_t *db = database__static_open(path);
+    assert(db != NULL);
+    char data[64];
+    static char ids[1000][32];
+    for (int i = 0; i < 1000; i++) {
+        int data_length = snprintf(data, sizeof(data), "Record %d test_index_format", i);
+        record_t *record = database__instance__insert_record(db, data, data_length);
+        memcpy(ids[i], record->id, 32);
+        if (i % 4 == 0) assert(database__instance__delete_record(db, record) != NULL);
+    }
+    size_t length = db->record_list_length;
+    assert(database__static__close(db) == 0);
+
+    // compact entries: flags, id, two short varints and the checksum
+    long size;
+    assert(test_index_format__version(index_path, &size) == 3);
+    printf("%zu entries in %ld bytes, %zu bytes as records\n", length, size, (length + 1) * sizeof(record_t));
+    assert((size_t)size < (length + 1) * 48);
+
+    // a mapped index reads the fixed entries in place, the file is converted both ways on open
+    database_options_t mapped = {.map_index = 1};
+    db = database__static_open_with_options(path, &mapped);
+    assert(db != NULL && db->record_list_length == length);
+#ifndef __MINGW32__
+    assert(test_index_format__version(index_path, &size) == 2);
+    assert((size_t)size == (length + 1) * sizeof(record_t));
+#endif
+    assert(database__instance__get_by_id(db, ids[1]) != NULL);
+    assert(database__static__close(db) == 0);
+    db = database__static_open(path);
+    assert(db != NULL && db->record_list_length == length);
+    assert(test_index_format__version(index_path, &size) == 3);
+    for (int i = 0; i < 1000; i++) assert((database__instance__get_by_id(db, ids[i]) == NULL) == (i % 4 == 0));
+    assert(database__static__close(db) == 0);
+
+    // a torn last entry is dropped, the entries before it are kept
+    assert(truncate(index_path, size - 5) == 0);
+    db = database__static_open(path);
+    assert(db != NULL && db->record_list_length == length - 1);
+    assert(database__static__close(db) == 0);
+
+    // a damaged entry in the middle fails its checksum
+    FILE *index = fopen(index_path, "r+b");
+    fseek(index, 1000, SEEK_SET);
+    int byte = fgetc(index);
+    fseek(index, 1000, SEEK_SET);
+    fputc(byte ^ 0x40, index);
+    fclose(index);
+    db = database__static_open(path);
+    assert(db == NULL);
+}
+
+// Copies a file as it is, the image a crash leaves of a database that was flushed but not synced
+static void test_recovery__copy(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    char buffer[4096];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) assert(fwrite(buffer, 1, got, out) == got);
+    fclose(in);
+    fclose(out);
+}
+
+void test_recovery(const char* dbname) {
+    char path[256], crash_path[256], from[256], to[256];
+    snprintf(path, sizeof(path), "%s.recovery_test", dbname);
+    snprintf(crash_path, sizeof(crash_path), "%s.recovery_crash", dbname);
+    // the verified marks below count from a new database
+    snprintf(from, sizeof(from), "%s.index", path);
+    unlink(from);
+    snprintf(from, sizeof(from), "%s.data", path);
+    unlink(from);
+    // the mark only moves with an fsync, close syncs in any other mode than NONE
+    database_options_t options = {.durability = DATABASE_DURABILITY_EVERY_N_RECORDS, .sync_every_records = 1000};
+    database_t *db = database__static_open_with_options(path, &options);
+    assert(db != NULL);
+    char data[64];
+    static char ids[15][32];
+    record_t records[15];
+    for (int i = 0; i < 15; i++) {
+        // synced after the first 10, the other 5 are only flushed
+        if (i == 10) assert(database__instance__sync(db) == 0);
+        int data_length = snprintf(data, sizeof(data), "Record %d test_recovery", i);
+        record_t *record = database__instance__insert_record(db, data, data_length);
+        memcpy(ids[i], record->id, 32);
+        records[i] = *record;
+    }
+    assert(db->verified_length == 10);
+    assert(database__instance__flush(db) == 0);
+    snprintf(from, sizeof(from), "%s.index", path);
+    snprintf(to, sizeof(to), "%s.index", crash_path);
+    test_recovery__copy(from, to);
+    snprintf(from, sizeof(from), "%s.data", path);
+    snprintf(to, sizeof(to), "%s.data", crash_path);
+    test_recovery__copy(from, to);
+    assert(database__static__close(db) == 0);
+
+    // a clean close leaves nothing to check
+    db = database__static_open_with_options(path, &options);
+    assert(db->recovery.verified == 0 && db->recovery.dropped == 0);
+    assert(database__static__close(db) == 0);
+
+    // the content of record 12 never reached the disk and the last record is cut short
+    FILE *crash_data = fopen(to, "r+b");
+    fseek(crash_data, records[12].start, SEEK_SET);
+    fputc('X', crash_data);
+    fclose(crash_data);
+    assert(truncate(to, records[14].end - 3) == 0);
+    db = database__static_open_with_options(crash_path, &options);
+    assert(db != NULL);
+    assert(db->recovery.verified == 2 && db->recovery.dropped == 3);
+    assert(db->recovery.dropped_data_bytes == records[14].end - 3 - records[11].end);
+    assert(db->record_list_length == 12 && db->data_file_length == records[11].end);
+    assert(database__instance__get_by_id(db, ids[11]) != NULL);
+    assert(database__instance__get_by_id(db, ids[12]) == NULL);
+    // the log goes on after the dropped tail
+    assert(database__instance__insert_record(db, "after the crash test_recovery", 29) != NULL);
+    assert(database__static__close(db) == 0);
+
+    db = database__static_open_with_options(crash_path, &options);
+    assert(db->recovery.verified == 0 && db->recovery.dropped == 0);
+    assert(db->record_list_length == 13);
+    assert(database__static__close(db) == 0);
+
+    // closed without an fsync the tail is checked on every open
+    database_options_t unsynced = {0};
+    db = database__static_open_with_options(crash_path, &unsynced);
+    assert(database__instance__insert_record(db, "unsynced test_recovery", 22) != NULL);
+    assert(database__static__close(db) == 0);
+    db = database__static_open_with_options(crash_path, &unsynced);
+    assert(db->recovery.verified == 1 && db->recovery.dropped == 0);
+    assert(database__static__close(db) == 0);
+}
+
+#define TEST_STREAM_CHUNK 4096
+#define TEST_STREAM_CHUNKS 1024
+
+// The byte of a streamed record at offset, the chunks all differ
+static char test_stream__byte(size_t offset) {
+    return (char)('a' + (offset / TEST_STREAM_CHUNK + offset % 7) % 26);
+}
+
+void test_stream(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.stream_test", dbname);
+    database_options_t options = {.deduplicate = 1, .write_buffer_size = 4096};
+    database_t *db = database__static_open_with_options(path, &options);
+    assert(db != NULL);
+
+    // 4 MB written a chunk at a time while another record is inserted
+    record_stream_t *stream = database__instance__stream_begin(db);
+    assert(stream != NULL);
+    size_t total = (size_t)TEST_STREAM_CHUNK * TEST_STREAM_CHUNKS;
+    char *content = malloc(total);
+    for (size_t i = 0; i < total; i++) content[i] = test_stream__byte(i);
+    for (size_t i = 0; i < TEST_STREAM_CHUNKS; i++) {
+        assert(record_stream__instance__append(stream, content + i * TEST_STREAM_CHUNK, TEST_STREAM_CHUNK) == 0);
+        if (i == TEST_STREAM_CHUNKS / 2) assert(database__instance__insert_record(db, "in between test_stream", 22) != NULL);
+    }
+    record_t *committed = record_stream__instance__commit(stream);
+    assert(committed != NULL);
+    record_t record = *committed;
+    assert(record.length == total && record.end - record.start == total);
+
+    // the id of the whole content, as if it was inserted in one go
+    char id[32];
+    hash__static__compute(content, total, (unsigned char*)id);
+    assert(memcmp(record.id, id, 32) == 0);
+    assert(database__instance__get_by_id(db, id) != NULL);
+
+    // only the requested bytes are read
+    char range[100];
+    size_t offsets[] = {0, 4095, 2 * 1024 * 1024 + 13, total - 100};
+    for (int i = 0; i < 4; i++) {
+        assert(database__instance__read_range(db, &record, offsets[i], 100, range) == 0);
+        assert(memcmp(range, content + offsets[i], 100) == 0);
+    }
+    assert(database__instance__read_range(db, &record, total - 99, 100, range) != 0);
+    assert(database__instance__read_range(db, &record, total, 0, range) == 0);
+
+    // the same content inserted again is not stored twice
+    size_t data_length = db->data_file_length;
+    assert(database__instance__insert_record(db, content, (int)total)->start == record.start);
+    stream = database__instance__stream_begin(db);
+    assert(record_stream__instance__append(stream, content, total) == 0);
+    assert(record_stream__instance__commit(stream)->start == record.start);
+    assert(db->data_file_length == data_length);
+
+    // an aborted or empty stream leaves nothing behind
+    size_t length = db->record_list_length;
+    stream = database__instance__stream_begin(db);
+    assert(record_stream__instance__append(stream, "dropped", 7) == 0);
+    record_stream__instance__abort(stream);
+    assert(record_stream__instance__commit(database__instance__stream_begin(db)) == NULL);
+    assert(db->record_list_length == length && db->data_file_length == data_length);
+    assert(database__static__close(db) == 0);
+
+    db = database__static_open_with_options(path, &options);
+    assert(db->recovery.dropped == 0);
+    record_t *found = database__instance__get_by_id(db, id);
+    assert(found != NULL);
+    assert(database__instance__read_range(db, found, total - 100, 100, range) == 0);
+    assert(memcmp(range, content + total - 100, 100) == 0);
+    assert(database__static__close(db) == 0);
+    free(content);
+}
+
+static size_t test_cursor__entries;
+error_t test_cursor__count(record_t *record, int ord) {
+    test_cursor__entries++;
+    return 0;
+}
+
+void test_cursor(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.cursor_test", dbname);
+    database_options_t configurations[2] = {{.write_buffer_size = 4096, .compression = RECORD_CODEC_LZ}, {.btree_index = 1}};
+    for (int c = 0; c < 2; c++) {
+        database_t *db = database__static_open_with_options(path, &configurations[c]);
+        assert(db != NULL);
+        char data[128];
+        for (int i = 0; i < 300; i++) {
+            int data_length = snprintf(data, sizeof(data), "Record %d test_cursor, repeated repeated repeated repeated", i);
+            record_t *record = database__instance__insert_record(db, data, data_length);
+            if (i % 5 == 0) assert(database__instance__delete_record(db, record) != NULL);
+        }
+
+        // every entry in log order, the content in a buffer that only grows
+        record_t record;
+        char *buffer = NULL;
+        size_t capacity = 0, seen = 0;
+        database_cursor_t *cursor = database__instance__cursor_open(db, DATABASE_CURSOR_ALL);
+        assert(cursor != NULL);
+        int found;
+        while ((found = database_cursor__instance__next(cursor, &record, &buffer, &capacity)) == 1) {
+            assert(memcmp(&record, database__instance__record_at(db, seen), sizeof(record_t)) == 0);
+            assert(strlen(buffer) == record.length);
+            if (!record__instance__is_deleted(&record)) assert(memcmp(buffer, "Record ", 7) == 0);
+            seen++;
+        }
+        assert(found == 0 && seen == db->record_list_length);
+        assert(capacity < 128);
+        database_cursor__instance__close(cursor);
+
+        // the latest records match the callback iteration, log positions only go up without the tree
+        test_cursor__entries = 0;
+        assert(database__instance__get_latest_records(db, test_cursor__count) == 0);
+        cursor = database__instance__cursor_open(db, DATABASE_CURSOR_LATEST);
+        seen = 0;
+        size_t previous_start = 0;
+        while ((found = database_cursor__instance__next(cursor, &record, &buffer, &capacity)) == 1) {
+            assert(!record__instance__is_deleted(&record));
+            char content[128];
+            assert(database__instance__read_content(db, &record, content) == 0);
+            assert(memcmp(content, buffer, record.length) == 0);
+            if (c == 0) assert(seen == 0 || record.start > previous_start);
+            previous_start = record.start;
+            seen++;
+        }
+        assert(found == 0 && seen == test_cursor__entries && seen == 300 - 60);
+        database_cursor__instance__close(cursor);
+
+        // a range clamped to the log
+        cursor = database__instance__cursor_open_range(db, 10, 13);
+        for (size_t i = 10; i < 13; i++) {
+            assert(database_cursor__instance__next(cursor, &record, &buffer, &capacity) == 1);
+            assert(memcmp(record.id, database__instance__record_at(db, i)->id, 32) == 0);
+        }
+        assert(database_cursor__instance__next(cursor, &record, &buffer, &capacity) == 0);
+        database_cursor__instance__close(cursor);
+        cursor = database__instance__cursor_open_range(db, db->record_list_length - 1, db->record_list_length + 10);
+        assert(database_cursor__instance__next(cursor, &record, &buffer, &capacity) == 1);
+        assert(database_cursor__instance__next(cursor, &record, &buffer, &capacity) == 0);
+        database_cursor__instance__close(cursor);
+
+        // optimize renumbers the log under an open cursor
+        cursor = database__instance__cursor_open(db, DATABASE_CURSOR_ALL);
+        assert(database_cursor__instance__next(cursor, &record, &buffer, &capacity) == 1);
+        assert(database__instance__optimize(db) == 0);
+        assert(database_cursor__instance__next(cursor, &record, &buffer, &capacity) == -1);
+        database_cursor__instance__close(cursor);
+        free(buffer);
+        assert(database__static__close(db) == 0);
+    }
+}
+
+static database_t *test_latest_scan__db;
+static database_scan_order_t test_latest_scan__order;
+static size_t test_latest_scan__entries;
+static size_t test_latest_scan__previous;
+static char test_latest_scan__previous_id[32];
+
+static size_t test_latest_scan__position(record_t *record) {
+    for (size_t i = 0; i < test_latest_scan__db->record_list_length; i++) {
+        if (database__instance__record_at(test_latest_scan__db, i) == record) return i;
+    }
+    assert(0);
+    return 0;
+}
+
+error_t test_latest_scan__check(record_t *record, int ord, const char *content, size_t content_length) {
+    assert((size_t)ord == test_latest_scan__entries);
+    assert(!record__instance__is_deleted(record) && content_length == record->length);
+    char expected[128];
+    assert(database__instance__read_content(test_latest_scan__db, record, expected) == 0);
+    assert(memcmp(expected, content, content_length) == 0);
+
+    // the data order follows the addresses, the log order the positions of the entries, the id order the ids
+    if (test_latest_scan__order == DATABASE_SCAN_ID_ORDER) {
+        assert(test_latest_scan__entries == 0 || memcmp(record->id, test_latest_scan__previous_id, 32) > 0);
+        memcpy(test_latest_scan__previous_id, record->id, 32);
+    } else {
+        size_t key = test_latest_scan__order == DATABASE_SCAN_DATA_ORDER ? record->start : test_latest_scan__position(record);
+        assert(test_latest_scan__entries == 0 || key > test_latest_scan__previous);
+        test_latest_scan__previous = key;
+    }
+    test_latest_scan__entries++;
+    return 0;
+}
+
+error_t test_latest_scan__stop(record_t *record, int ord, const char *content, size_t content_length) {
+    return ord == 9 ? -1 : 0;
+}
+
+void test_latest_scan(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.latest_scan_test", dbname);
+    database_options_t configurations[3] = {
+        {.write_buffer_size = 4096, .compression = RECORD_CODEC_LZ},
+        {.btree_index = 1},
+        {.segment_size = 8192},
+    };
+    for (int c = 0; c < 3; c++) {
+        database_t *db = database__static_open_with_options(path, &configurations[c]);
+        assert(db != NULL);
+        char data[128];
+        for (int i = 0; i < 500; i++) {
+            int data_length = snprintf(data, sizeof(data), "Record %d test_latest_scan, repeated repeated repeated repeated", i);
+            record_t *record = database__instance__insert_record(db, data, data_length);
+            // the deleted records leave holes between the live ones
+            if (i % 3 == 0) assert(database__instance__delete_record(db, record) != NULL);
+        }
+
+        test_latest_scan__db = db;
+        test_cursor__entries = 0;
+        assert(database__instance__get_latest_records(db, test_cursor__count) == 0);
+        for (int order = DATABASE_SCAN_DATA_ORDER; order <= DATABASE_SCAN_ID_ORDER; order++) {
+            test_latest_scan__order = (database_scan_order_t)order;
+            test_latest_scan__entries = 0;
+            assert(database__instance__get_latest_records_with_content(db, test_latest_scan__order, test_latest_scan__check) == 0);
+            assert(test_latest_scan__entries == test_cursor__entries && test_latest_scan__entries == 500 - 167);
+        }
+        // a callback error stops the scan
+        assert(database__instance__get_latest_records_with_content(db, DATABASE_SCAN_DATA_ORDER, test_latest_scan__stop) == -1);
+        assert(database__static__close(db) == 0);
+    }
+}
+
+void test_multi_get(const char* dbname) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.multi_get_test", dbname);
+    database_options_t configurations[2] = {{.write_buffer_size = 4096, .compression = RECORD_CODEC_LZ}, {.segment_size = 8192}};
+    for (int c = 0; c < 2; c++) {
+        database_t *db = database__static_open_with_options(path, &configurations[c]);
+        assert(db != NULL);
+        char ids[400][32];
+        char data[128];
+        for (int i = 0; i < 400; i++) {
+            int data_length = snprintf(data, sizeof(data), "Record %d test_multi_get, repeated repeated repeated repeated", i);
+            record_t *record = database__instance__insert_record(db, data, data_length);
+            memcpy(ids[i], record->id, 32);
+            if (i % 4 == 0) assert(database__instance__delete_record(db, record) != NULL);
+        }
+
+        // asked in a scattered order, one of them twice and an id that was never inserted
+        const char *asked[402];
+        for (int i = 0; i < 400; i++) asked[i] = ids[(i * 7) % 400];
+        asked[400] = ids[7];
+        char unknown[32] = {0};
+        asked[401] = unknown;
+        char *buffers[402];
+        size_t lengths[402];
+        assert(database__instance__multi_get(db, asked, 402, buffers, lengths) == 0);
+        for (int i = 0; i < 402; i++) {
+            int index = i < 400 ? (i * 7) % 400 : 7;
+            if (i == 401 || index % 4 == 0) {
+                assert(buffers[i] == NULL && lengths[i] == 0);
+                continue;
+            }
+            int data_length = snprintf(data, sizeof(data), "Record %d test_multi_get, repeated repeated repeated repeated", index);
+            assert(lengths[i] == (size_t)data_length && strcmp(buffers[i], data) == 0);
+            free(buffers[i]);
+        }
+        assert(database__instance__multi_get(db, NULL, 0, NULL, NULL) == 0);
+        // the single id version copies the entry
+        record_t copy;
+        assert(database__instance__get_copy_by_id(db, ids[1], &copy) == 0);
+        assert(memcmp(&copy, database__instance__get_by_id(db, ids[1]), sizeof(record_t)) == 0);
+        assert(database__instance__get_copy_by_id(db, ids[4], &copy) == -1);
+        assert(database__static__close(db) == 0);
+    }
+}
+
+// Checks that every sampled record is the live version of its id
+static void test_random_sample__check_live(database_t *db, const record_t *record) {
+    record_t *latest = database__instance__get_by_id(db, record->id);
+    assert(latest != NULL && memcmp(latest, record, sizeof(record_t)) == 0);
+}
+
+void test_random_sample(const char* dbname) {
+    char path[256];
+    database_options_t configurations[2] = {{0}, {.btree_index = 1}};
+    for (int c = 0; c < 2; c++) {
+        snprintf(path, sizeof(path), "%s.random_sample_test_%d", dbname, c);
+        // starts from an empty database
+        const char *suffixes[3] = {"data", "index", "btree"};
+        for (int i = 0; i < 3; i++) {
+            char file_path[300];
+            snprintf(file_path, sizeof(file_path), "%s.%s", path, suffixes[i]);
+            unlink(file_path);
+        }
+        database_t *db = database__static_open_with_options(path, &configurations[c]);
+        assert(db != NULL);
+        size_t length = 1;
+        record_t none;
+        assert(database__instance__get_random_live_record(db) == NULL);
+        assert(database__instance__sample_k(db, 4, &none, &length) == 0 && length == 0);
+
+        char ids[1000][32];
+        char data[128];
+        for (int i = 0; i < 1000; i++) {
+            int data_length = snprintf(data, sizeof(data), "Record %d test_random_sample", i);
+            record_t *record = database__instance__insert_record(db, data, data_length);
+            memcpy(ids[i], record->id, 32);
+        }
+        // the sampler is built here, what follows is kept up to date by the writes
+        assert(database__instance__get_random_live_record(db) != NULL);
+        for (int i = 0; i < 1000; i += 2) assert(database__instance__delete_record(db, database__instance__get_by_id(db, ids[i])) != NULL);
+        // a newer version of the same id replaces the sampled one
+        for (int i = 1; i < 1000; i += 10) {
+            int data_length = snprintf(data, sizeof(data), "Record %d test_random_sample", i);
+            record_t *record = database__instance__insert_record(db, data, data_length);
+            assert(record != NULL && memcmp(record->id, ids[i], 32) == 0);
+        }
+
+        for (int round = 0; round < 2; round++) {
+            // 500 live ids, the hits of each stay far from 0 and from 10 times the mean
+            int hits[1000] = {0};
+            for (int i = 0; i < 50000; i++) {
+                record_t *record = database__instance__get_random_live_record(db);
+                assert(record != NULL);
+                test_random_sample__check_live(db, record);
+                int found = -1;
+                for (int j = 1; j < 1000 && found < 0; j += 2) if (memcmp(ids[j], record->id, 32) == 0) found = j;
+                assert(found >= 0);
+                hits[found]++;
+            }
+            for (int j = 1; j < 1000; j += 2) assert(hits[j] > 20 && hits[j] < 1000);
+
+            record_t sample[600];
+            assert(database__instance__sample_k(db, 100, sample, &length) == 0 && length == 100);
+            for (size_t i = 0; i < length; i++) {
+                test_random_sample__check_live(db, &sample[i]);
+                for (size_t j = 0; j < i; j++) assert(memcmp(sample[i].id, sample[j].id, 32) != 0);
+            }
+            assert(database__instance__sample_k(db, 600, sample, &length) == 0 && length == 500);
+            for (size_t i = 0; i < length; i++) {
+                test_random_sample__check_live(db, &sample[i]);
+                for (size_t j = 0; j < i; j++) assert(memcmp(sample[i].id, sample[j].id, 32) != 0);
+            }
+
+            // the generation switch drops the sampler, it is built again from the rewritten log
+            assert(database__instance__optimize(db) == 0);
+        }
+
+        assert(database__static__close(db) == 0);
+    }
+}
+
+static database_t *test_async__db;
+static size_t test_async__entries;
+
+error_t test_async__check(record_t *record, int ord, const char *content, size_t content_length) {
+    assert((size_t)ord == test_async__entries++);
+    char *expected = (char*)malloc(record->length);
+    assert(database__instance__read_content(test_async__db, record, expected) == 0);
+    assert(content_length == record->length && memcmp(expected, content, content_length) == 0);
+    free(expected);
+    return 0;
+}
+
+// Content of the i-th record of test_async, every 16th one larger than a staging slot
+static size_t test_async__content(int i, char *data) {
+    size_t length = i % 16 == 0 ? 40000 : 80;
+    int written = snprintf(data, length, "Record %d test_async, repeated repeated repeated repeated", i);
+    for (size_t j = written; j < length; j++) data[j] = (char)('a' + (j * (i + 1)) % 23);
+    return length;
+}
+
+// Waits for the completions of the queue and checks them
+static size_t test_async__drain(database_async_t *async, size_t expected) {
+    database_completion_t completions[8];
+    size_t reaped = 0;
+    while (reaped < expected) {
+        int count = database_async__instance__poll(async, completions, 8, 1);
+        assert(count > 0);
+        for (int i = 0; i < count; i++) {
+            assert(completions[i].result == 0 && completions[i].kind == DATABASE_ASYNC_INSERT);
+            record_t *latest = database__instance__get_by_id(async->database, completions[i].record.id);
+            assert(latest != NULL && latest->length == completions[i].record.length);
+        }
+        reaped += count;
+    }
+    return reaped;
+}
+
+void test_async(const char* dbname) {
+    char path[256];
+    database_options_t configurations[3] = {
+        {0},
+        {.write_buffer_size = 4096, .compression = RECORD_CODEC_LZ, .deduplicate = 1},
+        {.segment_size = 65536, .btree_index = 1},
+    };
+    char *data = (char*)malloc(40000 * 200);
+    for (int c = 0; c < 3; c++) {
+        snprintf(path, sizeof(path), "%s.async_test_%d", dbname, c);
+        database_t *db = database__static_open_with_options(path, &configurations[c]);
+        assert(db != NULL);
+        database_async_t *async = database__instance__async_open(db, 8);
+        assert(async != NULL);
+        if (c == 0) printf("io_uring %s\n", async->ring ? "in use" : "not available, requests run synchronously");
+
+        // more inserts than requests, a full queue is reaped before going on
+        size_t lengths[200], queued = 0, reaped = 0;
+        for (int i = 0; i < 200; i++) {
+            char *content = data + (size_t)i * 40000;
+            lengths[i] = test_async__content(i, content);
+            while (database_async__instance__insert(async, content, lengths[i], content) != 0) {
+                reaped += test_async__drain(async, 1);
+            }
+            queued++;
+        }
+        reaped += test_async__drain(async, queued - reaped);
+
+        // a compaction between the reservation and the write puts the record in the new generation
+        lengths[0] = test_async__content(1000, data);
+        assert(database_async__instance__insert(async, data, lengths[0], data) == 0);
+        assert(database__instance__optimize(db) == 0);
+        test_async__drain(async, 1);
+        lengths[0] = test_async__content(0, data);
+
+        // read back by id, with an id that was never inserted
+        char unknown[32] = {0};
+        assert(database_async__instance__get(async, unknown, NULL) == 0);
+        database_completion_t completions[8];
+        assert(database_async__instance__poll(async, completions, 8, 1) == 1);
+        assert(completions[0].kind == DATABASE_ASYNC_GET && completions[0].result == -1 && completions[0].content == NULL);
+        char id[32];
+        int got = 0, asked = 0;
+        while (got < 200) {
+            if (asked < 200) {
+                hash__static__compute(data + (size_t)asked * 40000, lengths[asked], (unsigned char*)id);
+                if (database_async__instance__get(async, id, data + (size_t)asked * 40000) == 0) {
+                    asked++;
+                    continue;
+                }
+            }
+            int count = database_async__instance__poll(async, completions, 8, 1);
+            for (int i = 0; i < count; i++) {
+                const char *expected = (const char*)completions[i].user_data;
+                assert(completions[i].result == 0 && completions[i].record.length == lengths[(expected - data) / 40000]);
+                assert(memcmp(completions[i].content, expected, completions[i].record.length) == 0);
+                assert(completions[i].content[completions[i].record.length] == '\0');
+                free(completions[i].content);
+            }
+            got += count;
+        }
+
+        // the scan sees the latest records with their content, while a request waits to be reaped
+        assert(database_async__instance__insert(async, "pending", 7, NULL) == 0);
+        test_async__db = db;
+        test_async__entries = 0;
+        test_cursor__entries = 0;
+        assert(database__instance__get_latest_records(db, test_cursor__count) == 0);
+        assert(database_async__instance__get_latest_records_with_content(async, test_async__check) == 0);
+        assert(test_async__entries == test_cursor__entries);
+        assert(database_async__instance__close(async) == 0);
+        assert(database__static__close(db) == 0);
+
+        // the records written through the ring are durable like the others
+        db = database__static_open_with_options(path, &configurations[c]);
+        assert(db != NULL && db->recovery.dropped == 0);
+        test_cursor__entries = 0;
+        assert(database__instance__get_latest_records(db, test_cursor__count) == 0);
+        assert(test_cursor__entries == 202);
+        assert(database__static__close(db) == 0);
+    }
+    free(data);
+}
+
 error_t test_list_all_with_content__validate_and_print(record_t *record, int ord, char *content) {
     printf("Record %d\t", ord);
-    printf("ID: %.32s\t", record->id);
+    char hex[65];
+    printf("ID: %s\t", id_to_hex(record, hex));
     printf("Content: %s\n", content);fflush(stdout);
 
     // Verify content for each record
@@ -173,16 +1607,62 @@ __declspec(dllexport) int main(int argc,const char** argv) {
     test_database_open_and_close(dbname);
     printf("=== test_insert_record  .............====================================================\n");
     test_insert_record(dbname);
+    printf("=== test_insert_batch  ..............====================================================\n");
+    test_insert_batch(dbname);
+    printf("=== test_durability  ................====================================================\n");
+    test_durability(dbname);
     printf("=== test_delete_record  .............====================================================\n");
     test_delete_record(dbname);
     printf("=== test_list_all  ..................====================================================\n");
     test_list_all(dbname);
     printf("=== test_list_all_with_content  .....====================================================\n");
     test_list_all_with_content(dbname);
+    printf("=== test_list_all_mapped_content  ...====================================================\n");
+    test_list_all_mapped_content(dbname);
     printf("=== test_get_latest_records  ........====================================================\n");
     test_get_latest_records(dbname);
+    printf("=== test_get_by_id  .................====================================================\n");
+    test_get_by_id(dbname);
+    printf("=== test_mapped_index  ..............====================================================\n");
+    test_mapped_index(dbname);
     printf("=== test_optimize  ..................====================================================\n");
     test_optimize(dbname);
+    printf("=== test_optimize_async  ............====================================================\n");
+    test_optimize_async(dbname);
+    printf("=== test_segmented_log  .............====================================================\n");
+    test_segmented_log(dbname);
+    printf("=== test_deduplicate  ...............====================================================\n");
+    test_deduplicate(dbname);
+    printf("=== test_compression  ...............====================================================\n");
+    test_compression(dbname);
+    printf("=== test_legacy_index  ..............====================================================\n");
+    test_legacy_index(dbname);
+    printf("=== test_concurrent_readers  ........====================================================\n");
+    test_concurrent_readers(dbname);
+    printf("=== test_parallel_scan  .............====================================================\n");
+    test_parallel_scan(dbname);
+    printf("=== test_btree_index  ...............====================================================\n");
+    test_btree_index(dbname);
+    printf("=== test_bloom_filter  ..............====================================================\n");
+    test_bloom_filter(dbname);
+    printf("=== test_checkpoint  ................====================================================\n");
+    test_checkpoint(dbname);
+    printf("=== test_index_format  ..............====================================================\n");
+    test_index_format(dbname);
+    printf("=== test_recovery  ..................====================================================\n");
+    test_recovery(dbname);
+    printf("=== test_stream  ....................====================================================\n");
+    test_stream(dbname);
+    printf("=== test_cursor  ....................====================================================\n");
+    test_cursor(dbname);
+    printf("=== test_latest_scan  ...............====================================================\n");
+    test_latest_scan(dbname);
+    printf("=== test_multi_get  .................====================================================\n");
+    test_multi_get(dbname);
+    printf("=== test_async  .....................====================================================\n");
+    test_async(dbname);
+    printf("=== test_random_sample  .............====================================================\n");
+    test_random_sample(dbname);
 
     printf("All tests passed!\n");
     return 0;
@@ -0,0 +1,779 @@
+#include "hash.h"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HASH_HAS_X86_SIMD
+#endif
+
+#define HASH_FLAG_CHUNK_START 1
+#define HASH_FLAG_CHUNK_END 2
+#define HASH_FLAG_PARENT 4
+#define HASH_FLAG_ROOT 8
+// blocks in a chunk
+#define HASH_CHUNK_BLOCKS (HASH_CHUNK_LENGTH / HASH_BLOCK_LENGTH)
+// the chunks of the largest subtree hashed in one go, its parents fill the vector lanes as well
+#define HASH_SUBTREE_CHUNKS 64
+
+static const uint32_t HASH_IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+// message word order of each of the 7 rounds, the permutation applied round after round
+static const uint8_t HASH_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+// -1 until the cpu was probed
+static int hash_backend = -1;
+
+static uint32_t load32(const uint8_t *bytes) {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void store32(uint8_t *bytes, uint32_t word) {
+    bytes[0] = (uint8_t)word;
+    bytes[1] = (uint8_t)(word >> 8);
+    bytes[2] = (uint8_t)(word >> 16);
+    bytes[3] = (uint8_t)(word >> 24);
+}
+
+static inline uint32_t rotr32(uint32_t word, int count) {
+    return (word >> count) | (word << (32 - count));
+}
+
+// Forces the rounds inline where the compiler allows it, the schedule then folds away and the state stays in registers
+#if defined(__GNUC__) || defined(__clang__)
+#define HASH_INLINE inline __attribute__((always_inline))
+#else
+#define HASH_INLINE inline
+#endif
+
+static HASH_INLINE void hash_g(uint32_t *state, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+    state[a] = state[a] + state[b] + x;
+    state[d] = rotr32(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];
+    state[b] = rotr32(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + y;
+    state[d] = rotr32(state[d] ^ state[a], 8);
+    state[c] = state[c] + state[d];
+    state[b] = rotr32(state[b] ^ state[c], 7);
+}
+
+static HASH_INLINE void hash_round(uint32_t *s, const uint32_t *m, int r) {
+    const uint8_t *k = HASH_SCHEDULE[r];
+    hash_g(s, 0, 4, 8, 12, m[k[0]], m[k[1]]);
+    hash_g(s, 1, 5, 9, 13, m[k[2]], m[k[3]]);
+    hash_g(s, 2, 6, 10, 14, m[k[4]], m[k[5]]);
+    hash_g(s, 3, 7, 11, 15, m[k[6]], m[k[7]]);
+    hash_g(s, 0, 5, 10, 15, m[k[8]], m[k[9]]);
+    hash_g(s, 1, 6, 11, 12, m[k[10]], m[k[11]]);
+    hash_g(s, 2, 7, 8, 13, m[k[12]], m[k[13]]);
+    hash_g(s, 3, 4, 9, 14, m[k[14]], m[k[15]]);
+}
+
+// The compression function: the 8 first words of out are the next chaining value
+static void hash_compress_portable(const uint32_t cv[8], const uint8_t block[HASH_BLOCK_LENGTH], uint8_t block_length,
+                                   uint64_t counter, uint8_t flags, uint32_t out[16]) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) m[i] = load32(block + 4 * i);
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        HASH_IV[0], HASH_IV[1], HASH_IV[2], HASH_IV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_length, flags,
+    };
+    hash_round(s, m, 0);
+    hash_round(s, m, 1);
+    hash_round(s, m, 2);
+    hash_round(s, m, 3);
+    hash_round(s, m, 4);
+    hash_round(s, m, 5);
+    hash_round(s, m, 6);
+    for (int i = 0; i < 8; i++) {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+// Chaining value of a whole chunk, one block after the other
+static void hash_chunk_portable(const uint8_t *input, uint64_t counter, uint32_t cv[8]) {
+    uint32_t out[16];
+    memcpy(cv, HASH_IV, sizeof(HASH_IV));
+    for (int b = 0; b < HASH_CHUNK_BLOCKS; b++) {
+        uint8_t flags = (b == 0 ? HASH_FLAG_CHUNK_START : 0) | (b == HASH_CHUNK_BLOCKS - 1 ? HASH_FLAG_CHUNK_END : 0);
+        hash_compress_portable(cv, input + b * HASH_BLOCK_LENGTH, HASH_BLOCK_LENGTH, counter, flags, out);
+        memcpy(cv, out, 8 * sizeof(uint32_t));
+    }
+}
+
+#ifdef HASH_HAS_X86_SIMD
+
+// The SIMD backends hash one chunk per vector lane: word i of every lane's state lives in vector i,
+// so the rounds are the scalar ones with every operation applied to all the lanes at once.
+
+__attribute__((target("sse4.1")))
+static inline __m128i rotr_sse41(__m128i word, int count) {
+    if (count == 16) return _mm_shuffle_epi8(word, _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13));
+    if (count == 8) return _mm_shuffle_epi8(word, _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12));
+    return _mm_or_si128(_mm_srli_epi32(word, count), _mm_slli_epi32(word, 32 - count));
+}
+
+__attribute__((target("sse4.1")))
+static inline void hash_g_sse41(__m128i *v, int a, int b, int c, int d, __m128i x, __m128i y) {
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x);
+    v[d] = rotr_sse41(_mm_xor_si128(v[d], v[a]), 16);
+    v[c] = _mm_add_epi32(v[c], v[d]);
+    v[b] = rotr_sse41(_mm_xor_si128(v[b], v[c]), 12);
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y);
+    v[d] = rotr_sse41(_mm_xor_si128(v[d], v[a]), 8);
+    v[c] = _mm_add_epi32(v[c], v[d]);
+    v[b] = rotr_sse41(_mm_xor_si128(v[b], v[c]), 7);
+}
+
+// Called with a constant r, the schedule then folds away and the state stays in registers
+__attribute__((target("sse4.1"), always_inline))
+static inline void hash_round_sse41(__m128i *v, const __m128i *m, int r) {
+    const uint8_t *k = HASH_SCHEDULE[r];
+    hash_g_sse41(v, 0, 4, 8, 12, m[k[0]], m[k[1]]);
+    hash_g_sse41(v, 1, 5, 9, 13, m[k[2]], m[k[3]]);
+    hash_g_sse41(v, 2, 6, 10, 14, m[k[4]], m[k[5]]);
+    hash_g_sse41(v, 3, 7, 11, 15, m[k[6]], m[k[7]]);
+    hash_g_sse41(v, 0, 5, 10, 15, m[k[8]], m[k[9]]);
+    hash_g_sse41(v, 1, 6, 11, 12, m[k[10]], m[k[11]]);
+    hash_g_sse41(v, 2, 7, 8, 13, m[k[12]], m[k[13]]);
+    hash_g_sse41(v, 3, 4, 9, 14, m[k[14]], m[k[15]]);
+}
+
+// The diagonal step as a column step: rows 0, 2 and 3 rotated so that each lane holds one diagonal
+__attribute__((target("sse4.1")))
+static inline void hash_diagonalize_sse41(__m128i *row0, __m128i *row2, __m128i *row3) {
+    *row0 = _mm_shuffle_epi32(*row0, _MM_SHUFFLE(2, 1, 0, 3));
+    *row3 = _mm_shuffle_epi32(*row3, _MM_SHUFFLE(1, 0, 3, 2));
+    *row2 = _mm_shuffle_epi32(*row2, _MM_SHUFFLE(0, 3, 2, 1));
+}
+
+__attribute__((target("sse4.1")))
+static inline void hash_undiagonalize_sse41(__m128i *row0, __m128i *row2, __m128i *row3) {
+    *row0 = _mm_shuffle_epi32(*row0, _MM_SHUFFLE(0, 3, 2, 1));
+    *row3 = _mm_shuffle_epi32(*row3, _MM_SHUFFLE(1, 0, 3, 2));
+    *row2 = _mm_shuffle_epi32(*row2, _MM_SHUFFLE(2, 1, 0, 3));
+}
+
+// 2 words of a then 2 words of b, a macro as the control has to be an immediate even in unoptimized builds
+#define hash_shuffle2_sse41(a, b, control) _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), (control)))
+
+/**
+ * hash_compress_portable with a row of the state per vector, the 4 G of a step at once.
+ * a single block has no lanes to spread over, this is what the parents and the short inputs go through.
+ * the message words stay in 4 vectors, put in the order of the next round by a few shuffles instead of being gathered
+ */
+__attribute__((target("sse4.1")))
+static void hash_compress_sse41(const uint32_t cv[8], const uint8_t block[HASH_BLOCK_LENGTH], uint8_t block_length,
+                                uint64_t counter, uint8_t flags, uint32_t out[16]) {
+    __m128i v[4] = {
+        _mm_loadu_si128((const __m128i *)cv),
+        _mm_loadu_si128((const __m128i *)(cv + 4)),
+        _mm_loadu_si128((const __m128i *)HASH_IV),
+        _mm_setr_epi32((int)(uint32_t)counter, (int)(uint32_t)(counter >> 32), block_length, flags),
+    };
+    __m128i m0 = _mm_loadu_si128((const __m128i *)block);
+    __m128i m1 = _mm_loadu_si128((const __m128i *)(block + 16));
+    __m128i m2 = _mm_loadu_si128((const __m128i *)(block + 32));
+    __m128i m3 = _mm_loadu_si128((const __m128i *)(block + 48));
+
+    // the first round takes the words in order: the even and odd ones of the columns, then of the diagonals
+    __m128i t0 = hash_shuffle2_sse41(m0, m1, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128i t1 = hash_shuffle2_sse41(m0, m1, _MM_SHUFFLE(3, 1, 3, 1));
+    __m128i t2 = _mm_shuffle_epi32(hash_shuffle2_sse41(m2, m3, _MM_SHUFFLE(2, 0, 2, 0)), _MM_SHUFFLE(2, 1, 0, 3));
+    __m128i t3 = _mm_shuffle_epi32(hash_shuffle2_sse41(m2, m3, _MM_SHUFFLE(3, 1, 3, 1)), _MM_SHUFFLE(2, 1, 0, 3));
+    hash_g_sse41(v, 0, 1, 2, 3, t0, t1);
+    hash_diagonalize_sse41(&v[0], &v[2], &v[3]);
+    hash_g_sse41(v, 0, 1, 2, 3, t2, t3);
+    hash_undiagonalize_sse41(&v[0], &v[2], &v[3]);
+
+    // every next round applies the message permutation to the words of the previous one
+    for (int r = 1; r < 7; r++) {
+        m0 = t0;
+        m1 = t1;
+        m2 = t2;
+        m3 = t3;
+        t0 = _mm_shuffle_epi32(hash_shuffle2_sse41(m0, m1, _MM_SHUFFLE(3, 1, 1, 2)), _MM_SHUFFLE(0, 3, 2, 1));
+        t1 = _mm_blend_epi16(_mm_shuffle_epi32(m0, _MM_SHUFFLE(0, 0, 3, 3)), hash_shuffle2_sse41(m2, m3, _MM_SHUFFLE(3, 3, 2, 2)), 0xCC);
+        t2 = _mm_shuffle_epi32(_mm_blend_epi16(_mm_unpacklo_epi64(m3, m1), m2, 0xC0), _MM_SHUFFLE(1, 3, 2, 0));
+        t3 = _mm_shuffle_epi32(_mm_unpacklo_epi32(m2, _mm_unpackhi_epi32(m1, m3)), _MM_SHUFFLE(0, 1, 3, 2));
+        hash_g_sse41(v, 0, 1, 2, 3, t0, t1);
+        hash_diagonalize_sse41(&v[0], &v[2], &v[3]);
+        hash_g_sse41(v, 0, 1, 2, 3, t2, t3);
+        hash_undiagonalize_sse41(&v[0], &v[2], &v[3]);
+    }
+    _mm_storeu_si128((__m128i *)out, _mm_xor_si128(v[0], v[2]));
+    _mm_storeu_si128((__m128i *)(out + 4), _mm_xor_si128(v[1], v[3]));
+    _mm_storeu_si128((__m128i *)(out + 8), _mm_xor_si128(v[2], _mm_loadu_si128((const __m128i *)cv)));
+    _mm_storeu_si128((__m128i *)(out + 12), _mm_xor_si128(v[3], _mm_loadu_si128((const __m128i *)(cv + 4))));
+}
+
+// Turns 4 vectors of 4 words of one lane each into 4 vectors of one word of every lane, and back
+__attribute__((target("sse4.1")))
+static inline void hash_transpose_sse41(__m128i *vectors) {
+    __m128i ab_01 = _mm_unpacklo_epi32(vectors[0], vectors[1]);
+    __m128i ab_23 = _mm_unpackhi_epi32(vectors[0], vectors[1]);
+    __m128i cd_01 = _mm_unpacklo_epi32(vectors[2], vectors[3]);
+    __m128i cd_23 = _mm_unpackhi_epi32(vectors[2], vectors[3]);
+    vectors[0] = _mm_unpacklo_epi64(ab_01, cd_01);
+    vectors[1] = _mm_unpackhi_epi64(ab_01, cd_01);
+    vectors[2] = _mm_unpacklo_epi64(ab_23, cd_23);
+    vectors[3] = _mm_unpackhi_epi64(ab_23, cd_23);
+}
+
+__attribute__((target("sse4.1")))
+static void hash_nodes_sse41(const uint8_t *input, int parents, uint64_t counter, uint32_t cvs[][8]) {
+    size_t stride = parents ? HASH_BLOCK_LENGTH : HASH_CHUNK_LENGTH;
+    int blocks = parents ? 1 : HASH_CHUNK_BLOCKS;
+    int step = parents ? 0 : 1;
+    __m128i cv[8], v[16], m[16];
+    for (int i = 0; i < 8; i++) cv[i] = _mm_set1_epi32((int)HASH_IV[i]);
+    __m128i counter_low = _mm_setr_epi32((int)(uint32_t)counter, (int)(uint32_t)(counter + step),
+                                         (int)(uint32_t)(counter + 2 * step), (int)(uint32_t)(counter + 3 * step));
+    __m128i counter_high = _mm_setr_epi32((int)(uint32_t)(counter >> 32), (int)(uint32_t)((counter + step) >> 32),
+                                          (int)(uint32_t)((counter + 2 * step) >> 32), (int)(uint32_t)((counter + 3 * step) >> 32));
+    for (int b = 0; b < blocks; b++) {
+        // every lane's block in 4 loads, transposed 4 words at a time
+        const uint8_t *block = input + b * HASH_BLOCK_LENGTH;
+        for (int i = 0; i < 16; i += 4) {
+            for (int lane = 0; lane < 4; lane++) {
+                m[i + lane] = _mm_loadu_si128((const __m128i *)(block + lane * stride + 4 * i));
+            }
+            hash_transpose_sse41(m + i);
+        }
+        int flags = parents ? HASH_FLAG_PARENT
+                            : (b == 0 ? HASH_FLAG_CHUNK_START : 0) | (b == HASH_CHUNK_BLOCKS - 1 ? HASH_FLAG_CHUNK_END : 0);
+        for (int i = 0; i < 8; i++) v[i] = cv[i];
+        for (int i = 0; i < 4; i++) v[8 + i] = _mm_set1_epi32((int)HASH_IV[i]);
+        v[12] = counter_low;
+        v[13] = counter_high;
+        v[14] = _mm_set1_epi32(HASH_BLOCK_LENGTH);
+        v[15] = _mm_set1_epi32(flags);
+        hash_round_sse41(v, m, 0);
+        hash_round_sse41(v, m, 1);
+        hash_round_sse41(v, m, 2);
+        hash_round_sse41(v, m, 3);
+        hash_round_sse41(v, m, 4);
+        hash_round_sse41(v, m, 5);
+        hash_round_sse41(v, m, 6);
+        for (int i = 0; i < 8; i++) cv[i] = _mm_xor_si128(v[i], v[i + 8]);
+    }
+    hash_transpose_sse41(cv);
+    hash_transpose_sse41(cv + 4);
+    for (int lane = 0; lane < 4; lane++) {
+        _mm_storeu_si128((__m128i *)cvs[lane], cv[lane]);
+        _mm_storeu_si128((__m128i *)(cvs[lane] + 4), cv[4 + lane]);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rotr_avx2(__m256i word, int count) {
+    if (count == 16) {
+        return _mm256_shuffle_epi8(word, _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                                          2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13));
+    }
+    if (count == 8) {
+        return _mm256_shuffle_epi8(word, _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                                          1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12));
+    }
+    return _mm256_or_si256(_mm256_srli_epi32(word, count), _mm256_slli_epi32(word, 32 - count));
+}
+
+__attribute__((target("avx2")))
+static inline void hash_g_avx2(__m256i *v, int a, int b, int c, int d, __m256i x, __m256i y) {
+    v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);
+    v[d] = rotr_avx2(_mm256_xor_si256(v[d], v[a]), 16);
+    v[c] = _mm256_add_epi32(v[c], v[d]);
+    v[b] = rotr_avx2(_mm256_xor_si256(v[b], v[c]), 12);
+    v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);
+    v[d] = rotr_avx2(_mm256_xor_si256(v[d], v[a]), 8);
+    v[c] = _mm256_add_epi32(v[c], v[d]);
+    v[b] = rotr_avx2(_mm256_xor_si256(v[b], v[c]), 7);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void hash_round_avx2(__m256i *v, const __m256i *m, int r) {
+    const uint8_t *k = HASH_SCHEDULE[r];
+    hash_g_avx2(v, 0, 4, 8, 12, m[k[0]], m[k[1]]);
+    hash_g_avx2(v, 1, 5, 9, 13, m[k[2]], m[k[3]]);
+    hash_g_avx2(v, 2, 6, 10, 14, m[k[4]], m[k[5]]);
+    hash_g_avx2(v, 3, 7, 11, 15, m[k[6]], m[k[7]]);
+    hash_g_avx2(v, 0, 5, 10, 15, m[k[8]], m[k[9]]);
+    hash_g_avx2(v, 1, 6, 11, 12, m[k[10]], m[k[11]]);
+    hash_g_avx2(v, 2, 7, 8, 13, m[k[12]], m[k[13]]);
+    hash_g_avx2(v, 3, 4, 9, 14, m[k[14]], m[k[15]]);
+}
+
+// The 8x8 version of hash_transpose_sse41, the 128 bits halves are swapped last
+__attribute__((target("avx2")))
+static inline void hash_transpose_avx2(__m256i *vectors) {
+    __m256i ab_0145 = _mm256_unpacklo_epi32(vectors[0], vectors[1]);
+    __m256i ab_2367 = _mm256_unpackhi_epi32(vectors[0], vectors[1]);
+    __m256i cd_0145 = _mm256_unpacklo_epi32(vectors[2], vectors[3]);
+    __m256i cd_2367 = _mm256_unpackhi_epi32(vectors[2], vectors[3]);
+    __m256i ef_0145 = _mm256_unpacklo_epi32(vectors[4], vectors[5]);
+    __m256i ef_2367 = _mm256_unpackhi_epi32(vectors[4], vectors[5]);
+    __m256i gh_0145 = _mm256_unpacklo_epi32(vectors[6], vectors[7]);
+    __m256i gh_2367 = _mm256_unpackhi_epi32(vectors[6], vectors[7]);
+    __m256i abcd_04 = _mm256_unpacklo_epi64(ab_0145, cd_0145);
+    __m256i abcd_15 = _mm256_unpackhi_epi64(ab_0145, cd_0145);
+    __m256i abcd_26 = _mm256_unpacklo_epi64(ab_2367, cd_2367);
+    __m256i abcd_37 = _mm256_unpackhi_epi64(ab_2367, cd_2367);
+    __m256i efgh_04 = _mm256_unpacklo_epi64(ef_0145, gh_0145);
+    __m256i efgh_15 = _mm256_unpackhi_epi64(ef_0145, gh_0145);
+    __m256i efgh_26 = _mm256_unpacklo_epi64(ef_2367, gh_2367);
+    __m256i efgh_37 = _mm256_unpackhi_epi64(ef_2367, gh_2367);
+    vectors[0] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x20);
+    vectors[1] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x20);
+    vectors[2] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x20);
+    vectors[3] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x20);
+    vectors[4] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x31);
+    vectors[5] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x31);
+    vectors[6] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x31);
+    vectors[7] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x31);
+}
+
+__attribute__((target("avx2")))
+static void hash_nodes_avx2(const uint8_t *input, int parents, uint64_t counter, uint32_t cvs[][8]) {
+    size_t stride = parents ? HASH_BLOCK_LENGTH : HASH_CHUNK_LENGTH;
+    int blocks = parents ? 1 : HASH_CHUNK_BLOCKS;
+    int step = parents ? 0 : 1;
+    __m256i cv[8], v[16], m[16];
+    uint32_t low[8], high[8];
+    for (int lane = 0; lane < 8; lane++) {
+        low[lane] = (uint32_t)(counter + lane * step);
+        high[lane] = (uint32_t)((counter + lane * step) >> 32);
+    }
+    __m256i counter_low = _mm256_loadu_si256((const __m256i *)low);
+    __m256i counter_high = _mm256_loadu_si256((const __m256i *)high);
+    for (int i = 0; i < 8; i++) cv[i] = _mm256_set1_epi32((int)HASH_IV[i]);
+    for (int b = 0; b < blocks; b++) {
+        // every lane's block in 2 loads, transposed 8 words at a time.
+        // the 8 lanes read 8 streams 1KB apart, the prefetchers are told about the blocks 4 ahead
+        const uint8_t *block = input + b * HASH_BLOCK_LENGTH;
+        for (int i = 0; i < 16; i += 8) {
+            for (int lane = 0; lane < 8; lane++) {
+                m[i + lane] = _mm256_loadu_si256((const __m256i *)(block + lane * stride + 4 * i));
+                if (!parents) _mm_prefetch((const char *)(block + lane * stride + 4 * i + 4 * HASH_BLOCK_LENGTH), _MM_HINT_T0);
+            }
+            hash_transpose_avx2(m + i);
+        }
+        int flags = parents ? HASH_FLAG_PARENT
+                            : (b == 0 ? HASH_FLAG_CHUNK_START : 0) | (b == HASH_CHUNK_BLOCKS - 1 ? HASH_FLAG_CHUNK_END : 0);
+        for (int i = 0; i < 8; i++) v[i] = cv[i];
+        for (int i = 0; i < 4; i++) v[8 + i] = _mm256_set1_epi32((int)HASH_IV[i]);
+        v[12] = counter_low;
+        v[13] = counter_high;
+        v[14] = _mm256_set1_epi32(HASH_BLOCK_LENGTH);
+        v[15] = _mm256_set1_epi32(flags);
+        hash_round_avx2(v, m, 0);
+        hash_round_avx2(v, m, 1);
+        hash_round_avx2(v, m, 2);
+        hash_round_avx2(v, m, 3);
+        hash_round_avx2(v, m, 4);
+        hash_round_avx2(v, m, 5);
+        hash_round_avx2(v, m, 6);
+        for (int i = 0; i < 8; i++) cv[i] = _mm256_xor_si256(v[i], v[i + 8]);
+    }
+    hash_transpose_avx2(cv);
+    for (int lane = 0; lane < 8; lane++) _mm256_storeu_si256((__m256i *)cvs[lane], cv[lane]);
+}
+
+__attribute__((target("avx512f")))
+static inline void hash_g_avx512(__m512i *v, int a, int b, int c, int d, __m512i x, __m512i y) {
+    v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), x);
+    v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 16);
+    v[c] = _mm512_add_epi32(v[c], v[d]);
+    v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 12);
+    v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), y);
+    v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 8);
+    v[c] = _mm512_add_epi32(v[c], v[d]);
+    v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 7);
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void hash_round_avx512(__m512i *v, const __m512i *m, int r) {
+    const uint8_t *k = HASH_SCHEDULE[r];
+    hash_g_avx512(v, 0, 4, 8, 12, m[k[0]], m[k[1]]);
+    hash_g_avx512(v, 1, 5, 9, 13, m[k[2]], m[k[3]]);
+    hash_g_avx512(v, 2, 6, 10, 14, m[k[4]], m[k[5]]);
+    hash_g_avx512(v, 3, 7, 11, 15, m[k[6]], m[k[7]]);
+    hash_g_avx512(v, 0, 5, 10, 15, m[k[8]], m[k[9]]);
+    hash_g_avx512(v, 1, 6, 11, 12, m[k[10]], m[k[11]]);
+    hash_g_avx512(v, 2, 7, 8, 13, m[k[12]], m[k[13]]);
+    hash_g_avx512(v, 3, 4, 9, 14, m[k[14]], m[k[15]]);
+}
+
+// The 16x16 version of hash_transpose_sse41: words within the 128 bits groups, then the groups in two steps
+__attribute__((target("avx512f")))
+static inline void hash_transpose_avx512(__m512i *vectors) {
+    __m512i pairs[16], quads[16];
+    for (int i = 0; i < 16; i += 2) {
+        pairs[i] = _mm512_unpacklo_epi32(vectors[i], vectors[i + 1]);
+        pairs[i + 1] = _mm512_unpackhi_epi32(vectors[i], vectors[i + 1]);
+    }
+    // quads[4 * q + j] holds the word j of each group of the rows 4q to 4q + 3
+    for (int q = 0; q < 4; q++) {
+        quads[4 * q] = _mm512_unpacklo_epi64(pairs[4 * q], pairs[4 * q + 2]);
+        quads[4 * q + 1] = _mm512_unpackhi_epi64(pairs[4 * q], pairs[4 * q + 2]);
+        quads[4 * q + 2] = _mm512_unpacklo_epi64(pairs[4 * q + 1], pairs[4 * q + 3]);
+        quads[4 * q + 3] = _mm512_unpackhi_epi64(pairs[4 * q + 1], pairs[4 * q + 3]);
+    }
+    for (int j = 0; j < 4; j++) {
+        __m512i low01 = _mm512_shuffle_i32x4(quads[j], quads[4 + j], _MM_SHUFFLE(1, 0, 1, 0));
+        __m512i high01 = _mm512_shuffle_i32x4(quads[j], quads[4 + j], _MM_SHUFFLE(3, 2, 3, 2));
+        __m512i low23 = _mm512_shuffle_i32x4(quads[8 + j], quads[12 + j], _MM_SHUFFLE(1, 0, 1, 0));
+        __m512i high23 = _mm512_shuffle_i32x4(quads[8 + j], quads[12 + j], _MM_SHUFFLE(3, 2, 3, 2));
+        vectors[j] = _mm512_shuffle_i32x4(low01, low23, _MM_SHUFFLE(2, 0, 2, 0));
+        vectors[4 + j] = _mm512_shuffle_i32x4(low01, low23, _MM_SHUFFLE(3, 1, 3, 1));
+        vectors[8 + j] = _mm512_shuffle_i32x4(high01, high23, _MM_SHUFFLE(2, 0, 2, 0));
+        vectors[12 + j] = _mm512_shuffle_i32x4(high01, high23, _MM_SHUFFLE(3, 1, 3, 1));
+    }
+}
+
+// hash_nodes_avx2 over 16 lanes, the 32 vector registers hold the whole state and message without spilling
+__attribute__((target("avx512f")))
+static void hash_nodes_avx512(const uint8_t *input, int parents, uint64_t counter, uint32_t cvs[][8]) {
+    size_t stride = parents ? HASH_BLOCK_LENGTH : HASH_CHUNK_LENGTH;
+    int blocks = parents ? 1 : HASH_CHUNK_BLOCKS;
+    int step = parents ? 0 : 1;
+    __m512i cv[16], v[16], m[16];
+    uint32_t low[16], high[16];
+    for (int lane = 0; lane < 16; lane++) {
+        low[lane] = (uint32_t)(counter + lane * step);
+        high[lane] = (uint32_t)((counter + lane * step) >> 32);
+    }
+    __m512i counter_low = _mm512_loadu_si512(low);
+    __m512i counter_high = _mm512_loadu_si512(high);
+    for (int i = 0; i < 8; i++) cv[i] = _mm512_set1_epi32((int)HASH_IV[i]);
+    for (int b = 0; b < blocks; b++) {
+        // every lane's block in a single load
+        const uint8_t *block = input + b * HASH_BLOCK_LENGTH;
+        for (int lane = 0; lane < 16; lane++) {
+            m[lane] = _mm512_loadu_si512(block + lane * stride);
+            if (!parents) _mm_prefetch((const char *)(block + lane * stride + 4 * HASH_BLOCK_LENGTH), _MM_HINT_T0);
+        }
+        hash_transpose_avx512(m);
+        int flags = parents ? HASH_FLAG_PARENT
+                            : (b == 0 ? HASH_FLAG_CHUNK_START : 0) | (b == HASH_CHUNK_BLOCKS - 1 ? HASH_FLAG_CHUNK_END : 0);
+        for (int i = 0; i < 8; i++) v[i] = cv[i];
+        for (int i = 0; i < 4; i++) v[8 + i] = _mm512_set1_epi32((int)HASH_IV[i]);
+        v[12] = counter_low;
+        v[13] = counter_high;
+        v[14] = _mm512_set1_epi32(HASH_BLOCK_LENGTH);
+        v[15] = _mm512_set1_epi32(flags);
+        hash_round_avx512(v, m, 0);
+        hash_round_avx512(v, m, 1);
+        hash_round_avx512(v, m, 2);
+        hash_round_avx512(v, m, 3);
+        hash_round_avx512(v, m, 4);
+        hash_round_avx512(v, m, 5);
+        hash_round_avx512(v, m, 6);
+        for (int i = 0; i < 8; i++) cv[i] = _mm512_xor_si512(v[i], v[i + 8]);
+    }
+    // the 8 words of the 16 lanes are the first half of a 16x16 transpose
+    for (int i = 8; i < 16; i++) cv[i] = _mm512_setzero_si512();
+    hash_transpose_avx512(cv);
+    for (int lane = 0; lane < 16; lane++) _mm256_storeu_si256((__m256i *)cvs[lane], _mm512_castsi512_si256(cv[lane]));
+}
+
+#endif
+
+static int hash_backend_supported(hash_backend_t backend) {
+    if (backend == HASH_BACKEND_PORTABLE) return 1;
+#ifdef HASH_HAS_X86_SIMD
+    __builtin_cpu_init();
+    if (backend == HASH_BACKEND_SSE41) return __builtin_cpu_supports("sse4.1");
+    if (backend == HASH_BACKEND_AVX2) return __builtin_cpu_supports("avx2");
+    if (backend == HASH_BACKEND_AVX512) return __builtin_cpu_supports("avx512f");
+#endif
+    return 0;
+}
+
+hash_backend_t hash__static__backend(void) {
+    // threads probing at the same time all store the same answer
+    int backend = __atomic_load_n(&hash_backend, __ATOMIC_RELAXED);
+    if (backend < 0) {
+        backend = HASH_BACKEND_AVX512;
+        while (!hash_backend_supported((hash_backend_t)backend)) backend--;
+        __atomic_store_n(&hash_backend, backend, __ATOMIC_RELAXED);
+    }
+    return (hash_backend_t)backend;
+}
+
+int hash__static__select_backend(hash_backend_t backend) {
+    if (backend < HASH_BACKEND_PORTABLE || backend > HASH_BACKEND_AVX512) return -1;
+    if (!hash_backend_supported(backend)) return -1;
+    __atomic_store_n(&hash_backend, (int)backend, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// The compression function of the selected backend for a single block
+static void hash_compress(const uint32_t cv[8], const uint8_t block[HASH_BLOCK_LENGTH], uint8_t block_length,
+                          uint64_t counter, uint8_t flags, uint32_t out[16]) {
+#ifdef HASH_HAS_X86_SIMD
+    if (hash__static__backend() >= HASH_BACKEND_SSE41) {
+        hash_compress_sse41(cv, block, block_length, counter, flags, out);
+        return;
+    }
+#endif
+    hash_compress_portable(cv, block, block_length, counter, flags, out);
+}
+
+// Node that is not compressed yet because it may still turn out to be the root
+typedef struct hash_output_s {
+    uint32_t cv[8];
+    uint8_t block[HASH_BLOCK_LENGTH];
+    uint8_t block_length;
+    uint64_t counter;
+    uint8_t flags;
+} hash_output_t;
+
+static void hash_output_cv(const hash_output_t *self, uint32_t cv[8]) {
+    uint32_t out[16];
+    hash_compress(self->cv, self->block, self->block_length, self->counter, self->flags, out);
+    memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void hash_parent_output(const uint32_t left[8], const uint32_t right[8], hash_output_t *output) {
+    memcpy(output->cv, HASH_IV, sizeof(HASH_IV));
+    for (int i = 0; i < 8; i++) {
+        store32(output->block + 4 * i, left[i]);
+        store32(output->block + 32 + 4 * i, right[i]);
+    }
+    output->block_length = HASH_BLOCK_LENGTH;
+    output->counter = 0;
+    output->flags = HASH_FLAG_PARENT;
+}
+
+// Chaining values of count whole chunks, or of the parents of count pairs of chaining values, as many at once as the backend allows
+static void hash_nodes(const uint8_t *input, size_t count, int parents, uint64_t counter, uint32_t cvs[][8]) {
+    size_t stride = parents ? HASH_BLOCK_LENGTH : HASH_CHUNK_LENGTH;
+    int step = parents ? 0 : 1;
+    size_t done = 0;
+#ifdef HASH_HAS_X86_SIMD
+    hash_backend_t backend = hash__static__backend();
+    if (backend >= HASH_BACKEND_AVX512) {
+        for (; done + 16 <= count; done += 16) {
+            hash_nodes_avx512(input + done * stride, parents, counter + done * step, cvs + done);
+        }
+    }
+    if (backend >= HASH_BACKEND_AVX2) {
+        for (; done + 8 <= count; done += 8) {
+            hash_nodes_avx2(input + done * stride, parents, counter + done * step, cvs + done);
+        }
+    }
+    if (backend >= HASH_BACKEND_SSE41) {
+        for (; done + 4 <= count; done += 4) {
+            hash_nodes_sse41(input + done * stride, parents, counter + done * step, cvs + done);
+        }
+    }
+#endif
+    // the vector loads take the chaining values as little endian bytes, the rest goes through the byte order independent code
+    const uint32_t (*children)[8] = (const uint32_t (*)[8])input;
+    for (; done < count; done++) {
+        if (parents) {
+            hash_output_t parent;
+            hash_parent_output(children[2 * done], children[2 * done + 1], &parent);
+            hash_output_cv(&parent, cvs[done]);
+        } else {
+            hash_chunk_portable(input + done * stride, counter + done, cvs[done]);
+        }
+    }
+}
+
+static size_t hasher_chunk_length(const hasher_t *self) {
+    return (size_t)self->blocks_compressed * HASH_BLOCK_LENGTH + self->block_length;
+}
+
+static uint8_t hasher_chunk_start_flag(const hasher_t *self) {
+    return self->blocks_compressed == 0 ? HASH_FLAG_CHUNK_START : 0;
+}
+
+static void hasher_chunk_reset(hasher_t *self, uint64_t counter) {
+    memcpy(self->chunk_cv, HASH_IV, sizeof(HASH_IV));
+    self->chunk_counter = counter;
+    memset(self->block, 0, sizeof(self->block));
+    self->block_length = 0;
+    self->blocks_compressed = 0;
+}
+
+static void hasher_chunk_output(const hasher_t *self, hash_output_t *output) {
+    memcpy(output->cv, self->chunk_cv, sizeof(self->chunk_cv));
+    memcpy(output->block, self->block, sizeof(self->block));
+    output->block_length = self->block_length;
+    output->counter = self->chunk_counter;
+    output->flags = hasher_chunk_start_flag(self) | HASH_FLAG_CHUNK_END;
+}
+
+// Feeds bytes of the current chunk, a full block is only compressed once more input shows it isn't the last one
+static void hasher_chunk_update(hasher_t *self, const uint8_t *input, size_t length) {
+    uint32_t out[16];
+    while (length > 0) {
+        if (self->block_length == HASH_BLOCK_LENGTH) {
+            hash_compress(self->chunk_cv, self->block, HASH_BLOCK_LENGTH, self->chunk_counter,
+                          hasher_chunk_start_flag(self), out);
+            memcpy(self->chunk_cv, out, 8 * sizeof(uint32_t));
+            self->blocks_compressed++;
+            self->block_length = 0;
+            memset(self->block, 0, sizeof(self->block));
+        }
+        // whole blocks straight from the input without going through the block buffer
+        while (self->block_length == 0 && length > HASH_BLOCK_LENGTH) {
+            hash_compress(self->chunk_cv, input, HASH_BLOCK_LENGTH, self->chunk_counter,
+                          hasher_chunk_start_flag(self), out);
+            memcpy(self->chunk_cv, out, 8 * sizeof(uint32_t));
+            self->blocks_compressed++;
+            input += HASH_BLOCK_LENGTH;
+            length -= HASH_BLOCK_LENGTH;
+        }
+        size_t take = HASH_BLOCK_LENGTH - self->block_length;
+        if (take > length) take = length;
+        memcpy(self->block + self->block_length, input, take);
+        self->block_length += (uint8_t)take;
+        input += take;
+        length -= take;
+    }
+}
+
+/**
+ * Pushes the chaining value of a finished subtree, merging the subtrees that it completes.
+ * total_chunks counts the subtrees of its size so far, a chunk being a subtree of 1 chunk
+ */
+static void hasher_push_chunk_cv(hasher_t *self, uint32_t cv[8], uint64_t total_chunks) {
+    hash_output_t parent;
+    uint32_t merged[8];
+    memcpy(merged, cv, sizeof(merged));
+    while ((total_chunks & 1) == 0) {
+        self->cv_stack_length--;
+        hash_parent_output(self->cv_stack[self->cv_stack_length], merged, &parent);
+        hash_output_cv(&parent, merged);
+        total_chunks >>= 1;
+    }
+    memcpy(self->cv_stack[self->cv_stack_length], merged, sizeof(merged));
+    self->cv_stack_length++;
+}
+
+void hasher__instance__init(hasher_t *self) {
+    if (!self) return;
+    hasher_chunk_reset(self, 0);
+    self->cv_stack_length = 0;
+}
+
+void hasher__instance__update(hasher_t *self, const void *data, size_t data_length) {
+    if (!self || (!data && data_length > 0)) return;
+    const uint8_t *input = (const uint8_t *)data;
+    uint32_t cvs[HASH_SUBTREE_CHUNKS][8];
+    while (data_length > 0) {
+        if (hasher_chunk_length(self) == HASH_CHUNK_LENGTH) {
+            hash_output_t output;
+            uint32_t cv[8];
+            hasher_chunk_output(self, &output);
+            hash_output_cv(&output, cv);
+            uint64_t total_chunks = self->chunk_counter + 1;
+            hasher_push_chunk_cv(self, cv, total_chunks);
+            hasher_chunk_reset(self, total_chunks);
+        }
+        if (hasher_chunk_length(self) == 0 && data_length > HASH_CHUNK_LENGTH) {
+            // whole chunks that can't be the last one go to the vectorized backends, a whole subtree at a time:
+            //   as many as fit of a power of two the chunks before are a multiple of, their parents merged level by level
+            size_t count = (data_length - 1) / HASH_CHUNK_LENGTH;
+            size_t subtree = HASH_SUBTREE_CHUNKS;
+            while (subtree > count || self->chunk_counter % subtree != 0) subtree /= 2;
+            hash_nodes(input, subtree, 0, self->chunk_counter, cvs);
+            for (size_t nodes = subtree / 2; nodes > 0; nodes /= 2) hash_nodes((const uint8_t *)cvs, nodes, 1, 0, cvs);
+            hasher_push_chunk_cv(self, cvs[0], self->chunk_counter / subtree + 1);
+            self->chunk_counter += subtree;
+            input += subtree * HASH_CHUNK_LENGTH;
+            data_length -= subtree * HASH_CHUNK_LENGTH;
+            continue;
+        }
+        size_t take = HASH_CHUNK_LENGTH - hasher_chunk_length(self);
+        if (take > data_length) take = data_length;
+        hasher_chunk_update(self, input, take);
+        input += take;
+        data_length -= take;
+    }
+}
+
+void hasher__instance__finalize(const hasher_t *self, unsigned char *out) {
+    if (!self || !out) return;
+    hash_output_t output;
+    uint32_t cv[8];
+    hasher_chunk_output(self, &output);
+    for (size_t remaining = self->cv_stack_length; remaining > 0; remaining--) {
+        hash_output_cv(&output, cv);
+        hash_parent_output(self->cv_stack[remaining - 1], cv, &output);
+    }
+    uint32_t words[16];
+    hash_compress(output.cv, output.block, output.block_length, output.counter, output.flags | HASH_FLAG_ROOT, words);
+    for (int i = 0; i < 8; i++) store32(out + 4 * i, words[i]);
+}
+
+void hash__static__compute(const void *data, size_t data_length, unsigned char *out) {
+    hasher_t hasher;
+    hasher__instance__init(&hasher);
+    hasher__instance__update(&hasher, data, data_length);
+    hasher__instance__finalize(&hasher, out);
+}
+
+// CRC-32C of every 4 bits value, two lookups per byte keep the table in a single cache line
+static const uint32_t CRC32C_NIBBLES[16] = {
+    0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1, 0x417B1DBC, 0x5125DAD3, 0x61C69362, 0x7198540D,
+    0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9, 0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75,
+};
+
+// -1 until the cpu was probed
+static int crc32c_hardware = -1;
+
+static uint32_t crc32c_portable(uint32_t crc, const uint8_t *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        crc = (crc >> 4) ^ CRC32C_NIBBLES[crc & 15];
+        crc = (crc >> 4) ^ CRC32C_NIBBLES[crc & 15];
+    }
+    return crc;
+}
+
+#ifdef HASH_HAS_X86_SIMD
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *bytes, size_t length) {
+#ifdef __x86_64__
+    uint64_t wide = crc;
+    for (; length >= 8; bytes += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t)wide;
+#endif
+    for (; length > 0; bytes++, length--) crc = _mm_crc32_u8(crc, *bytes);
+    return crc;
+}
+#endif
+
+uint32_t hash__static__crc32c(uint32_t crc, const void *data, size_t data_length) {
+    crc = ~crc;
+#ifdef HASH_HAS_X86_SIMD
+    // threads probing at the same time all store the same answer
+    int hardware = __atomic_load_n(&crc32c_hardware, __ATOMIC_RELAXED);
+    if (hardware < 0) {
+        __builtin_cpu_init();
+        hardware = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+        __atomic_store_n(&crc32c_hardware, hardware, __ATOMIC_RELAXED);
+    }
+    if (hardware) return ~crc32c_sse42(crc, (const uint8_t*)data, data_length);
+#endif
+    return ~crc32c_portable(crc, (const uint8_t*)data, data_length);
+}
@@ -0,0 +1,78 @@
+#ifndef __hash_h__
+#define __hash_h__
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * length in bytes of a content hash, the size of record_t.id
+ */
+#define HASH_LENGTH 32
+#define HASH_BLOCK_LENGTH 64
+#define HASH_CHUNK_LENGTH 1024
+/**
+ * depth of the chaining value stack, enough for 2^64 bytes of input
+ */
+#define HASH_MAX_DEPTH 54
+
+/**
+ * the compression code hashing whole chunks, picked at runtime from what the cpu supports
+ */
+typedef enum hash_backend_e {
+    HASH_BACKEND_PORTABLE = 0,
+    /**
+     * 4 chunks at once in 128bit vectors
+     */
+    HASH_BACKEND_SSE41,
+    /**
+     * 8 chunks at once in 256bit vectors
+     */
+    HASH_BACKEND_AVX2,
+    /**
+     * 16 chunks at once in 512bit vectors
+     */
+    HASH_BACKEND_AVX512,
+} hash_backend_e;
+
+typedef hash_backend_e hash_backend_t;
+
+/**
+ * incremental BLAKE3 hasher, the same digest as hashing the concatenation of every update in one go
+ */
+typedef struct hasher_s {
+    uint32_t chunk_cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[HASH_BLOCK_LENGTH];
+    uint8_t block_length;
+    uint8_t blocks_compressed;
+    uint8_t cv_stack_length;
+    uint32_t cv_stack[HASH_MAX_DEPTH][8];
+} hasher_s;
+
+typedef hasher_s hasher_t;
+
+void hasher__instance__init(hasher_t* self);
+void hasher__instance__update(hasher_t* self, const void* data, size_t data_length);
+/**
+ * writes the HASH_LENGTH bytes digest of everything hashed so far, the hasher can keep being updated
+ */
+void hasher__instance__finalize(const hasher_t* self, unsigned char* out);
+
+/**
+ * one shot BLAKE3 of data into HASH_LENGTH raw bytes
+ */
+void hash__static__compute(const void* data, size_t data_length, unsigned char* out);
+/**
+ * CRC-32C (Castagnoli) of data continuing crc, 0 to start a new checksum.
+ * computed with the sse4.2 crc32 instruction when the cpu has it
+ */
+uint32_t hash__static__crc32c(uint32_t crc, const void* data, size_t data_length);
+/**
+ * the backend used by the hashers, the fastest the cpu supports unless another one was selected
+ */
+hash_backend_t hash__static__backend(void);
+/**
+ * forces a backend, returns -1 if the cpu does not support it
+ */
+int hash__static__select_backend(hash_backend_t backend);
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hash.h"
+
+// Official BLAKE3 test vectors, the input is the byte sequence 0, 1, ..., 250, 0, 1, ... of the given length
+typedef struct hash_vector_s {
+    size_t length;
+    const char *digest;
+} hash_vector_t;
+
+static const hash_vector_t HASH_VECTORS[] = {
+    {0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+    {1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+    {1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11"},
+    {1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+    {1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+    {2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a"},
+    {2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030"},
+    {3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2"},
+    {3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3"},
+    {4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969"},
+    {4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995"},
+    {5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833"},
+    {8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63"},
+    {8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b"},
+    {16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4"},
+    {31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47"},
+    {102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"},
+};
+
+static const char *BACKEND_NAMES[] = {"portable", "sse4.1", "avx2", "avx512"};
+
+static void to_hex(const unsigned char *digest, char *hex) {
+    for (int i = 0; i < HASH_LENGTH; i++) sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+static unsigned char *test_input(size_t length) {
+    unsigned char *input = malloc(length + 1);
+    for (size_t i = 0; i < length; i++) input[i] = (unsigned char)(i % 251);
+    return input;
+}
+
+int test_vectors(hash_backend_t backend) {
+    int failures = 0;
+    size_t vectors = sizeof(HASH_VECTORS) / sizeof(HASH_VECTORS[0]);
+    for (size_t v = 0; v < vectors; v++) {
+        unsigned char *input = test_input(HASH_VECTORS[v].length);
+        unsigned char digest[HASH_LENGTH];
+        char hex[2 * HASH_LENGTH + 1];
+        hash__static__compute(input, HASH_VECTORS[v].length, digest);
+        to_hex(digest, hex);
+        if (strcmp(hex, HASH_VECTORS[v].digest) != 0) {
+            printf("%s: length %zu hashed to %s instead of %s\n", BACKEND_NAMES[backend], HASH_VECTORS[v].length, hex, HASH_VECTORS[v].digest);
+            failures++;
+        }
+        free(input);
+    }
+    printf("%s: %zu vectors, %d failures\n", BACKEND_NAMES[backend], vectors, failures);
+    return failures;
+}
+
+int test_incremental() {
+    size_t length = 102400;
+    unsigned char *input = test_input(length);
+    unsigned char expected[HASH_LENGTH], digest[HASH_LENGTH];
+    hash__static__compute(input, length, expected);
+    // updates of every size, crossing block and chunk boundaries at different places
+    size_t steps[] = {1, 7, 63, 64, 65, 1000, 1024, 1025, 9000};
+    int failures = 0;
+    for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        hasher_t hasher;
+        hasher__instance__init(&hasher);
+        for (size_t done = 0; done < length; done += steps[s]) {
+            size_t take = length - done < steps[s] ? length - done : steps[s];
+            hasher__instance__update(&hasher, input + done, take);
+        }
+        hasher__instance__finalize(&hasher, digest);
+        if (memcmp(digest, expected, HASH_LENGTH) != 0) {
+            printf("updates of %zu bytes give a different digest\n", steps[s]);
+            failures++;
+        }
+    }
+    printf("incremental: %d failures\n", failures);
+    free(input);
+    return failures;
+}
+
+int test_crc32c() {
+    // the check value of the catalogue of CRC algorithms, then the same bytes in two steps
+    int failures = hash__static__crc32c(0, "123456789", 9) != 0xE3069283;
+    failures += hash__static__crc32c(hash__static__crc32c(0, "1234", 4), "56789", 5) != 0xE3069283;
+    failures += hash__static__crc32c(0, "", 0) != 0;
+    printf("crc32c: %d failures\n", failures);
+    return failures;
+}
+
+double test_throughput(hash_backend_t backend) {
+    size_t length = 64 << 20;
+    unsigned char *input = test_input(length);
+    unsigned char digest[HASH_LENGTH];
+    clock_t begin = clock();
+    hash__static__compute(input, length, digest);
+    double seconds = (double)(clock() - begin) / CLOCKS_PER_SEC;
+    double throughput = seconds > 0 ? (length >> 20) / seconds : 0;
+    printf("%s: %.1f MB/s\n", BACKEND_NAMES[backend], throughput);
+    free(input);
+    return throughput;
+}
+
+int main() {
+    int failures = 0;
+    hash_backend_t fastest = hash__static__backend();
+    printf("=== test_vectors =======================================:\n");
+    for (int backend = HASH_BACKEND_PORTABLE; backend <= HASH_BACKEND_AVX512; backend++) {
+        if (hash__static__select_backend(backend) != 0) {
+            printf("%s: not supported by this cpu\n", BACKEND_NAMES[backend]);
+            continue;
+        }
+        failures += test_vectors(backend);
+    }
+    hash__static__select_backend(fastest);
+    printf("=== test_incremental =======================================:\n");
+    failures += test_incremental();
+    printf("=== test_crc32c =======================================:\n");
+    failures += test_crc32c();
+    printf("=== test_throughput =======================================:\n");
+    double throughput[HASH_BACKEND_AVX512 + 1] = {0};
+    for (int backend = HASH_BACKEND_PORTABLE; backend <= HASH_BACKEND_AVX512; backend++) {
+        if (hash__static__select_backend(backend) == 0) throughput[backend] = test_throughput(backend);
+    }
+    hash__static__select_backend(fastest);
+#ifdef __OPTIMIZE__
+    // a floor relative to the portable code so that it holds on any machine, the wider backends hash 8 and 16 chunks at once.
+    // unoptimized builds leave the intrinsics as calls and are not measured
+    if (fastest >= HASH_BACKEND_AVX2 && throughput[fastest] < 2.5 * throughput[HASH_BACKEND_PORTABLE]) {
+        printf("%s is only %.1f times faster than portable\n", BACKEND_NAMES[fastest], throughput[fastest] / throughput[HASH_BACKEND_PORTABLE]);
+        failures++;
+    }
+#else
+    (void)throughput;
+#endif
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+// the last 5 bytes are always literals and the last match starts 12 bytes before the end at the latest
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_DISTANCE 65535
+#define LZ_HASH_BITS 13
+// the search steps over input that doesn't match faster and faster, one more byte every 64 misses
+#define LZ_SKIP_TRIGGER 6
+
+static uint32_t read32(const uint8_t *bytes) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static uint64_t read64(const uint8_t *bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lz__static__compress_bound(size_t source_length) {
+    return source_length + source_length / 255 + 16;
+}
+
+// Writes the continuation of a length: bytes of 255 then the remainder
+static uint8_t* lz_write_length(uint8_t *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Emits a sequence of literals followed by a match, only the literals when match_length is 0. NULL when out of room
+static uint8_t* lz_emit(uint8_t *op, const uint8_t *op_end, const uint8_t *literals, size_t literal_length, size_t offset, size_t match_length) {
+    size_t needed = 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1;
+    if ((size_t)(op_end - op) < needed) return NULL;
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15) op = lz_write_length(op, literal_length - 15);
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0) return op;
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t code = match_length - LZ_MIN_MATCH;
+    *token |= (uint8_t)(code >= 15 ? 15 : code);
+    if (code >= 15) op = lz_write_length(op, code - 15);
+    return op;
+}
+
+size_t lz__static__compress(const char *source, size_t source_length, char *destination, size_t capacity) {
+    if (!source || !destination) return 0;
+
+    const uint8_t *in = (const uint8_t*)source;
+    uint8_t *op = (uint8_t*)destination;
+    const uint8_t *op_end = op + capacity;
+    size_t anchor = 0;
+
+    if (source_length > LZ_MATCH_LIMIT) {
+        // last position seen for each hash of 4 bytes, any stale entry is caught by comparing the bytes
+        size_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+        size_t limit = source_length - LZ_MATCH_LIMIT;
+        size_t match_end_limit = source_length - LZ_LAST_LITERALS;
+        size_t misses = 1 << LZ_SKIP_TRIGGER;
+        size_t ip = 0;
+
+        while (ip <= limit) {
+            uint32_t sequence = read32(in + ip);
+            uint32_t h = lz_hash(sequence);
+            size_t ref = table[h];
+            table[h] = ip;
+            if (ref >= ip || ip - ref > LZ_MAX_DISTANCE || read32(in + ref) != sequence) {
+                ip += misses++ >> LZ_SKIP_TRIGGER;
+                continue;
+            }
+
+            while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t match_length = LZ_MIN_MATCH;
+            while (ip + match_length + 8 <= match_end_limit && read64(in + ip + match_length) == read64(in + ref + match_length)) match_length += 8;
+            while (ip + match_length < match_end_limit && in[ip + match_length] == in[ref + match_length]) match_length++;
+
+            op = lz_emit(op, op_end, in + anchor, ip - anchor, ip - ref, match_length);
+            if (!op) return 0;
+            ip += match_length;
+            anchor = ip;
+            misses = 1 << LZ_SKIP_TRIGGER;
+            // index the bytes just before the next search too so that repeated runs keep matching
+            if (ip - 2 <= limit) table[lz_hash(read32(in + ip - 2))] = ip - 2;
+        }
+    }
+
+    op = lz_emit(op, op_end, in + anchor, source_length - anchor, 0, 0);
+    if (!op) return 0;
+    return (size_t)(op - (uint8_t*)destination);
+}
+
+// Copies 8 bytes at a time and may write up to 7 bytes past length, the caller checked there is room for it
+static void lz_wild_copy(uint8_t *to, const uint8_t *from, size_t length) {
+    uint8_t *end = to + length;
+    do {
+        memcpy(to, from, 8);
+        to += 8;
+        from += 8;
+    } while (to < end);
+}
+
+// Reads the continuation of a length, -1 when the input ends in the middle of it
+static int lz_read_length(const uint8_t **ip, const uint8_t *ip_end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*ip >= ip_end) return -1;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int lz__static__decompress(const char *source, size_t source_length, char *destination, size_t destination_length) {
+    if (!source || !destination) return -1;
+
+    const uint8_t *ip = (const uint8_t*)source;
+    const uint8_t *ip_end = ip + source_length;
+    uint8_t *op = (uint8_t*)destination;
+    uint8_t *op_start = op;
+    uint8_t *op_end = op + destination_length;
+
+    while (ip < ip_end) {
+        unsigned token = *ip++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && lz_read_length(&ip, ip_end, &literal_length) != 0) return -1;
+        if ((size_t)(ip_end - ip) < literal_length || (size_t)(op_end - op) < literal_length) return -1;
+        if ((size_t)(ip_end - ip) >= literal_length + 8 && (size_t)(op_end - op) >= literal_length + 8) lz_wild_copy(op, ip, literal_length);
+        else memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // the last sequence has no match
+        if (ip == ip_end) break;
+
+        if (ip_end - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - op_start)) return -1;
+
+        size_t match_length = token & 15;
+        if (match_length == 15 && lz_read_length(&ip, ip_end, &match_length) != 0) return -1;
+        match_length += LZ_MIN_MATCH;
+        if ((size_t)(op_end - op) < match_length) return -1;
+
+        const uint8_t *match = op - offset;
+        if (offset >= 8 && (size_t)(op_end - op) >= match_length + 8) {
+            lz_wild_copy(op, match, match_length);
+        } else if (offset >= match_length) {
+            memcpy(op, match, match_length);
+        } else {
+            // the match overlaps the bytes it produces, a run of the last offset bytes
+            for (size_t i = 0; i < match_length; i++) op[i] = match[i];
+        }
+        op += match_length;
+    }
+
+    return op == op_end ? 0 : -1;
+}
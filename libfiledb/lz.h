@@ -0,0 +1,25 @@
+#ifndef __lz_h__
+#define __lz_h__
+#include <stddef.h>
+
+/**
+ * LZ4 block format codec: a sequence is a token, literals copied as they are and a match
+ *   copying earlier output, 4 bytes long at least and at most 65535 bytes back
+ */
+
+/**
+ * the largest compressed size of source_length bytes, enough for input that doesn't compress at all
+ */
+size_t lz__static__compress_bound(size_t source_length);
+/**
+ * compresses source into destination and returns the compressed length,
+ *   0 when the compressed bytes don't fit in capacity
+ */
+size_t lz__static__compress(const char* source, size_t source_length, char* destination, size_t capacity);
+/**
+ * decompresses exactly destination_length bytes, returns -1 on malformed or truncated input
+ *   without ever reading or writing out of the given buffers
+ */
+int lz__static__decompress(const char* source, size_t source_length, char* destination, size_t destination_length);
+
+#endif
@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lz.h"
+
+// Compresses and decompresses source, returns the compressed length
+size_t round_trip(const char *source, size_t source_length) {
+    size_t capacity = lz__static__compress_bound(source_length);
+    char *compressed = malloc(capacity);
+    char *decompressed = malloc(source_length + 1);
+    size_t compressed_length = lz__static__compress(source, source_length, compressed, capacity);
+    assert(compressed_length > 0);
+    assert(lz__static__decompress(compressed, compressed_length, decompressed, source_length) == 0);
+    assert(memcmp(source, decompressed, source_length) == 0);
+    free(compressed);
+    free(decompressed);
+    return compressed_length;
+}
+
+// JSON like records, the payloads the database is expected to hold
+char* json_lines(size_t length) {
+    char *text = malloc(length + 64);
+    size_t used = 0;
+    for (int i = 0; used < length; i++) {
+        used += sprintf(text + used, "{\"id\":%d,\"name\":\"user %d\",\"active\":%s,\"score\":%d}\n", i, i * 7, i % 3 ? "true" : "false", (i * 37) % 1000);
+    }
+    return text;
+}
+
+void test_round_trips() {
+    char short_text[] = "abc";
+    round_trip(short_text, 0);
+    round_trip(short_text, 3);
+
+    char run[4096];
+    memset(run, 'x', sizeof(run));
+    size_t run_length = round_trip(run, sizeof(run));
+    printf("run: %zu -> %zu\n", sizeof(run), run_length);
+    assert(run_length < 64);
+
+    size_t length = 1 << 20;
+    char *random = malloc(length);
+    srand(7);
+    for (size_t i = 0; i < length; i++) random[i] = (char)rand();
+    size_t random_length = round_trip(random, length);
+    printf("random: %zu -> %zu\n", length, random_length);
+    assert(random_length <= lz__static__compress_bound(length));
+    free(random);
+
+    char *json = json_lines(length);
+    size_t json_length = round_trip(json, length);
+    printf("json: %zu -> %zu\n", length, json_length);
+    assert(json_length * 2 < length);
+    free(json);
+
+    // every length around the limits of the last literals
+    for (size_t n = 1; n < 300; n++) {
+        char *text = json_lines(n);
+        round_trip(text, n);
+        free(text);
+    }
+}
+
+void test_small_capacity() {
+    char *json = json_lines(1000);
+    char compressed[64];
+    assert(lz__static__compress(json, 1000, compressed, sizeof(compressed)) == 0);
+    free(json);
+}
+
+void test_malformed_input() {
+    size_t length = 10000;
+    char *json = json_lines(length);
+    size_t capacity = lz__static__compress_bound(length);
+    char *compressed = malloc(capacity);
+    char *decompressed = malloc(length);
+    size_t compressed_length = lz__static__compress(json, length, compressed, capacity);
+
+    // truncated input, a wrong expected length and corrupted bytes are rejected without overflowing
+    for (size_t cut = 0; cut < compressed_length; cut += 97) {
+        assert(lz__static__decompress(compressed, cut, decompressed, length) == -1);
+    }
+    assert(lz__static__decompress(compressed, compressed_length, decompressed, length - 1) == -1);
+    srand(11);
+    for (int i = 0; i < 200; i++) {
+        char saved;
+        size_t at = rand() % compressed_length;
+        saved = compressed[at];
+        compressed[at] = (char)rand();
+        lz__static__decompress(compressed, compressed_length, decompressed, length);
+        compressed[at] = saved;
+    }
+    assert(lz__static__decompress(compressed, compressed_length, decompressed, length) == 0);
+    free(json);
+    free(compressed);
+    free(decompressed);
+}
+
+void test_throughput() {
+    size_t length = 32 << 20;
+    char *json = json_lines(length);
+    size_t capacity = lz__static__compress_bound(length);
+    char *compressed = malloc(capacity);
+    char *decompressed = malloc(length);
+
+    clock_t begin = clock();
+    size_t compressed_length = lz__static__compress(json, length, compressed, capacity);
+    double compress_seconds = (double)(clock() - begin) / CLOCKS_PER_SEC;
+    begin = clock();
+    assert(lz__static__decompress(compressed, compressed_length, decompressed, length) == 0);
+    double decompress_seconds = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    printf("ratio %.2f, compress %.1f MB/s, decompress %.1f MB/s\n", (double)length / compressed_length,
+           compress_seconds > 0 ? (length >> 20) / compress_seconds : 0,
+           decompress_seconds > 0 ? (length >> 20) / decompress_seconds : 0);
+    free(json);
+    free(compressed);
+    free(decompressed);
+}
+
+int main() {
+    printf("=== test_round_trips =======================================:\n");
+    test_round_trips();
+    printf("=== test_small_capacity =======================================:\n");
+    test_small_capacity();
+    printf("=== test_malformed_input =======================================:\n");
+    test_malformed_input();
+    printf("=== test_throughput =======================================:\n");
+    test_throughput();
+    return 0;
+}
@@ -0,0 +1,324 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "shard.h"
+#include "hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define SHARDS_MAGIC "FILEDBSH"
+#define SHARDS_VERSION 1
+// requests a worker pops before applying them
+#define SHARD_BATCH 256
+
+typedef struct shards_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t shards;
+} shards_header_t;
+
+// The shard of an id, the leading 32 bits scaled to the number of shards so each shard holds a contiguous slice of the ids
+static size_t shard_of(const sharded_database_t *self, const char *id) {
+    const unsigned char *bytes = (const unsigned char*)id;
+    uint64_t leading = (uint64_t)bytes[0] << 24 | (uint64_t)bytes[1] << 16 | (uint64_t)bytes[2] << 8 | bytes[3];
+    return (size_t)((leading * self->shards_length) >> 32);
+}
+
+/**
+ * Reads the number of shards saved next to the shards, or saves it when there is none.
+ * the number asked for, 0 taking the saved one, or -1 when they differ
+ */
+static long shards_length_settle(const char *path, size_t shards) {
+    char meta_path[256];
+    snprintf(meta_path, 256, "%s.shards", path);
+    shards_header_t header;
+    FILE *file = fopen(meta_path, "rb");
+    if (file) {
+        size_t read = fread(&header, sizeof(header), 1, file);
+        fclose(file);
+        if (read != 1 || memcmp(header.magic, SHARDS_MAGIC, sizeof(header.magic)) != 0 || header.version != SHARDS_VERSION) return -1;
+        if (shards && shards != header.shards) return -1;
+        return header.shards;
+    }
+    if (shards == 0) return -1;
+
+    memcpy(header.magic, SHARDS_MAGIC, sizeof(header.magic));
+    header.version = SHARDS_VERSION;
+    header.shards = (uint32_t)shards;
+    file = fopen(meta_path, "wb");
+    if (!file) return -1;
+    size_t written = fwrite(&header, sizeof(header), 1, file);
+    if (fclose(file) != 0 || written != 1) return -1;
+    return (long)shards;
+}
+
+static void shard_queue_push(shard_t *self, shard_request_t *request) {
+    __atomic_store_n(&request->next, NULL, __ATOMIC_RELAXED);
+    shard_request_t *previous = __atomic_exchange_n(&self->head, request, __ATOMIC_ACQ_REL);
+    // until this store the request is in the queue but the worker can't reach it yet
+    __atomic_store_n(&previous->next, request, __ATOMIC_RELEASE);
+}
+
+// Pops the oldest request, NULL when the queue is empty or a push is halfway through
+static shard_request_t* shard_queue_pop(shard_t *self) {
+    shard_request_t *tail = self->tail;
+    shard_request_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &self->stub) {
+        if (!next) return NULL;
+        self->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        self->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&self->head, __ATOMIC_ACQUIRE)) return NULL;
+    // the last request is only handed out once something follows it, the stub if need be
+    shard_queue_push(self, &self->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (!next) return NULL;
+    self->tail = next;
+    return tail;
+}
+
+// Applies a batch of requests, the inserts that follow each other go to the log with a single batch insert
+static void shard_apply(shard_t *self, shard_request_t **requests, size_t length) {
+    char *buffers[SHARD_BATCH];
+    size_t lengths[SHARD_BATCH];
+    record_t records[SHARD_BATCH];
+    size_t i = 0;
+    while (i < length) {
+        if (requests[i]->kind == SHARD_REQUEST_DELETE) {
+            record_t *record = database__instance__get_by_id(self->database, requests[i]->id);
+            // the worker is the only writer of the shard, the entry stays put until it deletes
+            requests[i]->result = record && database__instance__delete_record(self->database, record) ? 0 : -1;
+            i++;
+            continue;
+        }
+        size_t first = i;
+        for (; i < length && requests[i]->kind == SHARD_REQUEST_INSERT; i++) {
+            buffers[i - first] = (char*)requests[i]->data;
+            lengths[i - first] = requests[i]->data_length;
+        }
+        error_t result = database__instance__insert_batch(self->database, buffers, lengths, i - first, records);
+        for (size_t j = first; j < i; j++) {
+            requests[j]->result = result;
+            if (result == 0) requests[j]->record = records[j - first];
+        }
+    }
+}
+
+static void* shard_worker(void *arg) {
+    shard_t *self = (shard_t*)arg;
+#ifdef __linux__
+    // one core per shard, the shards past the number of cores share them round robin
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(self->index % (size_t)cores, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+
+    shard_request_t *batch[SHARD_BATCH];
+    for (;;) {
+        size_t length = 0;
+        while (length < SHARD_BATCH && (batch[length] = shard_queue_pop(self)) != NULL) length++;
+        if (length == 0) {
+            int waited = 0;
+            pthread_mutex_lock(&self->lock);
+            while (__atomic_load_n(&self->pending, __ATOMIC_ACQUIRE) == 0 && self->running) {
+                pthread_cond_wait(&self->wakeup, &self->lock);
+                waited = 1;
+            }
+            int stop = !self->running && __atomic_load_n(&self->pending, __ATOMIC_ACQUIRE) == 0;
+            pthread_mutex_unlock(&self->lock);
+            if (stop) break;
+            // a producer is between counting its request and linking it
+            if (!waited) sched_yield();
+            continue;
+        }
+        __atomic_sub_fetch(&self->pending, length, __ATOMIC_RELEASE);
+
+        shard_apply(self, batch, length);
+        pthread_mutex_lock(&self->lock);
+        for (size_t i = 0; i < length; i++) batch[i]->done = 1;
+        pthread_cond_broadcast(&self->completed);
+        pthread_mutex_unlock(&self->lock);
+    }
+    return NULL;
+}
+
+// Queues a request to the worker of the shard and waits until it was applied
+static error_t shard_submit(shard_t *self, shard_request_t *request) {
+    request->done = 0;
+    // counted before it is linked so that the worker never counts below the requests it popped
+    size_t pending = __atomic_fetch_add(&self->pending, 1, __ATOMIC_ACQ_REL);
+    shard_queue_push(self, request);
+    if (pending == 0) {
+        pthread_mutex_lock(&self->lock);
+        pthread_cond_signal(&self->wakeup);
+        pthread_mutex_unlock(&self->lock);
+    }
+
+    pthread_mutex_lock(&self->lock);
+    while (!request->done) pthread_cond_wait(&self->completed, &self->lock);
+    pthread_mutex_unlock(&self->lock);
+    return request->result;
+}
+
+// Open a sharded database
+sharded_database_t* sharded_database__static__open(const char *path, size_t shards, const database_options_t *options) {
+    if (!path || shards > SHARDED_DATABASE_MAX_SHARDS) return NULL;
+    long length = shards_length_settle(path, shards);
+    if (length <= 0 || length > SHARDED_DATABASE_MAX_SHARDS) return NULL;
+
+    sharded_database_t *self = (sharded_database_t*)calloc(1, sizeof(sharded_database_t));
+    if (!self) return NULL;
+    self->shards = (shard_t*)calloc(length, sizeof(shard_t));
+    if (!self->shards) {
+        free(self);
+        return NULL;
+    }
+
+    // shards_length counts the shards whose worker runs, close only stops those
+    for (size_t k = 0; k < (size_t)length; k++) {
+        shard_t *shard = &self->shards[k];
+        char shard_path[256];
+        snprintf(shard_path, 256, "%s.shard-%zu", path, k);
+        shard->database = database__static_open_with_options(shard_path, options);
+        if (!shard->database) break;
+        shard->index = k;
+        shard->head = &shard->stub;
+        shard->tail = &shard->stub;
+        shard->running = 1;
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->wakeup, NULL);
+        pthread_cond_init(&shard->completed, NULL);
+        if (pthread_create(&shard->worker, NULL, shard_worker, shard) != 0) {
+            pthread_mutex_destroy(&shard->lock);
+            pthread_cond_destroy(&shard->wakeup);
+            pthread_cond_destroy(&shard->completed);
+            database__static__close(shard->database);
+            break;
+        }
+        self->shards_length++;
+    }
+    if (self->shards_length != (size_t)length) {
+        sharded_database__static__close(self);
+        return NULL;
+    }
+    return self;
+}
+
+// Close a sharded database
+error_t sharded_database__static__close(sharded_database_t *self) {
+    if (!self) return -1;
+    error_t result = 0;
+    for (size_t k = 0; k < self->shards_length; k++) {
+        shard_t *shard = &self->shards[k];
+        pthread_mutex_lock(&shard->lock);
+        shard->running = 0;
+        pthread_cond_signal(&shard->wakeup);
+        pthread_mutex_unlock(&shard->lock);
+        pthread_join(shard->worker, NULL);
+        pthread_mutex_destroy(&shard->lock);
+        pthread_cond_destroy(&shard->wakeup);
+        pthread_cond_destroy(&shard->completed);
+        if (database__static__close(shard->database) != 0) result = -1;
+    }
+    free(self->shards);
+    free(self);
+    return result;
+}
+
+// The shard of an id
+database_t* sharded_database__instance__shard(sharded_database_t *self, const char *id) {
+    if (!self || !id) return NULL;
+    return self->shards[shard_of(self, id)].database;
+}
+
+// Insert a record into its shard
+error_t sharded_database__instance__insert(sharded_database_t *self, const char *data, size_t data_length, record_t *out_record) {
+    if (!self || !data || data_length == 0) return -1;
+    char id[32];
+    hash__static__compute(data, data_length, (unsigned char*)id);
+
+    shard_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.kind = SHARD_REQUEST_INSERT;
+    request.data = data;
+    request.data_length = data_length;
+    error_t result = shard_submit(&self->shards[shard_of(self, id)], &request);
+    if (result == 0 && out_record) *out_record = request.record;
+    return result;
+}
+
+// Delete a record from its shard
+error_t sharded_database__instance__delete(sharded_database_t *self, const char *id) {
+    if (!self || !id) return -1;
+    shard_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.kind = SHARD_REQUEST_DELETE;
+    memcpy(request.id, id, 32);
+    return shard_submit(&self->shards[shard_of(self, id)], &request);
+}
+
+// Copy the latest version of a record
+error_t sharded_database__instance__get(sharded_database_t *self, const char *id, record_t *out_record) {
+    if (!self || !id || !out_record) return -1;
+    // the worker may append meanwhile, the entry is copied inside the lookup's read section
+    return database__instance__get_copy_by_id(self->shards[shard_of(self, id)].database, id, out_record);
+}
+
+// Copy the content of a record
+error_t sharded_database__instance__read_content(sharded_database_t *self, const record_t *record, char *buffer) {
+    if (!self || !record) return -1;
+    return database__instance__read_content(self->shards[shard_of(self, record->id)].database, record, buffer);
+}
+
+/**
+ * the caller's callback and the records delivered by the shards before
+ */
+typedef struct shard_scan_s {
+    record_found_with_span_fn on_record_found;
+    int ord;
+} shard_scan_t;
+
+static __thread shard_scan_t *shard_scan;
+
+static error_t shard_scan_deliver(record_t *record, int ord, const char *content, size_t content_length) {
+    (void)ord;
+    return shard_scan->on_record_found(record, shard_scan->ord++, content, content_length);
+}
+
+// Iterate over the latest records of every shard in id order
+error_t sharded_database__instance__get_latest_records_with_content(sharded_database_t *self, record_found_with_span_fn on_record_found) {
+    if (!self || !on_record_found) return -1;
+    // the shards hold ascending slices of the ids, so the shards one after the other each in id order are the merged order
+    shard_scan_t scan = {on_record_found, 0};
+    shard_scan_t *outer = shard_scan;
+    shard_scan = &scan;
+    error_t result = 0;
+    for (size_t k = 0; result == 0 && k < self->shards_length; k++) {
+        result = database__instance__get_latest_records_with_content(self->shards[k].database, DATABASE_SCAN_ID_ORDER, shard_scan_deliver);
+    }
+    shard_scan = outer;
+    return result;
+}
+
+// Sync every shard
+error_t sharded_database__instance__sync(sharded_database_t *self) {
+    if (!self) return -1;
+    error_t result = 0;
+    for (size_t k = 0; k < self->shards_length; k++) {
+        if (database__instance__sync(self->shards[k].database) != 0) result = -1;
+    }
+    return result;
+}
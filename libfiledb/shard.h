@@ -0,0 +1,119 @@
+#ifndef __shard_h__
+#define __shard_h__
+#include <stddef.h>
+#include <pthread.h>
+#include "filedb.h"
+
+/**
+ * a database split into shards <path>.shard-0, <path>.shard-1, ... each a database of its own.
+ * a record lives in the shard picked by the leading bits of its id, so shard k holds the k-th slice
+ *   of the id space and walking the shards in order walks the ids in order slice by slice.
+ * the inserts and deletes of a shard are queued to its own worker thread, pinned to a core, that
+ *   applies whatever is queued as one batch, so the writers of different shards never share an append point.
+ * lookups and reads go straight to the shard from the calling thread like on any database
+ */
+
+#define SHARDED_DATABASE_MAX_SHARDS 256
+
+typedef enum shard_request_kind_e {
+    SHARD_REQUEST_INSERT = 0,
+    SHARD_REQUEST_DELETE,
+} shard_request_kind_t;
+
+/**
+ * an insert or a delete waiting in the queue of a shard, on the stack of the thread that waits for it
+ */
+typedef struct shard_request_s {
+    struct shard_request_s* next;
+    shard_request_kind_t kind;
+    const char* data;
+    size_t data_length;
+    /**
+     * the id to delete
+     */
+    char id[32];
+    /**
+     * a copy of the log entry the request appended
+     */
+    record_t record;
+    error_t result;
+    /**
+     * set by the worker under the shard lock once the request was applied
+     */
+    int done;
+} shard_request_s;
+
+typedef shard_request_s shard_request_t;
+
+typedef struct shard_s {
+    database_t* database;
+    size_t index;
+    pthread_t worker;
+    /**
+     * the intrusive multiple producers single consumer queue: the producers swap themselves in at head,
+     *   the worker alone pops at tail. stub keeps the queue from ever being empty
+     */
+    shard_request_t* head;
+    shard_request_t* tail;
+    shard_request_t stub;
+    /**
+     * the requests pushed or about to be and not popped yet, the worker sleeps while it is 0
+     */
+    size_t pending;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t completed;
+} shard_s;
+
+typedef shard_s shard_t;
+
+typedef struct sharded_database_s {
+    shard_t* shards;
+    size_t shards_length;
+} sharded_database_s;
+
+typedef sharded_database_s sharded_database_t;
+
+/**
+ * opens or creates the shards of the database at path with the same options, and starts their workers.
+ * the number of shards is saved in <path>.shards: 0 opens as many as were created,
+ *   another number than the saved one fails since the ids would no longer be found in their shard
+ */
+sharded_database_t* sharded_database__static__open(const char* path, size_t shards, const database_options_t* options);
+/**
+ * stops the workers once their queues are empty and closes the shards
+ */
+error_t sharded_database__static__close(sharded_database_t* self);
+/**
+ * the shard that holds or would hold the record with the given 32 bytes id
+ */
+database_t* sharded_database__instance__shard(sharded_database_t* self, const char* id);
+/**
+ * inserts a record through the worker of its shard and waits until it is in the log.
+ * out_record, when not NULL, receives a copy of its log entry
+ */
+error_t sharded_database__instance__insert(sharded_database_t* self, const char* data, size_t data_length, record_t* out_record);
+/**
+ * deletes the record with the given id through the worker of its shard, -1 when it is not live
+ */
+error_t sharded_database__instance__delete(sharded_database_t* self, const char* id);
+/**
+ * copies the latest version of the record with the given id into out_record, -1 when it is not live
+ */
+error_t sharded_database__instance__get(sharded_database_t* self, const char* id, record_t* out_record);
+/**
+ * copies the content of a record found in the sharded database, see database__instance__read_content
+ */
+error_t sharded_database__instance__read_content(sharded_database_t* self, const record_t* record, char* buffer);
+/**
+ * iterates over the latest records of every shard with their content, in id order across the shards.
+ * ord counts the records across the shards, the content is only valid during the call
+ */
+error_t sharded_database__instance__get_latest_records_with_content(sharded_database_t* self, record_found_with_span_fn on_record_found);
+/**
+ * syncs every shard, see database__instance__sync
+ */
+error_t sharded_database__instance__sync(sharded_database_t* self);
+
+#endif
@@ -0,0 +1,110 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shard.h"
+
+#define TEST_SHARD_PATH "shard.test.db"
+#define TEST_SHARD_WRITERS 8
+#define TEST_SHARD_RECORDS 500
+
+typedef struct test_writer_s {
+    sharded_database_t *db;
+    int writer;
+    record_t records[TEST_SHARD_RECORDS];
+} test_writer_t;
+
+static size_t test_content(int writer, int i, char *data) {
+    return (size_t)snprintf(data, 64, "writer %d record %d of test_concurrent_writers", writer, i);
+}
+
+static void* test_writer(void *arg) {
+    test_writer_t *writer = (test_writer_t*)arg;
+    char data[64];
+    for (int i = 0; i < TEST_SHARD_RECORDS; i++) {
+        size_t length = test_content(writer->writer, i, data);
+        assert(sharded_database__instance__insert(writer->db, data, length, &writer->records[i]) == 0);
+    }
+    return NULL;
+}
+
+static sharded_database_t *test_db;
+static size_t test_entries;
+static size_t test_previous_shard;
+static char test_previous_id[32];
+
+error_t test_check(record_t *record, int ord, const char *content, size_t content_length) {
+    assert((size_t)ord == test_entries++);
+    assert(content_length == record->length && memcmp(content, "writer ", 7) == 0);
+    // in id order, shard by shard, each shard a slice of the ids above the previous one
+    assert(test_entries == 1 || memcmp(record->id, test_previous_id, 32) > 0);
+    memcpy(test_previous_id, record->id, 32);
+    size_t shard = 0;
+    while (test_db->shards[shard].database != sharded_database__instance__shard(test_db, record->id)) shard++;
+    assert(shard >= test_previous_shard && (unsigned char)record->id[0] >= shard * 256 / test_db->shards_length);
+    test_previous_shard = shard;
+    return 0;
+}
+
+void test_concurrent_writers() {
+    sharded_database_t *db = sharded_database__static__open(TEST_SHARD_PATH, 4, NULL);
+    assert(db != NULL && db->shards_length == 4);
+
+    static test_writer_t writers[TEST_SHARD_WRITERS];
+    pthread_t threads[TEST_SHARD_WRITERS];
+    for (int w = 0; w < TEST_SHARD_WRITERS; w++) {
+        writers[w].db = db;
+        writers[w].writer = w;
+        assert(pthread_create(&threads[w], NULL, test_writer, &writers[w]) == 0);
+    }
+    for (int w = 0; w < TEST_SHARD_WRITERS; w++) pthread_join(threads[w], NULL);
+
+    // every record is in the shard its id routes to, and the shards share the load
+    char data[64], content[64];
+    for (int w = 0; w < TEST_SHARD_WRITERS; w++) {
+        for (int i = 0; i < TEST_SHARD_RECORDS; i++) {
+            record_t found;
+            assert(sharded_database__instance__get(db, writers[w].records[i].id, &found) == 0);
+            assert(memcmp(&found, &writers[w].records[i], sizeof(record_t)) == 0);
+            size_t length = test_content(w, i, data);
+            assert(found.length == length);
+            assert(sharded_database__instance__read_content(db, &found, content) == 0);
+            assert(memcmp(content, data, length) == 0);
+        }
+    }
+    for (size_t k = 0; k < db->shards_length; k++) {
+        size_t length = db->shards[k].database->record_list_length;
+        assert(length > TEST_SHARD_WRITERS * TEST_SHARD_RECORDS / 8);
+        for (size_t i = 0; i < length; i++) {
+            assert(sharded_database__instance__shard(db, database__instance__record_at(db->shards[k].database, i)->id) == db->shards[k].database);
+        }
+    }
+
+    // a delete goes through the worker of the shard, a second one finds nothing
+    assert(sharded_database__instance__delete(db, writers[0].records[0].id) == 0);
+    assert(sharded_database__instance__delete(db, writers[0].records[0].id) == -1);
+    record_t found;
+    assert(sharded_database__instance__get(db, writers[0].records[0].id, &found) == -1);
+
+    test_db = db;
+    test_entries = 0;
+    test_previous_shard = 0;
+    assert(sharded_database__instance__get_latest_records_with_content(db, test_check) == 0);
+    assert(test_entries == TEST_SHARD_WRITERS * TEST_SHARD_RECORDS - 1);
+    assert(sharded_database__instance__sync(db) == 0);
+    assert(sharded_database__static__close(db) == 0);
+
+    // the number of shards is the saved one
+    assert(sharded_database__static__open(TEST_SHARD_PATH, 8, NULL) == NULL);
+    db = sharded_database__static__open(TEST_SHARD_PATH, 0, NULL);
+    assert(db != NULL && db->shards_length == 4);
+    assert(sharded_database__instance__get(db, writers[1].records[7].id, &found) == 0);
+    assert(sharded_database__static__close(db) == 0);
+}
+
+int main() {
+    printf("=== test_concurrent_writers =======================================:\n");
+    test_concurrent_writers();
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include "uring.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned length) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, length);
+}
+
+uring_t* uring__static__new(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = uring_setup(entries ? entries : 1, &params);
+    if (fd < 0) return NULL;
+    // plain reads and writes with an offset came with 5.6, as did this feature bit
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return NULL;
+    }
+
+    uring_t *self = (uring_t*)calloc(1, sizeof(uring_t));
+    if (!self) {
+        close(fd);
+        return NULL;
+    }
+    self->ring_reference = fd;
+    self->entries = params.sq_entries;
+    self->sq_ring_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    self->cq_ring_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // both rings share one mapping when the kernel allows it
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (self->cq_ring_length > self->sq_ring_length) self->sq_ring_length = self->cq_ring_length;
+        self->cq_ring_length = 0;
+    }
+    self->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    self->sq_ring = mmap(NULL, self->sq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    self->cq_ring = self->cq_ring_length == 0 ? self->sq_ring
+        : mmap(NULL, self->cq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    self->sqes = mmap(NULL, self->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (self->sq_ring == MAP_FAILED || self->cq_ring == MAP_FAILED || self->sqes == MAP_FAILED) {
+        if (self->sq_ring == MAP_FAILED) self->sq_ring = NULL;
+        if (self->cq_ring == MAP_FAILED) self->cq_ring = NULL;
+        if (self->sqes == MAP_FAILED) self->sqes = NULL;
+        uring__instance__close(self);
+        return NULL;
+    }
+
+    char *sq = (char*)self->sq_ring;
+    char *cq = (char*)self->cq_ring;
+    self->sq_head = (unsigned*)(sq + params.sq_off.head);
+    self->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    self->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    self->sq_array = (unsigned*)(sq + params.sq_off.array);
+    self->cq_head = (unsigned*)(cq + params.cq_off.head);
+    self->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    self->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    self->cqes = cq + params.cq_off.cqes;
+    return self;
+}
+
+void uring__instance__close(uring_t *self) {
+    if (!self) return;
+    if (self->sqes) munmap(self->sqes, self->sqes_length);
+    if (self->cq_ring && self->cq_ring != self->sq_ring) munmap(self->cq_ring, self->cq_ring_length);
+    if (self->sq_ring) munmap(self->sq_ring, self->sq_ring_length);
+    close(self->ring_reference);
+    free(self);
+}
+
+int uring__instance__register_files(uring_t *self, unsigned slots) {
+    if (!self || slots == 0) return -1;
+    int *fds = (int*)malloc(slots * sizeof(int));
+    if (!fds) return -1;
+    for (unsigned i = 0; i < slots; i++) fds[i] = -1;
+    int result = uring_register(self->ring_reference, IORING_REGISTER_FILES, fds, slots) == 0 ? 0 : -1;
+    free(fds);
+    return result;
+}
+
+int uring__instance__update_file(uring_t *self, unsigned slot, int fd) {
+    if (!self) return -1;
+    if (self->prepared > 0 && uring__instance__submit(self, 0) != 0) return -1;
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    return uring_register(self->ring_reference, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 ? 0 : -1;
+}
+
+int uring__instance__register_buffer(uring_t *self, char *buffer, size_t length) {
+    if (!self || !buffer || length == 0 || self->buffer) return -1;
+    struct iovec iov = {buffer, length};
+    if (uring_register(self->ring_reference, IORING_REGISTER_BUFFERS, &iov, 1) != 0) return -1;
+    self->buffer = buffer;
+    self->buffer_length = length;
+    return 0;
+}
+
+// Fills the next submission slot, the kernel only sees it once the tail moves in submit
+static int uring_prepare(uring_t *self, unsigned opcode, unsigned fixed_opcode, unsigned slot, const void *buffer, size_t length, uint64_t offset, uint64_t user_data) {
+    if (!self || length > UINT32_MAX) return -1;
+    unsigned tail = *self->sq_tail + self->prepared;
+    if (tail - __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE) >= self->entries) return -1;
+
+    unsigned index = tail & *self->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*)self->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    const char *bytes = (const char*)buffer;
+    int fixed = self->buffer && bytes >= self->buffer && bytes + length <= self->buffer + self->buffer_length;
+    sqe->opcode = (uint8_t)(fixed ? fixed_opcode : opcode);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = (int32_t)slot;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    sqe->buf_index = 0;
+    sqe->user_data = user_data;
+    self->sq_array[index] = index;
+    self->prepared++;
+    return 0;
+}
+
+int uring__instance__read(uring_t *self, unsigned slot, void *buffer, size_t length, uint64_t offset, uint64_t user_data) {
+    return uring_prepare(self, IORING_OP_READ, IORING_OP_READ_FIXED, slot, buffer, length, offset, user_data);
+}
+
+int uring__instance__write(uring_t *self, unsigned slot, const void *buffer, size_t length, uint64_t offset, uint64_t user_data) {
+    return uring_prepare(self, IORING_OP_WRITE, IORING_OP_WRITE_FIXED, slot, buffer, length, offset, user_data);
+}
+
+int uring__instance__submit(uring_t *self, unsigned wait) {
+    if (!self) return -1;
+    // the slots are filled in before the kernel can see the new tail
+    __atomic_store_n(self->sq_tail, *self->sq_tail + self->prepared, __ATOMIC_RELEASE);
+    unsigned submit = self->prepared;
+    self->prepared = 0;
+    while (submit > 0 || wait > 0) {
+        int entered = uring_enter(self->ring_reference, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (entered < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        submit -= (unsigned)entered;
+        // the wait was served by the same call
+        if (submit == 0) break;
+    }
+    return 0;
+}
+
+unsigned uring__instance__reap(uring_t *self, uring_completion_t *completions, unsigned max) {
+    if (!self) return 0;
+    unsigned head = *self->cq_head;
+    unsigned tail = __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    for (; head != tail && count < max; head++, count++) {
+        const struct io_uring_cqe *cqe = (const struct io_uring_cqe*)self->cqes + (head & *self->cq_mask);
+        completions[count].user_data = cqe->user_data;
+        completions[count].result = cqe->res;
+    }
+    // the kernel may reuse the slots once the head moved past them
+    __atomic_store_n(self->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+#else
+
+uring_t* uring__static__new(unsigned entries) {
+    return NULL;
+}
+
+void uring__instance__close(uring_t *self) {
+}
+
+int uring__instance__register_files(uring_t *self, unsigned slots) {
+    return -1;
+}
+
+int uring__instance__update_file(uring_t *self, unsigned slot, int fd) {
+    return -1;
+}
+
+int uring__instance__register_buffer(uring_t *self, char *buffer, size_t length) {
+    return -1;
+}
+
+int uring__instance__read(uring_t *self, unsigned slot, void *buffer, size_t length, uint64_t offset, uint64_t user_data) {
+    return -1;
+}
+
+int uring__instance__write(uring_t *self, unsigned slot, const void *buffer, size_t length, uint64_t offset, uint64_t user_data) {
+    return -1;
+}
+
+int uring__instance__submit(uring_t *self, unsigned wait) {
+    return -1;
+}
+
+unsigned uring__instance__reap(uring_t *self, uring_completion_t *completions, unsigned max) {
+    return 0;
+}
+
+#endif
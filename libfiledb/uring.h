@@ -0,0 +1,98 @@
+#ifndef __uring_h__
+#define __uring_h__
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * minimal io_uring submission and completion rings driven through the raw system calls, no liburing.
+ * reads and writes go through a table of registered files addressed by slot and may use
+ *   a single registered buffer, the kernel then neither looks the file up nor pins the pages per request.
+ * a ring is used by one thread at a time. uring__static__new returns NULL where io_uring is missing:
+ *   on other platforms, on kernels older than 5.6 or when it is forbidden, the caller then does the I/O itself
+ */
+
+typedef struct uring_s {
+    int ring_reference;
+    unsigned entries;
+    /**
+     * the shared ring indexes, the kernel moves sq_head and cq_tail, we move sq_tail and cq_head
+     */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    /**
+     * struct io_uring_sqe[entries] and struct io_uring_cqe[cq entries]
+     */
+    void* sqes;
+    void* cqes;
+    /**
+     * requests written to the submission ring and not handed to the kernel yet
+     */
+    unsigned prepared;
+    void* sq_ring;
+    size_t sq_ring_length;
+    void* cq_ring;
+    size_t cq_ring_length;
+    size_t sqes_length;
+    /**
+     * the registered buffer, NULL when none
+     */
+    char* buffer;
+    size_t buffer_length;
+} uring_s;
+
+typedef uring_s uring_t;
+
+/**
+ * a finished request, result is the byte count or -errno
+ */
+typedef struct uring_completion_s {
+    uint64_t user_data;
+    int32_t result;
+} uring_completion_s;
+
+typedef uring_completion_s uring_completion_t;
+
+/**
+ * a ring of at least entries submission slots, NULL when io_uring is not available
+ */
+uring_t* uring__static__new(unsigned entries);
+/**
+ * closes the ring, the requests still in flight complete without anyone reading them
+ */
+void uring__instance__close(uring_t* self);
+/**
+ * registers an empty table of slots files
+ */
+int uring__instance__register_files(uring_t* self, unsigned slots);
+/**
+ * puts fd in the slot, -1 empties it. the kernel holds its own reference to the file until the slot changes,
+ *   requests prepared but not submitted yet would see the new file so they are submitted first
+ */
+int uring__instance__update_file(uring_t* self, unsigned slot, int fd);
+/**
+ * registers buffer as the fixed buffer of the ring, reads and writes whose bytes lie inside it use it
+ */
+int uring__instance__register_buffer(uring_t* self, char* buffer, size_t length);
+/**
+ * prepares a read of length bytes at offset of the file in slot, -1 when the submission ring is full
+ */
+int uring__instance__read(uring_t* self, unsigned slot, void* buffer, size_t length, uint64_t offset, uint64_t user_data);
+/**
+ * prepares a write of length bytes at offset of the file in slot, -1 when the submission ring is full
+ */
+int uring__instance__write(uring_t* self, unsigned slot, const void* buffer, size_t length, uint64_t offset, uint64_t user_data);
+/**
+ * hands the prepared requests to the kernel and waits until at least wait completions are ready to reap
+ */
+int uring__instance__submit(uring_t* self, unsigned wait);
+/**
+ * moves up to max completions out of the completion ring without waiting, returns how many
+ */
+unsigned uring__instance__reap(uring_t* self, uring_completion_t* completions, unsigned max);
+
+#endif
@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uring.h"
+
+#define TEST_URING_PATH "uring.test.data"
+#define TEST_URING_BLOCKS 64
+#define TEST_URING_BLOCK_LENGTH 4096
+
+// Waits for n completions and checks that each moved a whole block
+void wait_blocks(uring_t *ring, unsigned n, unsigned char *seen) {
+    uring_completion_t completions[TEST_URING_BLOCKS];
+    unsigned reaped = 0;
+    while (reaped < n) {
+        assert(uring__instance__submit(ring, 1) == 0);
+        unsigned count = uring__instance__reap(ring, completions, TEST_URING_BLOCKS);
+        for (unsigned i = 0; i < count; i++) {
+            assert(completions[i].result == TEST_URING_BLOCK_LENGTH);
+            assert(completions[i].user_data < TEST_URING_BLOCKS && !seen[completions[i].user_data]);
+            seen[completions[i].user_data] = 1;
+        }
+        reaped += count;
+    }
+}
+
+void test_read_write() {
+    uring_t *ring = uring__static__new(16);
+    if (!ring) {
+        printf("io_uring is not available, skipped\n");
+        return;
+    }
+    assert(ring->entries >= 16);
+    unlink(TEST_URING_PATH);
+    int fd = open(TEST_URING_PATH, O_RDWR | O_CREAT, 0666);
+    assert(fd != -1);
+    assert(uring__instance__register_files(ring, 4) == 0);
+    assert(uring__instance__update_file(ring, 2, fd) == 0);
+
+    // the first half of the blocks written from the registered buffer, the other half from the heap
+    char *fixed = (char*)malloc(TEST_URING_BLOCKS / 2 * TEST_URING_BLOCK_LENGTH);
+    char *heap = (char*)malloc(TEST_URING_BLOCKS / 2 * TEST_URING_BLOCK_LENGTH);
+    assert(uring__instance__register_buffer(ring, fixed, TEST_URING_BLOCKS / 2 * TEST_URING_BLOCK_LENGTH) == 0);
+    for (unsigned i = 0; i < TEST_URING_BLOCKS; i++) {
+        char *block = (i < TEST_URING_BLOCKS / 2 ? fixed : heap) + (i % (TEST_URING_BLOCKS / 2)) * TEST_URING_BLOCK_LENGTH;
+        memset(block, 'a' + i % 26, TEST_URING_BLOCK_LENGTH);
+    }
+
+    // more requests than the ring holds, a full ring is submitted and drained before going on
+    unsigned char seen[TEST_URING_BLOCKS] = {0};
+    unsigned in_flight = 0;
+    for (unsigned i = 0; i < TEST_URING_BLOCKS; i++) {
+        char *block = (i < TEST_URING_BLOCKS / 2 ? fixed : heap) + (i % (TEST_URING_BLOCKS / 2)) * TEST_URING_BLOCK_LENGTH;
+        if (uring__instance__write(ring, 2, block, TEST_URING_BLOCK_LENGTH, (uint64_t)i * TEST_URING_BLOCK_LENGTH, i) != 0) {
+            wait_blocks(ring, in_flight, seen);
+            in_flight = 0;
+            assert(uring__instance__write(ring, 2, block, TEST_URING_BLOCK_LENGTH, (uint64_t)i * TEST_URING_BLOCK_LENGTH, i) == 0);
+        }
+        in_flight++;
+    }
+    wait_blocks(ring, in_flight, seen);
+    assert(lseek(fd, 0, SEEK_END) == TEST_URING_BLOCKS * TEST_URING_BLOCK_LENGTH);
+
+    // read back in reverse into the registered buffer
+    memset(seen, 0, sizeof(seen));
+    memset(fixed, 0, TEST_URING_BLOCKS / 2 * TEST_URING_BLOCK_LENGTH);
+    for (unsigned i = 0; i < TEST_URING_BLOCKS / 2; i++) {
+        unsigned block = TEST_URING_BLOCKS - 1 - i;
+        assert(uring__instance__read(ring, 2, fixed + i * TEST_URING_BLOCK_LENGTH, TEST_URING_BLOCK_LENGTH, (uint64_t)block * TEST_URING_BLOCK_LENGTH, block) == 0);
+        if ((i + 1) % 8 == 0) wait_blocks(ring, 8, seen);
+    }
+    for (unsigned i = 0; i < TEST_URING_BLOCKS / 2; i++) {
+        unsigned block = TEST_URING_BLOCKS - 1 - i;
+        assert(fixed[i * TEST_URING_BLOCK_LENGTH] == (char)('a' + block % 26));
+        assert(fixed[(i + 1) * TEST_URING_BLOCK_LENGTH - 1] == (char)('a' + block % 26));
+    }
+
+    // an empty slot fails the request, not the ring
+    uring_completion_t completion;
+    assert(uring__instance__read(ring, 1, heap, TEST_URING_BLOCK_LENGTH, 0, 99) == 0);
+    assert(uring__instance__submit(ring, 1) == 0);
+    assert(uring__instance__reap(ring, &completion, 1) == 1);
+    assert(completion.user_data == 99 && completion.result < 0);
+
+    uring__instance__close(ring);
+    close(fd);
+    unlink(TEST_URING_PATH);
+    free(fixed);
+    free(heap);
+}
+
+int main() {
+    printf("=== test_read_write =======================================:\n");
+    test_read_write();
+    return 0;
+}